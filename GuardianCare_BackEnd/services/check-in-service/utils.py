@@ -73,16 +73,21 @@ def check_in_prompt(transcription, prompt_file_path="prompt.md"):
         raise Exception("Failed to read prompt file")
 
     user_prompt = f"nUser's transcription:\n\"{transcription}\""
-    
-    return f"""
+
+    # sent as two segments of one prompt, so that the LLM service tokenizes the system prompt once
+    # the segments are tokenized as their concatenation, the model input is the same as with one string
+    system_segment = f"""
     [INST]
     <<SYS>>
     {system_prompt}
     <</SYS>>
-    {user_prompt}
+"""
+    user_segment = f"""    {user_prompt}
     [/INST]
     """
 
+    return [[system_segment, user_segment]]
+
 
 
 def generate_jwt(payload, expires_in=3600):
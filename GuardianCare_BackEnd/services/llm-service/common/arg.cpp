@@ -1403,7 +1403,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
     add_opt(common_arg(
         {"-ctv", "--cache-type-v"}, "TYPE",
         string_format(
-            "KV cache data type for V\n"
+            "KV cache data type for V, quantized types enable flash attention\n"
             "allowed values: %s\n"
             "(default: %s)",
             get_all_kv_cache_types().c_str(),
@@ -1497,6 +1497,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"--defrag-step"}, "N",
+        string_format("max KV cells moved per decode when defragmenting, the rest is moved by the next decodes (default: %d, 0 = all at once)", params.defrag_step),
+        [](common_params & params, int value) {
+            params.defrag_step = value;
+        }
+    ).set_env("LLAMA_ARG_DEFRAG_STEP"));
+    add_opt(common_arg(
+        {"-kvb", "--kv-block"}, "N",
+        string_format("KV cache block size: each sequence gets its own blocks of N cells, so that freed sequences leave no holes and defragmentation is not needed (default: %d, 0 = contiguous cells)", params.n_kv_block),
+        [](common_params & params, int value) {
+            params.n_kv_block = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
         string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -2047,6 +2061,81 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_threads_http = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_HTTP"));
+    add_opt(common_arg(
+        {"--threads-callback"}, "N",
+        string_format("number of threads used to deliver callback results (default: %d, -1 = same as --parallel)", params.n_threads_callback),
+        [](common_params & params, int value) {
+            params.n_threads_callback = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_CALLBACK"));
+    add_opt(common_arg(
+        {"--callback-queue"}, "N",
+        string_format("max number of callback requests waiting for their results, further requests get HTTP 503 (default: %d)", params.n_callback_queue),
+        [](common_params & params, int value) {
+            params.n_callback_queue = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CALLBACK_QUEUE"));
+    add_opt(common_arg(
+        {"--callback-retries"}, "N",
+        string_format("max number of retries, with exponential backoff, for a failed callback delivery (default: %d)", params.n_callback_retries),
+        [](common_params & params, int value) {
+            params.n_callback_retries = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CALLBACK_RETRIES"));
+    add_opt(common_arg(
+        {"--tokenize-cache"}, "N",
+        string_format("max number of tokenized first segments of prompts kept in memory (default: %d, 0 = disabled)", params.n_tokenize_cache),
+        [](common_params & params, int value) {
+            params.n_tokenize_cache = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_TOKENIZE_CACHE"));
+    add_opt(common_arg(
+        {"--max-queued"}, "N",
+        string_format("max number of requests waiting for a slot, further requests get HTTP 503 (default: %d, 0 = unlimited)", params.n_queue_max),
+        [](common_params & params, int value) {
+            params.n_queue_max = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MAX_QUEUED"));
+    add_opt(common_arg(
+        {"--max-queued-tokens"}, "N",
+        string_format("max number of prompt tokens waiting for a slot, further requests get HTTP 503 (default: %d, 0 = unlimited)", params.n_queue_max_tokens),
+        [](common_params & params, int value) {
+            params.n_queue_max_tokens = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MAX_QUEUED_TOKENS"));
+    add_opt(common_arg(
+        {"--max-kv-usage"}, "F",
+        string_format("reject requests that would have to wait while the KV cache usage is above this ratio (default: %.2f, 0.0 = disabled)", (double)params.kv_usage_max),
+        [](common_params & params, const std::string & value) {
+            params.kv_usage_max = std::stof(value);
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MAX_KV_USAGE"));
+    add_opt(common_arg(
+        {"--prefill-policy"}, "POLICY",
+        "how a batch is split between prompt processing and generation (default: capped; allowed values: greedy, capped, fair)\n"
+        "'greedy' lets prompts fill the whole batch, 'capped' limits prompt tokens to --prefill-budget while other slots are generating, "
+        "'fair' also splits that budget evenly between the prompts being processed",
+        [](common_params & params, const std::string & value) {
+            /**/ if (value == "greedy") { params.prefill_policy = COMMON_PREFILL_POLICY_GREEDY; }
+            else if (value == "capped") { params.prefill_policy = COMMON_PREFILL_POLICY_CAPPED; }
+            else if (value == "fair")   { params.prefill_policy = COMMON_PREFILL_POLICY_FAIR; }
+            else { throw std::invalid_argument("invalid value"); }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_POLICY"));
+    add_opt(common_arg(
+        {"--prefill-budget"}, "N",
+        string_format("max number of prompt tokens per batch while other slots are generating (default: %d, -1 = ubatch size)", params.n_prefill_budget),
+        [](common_params & params, int value) {
+            params.n_prefill_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_BUDGET"));
+    add_opt(common_arg(
+        {"--prefix-share-min"}, "N",
+        string_format("min number of extra prompt tokens for a slot to fork the cached prompt prefix of another slot (default: %d, 0 = disabled)", params.n_prefix_share_min),
+        [](common_params & params, int value) {
+            params.n_prefix_share_min = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_SHARE_MIN"));
     add_opt(common_arg(
         {"--cache-reuse"}, "N",
         string_format("min chunk size to attempt reusing from the cache via KV shifting (default: %d)", params.n_cache_reuse),
@@ -2061,6 +2150,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.endpoint_metrics = true;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ENDPOINT_METRICS"));
+    add_opt(common_arg(
+        {"--trace"}, "N",
+        string_format("record the last N spans of the request pipeline, dumped by GET /trace in the Chrome trace format (default: %d, 0 = disabled)", params.n_trace_spans),
+        [](common_params & params, int value) {
+            params.n_trace_spans = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_TRACE"));
     add_opt(common_arg(
         {"--slots"},
         string_format("enable slots monitoring endpoint (default: %s)", params.endpoint_slots ? "enabled" : "disabled"),
@@ -2093,6 +2189,80 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--response-schema"}, "NAME=FNAME",
+        "JSON schema file that requests can select with \"response_schema\": NAME, its grammar is built once at startup\n"
+        "can be repeated to add several schemas",
+        [](common_params & params, const std::string & value) {
+            const auto pos = value.find('=');
+            if (pos == std::string::npos || pos == 0) {
+                throw std::invalid_argument("expected NAME=FNAME");
+            }
+            std::ifstream file(value.substr(pos + 1));
+            if (!file) {
+                throw std::runtime_error(string_format("error: failed to open file '%s'\n", value.substr(pos + 1).c_str()));
+            }
+            const std::string schema((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            params.response_schemas.emplace_back(value.substr(0, pos), json_schema_to_grammar(json::parse(schema)));
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--prefix-cache-path"}, "PATH",
+        "directory where hot prompt prefixes are saved and reloaded from on startup (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.prefix_cache_path = value;
+            if (!params.prefix_cache_path.empty() && params.prefix_cache_path[params.prefix_cache_path.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.prefix_cache_path += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE_PATH"));
+    add_opt(common_arg(
+        {"--prefix-cache-size"}, "N",
+        string_format("max size of the prompt prefix cache on disk in MiB, least recently used prefixes are evicted first (default: %d)", params.prefix_cache_size),
+        [](common_params & params, int value) {
+            params.prefix_cache_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE_SIZE"));
+    add_opt(common_arg(
+        {"--prefix-cache-min-hits"}, "N",
+        string_format("min number of prompts reusing a prompt prefix before it is saved to the prefix cache on disk (default: %d)", params.prefix_cache_min_hits),
+        [](common_params & params, int value) {
+            params.prefix_cache_min_hits = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE_MIN_HITS"));
+    add_opt(common_arg(
+        {"--session-memory"}, "N",
+        string_format("max size in MiB of the KV cache of the chat sessions that lost their slot, kept in memory until their next turn, least recently used sessions are evicted first (default: %d, 0 = disabled)", params.session_memory),
+        [](common_params & params, int value) {
+            params.session_memory = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SESSION_MEMORY"));
+    add_opt(common_arg(
+        {"--park-memory"}, "N",
+        string_format("max size in MiB of the KV cache of the requests preempted by a higher priority one, kept in memory until they resume, further requests wait for a slot instead of preempting (default: %d, 0 = no preemption)", params.park_memory),
+        [](common_params & params, int value) {
+            params.park_memory = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PARK_MEMORY"));
+    add_opt(common_arg(
+        {"--extra-model"}, "NAME=FNAME",
+        "model file that requests can select with \"model\": NAME, loaded on its first request\n"
+        "can be repeated to serve several models",
+        [](common_params & params, const std::string & value) {
+            const auto pos = value.find('=');
+            if (pos == std::string::npos || pos == 0) {
+                throw std::invalid_argument("expected NAME=FNAME");
+            }
+            params.extra_models.emplace_back(value.substr(0, pos), value.substr(pos + 1));
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--extra-models-memory"}, "N",
+        string_format("max memory of the extra models kept loaded in MiB, their weights plus the KV cache and compute buffers of their context, least recently used models are unloaded first (default: %d, 0 = unlimited)", params.extra_models_memory),
+        [](common_params & params, int value) {
+            params.extra_models_memory = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_EXTRA_MODELS_MEMORY"));
     add_opt(common_arg(
         {"--jinja"},
         "use jinja template for chat (default: disabled)",
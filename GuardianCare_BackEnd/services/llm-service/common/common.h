@@ -182,6 +182,7 @@ struct common_params_speculative {
     int32_t n_gpu_layers =    -1; // number of layers to store in VRAM for the draft model (-1 - use default)
     float   p_split      =  0.1f; // speculative decoding split probability
     float   p_min        = 0.75f; // minimum speculative decoding probability (greedy)
+    bool    ngram        = false; // draft from the n-grams of the context instead of a draft model
 
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
@@ -208,6 +209,13 @@ enum common_reasoning_format {
     COMMON_REASONING_FORMAT_DEEPSEEK, // Extract thinking tag contents and return as `message.reasoning_content`
 };
 
+// how the server splits a batch between prompt processing and token generation
+enum common_prefill_policy {
+    COMMON_PREFILL_POLICY_GREEDY, // prompts fill the whole batch
+    COMMON_PREFILL_POLICY_CAPPED, // prompts get at most n_prefill_budget tokens while other slots are generating
+    COMMON_PREFILL_POLICY_FAIR,   // same as capped, and the budget is split evenly between the prompts
+};
+
 struct common_params {
     int32_t n_predict             =    -1; // new tokens to predict
     int32_t n_ctx                 =  4096; // context size
@@ -228,6 +236,8 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t n_kv_block            =     0; // KV cache block size of the paged layout (0 = contiguous)
+    int32_t defrag_step           =   256; // max KV cells moved per decode when defragmenting (0 = all at once)
 
     // offload params
     std::vector<ggml_backend_dev_t> devices; // devices to use for offloading
@@ -348,6 +358,21 @@ struct common_params {
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
 
+    int32_t n_threads_callback = -1;  // number of threads delivering /answer/callback results (-1 = n_parallel)
+    int32_t n_callback_queue   = 256; // max number of callback requests waiting for their results
+    int32_t n_callback_retries = 3;   // max number of retries for a failed callback delivery
+
+    int32_t n_tokenize_cache   = 64; // max number of tokenized prompt segments kept in memory (0 = disabled)
+    int32_t n_trace_spans      = 0;  // size of the span ring buffer dumped by GET /trace (0 = disabled)
+
+    int32_t n_queue_max        = 0;    // max number of requests waiting for a slot, further ones get 503 (0 = unlimited)
+    int32_t n_queue_max_tokens = 0;    // max number of prompt tokens waiting for a slot (0 = unlimited)
+    float   kv_usage_max       = 0.0f; // reject requests that would wait while the KV cache usage is above this ratio (0 = disabled)
+
+    common_prefill_policy prefill_policy = COMMON_PREFILL_POLICY_CAPPED;
+    int32_t n_prefill_budget = -1; // max prompt tokens per batch while other slots are generating (-1 = n_ubatch)
+    int32_t n_prefix_share_min = 32; // min extra prompt tokens to fork the cached prefix of another slot (0 = disabled)
+
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
     std::string chat_template = "";                                                                         // NOLINT
@@ -370,6 +395,17 @@ struct common_params {
 
     std::string slot_save_path;
 
+    std::vector<std::pair<std::string, std::string>> response_schemas; // name and grammar of the schemas selectable per request
+
+    std::string prefix_cache_path;        // directory of the persistent prompt prefix cache (empty = disabled)
+    int32_t prefix_cache_size     = 4096; // max size of the persistent prompt prefix cache in MiB
+    int32_t prefix_cache_min_hits = 2;    // min number of prompts reusing a prefix before it is saved to disk
+    int32_t session_memory        = 1024; // max size of the KV cache snapshots of chat sessions kept in memory in MiB (0 = disabled)
+    int32_t park_memory           = 1024; // max size of the KV cache of the preempted requests kept in memory in MiB (0 = no preemption)
+
+    std::vector<std::pair<std::string, std::string>> extra_models; // name and path of the models selectable per request
+    int32_t extra_models_memory = 0; // max memory of the extra models kept loaded in MiB (0 = unlimited)
+
     float slot_prompt_similarity = 0.5f;
 
     // batched-bench params
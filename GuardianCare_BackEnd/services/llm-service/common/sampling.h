@@ -36,7 +36,9 @@ struct common_sampler;
 
 // llama_sampler API overloads
 
-struct common_sampler * common_sampler_init(const struct llama_model * model, const struct common_params_sampling & params);
+// if grmr is not null, it is cloned instead of building a new grammar sampler from params.grammar
+struct common_sampler * common_sampler_init(const struct llama_model * model, const struct common_params_sampling & params,
+                                            const struct llama_sampler * grmr = nullptr);
 
 void common_sampler_free(struct common_sampler * gsmpl);
 
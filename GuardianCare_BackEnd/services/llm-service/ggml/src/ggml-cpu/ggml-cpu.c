@@ -1611,6 +1611,58 @@ inline static void ggml_vec_mad_f16(const int n, ggml_fp16_t * restrict y, const
 #endif
 }
 
+// y += dequantize(x)*v, without going through a temporary F32 row
+inline static void ggml_vec_mad_q8_0(const int n, float * restrict y, const block_q8_0 * restrict x, const float v) {
+    assert(n % QK8_0 == 0);
+
+    const int nb = n / QK8_0;
+
+    for (int ib = 0; ib < nb; ++ib) {
+        const float d = GGML_FP16_TO_FP32(x[ib].d)*v;
+
+        float * restrict yb = y + ib*QK8_0;
+        for (int j = 0; j < QK8_0; ++j) {
+            yb[j] += x[ib].qs[j]*d;
+        }
+    }
+}
+
+inline static void ggml_vec_mad_q4_0(const int n, float * restrict y, const block_q4_0 * restrict x, const float v) {
+    assert(n % QK4_0 == 0);
+
+    const int nb = n / QK4_0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    // the compilers do not vectorize the nibble unpacking well
+    const __m128i m4 = _mm_set1_epi8(0x0F);
+    const __m128i m8 = _mm_set1_epi8(8);
+
+    for (int ib = 0; ib < nb; ++ib) {
+        const __m256 d = _mm256_set1_ps(GGML_FP16_TO_FP32(x[ib].d)*v);
+
+        const __m128i qs = _mm_loadu_si128((const __m128i *) x[ib].qs);
+        const __m128i lo = _mm_sub_epi8(_mm_and_si128(qs, m4), m8);
+        const __m128i hi = _mm_sub_epi8(_mm_and_si128(_mm_srli_epi16(qs, 4), m4), m8);
+
+        float * restrict yb = y + ib*QK4_0;
+        _mm256_storeu_ps(yb +  0, _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(lo)),                    d, _mm256_loadu_ps(yb +  0)));
+        _mm256_storeu_ps(yb +  8, _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(lo, 8))), d, _mm256_loadu_ps(yb +  8)));
+        _mm256_storeu_ps(yb + 16, _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(hi)),                    d, _mm256_loadu_ps(yb + 16)));
+        _mm256_storeu_ps(yb + 24, _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(hi, 8))), d, _mm256_loadu_ps(yb + 24)));
+    }
+#else
+    for (int ib = 0; ib < nb; ++ib) {
+        const float d = GGML_FP16_TO_FP32(x[ib].d)*v;
+
+        float * restrict yb = y + ib*QK4_0;
+        for (int j = 0; j < QK4_0/2; ++j) {
+            yb[j]           += ((x[ib].qs[j] & 0x0F) - 8)*d;
+            yb[j + QK4_0/2] += ((x[ib].qs[j] >>   4) - 8)*d;
+        }
+    }
+#endif
+}
+
 // xs and vs are byte strides of x and v
 inline static void ggml_vec_mad_f32_unroll(const int n, const int xs, const int vs, float * restrict y, const float * restrict xv, const float * restrict vv) {
 
@@ -2870,17 +2922,17 @@ static void ggml_compute_forward_dup_same_cont(
     const int ith = params->ith; // thread index
     const int nth = params->nth; // number of threads
 
-    // parallelize by elements
-    const int ne = ggml_nelements(dst);
-    const int dr = (ne + nth - 1) / nth;
-    const int ie0 = dr * ith;
-    const int ie1 = MIN(ie0 + dr, ne);
+    // parallelize by blocks, nb0 is the size of a block for the quantized types
+    const int nk = ggml_nelements(dst)/ggml_blck_size(dst->type);
+    const int dr = (nk + nth - 1) / nth;
+    const int k0 = dr * ith;
+    const int k1 = MIN(k0 + dr, nk);
 
-    if (ie0 < ie1) {
+    if (k0 < k1) {
         memcpy(
-            ((char *)  dst->data + ie0*nb0),
-            ((char *) src0->data + ie0*nb0),
-            (ie1 - ie0) * nb0);
+            ((char *)  dst->data + k0*nb0),
+            ((char *) src0->data + k0*nb0),
+            (k1 - k0) * nb0);
     }
 }
 
@@ -3829,6 +3881,12 @@ static void ggml_compute_forward_dup_bytes(
     }
 
     const size_t type_size = ggml_type_size(src0->type);
+    const int64_t blck_size = ggml_blck_size(src0->type);
+
+    // the loops below go over blocks, which are the elements for the non-quantized types
+    const int64_t k00 = ne00/blck_size;
+    const int64_t k0  = ne0/blck_size;
+
     const int ith = params->ith; // thread index
     const int nth = params->nth; // number of threads
 
@@ -3845,7 +3903,7 @@ static void ggml_compute_forward_dup_bytes(
         ne00 == ne0 &&
         nb00 == type_size && nb0 == type_size) {
         // copy by rows
-        const size_t rs = ne00 * type_size;
+        const size_t rs = ggml_row_size(src0->type, ne00);
         for (int64_t i03 = 0; i03 < ne03; i03++) {
             for (int64_t i02 = 0; i02 < ne02; i02++) {
                 for (int64_t i01 = ir0; i01 < ir1; i01++) {
@@ -3862,7 +3920,7 @@ static void ggml_compute_forward_dup_bytes(
     if (ggml_is_contiguous(dst)) {
         size_t id = 0;
         char * dst_ptr = (char *) dst->data;
-        const size_t rs = ne00 * type_size;
+        const size_t rs = ggml_row_size(src0->type, ne00);
 
         if (nb00 == type_size) {
             // src0 is contigous on first dimension, copy by rows
@@ -3884,7 +3942,7 @@ static void ggml_compute_forward_dup_bytes(
                 for (int64_t i02 = 0; i02 < ne02; i02++) {
                     id += rs * ir0;
                     for (int64_t i01 = ir0; i01 < ir1; i01++) {
-                        for (int64_t i00 = 0; i00 < ne00; i00++) {
+                        for (int64_t i00 = 0; i00 < k00; i00++) {
                             const char * src0_ptr = (char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03;
                             memcpy(dst_ptr + id, src0_ptr, type_size);
 
@@ -3908,9 +3966,9 @@ static void ggml_compute_forward_dup_bytes(
 
     for (int64_t i03 = 0; i03 < ne03; i03++) {
         for (int64_t i02 = 0; i02 < ne02; i02++) {
-            i10 += ne00 * ir0;
-            while (i10 >= ne0) {
-                i10 -= ne0;
+            i10 += k00 * ir0;
+            while (i10 >= k0) {
+                i10 -= k0;
                 if (++i11 == ne1) {
                     i11 = 0;
                     if (++i12 == ne2) {
@@ -3922,13 +3980,13 @@ static void ggml_compute_forward_dup_bytes(
                 }
             }
             for (int64_t i01 = ir0; i01 < ir1; i01++) {
-                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                for (int64_t i00 = 0; i00 < k00; i00++) {
                     const char * src0_ptr = ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
                           char * dst_ptr  = ((char *)  dst->data + i10*nb0  + i11*nb1  + i12*nb2  + i13*nb3);
 
                     memcpy(dst_ptr, src0_ptr, type_size);
 
-                    if (++i10 == ne0) {
+                    if (++i10 == k0) {
                         i10 = 0;
                         if (++i11 == ne1) {
                             i11 = 0;
@@ -3942,9 +4000,9 @@ static void ggml_compute_forward_dup_bytes(
                     }
                 }
             }
-            i10 += ne00 * (ne01 - ir1);
-            while (i10 >= ne0) {
-                i10 -= ne0;
+            i10 += k00 * (ne01 - ir1);
+            while (i10 >= k0) {
+                i10 -= k0;
                 if (++i11 == ne1) {
                     i11 = 0;
                     if (++i12 == ne2) {
@@ -11079,10 +11137,15 @@ static void ggml_compute_forward_flash_attn_ext_f16(
                     vs = expf(s - M);
                 }
 
-                v_to_float(v_data, V32, D);
-
                 // V += v*expf(s - M)
-                ggml_vec_mad_f32(D, VKQ32, V32, vs);
+                if (v->type == GGML_TYPE_Q8_0) {
+                    ggml_vec_mad_q8_0(D, VKQ32, (const block_q8_0 *) v_data, vs);
+                } else if (v->type == GGML_TYPE_Q4_0) {
+                    ggml_vec_mad_q4_0(D, VKQ32, (const block_q4_0 *) v_data, vs);
+                } else {
+                    v_to_float(v_data, V32, D);
+                    ggml_vec_mad_f32(D, VKQ32, V32, vs);
+                }
             }
 
             S = S*ms + vs; // scale and increment sum with partial sum
@@ -329,6 +329,8 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t n_kv_block;       // KV cache block size of the paged layout, 0 = contiguous cells (default)
+        uint32_t defrag_step;      // max KV cells moved by a llama_kv_cache_update, the rest in the next ones, 0 = all (default)
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -460,6 +462,9 @@ extern "C" {
     LLAMA_API uint32_t llama_n_ubatch   (const struct llama_context * ctx);
     LLAMA_API uint32_t llama_n_seq_max  (const struct llama_context * ctx);
 
+    // Returns the size in bytes of the buffers allocated by the context: KV cache, outputs and compute buffers
+    LLAMA_API size_t llama_context_size(const struct llama_context * ctx);
+
     DEPRECATED(LLAMA_API int32_t llama_n_ctx_train(const struct llama_model * model), "use llama_model_n_ctx_train instead");
     DEPRECATED(LLAMA_API int32_t llama_n_embd     (const struct llama_model * model), "use llama_model_n_embd instead");
     DEPRECATED(LLAMA_API int32_t llama_n_layer    (const struct llama_model * model), "use llama_model_n_layer instead");
@@ -1314,6 +1319,10 @@ extern "C" {
 
         int32_t n_p_eval;
         int32_t n_eval;
+
+        double   t_defrag_ms;    // time spent defragmenting the KV cache
+        uint64_t n_defrag;       // number of defragmentation steps
+        uint64_t n_defrag_cells; // number of KV cells moved by defragmentation
     };
 
     struct llama_perf_sampler_data {
@@ -3,6 +3,7 @@
 #include "json-schema-to-grammar.h"
 #include "llama.h"
 #include "log.h"
+#include "ngram-cache.h"
 #include "sampling.h"
 #include "speculative.h"
 #include "utils.hpp"
@@ -18,11 +19,17 @@
 #include <atomic>
 #include <chrono>
 #include <cinttypes>
+#include <cmath>
 #include <condition_variable>
 #include <cstddef>
 #include <deque>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <numeric>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
@@ -72,6 +79,28 @@ enum server_task_type
     SERVER_TASK_TYPE_SET_LORA,
 };
 
+// scheduling class of a completion task, higher classes are served first and may preempt lower ones
+enum server_task_priority
+{
+    SERVER_TASK_PRIORITY_LOW,
+    SERVER_TASK_PRIORITY_NORMAL,
+    SERVER_TASK_PRIORITY_HIGH,
+    SERVER_TASK_PRIORITY_COUNT,
+};
+
+static const char *server_task_priority_name(server_task_priority priority)
+{
+    switch (priority)
+    {
+    case SERVER_TASK_PRIORITY_LOW:
+        return "low";
+    case SERVER_TASK_PRIORITY_HIGH:
+        return "high";
+    default:
+        return "normal";
+    }
+}
+
 enum oaicompat_type
 {
     OAICOMPAT_TYPE_NONE,
@@ -92,6 +121,55 @@ enum error_type
     ERROR_TYPE_NOT_SUPPORTED, // custom error
 };
 
+// grammars of the response schemas, so that they are not converted and parsed again for every request
+struct server_grammar_cache
+{
+    // named response schemas, converted at startup and read-only afterwards
+    std::unordered_map<std::string, std::string> named;
+
+    // converted "json_schema" of the requests, used by the HTTP threads
+    std::mutex mutex_schemas;
+    lru_cache<std::string> schemas{32};
+
+    // parsed grammar samplers, cloned into the slots by the main loop
+    lru_cache<llama_sampler_ptr> samplers{32};
+
+    std::string from_schema(const json &schema)
+    {
+        const std::string key = schema.dump();
+        {
+            std::lock_guard<std::mutex> lock(mutex_schemas);
+            if (const std::string *grammar = schemas.get(key))
+            {
+                return *grammar;
+            }
+        }
+
+        // convert outside of the lock, a concurrent miss only costs a duplicate conversion
+        std::string grammar = json_schema_to_grammar(schema);
+
+        std::lock_guard<std::mutex> lock(mutex_schemas);
+        return schemas.put(key, std::move(grammar));
+    }
+
+    // nullptr if the grammar is invalid
+    const llama_sampler *get_sampler(const llama_vocab *vocab, const std::string &grammar)
+    {
+        if (llama_sampler_ptr *smpl = samplers.get(grammar))
+        {
+            return smpl->get();
+        }
+
+        llama_sampler_ptr smpl(llama_sampler_init_grammar(vocab, grammar.c_str(), "root"));
+        if (!smpl)
+        {
+            return nullptr;
+        }
+
+        return samplers.put(grammar, std::move(smpl)).get();
+    }
+};
+
 struct slot_params
 {
     bool stream = true;
@@ -189,6 +267,7 @@ struct slot_params
             {"speculative.n_max", speculative.n_max},
             {"speculative.n_min", speculative.n_min},
             {"speculative.p_min", speculative.p_min},
+            {"speculative.ngram", speculative.ngram},
             {"timings_per_token", timings_per_token},
             {"post_sampling_probs", post_sampling_probs},
             {"lora", lora},
@@ -227,10 +306,83 @@ struct server_task
     // used by SERVER_TASK_TYPE_SET_LORA
     std::vector<common_adapter_lora_info> set_lora;
 
-    server_task(server_task_type type) : type(type) {}
+    // scheduling
+    server_task_priority priority = SERVER_TASK_PRIORITY_NORMAL;
+    int64_t t_enqueued; // us
+    int64_t t_received = 0; // us, first seen by the main loop
+
+    // prompts of one request sharing a prefix: the first task computes it, the others fork it
+    int id_prefix_task = -1;      // task computing the shared prefix
+    int32_t n_prefix_publish = 0; // length of the shared prefix, for the task computing it
+    int64_t t_deadline = -1; // us, -1 = no deadline
+
+    // multi-turn conversation whose KV cache is kept between requests, see server_session_store
+    std::string session;
+
+    server_task(server_task_type type) : type(type), t_enqueued(ggml_time_us()) {}
+
+    bool is_inference() const
+    {
+        return type == SERVER_TASK_TYPE_COMPLETION || type == SERVER_TASK_TYPE_INFILL ||
+               type == SERVER_TASK_TYPE_EMBEDDING || type == SERVER_TASK_TYPE_RERANK;
+    }
+
+    // scheduling order: control tasks first, then by priority class, then earliest deadline first
+    // callers rely on a stable ordering to keep FIFO among equal tasks
+    static bool sched_before(const server_task &a, const server_task &b)
+    {
+        const int rank_a = a.is_inference() ? (int)a.priority : (int)SERVER_TASK_PRIORITY_COUNT;
+        const int rank_b = b.is_inference() ? (int)b.priority : (int)SERVER_TASK_PRIORITY_COUNT;
+        if (rank_a != rank_b)
+        {
+            return rank_a > rank_b;
+        }
+        if (a.t_deadline != b.t_deadline)
+        {
+            return b.t_deadline < 0 || (a.t_deadline >= 0 && a.t_deadline < b.t_deadline);
+        }
+        return false;
+    }
+
+    // "priority" may be "low", "normal", "high" or the equivalent 0, 1, 2
+    // "deadline_ms" is relative to the arrival of the request
+    void sched_from_json(const json &data)
+    {
+        if (data.contains("priority"))
+        {
+            const json &value = data.at("priority");
+            int p = -1;
+            if (value.is_string())
+            {
+                const std::string str = value.get<std::string>();
+                for (int i = 0; i < SERVER_TASK_PRIORITY_COUNT; i++)
+                {
+                    if (str == server_task_priority_name((server_task_priority)i))
+                    {
+                        p = i;
+                    }
+                }
+            }
+            else if (value.is_number_integer())
+            {
+                p = value.get<int>();
+            }
+            if (p < 0 || p >= SERVER_TASK_PRIORITY_COUNT)
+            {
+                throw std::runtime_error("\"priority\" must be one of \"low\", \"normal\", \"high\"");
+            }
+            priority = (server_task_priority)p;
+        }
+
+        const int64_t deadline_ms = json_value(data, "deadline_ms", (int64_t)-1);
+        if (deadline_ms >= 0)
+        {
+            t_deadline = t_enqueued + deadline_ms * 1000;
+        }
+    }
 
     static slot_params params_from_json_cmpl(const llama_context *ctx, const common_params &params_base,
-                                             const json &data)
+                                             server_grammar_cache &grammars, const json &data)
     {
         const llama_model *model = llama_get_model(ctx);
         const llama_vocab *vocab = llama_model_get_vocab(model);
@@ -287,6 +439,7 @@ struct server_task
         params.speculative.n_min = json_value(data, "speculative.n_min", defaults.speculative.n_min);
         params.speculative.n_max = json_value(data, "speculative.n_max", defaults.speculative.n_max);
         params.speculative.p_min = json_value(data, "speculative.p_min", defaults.speculative.p_min);
+        params.speculative.ngram = json_value(data, "speculative.ngram", defaults.speculative.ngram);
 
         params.speculative.n_min = std::min(params.speculative.n_max, params.speculative.n_min);
         params.speculative.n_min = std::max(params.speculative.n_min, 0);
@@ -358,14 +511,24 @@ struct server_task
             }
         }
 
-        // process "json_schema" and "grammar"
-        if (data.contains("json_schema") && !data.contains("grammar"))
+        // process "response_schema", "json_schema" and "grammar"
+        if (data.contains("response_schema") && !data.contains("grammar") && !data.contains("json_schema"))
+        {
+            const std::string name = json_value(data, "response_schema", std::string());
+            auto it = grammars.named.find(name);
+            if (it == grammars.named.end())
+            {
+                throw std::runtime_error("\"response_schema\": unknown schema '" + name + "'");
+            }
+            params.sampling.grammar = it->second;
+        }
+        else if (data.contains("json_schema") && !data.contains("grammar"))
         {
             try
             {
                 auto schema = json_value(data, "json_schema", json::object());
                 SRV_DBG("JSON schema: %s\n", schema.dump(2).c_str());
-                params.sampling.grammar = json_schema_to_grammar(schema);
+                params.sampling.grammar = grammars.from_schema(schema);
                 SRV_DBG("Converted grammar: %s\n", params.sampling.grammar.c_str());
             }
             catch (const std::exception &e)
@@ -593,6 +756,11 @@ struct server_task_result
     virtual int get_index() { return -1; }
 
     virtual json to_json() = 0;
+
+    // append the result as a server-sent event to out without building a json
+    // returns false if the result has no direct serialization and to_json() must be used instead
+    virtual bool to_sse(std::string & /*out*/) { return false; }
+
     virtual ~server_task_result() = default;
 };
 
@@ -1109,6 +1277,93 @@ struct server_task_result_cmpl_partial : server_task_result
 
         return std::vector<json>({ret});
     }
+
+    // the chunks sent for most tokens, byte for byte the same as their to_json() counterpart
+    // chunks with probabilities, timings or verbose output and the first chat chunk go through to_json()
+    virtual bool to_sse(std::string &out) override
+    {
+        if (!prob_output.probs.empty() || verbose)
+        {
+            return false;
+        }
+
+        switch (oaicompat)
+        {
+        case OAICOMPAT_TYPE_NONE:
+        {
+            if (timings.prompt_n > 0)
+            {
+                return false;
+            }
+
+            out += "data: {\"index\":";
+            json_append_int(out, index);
+            out += ",\"content\":";
+            json_append_string(out, content);
+            out += ",\"tokens\":[";
+            for (size_t i = 0; i < tokens.size(); i++)
+            {
+                if (i > 0)
+                {
+                    out += ',';
+                }
+                json_append_int(out, tokens[i]);
+            }
+            out += "],\"stop\":false,\"id_slot\":";
+            json_append_int(out, id_slot);
+            out += ",\"tokens_predicted\":";
+            json_append_int(out, n_decoded);
+            out += ",\"tokens_evaluated\":";
+            json_append_int(out, n_prompt_tokens);
+            out += "}\n\n";
+            return true;
+        }
+        case OAICOMPAT_TYPE_COMPLETION:
+        {
+            if (timings.prompt_n >= 0)
+            {
+                return false;
+            }
+
+            out += "data: {\"choices\":[{\"text\":";
+            json_append_string(out, content);
+            out += ",\"index\":";
+            json_append_int(out, index);
+            out += ",\"logprobs\":null,\"finish_reason\":null}],\"created\":";
+            json_append_int(out, std::time(0));
+            out += ",\"model\":";
+            json_append_string(out, oaicompat_model);
+            out += ",\"system_fingerprint\":";
+            json_append_string(out, build_info);
+            out += ",\"object\":\"text_completion\",\"id\":";
+            json_append_string(out, oaicompat_cmpl_id);
+            out += "}\n\n";
+            return true;
+        }
+        case OAICOMPAT_TYPE_CHAT:
+        {
+            if (timings.prompt_n >= 0 || n_decoded == 0)
+            {
+                return false;
+            }
+
+            out += "data: {\"choices\":[{\"finish_reason\":null,\"index\":0,\"delta\":{\"content\":";
+            json_append_string(out, content);
+            out += "}}],\"created\":";
+            json_append_int(out, std::time(0));
+            out += ",\"id\":";
+            json_append_string(out, oaicompat_cmpl_id);
+            out += ",\"model\":";
+            json_append_string(out, oaicompat_model);
+            out += ",\"system_fingerprint\":";
+            json_append_string(out, build_info);
+            out += ",\"object\":\"chat.completion.chunk\"}\n\n";
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
 };
 
 struct server_task_result_embd : server_task_result
@@ -1244,6 +1499,41 @@ struct server_task_result_metrics : server_task_result
     uint64_t n_decode_total = 0;
     uint64_t n_busy_slots_total = 0;
 
+    uint64_t n_tasks_started_total[SERVER_TASK_PRIORITY_COUNT] = {};
+    uint64_t t_queue_wait_total[SERVER_TASK_PRIORITY_COUNT] = {};
+    uint64_t n_preempted_total = 0;
+    uint64_t n_draft_total = 0;
+    uint64_t n_draft_accepted_total = 0;
+    int n_tasks_parked = 0;
+    size_t n_parked_bytes = 0;
+
+    uint64_t n_prefix_hits_total = 0;
+    uint64_t n_prefix_tokens_total = 0;
+    uint64_t n_prefix_disk_loads_total = 0;
+    uint64_t n_prefix_disk_saves_total = 0;
+    uint64_t n_prefix_batch_tokens_total = 0;
+    uint64_t n_batches_aborted_total = 0;
+
+    uint64_t n_session_saves_total = 0;
+    uint64_t n_session_restores_total = 0;
+    uint64_t n_session_tokens_total = 0;
+    uint64_t n_session_evictions_total = 0;
+    size_t n_sessions = 0;
+    size_t n_session_bytes = 0;
+
+    double t_kv_defrag = 0.0;
+    uint64_t n_kv_defrag_total = 0;
+    uint64_t n_kv_defrag_cells_total = 0;
+
+    uint64_t n_batch_decode_tokens_total = 0;
+    uint64_t n_batch_prompt_tokens_total = 0;
+    int32_t n_batch_decode_tokens_last = 0;
+    int32_t n_batch_prompt_tokens_last = 0;
+
+    uint64_t n_token_gaps = 0;
+    uint64_t t_token_gaps = 0;
+    uint64_t t_token_gap_max = 0;
+
     // while we can also use std::vector<server_slot> this requires copying the slot object which can be quite messy
     // therefore, we use json to temporarily store the slot.to_json() result
     json slots_data = json::array();
@@ -1269,6 +1559,35 @@ struct server_task_result_metrics : server_task_result
             {"n_decode_total", n_decode_total},
             {"n_busy_slots_total", n_busy_slots_total},
 
+            {"n_preempted_total", n_preempted_total},
+            {"n_draft_total", n_draft_total},
+            {"n_draft_accepted_total", n_draft_accepted_total},
+            {"parked", n_tasks_parked},
+            {"n_parked_bytes", n_parked_bytes},
+
+            {"n_prefix_hits_total", n_prefix_hits_total},
+            {"n_prefix_tokens_total", n_prefix_tokens_total},
+            {"n_prefix_disk_loads_total", n_prefix_disk_loads_total},
+            {"n_prefix_disk_saves_total", n_prefix_disk_saves_total},
+            {"n_prefix_batch_tokens_total", n_prefix_batch_tokens_total},
+            {"n_batches_aborted_total", n_batches_aborted_total},
+            {"n_session_saves_total", n_session_saves_total},
+            {"n_session_restores_total", n_session_restores_total},
+            {"n_session_tokens_total", n_session_tokens_total},
+            {"n_session_evictions_total", n_session_evictions_total},
+            {"n_sessions", n_sessions},
+            {"n_session_bytes", n_session_bytes},
+            {"t_kv_defrag", t_kv_defrag},
+            {"n_kv_defrag_total", n_kv_defrag_total},
+            {"n_kv_defrag_cells_total", n_kv_defrag_cells_total},
+
+            {"n_batch_decode_tokens_total", n_batch_decode_tokens_total},
+            {"n_batch_prompt_tokens_total", n_batch_prompt_tokens_total},
+            {"n_batch_decode_tokens", n_batch_decode_tokens_last},
+            {"n_batch_prompt_tokens", n_batch_prompt_tokens_last},
+            {"t_token_gap_avg", n_token_gaps ? t_token_gaps / 1e3 / n_token_gaps : 0.0},
+            {"t_token_gap_max", t_token_gap_max / 1e3},
+
             {"kv_cache_tokens_count", kv_cache_tokens_count},
             {"kv_cache_used_cells", kv_cache_used_cells},
 
@@ -1333,6 +1652,150 @@ struct server_task_result_apply_lora : server_task_result
     }
 };
 
+// suffix automaton over the cached tokens of a slot
+// finds the longest common substring with a prompt in O(prompt length), instead of the O(n*m) of common_lcs()
+// it can only grow by appending tokens, so it is rebuilt when the cached tokens change in any other way
+struct server_token_index
+{
+    struct state
+    {
+        int32_t len = 0;
+        int32_t link = -1;
+        std::vector<std::pair<llama_token, int32_t>> next; // transitions, sorted by token
+    };
+
+    std::vector<state> states;
+    llama_tokens tokens; // the indexed tokens
+    int32_t last = 0;
+
+    void clear()
+    {
+        states.assign(1, state());
+        tokens.clear();
+        last = 0;
+    }
+
+    // bring the index up to date with the cached tokens, only the new tokens are indexed if they were appended
+    void sync(const llama_tokens &cache_tokens)
+    {
+        if (states.empty() || cache_tokens.size() < tokens.size() ||
+            !std::equal(tokens.begin(), tokens.end(), cache_tokens.begin()))
+        {
+            clear();
+        }
+
+        for (size_t i = tokens.size(); i < cache_tokens.size(); i++)
+        {
+            extend(cache_tokens[i]);
+        }
+    }
+
+    // length of the longest common substring of the indexed tokens and the given ones
+    size_t lcs(const llama_tokens &other) const
+    {
+        if (states.empty())
+        {
+            return 0;
+        }
+
+        size_t n_best = 0;
+        size_t n_cur = 0;
+        int32_t v = 0;
+
+        for (const llama_token t : other)
+        {
+            int32_t nxt = get(v, t);
+            while (v != 0 && nxt < 0)
+            {
+                v = states[v].link;
+                n_cur = states[v].len;
+                nxt = get(v, t);
+            }
+
+            if (nxt < 0)
+            {
+                n_cur = 0;
+                continue;
+            }
+
+            v = nxt;
+            n_best = std::max(n_best, ++n_cur);
+        }
+
+        return n_best;
+    }
+
+private:
+    static bool token_less(const std::pair<llama_token, int32_t> &e, llama_token t) { return e.first < t; }
+
+    int32_t get(int32_t v, llama_token t) const
+    {
+        const auto &next = states[v].next;
+        auto it = std::lower_bound(next.begin(), next.end(), t, token_less);
+        return it != next.end() && it->first == t ? it->second : -1;
+    }
+
+    void set(int32_t v, llama_token t, int32_t to)
+    {
+        auto &next = states[v].next;
+        auto it = std::lower_bound(next.begin(), next.end(), t, token_less);
+        if (it != next.end() && it->first == t)
+        {
+            it->second = to;
+        }
+        else
+        {
+            next.insert(it, {t, to});
+        }
+    }
+
+    void extend(llama_token t)
+    {
+        tokens.push_back(t);
+
+        const int32_t cur = states.size();
+        states.emplace_back();
+        states[cur].len = states[last].len + 1;
+
+        int32_t p = last;
+        while (p != -1 && get(p, t) < 0)
+        {
+            set(p, t, cur);
+            p = states[p].link;
+        }
+
+        if (p == -1)
+        {
+            states[cur].link = 0;
+        }
+        else
+        {
+            const int32_t q = get(p, t);
+            if (states[p].len + 1 == states[q].len)
+            {
+                states[cur].link = q;
+            }
+            else
+            {
+                const int32_t clone = states.size();
+                states.push_back(states[q]);
+                states[clone].len = states[p].len + 1;
+
+                while (p != -1 && get(p, t) == q)
+                {
+                    set(p, t, clone);
+                    p = states[p].link;
+                }
+
+                states[q].link = clone;
+                states[cur].link = clone;
+            }
+        }
+
+        last = cur;
+    }
+};
+
 struct server_slot
 {
     int id;
@@ -1355,6 +1818,18 @@ struct server_slot
 
     struct slot_params params;
 
+    // scheduling class of the current task, see server_task
+    server_task_priority priority = SERVER_TASK_PRIORITY_NORMAL;
+    int64_t t_deadline = -1;
+    int64_t t_enqueued = 0; // us, when the task was posted
+
+    // see server_task, id_prefix_task is cleared once the prompt processing starts
+    int id_prefix_task = -1;
+    int32_t n_prefix_publish = 0;
+
+    // session whose KV cache the slot holds, kept after the release until the slot is reused
+    std::string session;
+
     slot_state state = SLOT_STATE_IDLE;
 
     // used to determine the slot that has been used the longest
@@ -1381,6 +1856,19 @@ struct server_slot
     llama_tokens generated_tokens;
 
     llama_tokens cache_tokens;
+    server_token_index cache_index; // synced lazily with cache_tokens, see get_available_slot()
+
+    // n-grams of the first n_ngram_indexed cache_tokens, used to draft tokens without a draft model
+    common_ngram_cache ngram_cache;
+    size_t n_ngram_indexed = 0;
+
+    // speculative decoding stats of the current task
+    int32_t n_draft_total = 0;
+    int32_t n_draft_accepted = 0;
+
+    // the KV cells of the first n_kv_shared positions may also belong to other slots (see server_prefix_tree)
+    // they must never be shifted, as that would move them for the other slots too
+    int32_t n_kv_shared = 0;
 
     std::vector<completion_token_output> generated_token_probs;
 
@@ -1405,6 +1893,7 @@ struct server_slot
 
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
+    int64_t t_last_token = 0; // us, time the previous token was sampled
 
     double t_prompt_processing; // ms
     double t_token_generation;  // ms
@@ -1428,6 +1917,9 @@ struct server_slot
 
         generated_tokens.clear();
         generated_token_probs.clear();
+
+        n_draft_total = 0;
+        n_draft_accepted = 0;
     }
 
     bool is_non_causal() const
@@ -1463,7 +1955,10 @@ struct server_slot
 
     bool is_processing() const { return state != SLOT_STATE_IDLE; }
 
-    bool can_speculate() const { return ctx_dft && params.speculative.n_max > 0 && params.cache_prompt; }
+    bool can_speculate() const
+    {
+        return (ctx_dft || params.speculative.ngram) && params.speculative.n_max > 0 && params.cache_prompt;
+    }
 
     void add_token(const completion_token_output &token)
     {
@@ -1567,6 +2062,7 @@ struct server_slot
             {"speculative", can_speculate()},
             {"is_processing", is_processing()},
             {"non_causal", is_non_causal()},
+            {"priority", server_task_priority_name(priority)},
             {"params", params.to_json()},
             {"prompt", common_detokenize(ctx, prompt_tokens)},
             {"next_token",
@@ -1577,2197 +2073,5195 @@ struct server_slot
                  {"n_decoded", n_decoded},
                  {"stopping_word", stopping_word},
              }},
+            {"n_draft_total", n_draft_total},
+            {"n_draft_accepted", n_draft_accepted},
+            {"draft_acceptance_rate", n_draft_total > 0 ? (double)n_draft_accepted / n_draft_total : 0.0},
         };
     }
 };
 
-struct server_metrics
+// radix tree over the prompt prefixes held in the KV cache of the slots
+// each node lists the slots whose cached sequence covers the whole path from the root to the end of its edge,
+// so the owners of a node are always a subset of the owners of its parent
+struct server_prefix_tree
 {
-    int64_t t_start = 0;
+    struct node
+    {
+        llama_tokens edge;
+        std::unordered_map<llama_token, std::unique_ptr<node>> children;
+        std::vector<int> owners;
+    };
 
-    uint64_t n_prompt_tokens_processed_total = 0;
-    uint64_t t_prompt_processing_total = 0;
-    uint64_t n_tokens_predicted_total = 0;
-    uint64_t t_tokens_generation_total = 0;
+    node root;
 
-    uint64_t n_prompt_tokens_processed = 0;
-    uint64_t t_prompt_processing = 0;
+    // indexed prefix of each slot, needed to find its nodes again
+    std::unordered_map<int, llama_tokens> seqs;
 
-    uint64_t n_tokens_predicted = 0;
-    uint64_t t_tokens_generation = 0;
+    // index the first n tokens as held by the slot, replacing what was indexed before
+    void insert(int id_slot, const llama_tokens &tokens, size_t n)
+    {
+        remove(id_slot);
 
-    uint64_t n_decode_total = 0;
-    uint64_t n_busy_slots_total = 0;
+        n = std::min(n, tokens.size());
+        if (n == 0)
+        {
+            return;
+        }
 
-    void init() { t_start = ggml_time_us(); }
+        seqs[id_slot] = llama_tokens(tokens.begin(), tokens.begin() + n);
 
-    void on_prompt_eval(const server_slot &slot)
-    {
-        n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
-        n_prompt_tokens_processed += slot.n_prompt_tokens_processed;
-        t_prompt_processing += slot.t_prompt_processing;
-        t_prompt_processing_total += slot.t_prompt_processing;
+        node *cur = &root;
+        size_t i = 0;
+        while (i < n)
+        {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end())
+            {
+                auto child = std::make_unique<node>();
+                child->edge.assign(tokens.begin() + i, tokens.begin() + n);
+                child->owners.push_back(id_slot);
+                cur->children.emplace(tokens[i], std::move(child));
+                return;
+            }
+
+            node *child = it->second.get();
+            const size_t n_common = common_len(child->edge, tokens, i, n);
+
+            if (n_common < child->edge.size())
+            {
+                // split the edge, the new node is covered by the owners of the old one
+                auto mid = std::make_unique<node>();
+                mid->edge.assign(child->edge.begin(), child->edge.begin() + n_common);
+                mid->owners = child->owners;
+
+                std::unique_ptr<node> tail = std::move(it->second);
+                tail->edge.erase(tail->edge.begin(), tail->edge.begin() + n_common);
+                mid->children.emplace(tail->edge[0], std::move(tail));
+
+                it->second = std::move(mid);
+                child = it->second.get();
+            }
+
+            child->owners.push_back(id_slot);
+            cur = child;
+            i += n_common;
+        }
     }
 
-    void on_prediction(const server_slot &slot)
+    // keep only the first n tokens of the slot's indexed prefix
+    void truncate(int id_slot, size_t n)
     {
-        n_tokens_predicted_total += slot.n_decoded;
-        n_tokens_predicted += slot.n_decoded;
-        t_tokens_generation += slot.t_token_generation;
-        t_tokens_generation_total += slot.t_token_generation;
+        auto it = seqs.find(id_slot);
+        if (it == seqs.end() || n >= it->second.size())
+        {
+            return;
+        }
+
+        const llama_tokens tokens = it->second;
+        insert(id_slot, tokens, n);
     }
 
-    void on_decoded(const std::vector<server_slot> &slots)
+    void remove(int id_slot)
     {
-        n_decode_total++;
-        for (const auto &slot : slots)
+        auto it = seqs.find(id_slot);
+        if (it == seqs.end())
         {
-            if (slot.is_processing())
+            return;
+        }
+        const llama_tokens tokens = std::move(it->second);
+        seqs.erase(it);
+
+        node *cur = &root;
+        size_t i = 0;
+        while (i < tokens.size())
+        {
+            auto it_child = cur->children.find(tokens[i]);
+            if (it_child == cur->children.end())
             {
-                n_busy_slots_total++;
+                break;
+            }
+
+            node *child = it_child->second.get();
+            child->owners.erase(std::remove(child->owners.begin(), child->owners.end(), id_slot),
+                                child->owners.end());
+
+            i += child->edge.size();
+
+            if (child->owners.empty())
+            {
+                // nobody covers this node, so nobody covers its subtree either
+                cur->children.erase(it_child);
+                break;
             }
+            cur = child;
         }
     }
 
-    void reset_bucket()
+    void clear()
     {
-        n_prompt_tokens_processed = 0;
-        t_prompt_processing = 0;
-        n_tokens_predicted = 0;
-        t_tokens_generation = 0;
+        root.children.clear();
+        seqs.clear();
     }
-};
-
-struct server_queue
-{
-    int id = 0;
-    bool running;
-
-    // queues
-    std::deque<server_task> queue_tasks;
-    std::deque<server_task> queue_tasks_deferred;
-
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
-
-    // callback functions
-    std::function<void(server_task)> callback_new_task;
-    std::function<void(void)> callback_update_slots;
 
-    // Add a new task to the end of the queue
-    int post(server_task task, bool front = false)
+    // length of the longest prefix of tokens held by a slot accepted by the filter, -1 in id_slot if none
+    size_t match(const llama_tokens &tokens, int &id_slot, const std::function<bool(int)> &filter) const
     {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        GGML_ASSERT(task.id != -1);
-        // if this is cancel task make sure to clean up pending tasks
-        if (task.type == SERVER_TASK_TYPE_CANCEL)
-        {
-            cleanup_pending_task(task.id_target);
-        }
-        QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
-        if (front)
-        {
-            queue_tasks.push_front(std::move(task));
-        }
-        else
-        {
-            queue_tasks.push_back(std::move(task));
-        }
-        condition_tasks.notify_one();
-        return task.id;
-    }
+        size_t n_best = 0;
+        id_slot = -1;
 
-    // multi-task version of post()
-    int post(std::vector<server_task> &tasks, bool front = false)
-    {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto &task : tasks)
+        const node *cur = &root;
+        size_t i = 0;
+        while (i < tokens.size())
         {
-            if (task.id == -1)
-            {
-                task.id = id++;
-            }
-            // if this is cancel task make sure to clean up pending tasks
-            if (task.type == SERVER_TASK_TYPE_CANCEL)
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end())
             {
-                cleanup_pending_task(task.id_target);
+                break;
             }
-            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int)tasks.size(), front);
-            if (front)
+
+            const node *child = it->second.get();
+            const size_t n_common = common_len(child->edge, tokens, i, tokens.size());
+
+            for (int owner : child->owners)
             {
-                queue_tasks.push_front(std::move(task));
+                if (filter(owner))
+                {
+                    n_best = i + n_common;
+                    id_slot = owner;
+                    break;
+                }
             }
-            else
+
+            if (n_common < child->edge.size())
             {
-                queue_tasks.push_back(std::move(task));
+                break;
             }
+            cur = child;
+            i += n_common;
         }
-        condition_tasks.notify_one();
-        return 0;
+
+        return n_best;
     }
 
-    // Add a new task, but defer until one slot is available
-    void defer(server_task task)
+private:
+    static size_t common_len(const llama_tokens &edge, const llama_tokens &tokens, size_t i, size_t n)
     {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %d\n", task.id);
-        queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
+        size_t k = 0;
+        while (k < edge.size() && i + k < n && edge[k] == tokens[i + k])
+        {
+            k++;
+        }
+        return k;
     }
+};
 
-    // Get the next id for creating a new task
-    int get_new_id()
+// content-addressed store of hot prompt prefixes on disk, so that they survive a restart of the server
+// each entry is a sequence state file in the format of llama_state_seq_save_file, named after the model and the prefix
+// hash
+// a prefix is only saved once n_hits_min prompts reused it, and the file is written by a thread of the store: the
+// decode loop only copies the KV cache of the sequence
+struct server_prefix_store
+{
+    struct entry
     {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
-    }
+        std::string path;
+        llama_tokens tokens;
+        size_t n_bytes = 0;
+        std::filesystem::file_time_type t_last_used;
+        bool pending = false; // the file is being written
+    };
 
-    // Register function to process a new task
-    void on_new_task(std::function<void(server_task)> callback) { callback_new_task = std::move(callback); }
+    // a prefix reused by some prompts, not hot enough to be saved yet
+    struct candidate
+    {
+        llama_tokens tokens;
+        int32_t n_hits = 0;
+    };
 
-    // Register the function to be called when all slots data is ready to be processed
-    void on_update_slots(std::function<void(void)> callback) { callback_update_slots = std::move(callback); }
+    std::string dir;
+    std::string model_key; // hash of the model and of the KV cache layout, files of other models are ignored
+    size_t n_bytes_max = 0;
+    size_t n_bytes = 0;
+    int32_t n_hits_min = 1;
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    void pop_deferred_task()
-    {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (!queue_tasks_deferred.empty())
-        {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
-        }
-        condition_tasks.notify_one();
-    }
+    // only a handful of prefixes are hot at any time, so linear scans are fine
+    std::vector<entry> entries;
+    std::vector<candidate> candidates; // most recently used first
 
-    // end the start_loop routine
-    void terminate()
+    ~server_prefix_store()
     {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        running = false;
-        condition_tasks.notify_all();
+        stop();
     }
 
-    /**
-     * Main loop consists of these steps:
-     * - Wait until a new task arrives
-     * - Process the task (i.e. maybe copy data into slot)
-     * - Check if multitask is finished
-     * - Update all slots
-     */
-    void start_loop()
+    bool enabled() const { return !dir.empty(); }
+
+    // index the entries of the model that are already on disk
+    void init(const std::string &path, const std::string &key, size_t n_bytes_limit, int32_t n_hits)
     {
-        running = true;
+        dir = path;
+        model_key = key;
+        n_bytes_max = n_bytes_limit;
+        n_hits_min = std::max(n_hits, 1);
 
-        while (true)
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (ec)
         {
-            QUE_DBG("%s", "processing new tasks\n");
+            SRV_ERR("failed to create prefix cache directory '%s': %s\n", dir.c_str(), ec.message().c_str());
+            dir.clear();
+            return;
+        }
 
-            while (true)
+        for (const auto &it : std::filesystem::directory_iterator(dir, ec))
+        {
+            const std::string name = it.path().filename().string();
+            if (!it.is_regular_file() || name.rfind(model_key + "-", 0) != 0)
             {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running)
-                {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty())
-                {
-                    lock.unlock();
-                    break;
-                }
-                server_task task = queue_tasks.front();
-                queue_tasks.pop_front();
-                lock.unlock();
-
-                QUE_DBG("processing task, id = %d\n", task.id);
-                callback_new_task(std::move(task));
+                continue;
             }
 
-            // all tasks in the current loop is processed, slots data is now ready
-            QUE_DBG("%s", "update slots\n");
-
-            callback_update_slots();
+            entry e;
+            e.path = it.path().string();
+            e.n_bytes = it.file_size(ec);
+            e.t_last_used = it.last_write_time(ec);
 
-            QUE_DBG("%s", "waiting for new tasks\n");
+            if (!read_tokens(e.path, e.tokens) || e.tokens.empty())
             {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running)
-                {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty())
-                {
-                    condition_tasks.wait(lock, [&]
-                                         { return (!queue_tasks.empty() || !running); });
-                }
+                SRV_WRN("ignoring invalid prefix cache file '%s'\n", e.path.c_str());
+                continue;
             }
+
+            n_bytes += e.n_bytes;
+            entries.push_back(std::move(e));
         }
+
+        // most recently used first
+        std::sort(entries.begin(), entries.end(), [](const entry &a, const entry &b)
+                  { return a.t_last_used > b.t_last_used; });
+
+        evict();
+
+        running = true;
+        writer = std::thread([this]()
+                             { writer_loop(); });
+
+        SRV_INF("prefix cache '%s': %zu entries, %.2f MiB\n", dir.c_str(), entries.size(), n_bytes / 1024.0 / 1024.0);
     }
 
-private:
-    void cleanup_pending_task(int id_target)
+    void stop()
     {
-        // no need lock because this is called exclusively by post()
-        auto rm_func = [id_target](const server_task &task)
         {
-            return task.id_target == id_target;
-        };
-        queue_tasks.erase(std::remove_if(queue_tasks.begin(), queue_tasks.end(), rm_func), queue_tasks.end());
-        queue_tasks_deferred.erase(std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), rm_func),
-                                   queue_tasks_deferred.end());
+            std::unique_lock<std::mutex> lock(mutex_writer);
+            if (!running)
+            {
+                return;
+            }
+            running = false;
+        }
+        condition_writer.notify_all();
+
+        // the pending file is written first
+        writer.join();
     }
-};
 
-struct server_response
-{
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+    // entry sharing the longest common prefix with tokens, nullptr if none
+    // the entries whose file is still being written only count with include_pending
+    const entry *match(const llama_tokens &tokens, size_t &n_match, bool include_pending = false) const
+    {
+        const entry *best = nullptr;
+        n_match = 0;
+
+        for (const entry &e : entries)
+        {
+            if (e.pending && !include_pending)
+            {
+                continue;
+            }
 
-    // the main result queue (using ptr for polymorphism)
-    std::vector<server_task_result_ptr> queue_results;
+            const size_t n = common_lcp(e.tokens, tokens);
+            if (n > n_match)
+            {
+                n_match = n;
+                best = &e;
+            }
+        }
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+        return best;
+    }
 
-    // add the id_task to the list of tasks waiting for response
-    void add_waiting_task_id(int id_task)
+    // path for the state of the given prefix, empty if an entry already covers it
+    std::string path_for(const llama_tokens &tokens) const
     {
-        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task,
-                (int)waiting_task_ids.size());
+        size_t n_match = 0;
+        match(tokens, n_match, true);
+        if (n_match >= tokens.size())
+        {
+            return "";
+        }
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        const uint64_t h = hash(tokens.data(), tokens.size() * sizeof(llama_token));
+
+        return dir + model_key + "-" + string_format("%016" PRIx64, h) + ".bin";
     }
 
-    void add_waiting_tasks(const std::vector<server_task> &tasks)
+    // count a prompt reusing the prefix, true once n_hits_min prompts reused at least n_min tokens of it
+    bool hit(const llama_tokens &tokens, size_t n_min)
     {
-        std::unique_lock<std::mutex> lock(mutex_results);
+        if (n_hits_min <= 1)
+        {
+            return true;
+        }
 
-        for (const auto &task : tasks)
+        size_t n_match = 0;
+        size_t i_best = candidates.size();
+        for (size_t i = 0; i < candidates.size(); i++)
         {
-            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id,
-                    (int)waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
+            const size_t n = common_lcp(candidates[i].tokens, tokens);
+            if (n >= n_min && n > n_match)
+            {
+                n_match = n;
+                i_best = i;
+            }
         }
-    }
 
-    // when the request is finished, we can remove task associated with it
-    void remove_waiting_task_id(int id_task)
-    {
-        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task,
-                (int)waiting_task_ids.size());
+        if (i_best == candidates.size())
+        {
+            candidates.insert(candidates.begin(), {tokens, 1});
+            if (candidates.size() > N_CANDIDATES_MAX)
+            {
+                candidates.pop_back();
+            }
+            return false;
+        }
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
-        // make sure to clean up all pending results
-        queue_results.erase(
-            std::remove_if(queue_results.begin(), queue_results.end(),
-                           [id_task](const server_task_result_ptr &res)
-                           { return res->id == id_task; }),
-            queue_results.end());
+        // the candidate becomes the part the prompts have in common
+        candidate &c = candidates[i_best];
+        c.tokens.resize(n_match);
+        c.n_hits++;
+        std::rotate(candidates.begin(), candidates.begin() + i_best, candidates.begin() + i_best + 1);
+
+        return candidates.front().n_hits >= n_hits_min;
     }
 
-    void remove_waiting_task_ids(const std::unordered_set<int> &id_tasks)
+    // a file is being written, the next one has to wait
+    bool busy()
     {
-        std::unique_lock<std::mutex> lock(mutex_results);
+        std::unique_lock<std::mutex> lock(mutex_writer);
+        return job_pending || job_writing;
+    }
 
-        for (const auto &id_task : id_tasks)
+    // buffer of at least n bytes for the state of the next file, only while the store is not busy
+    // it is kept between the files: a fresh allocation of the size of a KV cache copy costs more in page faults than
+    // the copy itself
+    uint8_t *reserve(size_t n)
+    {
+        if (buffer.size() < n)
         {
-            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task,
-                    (int)waiting_task_ids.size());
-            waiting_task_ids.erase(id_task);
+            buffer.resize(n);
         }
+        return buffer.data();
     }
 
-    // This function blocks the thread until there is a response for one of the id_tasks
-    server_task_result_ptr recv(const std::unordered_set<int> &id_tasks)
+    // add an entry for the state of the sequence, the first n_data bytes of the buffer hold the output of
+    // llama_state_seq_get_data
+    // the file is written by the writer thread, the entry is not matched until then
+    void write(const std::string &path, const llama_tokens &tokens, size_t n_data)
     {
-        while (true)
-        {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]
-                                   { return !queue_results.empty(); });
+        entry e;
+        e.path = path;
+        e.tokens = tokens;
+        e.n_bytes = 3 * sizeof(uint32_t) + tokens.size() * sizeof(llama_token) + n_data;
+        e.t_last_used = std::filesystem::file_time_type::clock::now();
+        e.pending = true;
 
-            for (size_t i = 0; i < queue_results.size(); i++)
-            {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end())
-                {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
+        n_bytes += e.n_bytes;
+        entries.insert(entries.begin(), std::move(e));
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_writer);
+            job.path = path;
+            job.tokens = tokens;
+            job.n_data = n_data;
+            job_pending = true;
         }
+        condition_writer.notify_one();
 
-        // should never reach here
+        evict();
     }
 
-    // same as recv(), but have timeout in seconds
-    // if timeout is reached, nullptr is returned
-    server_task_result_ptr recv_with_timeout(const std::unordered_set<int> &id_tasks, int timeout)
+    // apply the files written since the last call, returns the number of files written
+    size_t collect()
     {
-        while (true)
+        std::vector<std::pair<std::string, bool>> results;
         {
-            std::unique_lock<std::mutex> lock(mutex_results);
+            std::unique_lock<std::mutex> lock(mutex_writer);
+            results.swap(written);
+        }
 
-            for (int i = 0; i < (int)queue_results.size(); i++)
+        size_t n_written = 0;
+        for (const auto &result : results)
+        {
+            auto it = std::find_if(entries.begin(), entries.end(), [&](const entry &e)
+                                   { return e.path == result.first; });
+            if (it == entries.end())
             {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end())
-                {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
+                continue;
             }
 
-            std::cv_status cr_res = condition_results.wait_for(lock, std::chrono::seconds(timeout));
-            if (cr_res == std::cv_status::timeout)
+            if (result.second)
             {
-                return nullptr;
+                it->pending = false;
+                n_written++;
+            }
+            else
+            {
+                n_bytes -= it->n_bytes;
+                entries.erase(it);
             }
         }
 
-        // should never reach here
+        evict();
+
+        return n_written;
     }
 
-    // single-task version of recv()
-    server_task_result_ptr recv(int id_task)
+    void touch(const std::string &path)
     {
-        std::unordered_set<int> id_tasks = {id_task};
-        return recv(id_tasks);
+        auto it = std::find_if(entries.begin(), entries.end(), [&](const entry &e)
+                               { return e.path == path; });
+        if (it == entries.end())
+        {
+            return;
+        }
+
+        it->t_last_used = std::filesystem::file_time_type::clock::now();
+
+        // the modification time is the recency across restarts
+        std::error_code ec;
+        std::filesystem::last_write_time(it->path, it->t_last_used, ec);
+
+        std::rotate(entries.begin(), it, it + 1);
     }
 
-    // Send a new result to a waiting id_task
-    void send(server_task_result_ptr &&result)
+    static uint64_t hash(const void *data, size_t n, uint64_t h = 0xcbf29ce484222325ULL)
     {
-        SRV_DBG("sending result for task id = %d\n", result->id);
+        // FNV-1a
+        const uint8_t *p = (const uint8_t *)data;
+        for (size_t i = 0; i < n; i++)
+        {
+            h ^= p[i];
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto &id_task : waiting_task_ids)
+private:
+    static constexpr size_t N_CANDIDATES_MAX = 32;
+
+    struct write_job
+    {
+        std::string path;
+        llama_tokens tokens;
+        size_t n_data = 0;
+    };
+
+    // a single job at a time: the data is a copy of the KV cache of a sequence, it can be large
+    std::vector<uint8_t> buffer;
+    std::thread writer;
+    std::mutex mutex_writer;
+    std::condition_variable condition_writer;
+    bool running = false;
+    bool job_pending = false;
+    bool job_writing = false;
+    write_job job;
+    std::vector<std::pair<std::string, bool>> written; // path, success
+
+    void writer_loop()
+    {
+        while (true)
         {
-            if (result->id == id_task)
+            write_job cur;
             {
-                SRV_DBG("task id = %d pushed to result queue\n", result->id);
+                std::unique_lock<std::mutex> lock(mutex_writer);
+                condition_writer.wait(lock, [&]
+                                      { return !running || job_pending; });
+                if (!job_pending)
+                {
+                    return;
+                }
+                cur = std::move(job);
+                job_pending = false;
+                job_writing = true;
+            }
 
-                queue_results.emplace_back(std::move(result));
-                condition_results.notify_all();
-                return;
+            const int64_t t_start = ggml_time_us();
+            const bool ok = write_file(cur, buffer.data());
+            if (ok)
+            {
+                SRV_INF("saved %zu prompt tokens to the prefix cache file '%s' in %.2f ms, %.2f MiB\n",
+                        cur.tokens.size(), cur.path.c_str(), (ggml_time_us() - t_start) / 1e3,
+                        cur.n_data / 1024.0 / 1024.0);
             }
+            else
+            {
+                SRV_WRN("failed to save prefix cache file '%s'\n", cur.path.c_str());
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_writer);
+            job_writing = false;
+            written.emplace_back(cur.path, ok);
         }
     }
-};
 
-struct server_context
-{
-    common_params params_base;
+    // same layout as llama_state_seq_save_file, written under another name first so that no partial file is indexed
+    static bool write_file(const write_job &j, const uint8_t *data)
+    {
+        const std::filesystem::path path(j.path);
+        const std::filesystem::path path_tmp = path.parent_path() / ("tmp-" + path.filename().string());
 
-    // note: keep these alive - they determine the lifetime of the model, context, etc.
-    common_init_result llama_init;
-    common_init_result llama_init_dft;
+        {
+            std::ofstream f(path_tmp, std::ios::binary);
 
-    llama_model *model = nullptr;
-    llama_context *ctx = nullptr;
+            const uint32_t header[3] = {LLAMA_STATE_SEQ_MAGIC, LLAMA_STATE_SEQ_VERSION, (uint32_t)j.tokens.size()};
+            f.write((const char *)header, sizeof(header));
+            f.write((const char *)j.tokens.data(), j.tokens.size() * sizeof(llama_token));
+            f.write((const char *)data, j.n_data);
 
-    const llama_vocab *vocab = nullptr;
-
-    llama_model *model_dft = nullptr;
-
-    llama_context_params cparams_dft;
-
-    llama_batch batch = {};
-
-    bool clean_kv_cache = true;
-    bool add_bos_token = true;
-    bool has_eos_token = false;
-
-    int32_t n_ctx; // total context for all clients / slots
-
-    // slots / clients
-    std::vector<server_slot> slots;
-    json default_generation_settings_for_props;
-
-    server_queue queue_tasks;
-    server_response queue_results;
-
-    server_metrics metrics;
+            if (!f)
+            {
+                std::error_code ec;
+                std::filesystem::remove(path_tmp, ec);
+                return false;
+            }
+        }
 
-    // Necessary similarity of prompt for slot selection
-    float slot_prompt_similarity = 0.0f;
+        std::error_code ec;
+        std::filesystem::rename(path_tmp, path, ec);
 
-    common_chat_templates_ptr chat_templates;
+        return !ec;
+    }
 
-    ~server_context()
+    // drop the least recently used entries until the store fits in n_bytes_max
+    // an entry whose file is being written is kept until it is collected
+    void evict()
     {
-        // Clear any sampling context
-        for (server_slot &slot : slots)
+        while (!entries.empty() && n_bytes > n_bytes_max && !entries.back().pending)
         {
-            common_sampler_free(slot.smpl);
-            slot.smpl = nullptr;
+            const entry &e = entries.back();
 
-            llama_free(slot.ctx_dft);
-            slot.ctx_dft = nullptr;
+            SRV_INF("evicting prefix cache file '%s', n_tokens = %zu, %.2f MiB\n", e.path.c_str(), e.tokens.size(),
+                    e.n_bytes / 1024.0 / 1024.0);
 
-            common_speculative_free(slot.spec);
-            slot.spec = nullptr;
+            std::error_code ec;
+            std::filesystem::remove(e.path, ec);
 
-            llama_batch_free(slot.batch_spec);
+            n_bytes -= e.n_bytes;
+            entries.pop_back();
         }
-
-        llama_batch_free(batch);
     }
 
-    bool load_model(const common_params &params)
+    // read the prompt stored in the header of a sequence state file
+    static bool read_tokens(const std::string &path, llama_tokens &tokens)
     {
-        SRV_INF("loading model '%s'\n", params.model.c_str());
-
-        params_base = params;
+        std::ifstream f(path, std::ios::binary);
 
-        llama_init = common_init_from_params(params_base);
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        uint32_t n_tokens = 0;
 
-        model = llama_init.model.get();
-        ctx = llama_init.context.get();
+        f.read((char *)&magic, sizeof(magic));
+        f.read((char *)&version, sizeof(version));
+        f.read((char *)&n_tokens, sizeof(n_tokens));
 
-        if (model == nullptr)
+        if (!f || magic != LLAMA_STATE_SEQ_MAGIC || version != LLAMA_STATE_SEQ_VERSION)
         {
-            SRV_ERR("failed to load model, '%s'\n", params_base.model.c_str());
             return false;
         }
 
-        vocab = llama_model_get_vocab(model);
+        tokens.resize(n_tokens);
+        f.read((char *)tokens.data(), n_tokens * sizeof(llama_token));
 
-        n_ctx = llama_n_ctx(ctx);
+        return (bool)f;
+    }
+};
 
-        add_bos_token = llama_vocab_get_add_bos(vocab);
-        has_eos_token = llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL;
+// KV cache of the chat sessions that lost their slot to another task, kept in memory until their next turn
+// a snapshot is only taken when the slot of the session is reused, a session that keeps its slot costs nothing
+struct server_session_store
+{
+    struct entry
+    {
+        llama_tokens tokens;
+        std::vector<uint8_t> kv_state;
+    };
 
-        if (!params_base.speculative.model.empty() || !params_base.speculative.hf_repo.empty())
-        {
-            SRV_INF("loading draft model '%s'\n", params_base.speculative.model.c_str());
+    size_t n_bytes_max = 0;
+    size_t n_bytes = 0;
+    uint64_t n_evicted_total = 0;
 
-            auto params_dft = params_base;
+    std::list<std::pair<std::string, entry>> entries; // most recently used first
+    std::unordered_map<std::string, std::list<std::pair<std::string, entry>>::iterator> index;
 
-            params_dft.devices = params_base.speculative.devices;
-            params_dft.hf_file = params_base.speculative.hf_file;
-            params_dft.hf_repo = params_base.speculative.hf_repo;
-            params_dft.model = params_base.speculative.model;
-            params_dft.model_url = params_base.speculative.model_url;
-            params_dft.n_ctx = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
-            params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
-            params_dft.n_parallel = 1;
+    bool enabled() const { return n_bytes_max > 0; }
 
-            llama_init_dft = common_init_from_params(params_dft);
+    void put(const std::string &session, entry e)
+    {
+        erase(session);
 
-            model_dft = llama_init_dft.model.get();
+        n_bytes += e.kv_state.size();
+        entries.emplace_front(session, std::move(e));
+        index[session] = entries.begin();
 
-            if (model_dft == nullptr)
-            {
-                SRV_ERR("failed to load draft model, '%s'\n", params_base.speculative.model.c_str());
-                return false;
-            }
+        evict();
+    }
 
-            if (!common_speculative_are_compatible(ctx, llama_init_dft.context.get()))
-            {
-                SRV_ERR("the draft model '%s' is not compatible with the target model '%s'\n",
-                        params_base.speculative.model.c_str(), params_base.model.c_str());
+    // the snapshot stays in the store until it is erased, once a slot holds the session
+    const entry *find(const std::string &session) const
+    {
+        auto it = index.find(session);
+        return it == index.end() ? nullptr : &it->second->second;
+    }
 
-                return false;
-            }
+    void erase(const std::string &session)
+    {
+        auto it = index.find(session);
+        if (it == index.end())
+        {
+            return;
+        }
 
-            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
+        n_bytes -= it->second->second.kv_state.size();
+        entries.erase(it->second);
+        index.erase(it);
+    }
 
-            cparams_dft = common_context_params_to_llama(params_dft);
-            cparams_dft.n_batch = n_ctx_dft;
+private:
+    void evict()
+    {
+        while (!entries.empty() && n_bytes > n_bytes_max)
+        {
+            const auto &back = entries.back();
 
-            // force F16 KV cache for the draft model for extra performance
-            cparams_dft.type_k = GGML_TYPE_F16;
-            cparams_dft.type_v = GGML_TYPE_F16;
+            SRV_INF("evicting session '%s', n_tokens = %zu, %.2f MiB\n", back.first.c_str(),
+                    back.second.tokens.size(), back.second.kv_state.size() / 1024.0 / 1024.0);
 
-            // the context is not needed - we will create one for each slot
-            llama_init_dft.context.reset();
+            n_bytes -= back.second.kv_state.size();
+            index.erase(back.first);
+            entries.pop_back();
+            n_evicted_total++;
         }
+    }
+};
 
-        chat_templates = common_chat_templates_init(model, params_base.chat_template);
-        try
-        {
-            common_chat_format_example(chat_templates.get(), params.use_jinja);
-        }
-        catch (const std::exception &e)
+// a slot that was preempted by a higher priority task
+// it is resumed through a deferred task with the same id once a slot is available again
+struct server_slot_parked
+{
+    server_slot slot; // snapshot of the slot, owns the sampler - the other resources stay with the live slot
+    std::vector<uint8_t> kv_state;
+    int64_t t_parked = 0;
+};
+
+// spans of the request pipeline, kept in a ring buffer and exported by GET /trace in the Chrome trace format, which
+// chrome://tracing and Perfetto can open
+// adding a span is lock-free: the writer takes an entry with an atomic increment and publishes it with a sequence
+// number, so that a dump skips the entries that are being overwritten
+struct server_tracer
+{
+    void init(size_t n_spans)
+    {
+        spans.reset(n_spans > 0 ? new span[n_spans] : nullptr);
+        this->n_spans = n_spans;
+    }
+
+    bool enabled() const { return n_spans > 0; }
+
+    // name must be a string literal, id_task = -1 for the spans that are not specific to a task
+    void add(const char *name, int id_task, int64_t t_start, int64_t t_end)
+    {
+        if (!enabled())
         {
-            SRV_WRN(
-                "%s: The chat template that comes with this model is not yet supported, falling back to chatml. This "
-                "may cause the model to output suboptimal responses\n",
-                __func__);
-            chat_templates = common_chat_templates_init(model, "chatml");
+            return;
         }
 
-        return true;
+        const uint64_t i = n_written.fetch_add(1, std::memory_order_relaxed);
+        span &s = spans[i % n_spans];
+
+        s.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s.name.store(name, std::memory_order_relaxed);
+        s.id_task.store(id_task, std::memory_order_relaxed);
+        s.tid.store(thread_index(), std::memory_order_relaxed);
+        s.t_start.store(t_start, std::memory_order_relaxed);
+        s.t_end.store(t_end, std::memory_order_relaxed);
+        s.seq.store(i + 1, std::memory_order_release);
     }
 
-    void init()
+    json to_json() const
     {
-        const int32_t n_ctx_slot = n_ctx / params_base.n_parallel;
+        json events = json::array();
 
-        SRV_INF("initializing slots, n_slots = %d\n", params_base.n_parallel);
-
-        for (int i = 0; i < params_base.n_parallel; i++)
+        const uint64_t n = n_written.load(std::memory_order_acquire);
+        for (uint64_t i = n > n_spans ? n - n_spans : 0; i < n; i++)
         {
-            server_slot slot;
+            const span &s = spans[i % n_spans];
 
-            slot.id = i;
-            slot.ctx = ctx;
-            slot.n_ctx = n_ctx_slot;
-            slot.n_predict = params_base.n_predict;
-
-            if (model_dft)
+            const uint64_t seq = s.seq.load(std::memory_order_acquire);
+            const char *name = s.name.load(std::memory_order_relaxed);
+            const int32_t id_task = s.id_task.load(std::memory_order_relaxed);
+            const int32_t tid = s.tid.load(std::memory_order_relaxed);
+            const int64_t t_start = s.t_start.load(std::memory_order_relaxed);
+            const int64_t t_end = s.t_end.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq != i + 1 || s.seq.load(std::memory_order_relaxed) != seq)
             {
-                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
-
-                slot.ctx_dft = llama_init_from_model(model_dft, cparams_dft);
-                if (slot.ctx_dft == nullptr)
-                {
-                    SRV_ERR("%s", "failed to create draft context\n");
-                    return;
-                }
+                continue; // overwritten since
+            }
 
-                slot.spec = common_speculative_init(slot.ctx_dft);
-                if (slot.spec == nullptr)
-                {
-                    SRV_ERR("%s", "failed to create speculator\n");
-                    return;
-                }
+            json event = {
+                {"name", name},
+                {"cat", "server"},
+                {"ph", "X"},
+                {"ts", t_start},
+                {"dur", t_end - t_start},
+                {"pid", 1},
+                {"tid", tid},
+            };
+            if (id_task >= 0)
+            {
+                event["args"] = {{"id_task", id_task}};
             }
+            events.push_back(std::move(event));
+        }
 
-            SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
+        return json{
+            {"traceEvents", std::move(events)},
+            {"displayTimeUnit", "ms"},
+        };
+    }
 
-            slot.params.sampling = params_base.sampling;
+private:
+    struct span
+    {
+        std::atomic<uint64_t> seq{0}; // index of the span + 1, 0 while it is written
+        std::atomic<const char *> name{nullptr};
+        std::atomic<int32_t> id_task{-1};
+        std::atomic<int32_t> tid{0};
+        std::atomic<int64_t> t_start{0};
+        std::atomic<int64_t> t_end{0};
+    };
 
-            slot.callback_on_release = [this](int)
-            {
-                queue_tasks.pop_deferred_task();
-            };
+    std::unique_ptr<span[]> spans;
+    size_t n_spans = 0;
+    std::atomic<uint64_t> n_written{0};
 
-            slot.reset();
+    static int32_t thread_index()
+    {
+        static std::atomic<int32_t> n_threads{0};
+        thread_local const int32_t i = n_threads.fetch_add(1, std::memory_order_relaxed) + 1;
+        return i;
+    }
+};
 
-            slots.push_back(slot);
-        }
+static server_tracer tracer;
 
-        default_generation_settings_for_props = slots[0].to_json();
+// adds a span for the lifetime of the object
+struct server_trace_span
+{
+    const char *name;
+    int id_task;
+    int64_t t_start;
 
-        // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
-        // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
-        {
-            const int32_t n_batch = llama_n_batch(ctx);
+    server_trace_span(const char *name, int id_task = -1)
+        : name(name), id_task(id_task), t_start(tracer.enabled() ? ggml_time_us() : 0)
+    {
+    }
 
-            // only a single seq_id per token is needed
-            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
+    ~server_trace_span()
+    {
+        if (t_start > 0)
+        {
+            tracer.add(name, id_task, t_start, ggml_time_us());
         }
+    }
+};
 
-        metrics.init();
+// latency histogram with log-linear buckets (HDR style): 4 buckets per power of two of microseconds, so a quantile
+// is off by 25% at most, from 128 us to 134 s
+// the counts are sharded by writer thread, recording is a relaxed increment on a cache line of its own, and the
+// shards are summed when the metrics are scraped, from any thread
+struct server_histogram
+{
+    static constexpr int N_SUB = 4;
+    static constexpr int E_MIN = 7;  // everything below 2^E_MIN us goes to the first bucket
+    static constexpr int E_MAX = 27; // everything from 2^E_MAX us goes to the +Inf bucket
+    static constexpr int N_BUCKETS = (E_MAX - E_MIN) * N_SUB + 2;
+    static constexpr int N_SHARDS = 8;
+
+    void record(int64_t t_us)
+    {
+        shard &s = shards[shard_index()];
+        s.counts[bucket_index(t_us)].fetch_add(1, std::memory_order_relaxed);
+        s.sum.fetch_add((uint64_t)std::max<int64_t>(t_us, 0), std::memory_order_relaxed);
     }
 
-    server_slot *get_slot_by_id(int id)
+    // cumulative buckets in the Prometheus text format, in seconds
+    void to_prometheus(std::ostream &os, const std::string &name, const std::string &help) const
     {
-        for (server_slot &slot : slots)
+        uint64_t counts[N_BUCKETS] = {};
+        uint64_t sum = 0;
+        for (const shard &s : shards)
         {
-            if (slot.id == id)
+            for (int i = 0; i < N_BUCKETS; i++)
             {
-                return &slot;
+                counts[i] += s.counts[i].load(std::memory_order_relaxed);
             }
+            sum += s.sum.load(std::memory_order_relaxed);
         }
 
-        return nullptr;
-    }
-
-    server_slot *get_available_slot(const server_task &task)
-    {
-        server_slot *ret = nullptr;
+        os << "# HELP llamacpp:" << name << " " << help << "\n"
+           << "# TYPE llamacpp:" << name << " histogram\n";
 
-        // find the slot that has at least n% prompt similarity
-        if (ret == nullptr && slot_prompt_similarity != 0.0f)
+        char le[32];
+        uint64_t n = 0;
+        for (int i = 0; i < N_BUCKETS; i++)
         {
-            int lcs_len = 0;
-            float similarity = 0;
-
-            for (server_slot &slot : slots)
+            n += counts[i];
+            if (i == N_BUCKETS - 1)
             {
-                // skip the slot if it is not available
-                if (slot.is_processing())
-                {
-                    continue;
-                }
-
-                // skip the slot if it does not contains cached tokens
-                if (slot.cache_tokens.empty())
-                {
-                    continue;
-                }
-
-                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
-                int cur_lcs_len = common_lcs(slot.cache_tokens, task.prompt_tokens);
-
-                // fraction of the common subsequence length compared to the current slot's prompt length
-                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
-
-                // select the current slot if the criteria match
-                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity)
-                {
-                    lcs_len = cur_lcs_len;
-                    similarity = cur_similarity;
-                    ret = &slot;
-                }
+                snprintf(le, sizeof(le), "+Inf");
             }
-
-            if (ret != nullptr)
+            else
             {
-                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+                snprintf(le, sizeof(le), "%.6f", bucket_bound(i) / 1e6);
             }
+            os << "llamacpp:" << name << "_bucket{le=\"" << le << "\"} " << n << "\n";
         }
+        os << "llamacpp:" << name << "_sum " << sum / 1e6 << "\n"
+           << "llamacpp:" << name << "_count " << n << "\n";
+    }
 
-        // find the slot that has been least recently used
-        if (ret == nullptr)
+    static int bucket_index(int64_t t_us)
+    {
+        if (t_us < (1 << E_MIN))
         {
-            int64_t t_last = ggml_time_us();
-            for (server_slot &slot : slots)
-            {
-                // skip the slot if it is not available
-                if (slot.is_processing())
-                {
-                    continue;
-                }
+            return 0;
+        }
+        if (t_us >= ((int64_t)1 << E_MAX))
+        {
+            return N_BUCKETS - 1;
+        }
+        int e = E_MIN; // position of the leading one
+        while ((t_us >> (e + 1)) != 0)
+        {
+            e++;
+        }
+        const int sub = (int)(t_us >> (e - 2)) & (N_SUB - 1); // the 2 bits after the leading one
+        return 1 + (e - E_MIN) * N_SUB + sub;
+    }
 
-                // select the current slot if the criteria match
-                if (slot.t_last_used < t_last)
-                {
-                    t_last = slot.t_last_used;
-                    ret = &slot;
-                }
-            }
-
-            if (ret != nullptr)
-            {
-                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
-            }
+    // largest value of a bucket, in us
+    static int64_t bucket_bound(int i)
+    {
+        if (i == 0)
+        {
+            return (1 << E_MIN) - 1;
         }
-
-        return ret;
+        const int e = (i - 1) / N_SUB + E_MIN;
+        const int sub = (i - 1) % N_SUB;
+        return ((int64_t)(N_SUB + sub + 1) << (e - 2)) - 1;
     }
 
-    bool launch_slot_with_task(server_slot &slot, const server_task &task)
+private:
+    struct alignas(64) shard
     {
-        slot.reset();
-        slot.id_task = task.id;
-        slot.index = task.index;
-        slot.task_type = task.type;
-        slot.params = std::move(task.params);
-        slot.prompt_tokens = std::move(task.prompt_tokens);
+        std::atomic<uint64_t> counts[N_BUCKETS] = {};
+        std::atomic<uint64_t> sum{0};
+    };
 
-        if (!are_lora_equal(task.params.lora, slot.lora))
-        {
-            // if lora is changed, we cannot reuse cached tokens
-            slot.cache_tokens.clear();
-            slot.lora = task.params.lora;
-        }
+    shard shards[N_SHARDS];
 
-        SLT_DBG(slot, "launching slot : %s\n", safe_json_to_str(slot.to_json()).c_str());
+    static int shard_index()
+    {
+        static std::atomic<int> n_threads{0};
+        thread_local const int i = n_threads.fetch_add(1, std::memory_order_relaxed) % N_SHARDS;
+        return i;
+    }
+};
 
-        if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict)
-        {
-            // Might be better to reject the request with a 400 ?
-            SLT_WRN(slot, "n_predict = %d exceeds server configuration, setting to %d", slot.params.n_predict,
-                    slot.n_predict);
-            slot.params.n_predict = slot.n_predict;
-        }
+struct server_metrics
+{
+    int64_t t_start = 0;
 
-        if (slot.params.ignore_eos && has_eos_token)
-        {
-            slot.params.sampling.logit_bias.push_back({llama_vocab_eos(vocab), -INFINITY});
-        }
+    uint64_t n_prompt_tokens_processed_total = 0;
+    uint64_t t_prompt_processing_total = 0;
+    uint64_t n_tokens_predicted_total = 0;
+    uint64_t t_tokens_generation_total = 0;
 
-        {
-            if (slot.smpl != nullptr)
-            {
-                common_sampler_free(slot.smpl);
-            }
+    uint64_t n_prompt_tokens_processed = 0;
+    uint64_t t_prompt_processing = 0;
 
-            slot.smpl = common_sampler_init(model, slot.params.sampling);
-            if (slot.smpl == nullptr)
-            {
-                // for now, the only error that may happen here is invalid grammar
-                send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
-                return false;
-            }
-        }
+    uint64_t n_tokens_predicted = 0;
+    uint64_t t_tokens_generation = 0;
 
-        if (slot.ctx_dft)
-        {
-            llama_batch_free(slot.batch_spec);
+    uint64_t n_decode_total = 0;
+    uint64_t n_busy_slots_total = 0;
 
-            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
-        }
+    // time spent in the queue before the first slot assignment, per priority class
+    uint64_t n_tasks_started_total[SERVER_TASK_PRIORITY_COUNT] = {};
+    uint64_t t_queue_wait_total[SERVER_TASK_PRIORITY_COUNT] = {}; // ms
+    uint64_t n_preempted_total = 0;
+    uint64_t n_draft_total = 0;
+    uint64_t n_draft_accepted_total = 0;
+
+    // prompt prefixes forked from the KV cache of another slot
+    uint64_t n_prefix_hits_total = 0;
+    uint64_t n_prefix_tokens_total = 0;
+    uint64_t n_prefix_disk_loads_total = 0;
+    uint64_t n_prefix_disk_saves_total = 0;
+    uint64_t n_prefix_batch_tokens_total = 0;
+    uint64_t n_batches_aborted_total = 0;
+    uint64_t n_session_saves_total = 0;
+    uint64_t n_session_restores_total = 0;
+    uint64_t n_session_tokens_total = 0;
+
+    // batch composition of the update_slots() iterations
+    uint64_t n_batch_decode_tokens_total = 0;
+    uint64_t n_batch_prompt_tokens_total = 0;
+    int32_t n_batch_decode_tokens_last = 0;
+    int32_t n_batch_prompt_tokens_last = 0;
+
+    // gap between two consecutive tokens of the same slot (inter-token latency), us
+    uint64_t n_token_gaps = 0;
+    uint64_t t_token_gaps = 0;
+    uint64_t t_token_gap_max = 0;
+
+    // latency distributions, never reset, read by the HTTP threads when scraped
+    server_histogram h_queue_wait; // posted -> first seen by the main loop
+    server_histogram h_slot_wait;  // first seen by the main loop -> assigned to a slot
+    server_histogram h_prefill;    // prompt processing
+    server_histogram h_ttft;       // posted -> first token
+    server_histogram h_token_gap;  // between two consecutive tokens of a slot
 
-        slot.state = SLOT_STATE_STARTED;
+    void init() { t_start = ggml_time_us(); }
 
-        SLT_INF(slot, "%s", "processing task\n");
+    void on_batch(int32_t n_decode_tokens, int32_t n_prompt_tokens)
+    {
+        n_batch_decode_tokens_total += n_decode_tokens;
+        n_batch_prompt_tokens_total += n_prompt_tokens;
+        n_batch_decode_tokens_last = n_decode_tokens;
+        n_batch_prompt_tokens_last = n_prompt_tokens;
+    }
 
-        return true;
+    void on_token_gap(int64_t t_gap)
+    {
+        n_token_gaps++;
+        t_token_gaps += t_gap;
+        t_token_gap_max = std::max(t_token_gap_max, (uint64_t)t_gap);
+        h_token_gap.record(t_gap);
     }
 
-    void kv_cache_clear()
+    void on_task_received(const server_task &task) { h_queue_wait.record(task.t_received - task.t_enqueued); }
+
+    void on_task_started(const server_task &task)
     {
-        SRV_DBG("%s", "clearing KV cache\n");
+        const int64_t t_current = ggml_time_us();
+        n_tasks_started_total[task.priority]++;
+        t_queue_wait_total[task.priority] += (t_current - task.t_enqueued) / 1000;
+        h_slot_wait.record(t_current - task.t_received);
+    }
 
-        // clear the entire KV cache
-        llama_kv_cache_clear(ctx);
-        clean_kv_cache = false;
+    void on_prompt_eval(const server_slot &slot)
+    {
+        n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
+        n_prompt_tokens_processed += slot.n_prompt_tokens_processed;
+        t_prompt_processing += slot.t_prompt_processing;
+        t_prompt_processing_total += slot.t_prompt_processing;
     }
 
-    bool process_token(completion_token_output &result, server_slot &slot)
+    void on_first_token(const server_slot &slot)
     {
-        // remember which tokens were sampled - used for repetition penalties during sampling
-        const std::string token_str = result.text_to_send;
-        slot.sampled = result.tok;
+        h_prefill.record(slot.t_start_generation - slot.t_start_process_prompt);
+        h_ttft.record(slot.t_start_generation - slot.t_enqueued);
+    }
 
-        slot.generated_text += token_str;
-        if (slot.params.return_tokens)
+    void on_prediction(const server_slot &slot)
+    {
+        n_tokens_predicted_total += slot.n_decoded;
+        n_tokens_predicted += slot.n_decoded;
+        t_tokens_generation += slot.t_token_generation;
+        t_tokens_generation_total += slot.t_token_generation;
+    }
+
+    void on_decoded(const std::vector<server_slot> &slots)
+    {
+        n_decode_total++;
+        for (const auto &slot : slots)
         {
-            slot.generated_tokens.push_back(result.tok);
+            if (slot.is_processing())
+            {
+                n_busy_slots_total++;
+            }
         }
-        slot.has_next_token = true;
+    }
 
-        // check if there is incomplete UTF-8 character at the end
-        bool incomplete = validate_utf8(slot.generated_text) < slot.generated_text.size();
+    void reset_bucket()
+    {
+        n_prompt_tokens_processed = 0;
+        t_prompt_processing = 0;
+        n_tokens_predicted = 0;
+        t_tokens_generation = 0;
+        n_token_gaps = 0;
+        t_token_gaps = 0;
+        t_token_gap_max = 0;
+    }
+};
 
-        // search stop word and delete it
-        if (!incomplete)
-        {
-            size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
+struct server_queue
+{
+    std::atomic<int> id{0};
+    std::atomic<bool> running{false};
 
-            const std::string str_test = slot.generated_text.substr(pos);
-            bool send_text = true;
+    // tasks owned by the main loop, only touched from the thread running start_loop()
+    std::deque<server_task> queue_tasks;
+    std::deque<server_task> queue_tasks_deferred;
 
-            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), true);
-            if (stop_pos != std::string::npos)
-            {
-                slot.generated_text.erase(slot.generated_text.begin() + pos + stop_pos, slot.generated_text.end());
-                pos = std::min(slot.n_sent_text, slot.generated_text.size());
-            }
-            else if (slot.has_next_token)
-            {
-                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), false);
-                send_text = stop_pos == std::string::npos;
-            }
+    // inference tasks waiting for a slot, read by the HTTP threads for admission control
+    std::atomic<int> n_incoming{0}; // posted, not yet seen by the main loop
+    std::atomic<int64_t> n_incoming_tokens{0};
+    std::atomic<int> n_deferred{0};
+    std::atomic<int64_t> n_deferred_tokens{0};
 
-            // check if there is any token to predict
-            if (send_text)
-            {
-                // no send the stop word in the response
-                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
-                slot.n_sent_text += result.text_to_send.size();
-                // add the token to slot queue and cache
-            }
-            else
-            {
-                result.text_to_send = "";
-            }
+    // callback functions
+    std::function<void(server_task)> callback_new_task;
+    std::function<void(void)> callback_update_slots;
 
-            slot.add_token(result);
-            if (slot.params.stream)
-            {
-                send_partial_response(slot, result);
-            }
-        }
+    ~server_queue()
+    {
+        free_nodes(incoming_back.exchange(nullptr));
+        free_nodes(incoming_front.exchange(nullptr));
+    }
 
-        if (incomplete)
+    // Add a new task to the end of the queue
+    int post(server_task task, bool front = false)
+    {
+        GGML_ASSERT(task.id != -1);
+        QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
+        const int id_task = task.id;
+        if (task.is_inference())
         {
-            slot.has_next_token = true;
+            n_incoming++;
+            n_incoming_tokens += task.prompt_tokens.size();
         }
 
-        // check the limits
-        if (slot.n_decoded > 0 && slot.has_next_token && !slot.has_budget(params_base))
-        {
-            slot.stop = STOP_TYPE_LIMIT;
-            slot.has_next_token = false;
+        task_node *node = new task_node{std::move(task), nullptr};
+        push_nodes(front ? incoming_front : incoming_back, node, node);
+        return id_task;
+    }
 
-            SLT_DBG(slot, "stopped by limit, n_decoded = %d, n_predict = %d\n", slot.n_decoded, slot.params.n_predict);
+    // multi-task version of post()
+    int post(std::vector<server_task> &tasks, bool front = false)
+    {
+        if (tasks.empty())
+        {
+            return 0;
         }
 
-        if (slot.has_new_line)
+        // link the tasks in reverse order, so that the chain can be pushed in a single step
+        task_node *first = nullptr;
+        task_node *last = nullptr;
+        for (auto &task : tasks)
         {
-            // if we have already seen a new line, we stop after a certain time limit
-            if (slot.params.t_max_predict_ms > 0 &&
-                (ggml_time_us() - slot.t_start_generation > 1000.0f * slot.params.t_max_predict_ms))
+            if (task.id == -1)
             {
-                slot.stop = STOP_TYPE_LIMIT;
-                slot.has_next_token = false;
-
-                SLT_DBG(slot, "stopped by time limit, n_decoded = %d, t_max_predict_ms = %d ms\n", slot.n_decoded,
-                        (int)slot.params.t_max_predict_ms);
+                task.id = id++;
+            }
+            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int)tasks.size(), front);
+            if (task.is_inference())
+            {
+                n_incoming++;
+                n_incoming_tokens += task.prompt_tokens.size();
             }
 
-            // require that each new line has a whitespace prefix (i.e. indentation) of at least slot.params.n_indent
-            if (slot.params.n_indent > 0)
+            first = new task_node{std::move(task), first};
+            if (last == nullptr)
             {
-                // check the current indentation
-                // TODO: improve by not doing it more than once for each new line
-                if (slot.last_nl_pos > 0)
-                {
-                    size_t pos = slot.last_nl_pos;
+                last = first;
+            }
+        }
+        push_nodes(front ? incoming_front : incoming_back, first, last);
+        return 0;
+    }
 
-                    int n_indent = 0;
-                    while (pos < slot.generated_text.size() &&
-                           (slot.generated_text[pos] == ' ' || slot.generated_text[pos] == '\t'))
-                    {
-                        n_indent++;
-                        pos++;
-                    }
+    // Add a new task, but defer until one slot is available
+    // deferred tasks are kept in scheduling order, see server_task::sched_before
+    // must be called from the main loop
+    void defer(server_task &&task)
+    {
+        QUE_DBG("defer task, id = %d, priority = %s\n", task.id, server_task_priority_name(task.priority));
+        auto it = std::upper_bound(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), task,
+                                   server_task::sched_before);
+        n_deferred++;
+        n_deferred_tokens += task.prompt_tokens.size();
+        queue_tasks_deferred.insert(it, std::move(task));
+    }
 
-                    if (pos < slot.generated_text.size() && n_indent < slot.params.n_indent)
-                    {
-                        slot.stop = STOP_TYPE_LIMIT;
-                        slot.has_next_token = false;
+    // Get the next id for creating a new task
+    int get_new_id() { return id++; }
 
-                        // cut the last line
-                        slot.generated_text.erase(pos, std::string::npos);
+    // Register function to process a new task
+    void on_new_task(std::function<void(server_task)> callback) { callback_new_task = std::move(callback); }
 
-                        SLT_DBG(slot, "stopped by indentation limit, n_decoded = %d, n_indent = %d\n", slot.n_decoded,
-                                n_indent);
-                    }
-                }
+    // Register the function to be called when all slots data is ready to be processed
+    void on_update_slots(std::function<void(void)> callback) { callback_update_slots = std::move(callback); }
 
-                // find the next new line
-                {
-                    const size_t pos = slot.generated_text.find('\n', slot.last_nl_pos);
+    // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    // must be called from the main loop
+    void pop_deferred_task()
+    {
+        if (!queue_tasks_deferred.empty())
+        {
+            n_deferred--;
+            n_deferred_tokens -= queue_tasks_deferred.front().prompt_tokens.size();
+            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
+            queue_tasks_deferred.pop_front();
+        }
+    }
 
-                    if (pos != std::string::npos)
+    // end the start_loop routine
+    void terminate()
+    {
+        std::unique_lock<std::mutex> lock(mutex_wakeup);
+        running = false;
+        condition_wakeup.notify_all();
+    }
+
+    /**
+     * Main loop consists of these steps:
+     * - Wait until a new task arrives
+     * - Process the task (i.e. maybe copy data into slot)
+     * - Check if multitask is finished
+     * - Update all slots
+     */
+    void start_loop()
+    {
+        running = true;
+
+        while (true)
+        {
+            QUE_DBG("%s", "processing new tasks\n");
+
+            while (true)
+            {
+                if (!running)
+                {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty())
+                {
+                    // take everything posted since the last drain in one step
+                    drain_incoming();
+                    if (queue_tasks.empty())
                     {
-                        slot.last_nl_pos = pos + 1;
+                        break;
                     }
                 }
+                server_task task = std::move(queue_tasks.front());
+                queue_tasks.pop_front();
+
+                QUE_DBG("processing task, id = %d\n", task.id);
+                callback_new_task(std::move(task));
+            }
+
+            // all tasks in the current loop is processed, slots data is now ready
+            QUE_DBG("%s", "update slots\n");
+
+            callback_update_slots();
+
+            QUE_DBG("%s", "waiting for new tasks\n");
+            if (queue_tasks.empty())
+            {
+                std::unique_lock<std::mutex> lock(mutex_wakeup);
+                sleeping = true;
+                condition_wakeup.wait(lock, [&]
+                                      { return has_incoming() || !running; });
+                sleeping = false;
+            }
+            if (!running)
+            {
+                QUE_DBG("%s", "terminate\n");
+                return;
             }
         }
+    }
 
-        // check if there is a new line in the generated text
-        if (result.text_to_send.find('\n') != std::string::npos)
+private:
+    // producers push onto lock-free stacks, the main loop takes a whole stack at once and restores FIFO order
+    struct task_node
+    {
+        server_task task;
+        task_node *next;
+    };
+
+    std::atomic<task_node *> incoming_back{nullptr};
+    std::atomic<task_node *> incoming_front{nullptr};
+
+    // only used to put the main loop to sleep when there is nothing to do
+    std::atomic<bool> sleeping{false};
+    std::mutex mutex_wakeup;
+    std::condition_variable condition_wakeup;
+
+    // push the chain first -> ... -> last onto the stack, where first is the newest task
+    void push_nodes(std::atomic<task_node *> &head, task_node *first, task_node *last)
+    {
+        last->next = head.load(std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(last->next, first))
         {
-            slot.has_new_line = true;
         }
 
-        // if context shift is disabled, we stop when it reaches the context limit
-        if (slot.n_past >= slot.n_ctx)
+        if (sleeping)
         {
-            slot.truncated = true;
-            slot.stop = STOP_TYPE_LIMIT;
-            slot.has_next_token = false;
-
-            SLT_DBG(slot,
-                    "stopped due to running out of context capacity, n_past = %d, n_prompt_tokens = %d, n_decoded = "
-                    "%d, n_ctx = %d\n",
-                    slot.n_decoded, slot.n_prompt_tokens, slot.n_past, slot.n_ctx);
+            std::unique_lock<std::mutex> lock(mutex_wakeup);
+            condition_wakeup.notify_one();
         }
+    }
 
-        if (llama_vocab_is_eog(vocab, result.tok))
-        {
-            slot.stop = STOP_TYPE_EOS;
-            slot.has_next_token = false;
+    bool has_incoming() const { return incoming_back.load() != nullptr || incoming_front.load() != nullptr; }
 
-            SLT_DBG(slot, "%s", "stopped by EOS\n");
-        }
+    // the tasks are large (slot_params), so each is moved once from its node into queue_tasks
+    void drain_incoming()
+    {
+        std::vector<int> id_cancelled;
 
-        const auto n_ctx_train = llama_model_n_ctx_train(model);
+        // the stacks hold the newest task first: the front one is pushed to the front as is, the back one is
+        // reversed first and appended
+        for (task_node *node = incoming_front.exchange(nullptr); node != nullptr;)
+        {
+            take_node(node, id_cancelled);
+            queue_tasks.push_front(std::move(node->task));
+            task_node *next = node->next;
+            delete node;
+            node = next;
+        }
+        for (task_node *node = reverse_nodes(incoming_back.exchange(nullptr)); node != nullptr;)
+        {
+            take_node(node, id_cancelled);
+            queue_tasks.push_back(std::move(node->task));
+            task_node *next = node->next;
+            delete node;
+            node = next;
+        }
 
-        if (slot.params.n_predict < 1 && slot.n_predict < 1 && slot.n_prompt_tokens + slot.n_decoded >= n_ctx_train)
+        // urgent tasks must not wait behind routine ones that arrived earlier
+        // tasks of the same class usually arrive in order, otherwise only their indices are sorted
+        if (!std::is_sorted(queue_tasks.begin(), queue_tasks.end(), server_task::sched_before))
         {
-            slot.truncated = true;
-            slot.stop = STOP_TYPE_LIMIT;
-            slot.has_next_token = false; // stop prediction
+            std::vector<size_t> order(queue_tasks.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                             { return server_task::sched_before(queue_tasks[a], queue_tasks[b]); });
 
-            SLT_WRN(slot,
-                    "n_predict (%d) is set for infinite generation. "
-                    "Limiting generated tokens to n_ctx_train (%d) to avoid EOS-less generation infinite loop\n",
-                    slot.params.n_predict, n_ctx_train);
+            std::deque<server_task> sorted;
+            for (size_t i : order)
+            {
+                sorted.push_back(std::move(queue_tasks[i]));
+            }
+            queue_tasks.swap(sorted);
         }
 
-        SLT_DBG(slot, "n_decoded = %d, n_remaining = %d, next token: %5d '%s'\n", slot.n_decoded, slot.n_remaining,
-                result.tok, token_str.c_str());
-
-        return slot.has_next_token; // continue
+        // if this is cancel task make sure to clean up pending tasks
+        // done after the whole batch is queued, the cancelled task may have been posted in the same batch
+        for (int id_target : id_cancelled)
+        {
+            cleanup_pending_task(id_target);
+        }
     }
 
-    void populate_token_probs(const server_slot &slot, completion_token_output &result, bool post_sampling,
-                              bool special, int idx)
+    void take_node(const task_node *node, std::vector<int> &id_cancelled)
     {
-        size_t n_probs = slot.params.sampling.n_probs;
-        size_t n_vocab = llama_vocab_n_tokens(vocab);
-        if (post_sampling)
+        const server_task &task = node->task;
+        if (task.type == SERVER_TASK_TYPE_CANCEL)
         {
-            const auto *cur_p = common_sampler_get_candidates(slot.smpl);
-            const size_t max_probs = cur_p->size;
-
-            // set probability for sampled token
-            for (size_t i = 0; i < max_probs; i++)
-            {
-                if (cur_p->data[i].id == result.tok)
-                {
-                    result.prob = cur_p->data[i].p;
-                    break;
-                }
-            }
+            id_cancelled.push_back(task.id_target);
+        }
+        if (task.is_inference())
+        {
+            n_incoming--;
+            n_incoming_tokens -= task.prompt_tokens.size();
+        }
+    }
 
-            // set probability for top n_probs tokens
-            result.probs.reserve(max_probs);
-            for (size_t i = 0; i < std::min(max_probs, n_probs); i++)
-            {
-                result.probs.push_back(
-                    {cur_p->data[i].id, common_token_to_piece(ctx, cur_p->data[i].id, special), cur_p->data[i].p});
-            }
+    // returns the stack in the order the tasks were posted
+    static task_node *reverse_nodes(task_node *head)
+    {
+        task_node *prev = nullptr;
+        while (head != nullptr)
+        {
+            task_node *next = head->next;
+            head->next = prev;
+            prev = head;
+            head = next;
         }
-        else
+        return prev;
+    }
+
+    static void free_nodes(task_node *head)
+    {
+        while (head != nullptr)
         {
-            // TODO: optimize this with min-p optimization
-            std::vector<llama_token_data> cur = get_token_probabilities(ctx, idx);
+            task_node *next = head->next;
+            delete head;
+            head = next;
+        }
+    }
 
-            // set probability for sampled token
-            for (size_t i = 0; i < n_vocab; i++)
-            {
-                // set probability for sampled token
-                if (cur[i].id == result.tok)
-                {
-                    result.prob = cur[i].p;
-                    break;
-                }
-            }
+    void cleanup_pending_task(int id_target)
+    {
+        // no need lock because this is called exclusively by the main loop
+        // a cancelled task that has not reached a slot yet must never be started
+        auto rm_func = [id_target](const server_task &task)
+        {
+            return task.type != SERVER_TASK_TYPE_CANCEL && task.id == id_target;
+        };
+        queue_tasks.erase(std::remove_if(queue_tasks.begin(), queue_tasks.end(), rm_func), queue_tasks.end());
+        queue_tasks_deferred.erase(std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), rm_func),
+                                   queue_tasks_deferred.end());
 
-            // set probability for top n_probs tokens
-            result.probs.reserve(n_probs);
-            for (size_t i = 0; i < std::min(n_vocab, n_probs); i++)
-            {
-                result.probs.push_back({cur[i].id, common_token_to_piece(ctx, cur[i].id, special), cur[i].p});
-            }
+        int64_t n_tokens = 0;
+        for (const auto &task : queue_tasks_deferred)
+        {
+            n_tokens += task.prompt_tokens.size();
         }
+        n_deferred = queue_tasks_deferred.size();
+        n_deferred_tokens = n_tokens;
     }
+};
 
-    void send_error(const server_task &task, const std::string &error,
-                    const enum error_type type = ERROR_TYPE_SERVER)
+// called by send() with the results of a request that nobody waits for in recv(), e.g. a callback request
+using server_response_hook = std::function<void(server_task_result_ptr &&)>;
+
+// mailbox shared by all tasks of a single request (e.g. the N prompts of a multi-prompt request)
+// only the HTTP thread that owns the request waits on it, so send() never wakes unrelated waiters
+struct server_response_channel
+{
+    std::deque<server_task_result_ptr> results;
+
+    // when set, the results are handed to it instead of being queued for recv()
+    server_response_hook on_result;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+};
+
+using server_response_channel_ptr = std::shared_ptr<server_response_channel>;
+
+struct server_response
+{
+    // for keeping track of all tasks waiting for the result, mapped to the mailbox of their request
+    std::unordered_map<int, server_response_channel_ptr> waiting_tasks;
+
+    // only protects the map above - results are exchanged under the lock of each channel
+    std::mutex mutex_results;
+
+    // add the id_task to the list of tasks waiting for response
+    void add_waiting_task_id(int id_task)
     {
-        send_error(task.id, error, type);
+        auto channel = std::make_shared<server_response_channel>();
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task,
+                (int)waiting_tasks.size());
+        waiting_tasks[id_task] = std::move(channel);
     }
 
-    void send_error(const server_slot &slot, const std::string &error,
-                    const enum error_type type = ERROR_TYPE_SERVER)
+    void add_waiting_tasks(const std::vector<server_task> &tasks, server_response_hook on_result = nullptr)
     {
-        send_error(slot.id_task, error, type);
+        auto channel = std::make_shared<server_response_channel>();
+        channel->on_result = std::move(on_result);
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto &task : tasks)
+        {
+            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id,
+                    (int)waiting_tasks.size());
+            waiting_tasks[task.id] = channel;
+        }
     }
 
-    void send_error(const int id_task, const std::string &error, const enum error_type type = ERROR_TYPE_SERVER)
+    // when the request is finished, we can remove task associated with it
+    // pending results are released together with the channel once its last task is removed
+    void remove_waiting_task_id(int id_task)
     {
-        SRV_ERR("task id = %d, error: %s\n", id_task, error.c_str());
+        server_response_channel_ptr channel;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task,
+                    (int)waiting_tasks.size());
 
-        auto res = std::make_unique<server_task_result_error>();
-        res->id = id_task;
-        res->err_type = type;
-        res->err_msg = error;
+            auto it = waiting_tasks.find(id_task);
+            if (it == waiting_tasks.end())
+            {
+                return;
+            }
+            channel = std::move(it->second);
+            waiting_tasks.erase(it);
+        }
 
-        queue_results.send(std::move(res));
+        // make sure to clean up all pending results of this task
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        channel->results.erase(std::remove_if(channel->results.begin(), channel->results.end(),
+                                              [id_task](const server_task_result_ptr &res)
+                                              { return res->id == id_task; }),
+                               channel->results.end());
     }
 
-    void send_partial_response(server_slot &slot, const completion_token_output &tkn)
+    void remove_waiting_task_ids(const std::unordered_set<int> &id_tasks)
     {
-        auto res = std::make_unique<server_task_result_cmpl_partial>();
+        std::unique_lock<std::mutex> lock(mutex_results);
 
-        res->id = slot.id_task;
-        res->index = slot.index;
-        res->content = tkn.text_to_send;
-        res->tokens = {tkn.tok};
+        for (const auto &id_task : id_tasks)
+        {
+            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task,
+                    (int)waiting_tasks.size());
+            waiting_tasks.erase(id_task);
+        }
+    }
 
-        res->n_decoded = slot.n_decoded;
-        res->n_prompt_tokens = slot.n_prompt_tokens;
-        res->post_sampling_probs = slot.params.post_sampling_probs;
+    // This function blocks the thread until there is a response for one of the id_tasks
+    server_task_result_ptr recv(const std::unordered_set<int> &id_tasks)
+    {
+        server_response_channel_ptr channel = get_channel(id_tasks);
+        GGML_ASSERT(channel != nullptr && "recv() called for tasks that are not waiting");
 
-        res->verbose = slot.params.verbose;
-        res->oaicompat = slot.params.oaicompat;
-        res->oaicompat_model = slot.params.oaicompat_model;
-        res->oaicompat_cmpl_id = slot.params.oaicompat_cmpl_id;
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        channel->condition.wait(lock, [&]
+                                { return !channel->results.empty(); });
 
-        // populate res.probs_output
-        if (slot.params.sampling.n_probs > 0)
+        server_task_result_ptr res = std::move(channel->results.front());
+        channel->results.pop_front();
+        return res;
+    }
+
+    // same as recv(), but have timeout in seconds
+    // if timeout is reached, nullptr is returned
+    // if the tasks are not waiting anymore, nullptr is returned at once - use is_waiting() to tell both cases apart
+    server_task_result_ptr recv_with_timeout(const std::unordered_set<int> &id_tasks, int timeout)
+    {
+        server_response_channel_ptr channel = get_channel(id_tasks);
+        if (channel == nullptr)
         {
-            res->prob_output = tkn; // copy the token probs
+            return nullptr;
         }
 
-        // populate timings if this is final response or timings_per_token is enabled
-        if (slot.stop != STOP_TYPE_NONE || slot.params.timings_per_token)
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        if (!channel->condition.wait_for(lock, std::chrono::seconds(timeout), [&]
+                                         { return !channel->results.empty(); }))
         {
-            res->timings = slot.get_timings();
+            return nullptr;
         }
 
-        queue_results.send(std::move(res));
+        server_task_result_ptr res = std::move(channel->results.front());
+        channel->results.pop_front();
+        return res;
     }
 
-    void send_final_response(server_slot &slot)
+    // false once all the tasks have been removed from the waiting list, i.e. the request was cancelled
+    bool is_waiting(const std::unordered_set<int> &id_tasks)
     {
-        auto res = std::make_unique<server_task_result_cmpl_final>();
-        res->id = slot.id_task;
-        res->id_slot = slot.id;
+        return get_channel(id_tasks) != nullptr;
+    }
 
-        res->index = slot.index;
-        res->content = std::move(slot.generated_text);
-        res->tokens = std::move(slot.generated_tokens);
-        res->timings = slot.get_timings();
-        res->prompt = common_detokenize(ctx, slot.prompt_tokens, true);
-        res->response_fields = std::move(slot.params.response_fields);
+    // single-task version of recv()
+    server_task_result_ptr recv(int id_task)
+    {
+        std::unordered_set<int> id_tasks = {id_task};
+        return recv(id_tasks);
+    }
 
-        res->truncated = slot.truncated;
-        res->n_decoded = slot.n_decoded;
-        res->n_prompt_tokens = slot.n_prompt_tokens;
-        res->n_tokens_cached = slot.n_past;
-        res->has_new_line = slot.has_new_line;
-        res->stopping_word = slot.stopping_word;
-        res->stop = slot.stop;
-        res->post_sampling_probs = slot.params.post_sampling_probs;
+    // Send a new result to a waiting id_task
+    void send(server_task_result_ptr &&result)
+    {
+        SRV_DBG("sending result for task id = %d\n", result->id);
 
-        res->verbose = slot.params.verbose;
-        res->stream = slot.params.stream;
-        res->oaicompat = slot.params.oaicompat;
-        res->oaicompat_model = slot.params.oaicompat_model;
-        res->oaicompat_cmpl_id = slot.params.oaicompat_cmpl_id;
-        res->oaicompat_chat_format = slot.params.oaicompat_chat_format;
-        // populate res.probs_output
-        if (slot.params.sampling.n_probs > 0)
+        server_response_channel_ptr channel;
         {
-            if (!slot.params.stream && slot.stop == STOP_TYPE_WORD)
-            {
-                const llama_tokens stop_word_toks = common_tokenize(ctx, slot.stopping_word, false);
-
-                size_t safe_offset = std::min(slot.generated_token_probs.size(), stop_word_toks.size());
-                res->probs_output = std::vector<completion_token_output>(
-                    slot.generated_token_probs.begin(), slot.generated_token_probs.end() - safe_offset);
-            }
-            else
+            std::unique_lock<std::mutex> lock(mutex_results);
+            auto it = waiting_tasks.find(result->id);
+            if (it == waiting_tasks.end())
             {
-                res->probs_output = std::vector<completion_token_output>(slot.generated_token_probs.begin(),
-                                                                         slot.generated_token_probs.end());
+                // nobody is waiting for this task anymore (e.g. the request was cancelled)
+                return;
             }
+            channel = it->second;
         }
 
-        res->generation_params = slot.params; // copy the parameters
+        if (channel->on_result)
+        {
+            // outside of the lock of the channel, the hook may cancel or remove the tasks of its request
+            channel->on_result(std::move(result));
+            return;
+        }
 
-        queue_results.send(std::move(res));
+        SRV_DBG("task id = %d pushed to result queue\n", result->id);
+
+        {
+            std::unique_lock<std::mutex> lock(channel->mutex);
+            channel->results.emplace_back(std::move(result));
+        }
+        channel->condition.notify_one();
     }
 
-    void send_embedding(const server_slot &slot, const llama_batch &batch)
+private:
+    // all tasks of a request share the same channel, so any of them can be used for the lookup
+    server_response_channel_ptr get_channel(const std::unordered_set<int> &id_tasks)
     {
-        auto res = std::make_unique<server_task_result_embd>();
-        res->id = slot.id_task;
-        res->index = slot.index;
-        res->n_tokens = slot.n_prompt_tokens;
-        res->oaicompat = slot.params.oaicompat;
-
-        const int n_embd = llama_model_n_embd(model);
-
-        std::vector<float> embd_res(n_embd, 0.0f);
-
-        for (int i = 0; i < batch.n_tokens; ++i)
+        std::unique_lock<std::mutex> lock(mutex_results);
+        for (const auto &id_task : id_tasks)
         {
-            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id)
+            auto it = waiting_tasks.find(id_task);
+            if (it != waiting_tasks.end())
             {
-                continue;
+                return it->second;
             }
+        }
+        return nullptr;
+    }
+};
 
-            const float *embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
-            if (embd == NULL)
-            {
-                embd = llama_get_embeddings_ith(ctx, i);
-            }
+struct server_context
+{
+    common_params params_base;
 
-            if (embd == NULL)
-            {
-                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i],
-                        batch.seq_id[i][0]);
+    // note: keep these alive - they determine the lifetime of the model, context, etc.
+    common_init_result llama_init;
+    common_init_result llama_init_dft;
 
-                res->embedding.push_back(std::vector<float>(n_embd, 0.0f));
-                continue;
-            }
+    llama_model *model = nullptr;
+    llama_context *ctx = nullptr;
 
-            // normalize only when there is pooling
-            // TODO: configurable
-            if (llama_pooling_type(slot.ctx) != LLAMA_POOLING_TYPE_NONE)
-            {
-                common_embd_normalize(embd, embd_res.data(), n_embd, 2);
-                res->embedding.push_back(embd_res);
-            }
-            else
-            {
-                res->embedding.push_back({embd, embd + n_embd});
-            }
-        }
+    const llama_vocab *vocab = nullptr;
 
-        SLT_DBG(slot, "%s", "sending embeddings\n");
+    llama_model *model_dft = nullptr;
 
-        queue_results.send(std::move(res));
-    }
+    llama_context_params cparams_dft;
 
-    void send_rerank(const server_slot &slot, const llama_batch &batch)
-    {
-        auto res = std::make_unique<server_task_result_rerank>();
-        res->id = slot.id_task;
-        res->index = slot.index;
-        res->n_tokens = slot.n_prompt_tokens;
+    llama_batch batch = {};
 
-        for (int i = 0; i < batch.n_tokens; ++i)
-        {
-            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id)
-            {
-                continue;
-            }
+    bool clean_kv_cache = true;
+    bool add_bos_token = true;
+    bool has_eos_token = false;
 
-            const float *embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
-            if (embd == NULL)
-            {
-                embd = llama_get_embeddings_ith(ctx, i);
-            }
+    int32_t n_ctx; // total context for all clients / slots
 
-            if (embd == NULL)
-            {
-                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i],
-                        batch.seq_id[i][0]);
+    // slots / clients
+    std::vector<server_slot> slots;
+    json default_generation_settings_for_props;
 
-                res->score = -1e6;
-                continue;
-            }
+    server_queue queue_tasks;
+    server_response queue_results;
 
-            res->score = embd[0];
-        }
+    server_metrics metrics;
 
-        SLT_DBG(slot, "sending rerank result, res.score = %f\n", res->score);
+    // preempted tasks, by task id
+    std::unordered_map<int, server_slot_parked> parked_slots;
+    size_t n_parked_bytes = 0;     // size of the KV cache of the parked slots
+    size_t n_parked_bytes_max = 0; // --park-memory
 
-        queue_results.send(std::move(res));
-    }
+    // prompt prefixes in the KV cache of the slots, shared through llama_kv_cache_seq_cp
+    server_prefix_tree prefix_tree;
 
-    //
-    // Functions to create new task(s) and receive result(s)
-    //
+    // hot prompt prefixes persisted across restarts
+    server_prefix_store prefix_store;
 
-    void cancel_tasks(const std::unordered_set<int> &id_tasks)
-    {
-        std::vector<server_task> cancel_tasks;
-        cancel_tasks.reserve(id_tasks.size());
-        for (const auto &id_task : id_tasks)
-        {
-            SRV_WRN("cancel task, id_task = %d\n", id_task);
+    server_session_store sessions;
 
-            server_task task(SERVER_TASK_TYPE_CANCEL);
-            task.id_target = id_task;
-            queue_results.remove_waiting_task_id(id_task);
-            cancel_tasks.push_back(task);
-        }
-        // push to beginning of the queue, so it has highest priority
-        queue_tasks.post(cancel_tasks, true);
-    }
+    server_grammar_cache grammars;
 
-    // receive the results from task(s)
-    void receive_multi_results(const std::unordered_set<int> &id_tasks,
-                               const std::function<void(std::vector<server_task_result_ptr> &)> &result_handler,
-                               const std::function<void(json)> &error_handler,
-                               const std::function<bool()> &is_connection_closed)
+    // published by the main loop for admission control in the HTTP threads
+    std::atomic<int32_t> n_kv_used{0};
+    std::atomic<double> t_service_avg_ms{0.0}; // moving average of the time a completion occupies a slot
+    std::atomic<uint64_t> n_requests_rejected_total{0};
+
+    // HTTP threads blocked on an inference request, counted across the models since they share the HTTP threads
+    inline static std::atomic<int> n_requests_inflight{0};
+
+    // admitted tasks and prompt tokens that are not posted yet, counted as waiting so that concurrent admissions see them
+    std::atomic<int> n_tasks_admitting{0};
+    std::atomic<int64_t> n_tokens_admitting{0};
+
+    // tasks cancelled by the HTTP threads whose cancel task has not been processed yet, read by the abort callback of
+    // llama_decode() so that a batch made only of cancelled tasks stops between graph nodes
+    std::mutex mutex_cancelled;
+    std::unordered_set<int> id_tasks_cancelled;
+    std::atomic<int> n_tasks_cancelled{0};
+    std::vector<int> id_tasks_decoding; // tasks of the batch being decoded, guarded by mutex_cancelled
+    std::atomic<bool> decoding_cancelled{false}; // all of id_tasks_decoding are cancelled, the only state read by abort_decode()
+
+    // Necessary similarity of prompt for slot selection
+    float slot_prompt_similarity = 0.0f;
+
+    common_chat_templates_ptr chat_templates;
+
+    ~server_context()
     {
-        std::vector<server_task_result_ptr> results(id_tasks.size());
-        for (int i = 0; i < (int)id_tasks.size(); i++)
+        // Clear any sampling context
+        for (server_slot &slot : slots)
         {
-            server_task_result_ptr result = queue_results.recv_with_timeout(id_tasks, HTTP_POLLING_SECONDS);
+            common_sampler_free(slot.smpl);
+            slot.smpl = nullptr;
 
-            if (is_connection_closed())
-            {
-                cancel_tasks(id_tasks);
-                return;
-            }
+            llama_free(slot.ctx_dft);
+            slot.ctx_dft = nullptr;
 
-            if (result == nullptr)
-            {
-                i--; // retry
-                continue;
-            }
+            common_speculative_free(slot.spec);
+            slot.spec = nullptr;
 
-            if (result->is_error())
-            {
-                error_handler(result->to_json());
-                cancel_tasks(id_tasks);
-                return;
-            }
+            llama_batch_free(slot.batch_spec);
+        }
 
-            GGML_ASSERT(dynamic_cast<server_task_result_cmpl_final *>(result.get()) != nullptr ||
-                        dynamic_cast<server_task_result_embd *>(result.get()) != nullptr ||
-                        dynamic_cast<server_task_result_rerank *>(result.get()) != nullptr);
-            const size_t idx = result->get_index();
-            GGML_ASSERT(idx < results.size() && "index out of range");
-            results[idx] = std::move(result);
+        for (auto &it : parked_slots)
+        {
+            common_sampler_free(it.second.slot.smpl);
         }
-        result_handler(results);
+
+        llama_batch_free(batch);
     }
 
-    // receive the results from task(s), in stream mode
-    void receive_cmpl_results_stream(const std::unordered_set<int> &id_tasks,
-                                     const std::function<bool(server_task_result_ptr &)> &result_handler,
-                                     const std::function<void(json)> &error_handler,
-                                     const std::function<bool()> &is_connection_closed)
+    bool load_model(const common_params &params)
     {
-        size_t n_finished = 0;
-        while (true)
-        {
-            server_task_result_ptr result = queue_results.recv_with_timeout(id_tasks, HTTP_POLLING_SECONDS);
+        SRV_INF("loading model '%s'\n", params.model.c_str());
 
-            if (is_connection_closed())
-            {
-                cancel_tasks(id_tasks);
-                return;
-            }
+        params_base = params;
 
-            if (result == nullptr)
-            {
-                continue; // retry
-            }
+        llama_init = common_init_from_params(params_base);
 
-            if (result->is_error())
-            {
-                error_handler(result->to_json());
-                cancel_tasks(id_tasks);
-                return;
-            }
+        model = llama_init.model.get();
+        ctx = llama_init.context.get();
 
-            GGML_ASSERT(dynamic_cast<server_task_result_cmpl_partial *>(result.get()) != nullptr ||
-                        dynamic_cast<server_task_result_cmpl_final *>(result.get()) != nullptr);
-            if (!result_handler(result))
-            {
-                cancel_tasks(id_tasks);
-                break;
-            }
-
-            if (result->is_stop())
-            {
-                if (++n_finished == id_tasks.size())
-                {
-                    break;
-                }
-            }
+        if (model == nullptr)
+        {
+            SRV_ERR("failed to load model, '%s'\n", params_base.model.c_str());
+            return false;
         }
-    }
 
-    //
-    // Functions to process the task
-    //
+        vocab = llama_model_get_vocab(model);
 
-    void process_single_task(server_task task)
-    {
-        switch (task.type)
-        {
-        case SERVER_TASK_TYPE_COMPLETION:
-        case SERVER_TASK_TYPE_INFILL:
-        case SERVER_TASK_TYPE_EMBEDDING:
-        case SERVER_TASK_TYPE_RERANK:
+        n_ctx = llama_n_ctx(ctx);
+
+        add_bos_token = llama_vocab_get_add_bos(vocab);
+        has_eos_token = llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL;
+
+        if (!params_base.speculative.model.empty() || !params_base.speculative.hf_repo.empty())
         {
-            const int id_slot = task.id_selected_slot;
+            SRV_INF("loading draft model '%s'\n", params_base.speculative.model.c_str());
 
-            server_slot *slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
+            auto params_dft = params_base;
 
-            if (slot == nullptr)
-            {
-                // if no slot is available, we defer this task for processing later
-                SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
-                queue_tasks.defer(task);
-                break;
-            }
-            if (slot->is_processing())
+            params_dft.devices = params_base.speculative.devices;
+            params_dft.hf_file = params_base.speculative.hf_file;
+            params_dft.hf_repo = params_base.speculative.hf_repo;
+            params_dft.model = params_base.speculative.model;
+            params_dft.model_url = params_base.speculative.model_url;
+            params_dft.n_ctx = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
+            params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
+            params_dft.n_parallel = 1;
+
+            llama_init_dft = common_init_from_params(params_dft);
+
+            model_dft = llama_init_dft.model.get();
+
+            if (model_dft == nullptr)
             {
-                // if requested slot is unavailable, we defer this task for processing later
-                SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
-                queue_tasks.defer(task);
-                break;
+                SRV_ERR("failed to load draft model, '%s'\n", params_base.speculative.model.c_str());
+                return false;
             }
 
-            if (!launch_slot_with_task(*slot, task))
+            if (!common_speculative_are_compatible(ctx, llama_init_dft.context.get()))
             {
-                SRV_ERR("failed to launch slot with task, id_task = %d\n", task.id);
-                break;
+                SRV_ERR("the draft model '%s' is not compatible with the target model '%s'\n",
+                        params_base.speculative.model.c_str(), params_base.model.c_str());
+
+                return false;
             }
+
+            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
+
+            cparams_dft = common_context_params_to_llama(params_dft);
+            cparams_dft.n_batch = n_ctx_dft;
+
+            // force F16 KV cache for the draft model for extra performance
+            cparams_dft.type_k = GGML_TYPE_F16;
+            cparams_dft.type_v = GGML_TYPE_F16;
+
+            // the context is not needed - we will create one for each slot
+            llama_init_dft.context.reset();
         }
-        break;
-        case SERVER_TASK_TYPE_CANCEL:
+
+        for (const auto &schema : params_base.response_schemas)
         {
-            // release slot linked with the task id
-            for (auto &slot : slots)
+            if (grammars.get_sampler(vocab, schema.second) == nullptr)
             {
-                if (slot.id_task == task.id_target)
-                {
-                    slot.release();
-                    break;
-                }
+                SRV_ERR("failed to parse the grammar of response schema '%s'\n", schema.first.c_str());
+                return false;
             }
+            grammars.named[schema.first] = schema.second;
+
+            SRV_INF("loaded response schema '%s'\n", schema.first.c_str());
         }
-        break;
-        case SERVER_TASK_TYPE_NEXT_RESPONSE:
+
+        chat_templates = common_chat_templates_init(model, params_base.chat_template);
+        try
         {
-            // do nothing
+            common_chat_format_example(chat_templates.get(), params.use_jinja);
         }
-        break;
-        case SERVER_TASK_TYPE_METRICS:
+        catch (const std::exception &e)
         {
-            json slots_data = json::array();
+            SRV_WRN(
+                "%s: The chat template that comes with this model is not yet supported, falling back to chatml. This "
+                "may cause the model to output suboptimal responses\n",
+                __func__);
+            chat_templates = common_chat_templates_init(model, "chatml");
+        }
 
-            int n_idle_slots = 0;
-            int n_processing_slots = 0;
+        return true;
+    }
 
-            for (server_slot &slot : slots)
+    void init()
+    {
+        const int32_t n_ctx_slot = n_ctx / params_base.n_parallel;
+
+        SRV_INF("initializing slots, n_slots = %d\n", params_base.n_parallel);
+
+        for (int i = 0; i < params_base.n_parallel; i++)
+        {
+            server_slot slot;
+
+            slot.id = i;
+            slot.ctx = ctx;
+            slot.n_ctx = n_ctx_slot;
+            slot.n_predict = params_base.n_predict;
+
+            if (model_dft)
             {
-                json slot_data = slot.to_json();
+                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
 
-                if (slot.is_processing())
+                slot.ctx_dft = llama_init_from_model(model_dft, cparams_dft);
+                if (slot.ctx_dft == nullptr)
                 {
-                    n_processing_slots++;
+                    SRV_ERR("%s", "failed to create draft context\n");
+                    return;
                 }
-                else
+
+                slot.spec = common_speculative_init(slot.ctx_dft);
+                if (slot.spec == nullptr)
                 {
-                    n_idle_slots++;
+                    SRV_ERR("%s", "failed to create speculator\n");
+                    return;
                 }
-
-                slots_data.push_back(slot_data);
             }
-            SRV_DBG("n_idle_slots = %d, n_processing_slots = %d\n", n_idle_slots, n_processing_slots);
-
-            auto res = std::make_unique<server_task_result_metrics>();
-            res->id = task.id;
-            res->slots_data = std::move(slots_data);
-            res->n_idle_slots = n_idle_slots;
-            res->n_processing_slots = n_processing_slots;
-            res->n_tasks_deferred = queue_tasks.queue_tasks_deferred.size();
-            res->t_start = metrics.t_start;
 
-            res->kv_cache_tokens_count = llama_get_kv_cache_token_count(ctx);
-            res->kv_cache_used_cells = llama_get_kv_cache_used_cells(ctx);
+            SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
 
-            res->n_prompt_tokens_processed_total = metrics.n_prompt_tokens_processed_total;
-            res->t_prompt_processing_total = metrics.t_prompt_processing_total;
-            res->n_tokens_predicted_total = metrics.n_tokens_predicted_total;
-            res->t_tokens_generation_total = metrics.t_tokens_generation_total;
+            slot.params.sampling = params_base.sampling;
 
-            res->n_prompt_tokens_processed = metrics.n_prompt_tokens_processed;
-            res->t_prompt_processing = metrics.t_prompt_processing;
-            res->n_tokens_predicted = metrics.n_tokens_predicted;
-            res->t_tokens_generation = metrics.t_tokens_generation;
+            slot.callback_on_release = [this](int)
+            {
+                queue_tasks.pop_deferred_task();
+            };
 
-            res->n_decode_total = metrics.n_decode_total;
-            res->n_busy_slots_total = metrics.n_busy_slots_total;
+            slot.reset();
 
-            if (task.metrics_reset_bucket)
-            {
-                metrics.reset_bucket();
-            }
-            queue_results.send(std::move(res));
+            slots.push_back(slot);
         }
-        break;
-        case SERVER_TASK_TYPE_SLOT_SAVE:
+
+        default_generation_settings_for_props = slots[0].to_json();
+
+        // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
+        // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
         {
-            int id_slot = task.slot_action.slot_id;
-            server_slot *slot = get_slot_by_id(id_slot);
-            if (slot == nullptr)
-            {
-                send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
-                break;
-            }
-            if (slot->is_processing())
-            {
-                // if requested slot is unavailable, we defer this task for processing later
-                SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
-                queue_tasks.defer(task);
-                break;
-            }
+            const int32_t n_batch = llama_n_batch(ctx);
 
-            const size_t token_count = slot->cache_tokens.size();
-            const int64_t t_start = ggml_time_us();
+            // only a single seq_id per token is needed
+            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
+        }
 
-            std::string filename = task.slot_action.filename;
-            std::string filepath = task.slot_action.filepath;
+        metrics.init();
 
-            const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id,
-                                                            slot->cache_tokens.data(), token_count);
+        sessions.n_bytes_max = (size_t)std::max(params_base.session_memory, 0) * 1024 * 1024;
+        n_parked_bytes_max = (size_t)std::max(params_base.park_memory, 0) * 1024 * 1024;
 
-            const int64_t t_end = ggml_time_us();
-            const double t_save_ms = (t_end - t_start) / 1000.0;
+        llama_set_abort_callback(ctx, abort_decode, this);
 
-            auto res = std::make_unique<server_task_result_slot_save_load>();
-            res->id = task.id;
-            res->id_slot = id_slot;
-            res->filename = filename;
-            res->is_save = true;
-            res->n_tokens = token_count;
-            res->n_bytes = nwrite;
-            res->t_ms = t_save_ms;
-            queue_results.send(std::move(res));
+        if (!params_base.prefix_cache_path.empty())
+        {
+            init_prefix_store();
         }
-        break;
-        case SERVER_TASK_TYPE_SLOT_RESTORE:
+    }
+
+    // the saved states are only valid for the same weights and KV cache layout
+    std::string get_model_key() const
+    {
+        char buf[256];
+
+        llama_model_desc(model, buf, sizeof(buf));
+        uint64_t h = server_prefix_store::hash(buf, strlen(buf));
+
+        const uint64_t layout[] = {
+            llama_model_size(model),
+            llama_model_n_params(model),
+            (uint64_t)params_base.cache_type_k,
+            (uint64_t)params_base.cache_type_v,
+            (uint64_t)params_base.flash_attn,
+        };
+        h = server_prefix_store::hash(layout, sizeof(layout), h);
+
+        for (int32_t i = 0; i < llama_model_meta_count(model); i++)
         {
-            int id_slot = task.slot_action.slot_id;
-            server_slot *slot = get_slot_by_id(id_slot);
-            if (slot == nullptr)
+            if (llama_model_meta_key_by_index(model, i, buf, sizeof(buf)) >= 0)
             {
-                send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
-                break;
+                h = server_prefix_store::hash(buf, strlen(buf), h);
             }
-            if (slot->is_processing())
+            if (llama_model_meta_val_str_by_index(model, i, buf, sizeof(buf)) >= 0)
             {
-                // if requested slot is unavailable, we defer this task for processing later
-                SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
-                queue_tasks.defer(task);
-                break;
+                h = server_prefix_store::hash(buf, strlen(buf), h);
             }
+        }
 
-            const int64_t t_start = ggml_time_us();
+        return string_format("%016" PRIx64, h);
+    }
 
-            std::string filename = task.slot_action.filename;
-            std::string filepath = task.slot_action.filepath;
+    void init_prefix_store()
+    {
+        if (llama_model_is_recurrent(model) || is_lora_active(params_base.lora_adapters))
+        {
+            SRV_WRN("%s", "the prefix cache is not supported with recurrent models or active LoRA adapters, disabling\n");
+            return;
+        }
 
-            slot->cache_tokens.resize(slot->n_ctx);
-            size_t token_count = 0;
-            size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, slot->cache_tokens.data(),
-                                                     slot->cache_tokens.size(), &token_count);
-            if (nread == 0)
-            {
-                slot->cache_tokens.resize(0);
-                send_error(task,
-                           "Unable to restore slot, no available space in KV cache or invalid slot save file",
-                           ERROR_TYPE_INVALID_REQUEST);
-                break;
-            }
-            slot->cache_tokens.resize(token_count);
+        prefix_store.init(params_base.prefix_cache_path, get_model_key(),
+                          (size_t)std::max(params_base.prefix_cache_size, 0) * 1024 * 1024,
+                          params_base.prefix_cache_min_hits);
 
-            const int64_t t_end = ggml_time_us();
-            const double t_restore_ms = (t_end - t_start) / 1000.0;
+        if (!prefix_store.enabled())
+        {
+            return;
+        }
 
-            auto res = std::make_unique<server_task_result_slot_save_load>();
-            res->id = task.id;
-            res->id_slot = id_slot;
-            res->filename = filename;
-            res->is_save = false;
-            res->n_tokens = token_count;
-            res->n_bytes = nread;
-            res->t_ms = t_restore_ms;
-            queue_results.send(std::move(res));
+        // load the most recently used prefixes into the slots, so the first requests after a restart skip their prefill
+        const int64_t t_start = ggml_time_us();
+
+        std::vector<std::string> paths;
+        for (size_t i = 0; i < std::min(prefix_store.entries.size(), slots.size()); i++)
+        {
+            paths.push_back(prefix_store.entries[i].path);
         }
-        break;
-        case SERVER_TASK_TYPE_SLOT_ERASE:
+
+        size_t n_tokens = 0;
+        for (size_t i = 0; i < paths.size(); i++)
         {
-            int id_slot = task.slot_action.slot_id;
-            server_slot *slot = get_slot_by_id(id_slot);
-            if (slot == nullptr)
-            {
-                send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
-                break;
-            }
-            if (slot->is_processing())
+            server_slot &slot = slots[i];
+            slot.lora = params_base.lora_adapters;
+
+            const size_t n = load_prefix_file(slot, paths[i]);
+            if (n > 0)
             {
-                // if requested slot is unavailable, we defer this task for processing later
-                SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
-                queue_tasks.defer(task);
-                break;
+                prefix_tree.insert(slot.id, slot.cache_tokens, n);
+                n_tokens += n;
             }
+        }
 
-            // Erase token cache
-            const size_t n_erased = slot->cache_tokens.size();
-            llama_kv_cache_seq_rm(ctx, slot->id, -1, -1);
-            slot->cache_tokens.clear();
+        SRV_INF("loaded %zu prompt tokens into %zu slot(s) from the prefix cache in %.2f ms\n", n_tokens, paths.size(),
+                (ggml_time_us() - t_start) / 1e3);
+    }
 
-            auto res = std::make_unique<server_task_result_slot_erase>();
-            res->id = task.id;
-            res->id_slot = id_slot;
-            res->n_erased = n_erased;
-            queue_results.send(std::move(res));
-        }
-        break;
-        case SERVER_TASK_TYPE_SET_LORA:
+    // replace the KV cache of the slot with a state file of the prefix cache, returns the number of tokens
+    size_t load_prefix_file(server_slot &slot, const std::string &path)
+    {
+        on_slot_kv_changed(slot, 0);
+        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+
+        size_t n_tokens = 0;
+        slot.cache_tokens.resize(slot.n_ctx);
+        const size_t nread = llama_state_seq_load_file(ctx, path.c_str(), slot.id, slot.cache_tokens.data(),
+                                                       slot.cache_tokens.size(), &n_tokens);
+        if (nread == 0)
         {
-            params_base.lora_adapters = std::move(task.set_lora);
-            auto res = std::make_unique<server_task_result_apply_lora>();
-            res->id = task.id;
-            queue_results.send(std::move(res));
-        }
-        break;
+            SLT_WRN(slot, "failed to load prefix cache file '%s'\n", path.c_str());
+            slot.cache_tokens.clear();
+            return 0;
         }
+        slot.cache_tokens.resize(n_tokens);
+
+        metrics.n_prefix_disk_loads_total++;
+
+        return n_tokens;
     }
 
-    void update_slots()
+    server_slot *get_slot_by_id(int id)
     {
-        // check if all slots are idle
+        for (server_slot &slot : slots)
         {
-            bool all_idle = true;
-
-            for (auto &slot : slots)
+            if (slot.id == id)
             {
-                if (slot.is_processing())
-                {
-                    all_idle = false;
-                    break;
-                }
+                return &slot;
             }
+        }
 
-            if (all_idle)
+        return nullptr;
+    }
+
+    server_slot *get_available_slot(const server_task &task)
+    {
+        server_slot *ret = nullptr;
+
+        // the slot still holding the KV cache of the session
+        if (!task.session.empty())
+        {
+            for (server_slot &slot : slots)
             {
-                SRV_INF("%s", "all slots are idle\n");
-                if (clean_kv_cache)
+                if (!slot.is_processing() && slot.session == task.session)
                 {
-                    kv_cache_clear();
+                    SLT_DBG(slot, "selected slot by session '%s'\n", task.session.c_str());
+                    return &slot;
                 }
-
-                return;
             }
         }
 
+        // find the slot that has at least n% prompt similarity
+        if (ret == nullptr && slot_prompt_similarity != 0.0f)
         {
-            SRV_DBG("%s", "posting NEXT_RESPONSE\n");
-
-            server_task task(SERVER_TASK_TYPE_NEXT_RESPONSE);
-            task.id = queue_tasks.get_new_id();
-            queue_tasks.post(task);
-        }
+            int lcs_len = 0;
+            float similarity = 0;
 
-        // apply context-shift if needed
-        // TODO: simplify and improve
-        for (server_slot &slot : slots)
-        {
-            if (slot.is_processing() && slot.n_past + 1 >= slot.n_ctx)
+            for (server_slot &slot : slots)
             {
-                if (!params_base.ctx_shift)
+                // skip the slot if it is not available
+                if (slot.is_processing())
                 {
-                    // this check is redundant (for good)
-                    // we should never get here, because generation should already stopped in process_token()
-                    slot.release();
-                    send_error(slot, "context shift is disabled", ERROR_TYPE_SERVER);
                     continue;
                 }
 
-                // Shift context
-                const int n_keep = slot.params.n_keep + add_bos_token;
-                const int n_left = slot.n_past - n_keep;
-                const int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+                // skip the slot if it does not contains cached tokens, or too few to beat the current best
+                if (slot.cache_tokens.empty() || slot.cache_tokens.size() <= (size_t)lcs_len)
+                {
+                    continue;
+                }
 
-                SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left,
-                        n_discard);
+                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
+                slot.cache_index.sync(slot.cache_tokens);
+                int cur_lcs_len = slot.cache_index.lcs(task.prompt_tokens);
 
-                llama_kv_cache_seq_rm(ctx, slot.id, n_keep, n_keep + n_discard);
-                llama_kv_cache_seq_add(ctx, slot.id, n_keep + n_discard, slot.n_past, -n_discard);
+                // fraction of the common subsequence length compared to the current slot's prompt length
+                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
 
-                if (slot.params.cache_prompt)
+                // select the current slot if the criteria match
+                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity)
                 {
-                    for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++)
-                    {
-                        slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
-                    }
+                    lcs_len = cur_lcs_len;
+                    similarity = cur_similarity;
+                    ret = &slot;
+                }
+            }
+
+            if (ret != nullptr)
+            {
+                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+            }
+        }
 
-                    slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+        // find the slot that has been least recently used
+        if (ret == nullptr)
+        {
+            int64_t t_last = ggml_time_us();
+            for (server_slot &slot : slots)
+            {
+                // skip the slot if it is not available
+                if (slot.is_processing())
+                {
+                    continue;
                 }
 
-                slot.n_past -= n_discard;
+                // select the current slot if the criteria match
+                if (slot.t_last_used < t_last)
+                {
+                    t_last = slot.t_last_used;
+                    ret = &slot;
+                }
+            }
 
-                slot.truncated = true;
+            if (ret != nullptr)
+            {
+                SLT_DBG(*ret, "selected slot by lru, t_last = %" PRId64 "\n", t_last);
             }
         }
 
-        // start populating the batch for this iteration
-        common_batch_clear(batch);
-
-        // track if given slot can be batched with slots already in the batch
-        server_slot *slot_batched = nullptr;
+        return ret;
+    }
 
-        auto accept_special_token = [&](server_slot &slot, llama_token token)
-        {
-            return params_base.special ||
-                   slot.params.sampling.preserved_tokens.find(token) != slot.params.sampling.preserved_tokens.end();
-        };
+    // find the lowest priority slot that can be parked to make room for the task
+    server_slot *get_preemptible_slot(const server_task &task)
+    {
+        server_slot *ret = nullptr;
 
-        // frist, add sampled tokens from any ongoing sequences
-        for (auto &slot : slots)
+        for (server_slot &slot : slots)
         {
-            if (slot.state != SLOT_STATE_GENERATING)
+            // only causal tasks keep state in the KV cache that is worth parking
+            if (slot.is_non_causal() ||
+                (slot.state != SLOT_STATE_PROCESSING_PROMPT && slot.state != SLOT_STATE_GENERATING))
             {
                 continue;
             }
 
-            // check if we can batch this slot with the previous one
-            if (!slot_batched)
-            {
-                slot_batched = &slot;
-            }
-            else if (!slot_batched->can_batch_with(slot))
+            if (slot.priority >= task.priority)
             {
                 continue;
             }
 
-            slot.i_batch = batch.n_tokens;
+            // among equal priorities, prefer the task with the latest deadline
+            if (ret == nullptr || slot.priority < ret->priority ||
+                (slot.priority == ret->priority && ret->t_deadline >= 0 &&
+                 (slot.t_deadline < 0 || slot.t_deadline > ret->t_deadline)))
+            {
+                ret = &slot;
+            }
+        }
 
-            common_batch_add(batch, slot.sampled, slot.n_past, {slot.id}, true);
+        return ret;
+    }
 
-            slot.n_past += 1;
+    // save the KV cache and the state of the slot, then free it for another task
+    // returns false if the KV cache does not fit in --park-memory, the task that wanted the slot waits for one then
+    bool park_slot(server_slot &slot)
+    {
+        server_slot_parked parked;
 
-            if (slot.params.cache_prompt)
-            {
-                slot.cache_tokens.push_back(slot.sampled);
-            }
+        const size_t n_state = llama_state_seq_get_size(ctx, slot.id);
+        if (n_parked_bytes + n_state > n_parked_bytes_max)
+        {
+            SLT_DBG(slot, "not parking task %d, state size = %zu bytes, parked = %zu bytes, max = %zu bytes\n",
+                    slot.id_task, n_state, n_parked_bytes, n_parked_bytes_max);
+            return false;
+        }
 
-            SLT_DBG(slot, "slot decode token, n_ctx = %d, n_past = %d, n_cache_tokens = %d, truncated = %d\n",
-                    slot.n_ctx, slot.n_past, (int)slot.cache_tokens.size(), slot.truncated);
+        parked.kv_state.resize(n_state);
+        if (llama_state_seq_get_data(ctx, parked.kv_state.data(), n_state, slot.id) != n_state)
+        {
+            SLT_WRN(slot, "%s", "failed to save the KV cache, not parking the slot\n");
+            return false;
         }
 
-        // process in chunks of params.n_batch
-        int32_t n_batch = llama_n_batch(ctx);
-        int32_t n_ubatch = llama_n_ubatch(ctx);
+        SLT_INF(slot, "parking task %d (priority = %s), n_past = %d, state size = %zu bytes\n", slot.id_task,
+                server_task_priority_name(slot.priority), slot.n_past, n_state);
 
-        // next, batch any pending prompts without exceeding n_batch
-        if (params_base.cont_batching || batch.n_tokens == 0)
-        {
-            for (auto &slot : slots)
-            {
-                // check if we can batch this slot with the previous one
-                if (slot.is_processing())
-                {
-                    if (!slot_batched)
-                    {
-                        slot_batched = &slot;
-                    }
-                    else if (!slot_batched->can_batch_with(slot))
-                    {
-                        continue;
-                    }
-                }
+        parked.slot = slot;
+        parked.t_parked = ggml_time_us();
 
-                // this slot still has a prompt to be processed
-                if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED)
-                {
-                    auto &prompt_tokens = slot.prompt_tokens;
+        // the snapshot takes ownership of the sampler
+        slot.smpl = nullptr;
 
-                    // TODO: maybe move branch to outside of this loop in the future
-                    if (slot.state == SLOT_STATE_STARTED)
-                    {
-                        slot.t_start_process_prompt = ggml_time_us();
-                        slot.t_start_generation = 0;
+        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+        on_slot_kv_changed(slot, 0);
+        slot.cache_tokens.clear();
+        slot.session.clear(); // the snapshot keeps it
+        slot.state = SLOT_STATE_IDLE;
+        slot.t_last_used = ggml_time_us();
 
-                        slot.n_past = 0;
-                        slot.n_prompt_tokens = prompt_tokens.size();
-                        slot.state = SLOT_STATE_PROCESSING_PROMPT;
+        server_task task(slot.task_type);
+        task.id = slot.id_task;
+        task.index = slot.index;
+        task.priority = slot.priority;
+        task.t_deadline = slot.t_deadline;
+        task.t_received = task.t_enqueued; // not a new request, keep it out of the queue wait
 
-                        SLT_INF(slot, "new prompt, n_ctx_slot = %d, n_keep = %d, n_prompt_tokens = %d\n", slot.n_ctx,
-                                slot.params.n_keep, slot.n_prompt_tokens);
+        n_parked_bytes += parked.kv_state.size();
+        parked_slots.emplace(task.id, std::move(parked));
+        queue_tasks.defer(std::move(task));
 
-                        // print prompt tokens (for debugging)
-                        if (1)
-                        {
-                            // first 16 tokens (avoid flooding logs)
-                            for (int i = 0; i < std::min<int>(16, prompt_tokens.size()); i++)
-                            {
-                                SLT_DBG(slot, "prompt token %3d: %6d '%s'\n", i, prompt_tokens[i],
-                                        common_token_to_piece(ctx, prompt_tokens[i]).c_str());
-                            }
+        metrics.n_preempted_total++;
+
+        return true;
+    }
+
+    // continue a parked task in the given slot
+    bool resume_slot(server_slot &slot, server_slot_parked &parked)
+    {
+        save_session(slot);
+
+        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+        on_slot_kv_changed(slot, 0);
+        if (llama_state_seq_set_data(ctx, parked.kv_state.data(), parked.kv_state.size(), slot.id) == 0)
+        {
+            SLT_ERR(slot, "failed to restore the KV cache of task %d\n", parked.slot.id_task);
+            slot.cache_tokens.clear();
+            return false;
+        }
+
+        server_slot &snapshot = parked.slot;
+
+        // keep the resources that belong to the destination slot
+        snapshot.id = slot.id;
+        snapshot.ctx = slot.ctx;
+        snapshot.ctx_dft = slot.ctx_dft;
+        snapshot.spec = slot.spec;
+        snapshot.batch_spec = slot.batch_spec;
+        snapshot.callback_on_release = slot.callback_on_release;
+        snapshot.i_batch = -1;
+        snapshot.n_kv_shared = 0; // the restored cells belong to this slot only
+
+        // do not count the time spent parked as processing time
+        const int64_t t_parked = ggml_time_us() - parked.t_parked;
+        snapshot.t_start_process_prompt += t_parked;
+        if (snapshot.t_start_generation > 0)
+        {
+            snapshot.t_start_generation += t_parked;
+            snapshot.t_last_token += t_parked;
+        }
+
+        common_sampler_free(slot.smpl);
+        slot = std::move(snapshot);
+        parked.slot.smpl = nullptr;
+
+        if (slot.ctx_dft || slot.params.speculative.ngram)
+        {
+            llama_batch_free(slot.batch_spec);
+
+            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
+        }
+
+        SLT_INF(slot, "resumed task %d (priority = %s) after %.2f ms, n_past = %d\n", slot.id_task,
+                server_task_priority_name(slot.priority), t_parked / 1e3, slot.n_past);
+
+        return true;
+    }
+
+    bool launch_slot_with_task(server_slot &slot, const server_task &task)
+    {
+        if (slot.session != task.session)
+        {
+            save_session(slot);
+        }
+
+        slot.reset();
+        slot.session = task.session;
+        slot.id_task = task.id;
+        slot.index = task.index;
+        slot.task_type = task.type;
+        slot.priority = task.priority;
+        slot.t_deadline = task.t_deadline;
+        slot.t_enqueued = task.t_enqueued;
+        slot.id_prefix_task = task.id_prefix_task;
+        slot.n_prefix_publish = task.n_prefix_publish;
+        slot.params = std::move(task.params);
+        slot.prompt_tokens = std::move(task.prompt_tokens);
+
+        if (!are_lora_equal(task.params.lora, slot.lora))
+        {
+            // if lora is changed, we cannot reuse cached tokens
+            slot.cache_tokens.clear();
+            slot.lora = task.params.lora;
+            prefix_tree.remove(slot.id);
+        }
+
+        SLT_DBG(slot, "launching slot : %s\n", safe_json_to_str(slot.to_json()).c_str());
+
+        if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict)
+        {
+            // Might be better to reject the request with a 400 ?
+            SLT_WRN(slot, "n_predict = %d exceeds server configuration, setting to %d", slot.params.n_predict,
+                    slot.n_predict);
+            slot.params.n_predict = slot.n_predict;
+        }
+
+        if (slot.params.ignore_eos && has_eos_token)
+        {
+            slot.params.sampling.logit_bias.push_back({llama_vocab_eos(vocab), -INFINITY});
+        }
+
+        {
+            if (slot.smpl != nullptr)
+            {
+                common_sampler_free(slot.smpl);
+            }
+
+            // plain grammars are parsed once and cloned, lazy and llguidance ones carry more state
+            const llama_sampler *grmr = nullptr;
+            const std::string &grammar = slot.params.sampling.grammar;
+            if (!grammar.empty() && !slot.params.sampling.grammar_lazy && grammar.compare(0, 11, "%llguidance") != 0)
+            {
+                grmr = grammars.get_sampler(vocab, grammar);
+                if (grmr == nullptr)
+                {
+                    send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
+                    return false;
+                }
+            }
+
+            slot.smpl = common_sampler_init(model, slot.params.sampling, grmr);
+            if (slot.smpl == nullptr)
+            {
+                // for now, the only error that may happen here is invalid grammar
+                send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+        }
+
+        if (slot.ctx_dft || slot.params.speculative.ngram)
+        {
+            llama_batch_free(slot.batch_spec);
+
+            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
+        }
+
+        slot.state = SLOT_STATE_STARTED;
+
+        SLT_INF(slot, "%s", "processing task\n");
+
+        return true;
+    }
+
+    // decide whether new tasks can be accepted, called from the HTTP threads
+    // the tasks are reserved first, so that concurrent requests cannot all pass the checks: once admitted, they count as
+    // waiting until end_admission() and, if hold_thread, as in flight until the request decrements n_requests_inflight
+    // on rejection, retry_after is an estimate in seconds of how long the current backlog takes to clear
+    bool admit_tasks(int n_tasks, int64_t n_tokens, bool hold_thread, int &retry_after, std::string &reason)
+    {
+        const int n_waiting = n_tasks_admitting.fetch_add(n_tasks) + queue_tasks.n_incoming + queue_tasks.n_deferred;
+        const int64_t n_waiting_tokens =
+            n_tokens_admitting.fetch_add(n_tokens) + queue_tasks.n_incoming_tokens + queue_tasks.n_deferred_tokens;
+        const int n_inflight = hold_thread ? n_requests_inflight.fetch_add(1) : 0;
+
+        const bool enabled = params_base.n_queue_max > 0 || params_base.n_queue_max_tokens > 0 ||
+                             params_base.kv_usage_max > 0.0f;
+        if (!enabled)
+        {
+            return true;
+        }
+
+        if (params_base.n_queue_max > 0 && n_waiting + n_tasks > params_base.n_queue_max)
+        {
+            reason = "too many queued requests";
+        }
+        else if (params_base.n_queue_max_tokens > 0 && n_waiting > 0 &&
+                 n_waiting_tokens + n_tokens > params_base.n_queue_max_tokens)
+        {
+            reason = "too many queued prompt tokens";
+        }
+        else if (params_base.kv_usage_max > 0.0f && n_waiting > 0 &&
+                 n_kv_used >= params_base.kv_usage_max * n_ctx)
+        {
+            reason = "KV cache is nearly full";
+        }
+        else if (hold_thread && n_inflight >= params_base.n_threads_http - 2)
+        {
+            // keep 2 HTTP threads for the monitoring endpoints
+            reason = "all HTTP threads are busy";
+        }
+        else
+        {
+            return true;
+        }
+
+        end_admission(n_tasks, n_tokens);
+        if (hold_thread)
+        {
+            n_requests_inflight--;
+        }
+
+        const int n_rounds = n_waiting / std::max(params_base.n_parallel, 1) + 1;
+        retry_after = std::max(1, (int)std::ceil(n_rounds * t_service_avg_ms / 1e3));
+        n_requests_rejected_total++;
+
+        SRV_WRN("rejecting %d task(s): %s, n_waiting = %d, n_waiting_tokens = %" PRId64 ", retry after %d s\n", n_tasks,
+                reason.c_str(), n_waiting, n_waiting_tokens, retry_after);
+
+        return false;
+    }
+
+    // the admitted tasks are posted (or dropped), the queue counts them from now on
+    void end_admission(int n_tasks, int64_t n_tokens)
+    {
+        n_tasks_admitting -= n_tasks;
+        n_tokens_admitting -= n_tokens;
+    }
+
+    void update_service_time(const server_slot &slot)
+    {
+        const double t_service = slot.t_prompt_processing + slot.t_token_generation;
+        const double t_avg = t_service_avg_ms;
+        t_service_avg_ms = t_avg == 0.0 ? t_service : 0.9 * t_avg + 0.1 * t_service;
+    }
+
+    void kv_cache_clear()
+    {
+        SRV_DBG("%s", "clearing KV cache\n");
+
+        // clear the entire KV cache
+        llama_kv_cache_clear(ctx);
+        clean_kv_cache = false;
+
+        prefix_tree.clear();
+        for (server_slot &slot : slots)
+        {
+            slot.n_kv_shared = 0;
+        }
+    }
+
+    // must be called whenever the KV cache of a slot is modified from position n_keep onwards
+    void on_slot_kv_changed(server_slot &slot, int32_t n_keep)
+    {
+        prefix_tree.truncate(slot.id, std::max(n_keep, 0));
+        slot.n_kv_shared = std::min(slot.n_kv_shared, std::max(n_keep, 0));
+
+        // the n-gram cache cannot be truncated
+        if ((size_t)std::max(n_keep, 0) < slot.n_ngram_indexed)
+        {
+            slot.ngram_cache.clear();
+            slot.n_ngram_indexed = 0;
+        }
+    }
+
+    // same as on_slot_kv_changed() for n_discard tokens removed after n_keep, the ones after them moving back
+    void on_slot_kv_shifted(server_slot &slot, int32_t n_keep, int32_t n_discard)
+    {
+        prefix_tree.truncate(slot.id, n_keep);
+        slot.n_kv_shared = std::min(slot.n_kv_shared, n_keep);
+
+        // the n-grams of the discarded tokens stay in the cache, they are still part of the history of the slot
+        // only the n-grams across the gap are missing, so there is no need to index everything again
+        if ((size_t)(n_keep + n_discard) <= slot.n_ngram_indexed)
+        {
+            slot.n_ngram_indexed -= n_discard;
+        }
+        else
+        {
+            slot.n_ngram_indexed = std::min(slot.n_ngram_indexed, (size_t)n_keep);
+        }
+    }
+
+    // draft the tokens that followed the latest n-grams elsewhere in the prompt or in the generated text
+    llama_tokens gen_ngram_draft(server_slot &slot, llama_token id, int n_draft_max)
+    {
+        if (slot.n_ngram_indexed < slot.cache_tokens.size())
+        {
+            common_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.cache_tokens,
+                                      slot.cache_tokens.size() - slot.n_ngram_indexed, false);
+            slot.n_ngram_indexed = slot.cache_tokens.size();
+        }
+
+        // no statistics from previous generations or from a corpus, only the context of the slot
+        common_ngram_cache nc_dynamic;
+        common_ngram_cache nc_static;
+
+        // the draft starts with the sampled token, which must also end the input
+        llama_tokens draft = {id};
+
+        slot.cache_tokens.push_back(id);
+        common_ngram_cache_draft(slot.cache_tokens, draft, n_draft_max, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX,
+                                 slot.ngram_cache, nc_dynamic, nc_static);
+        slot.cache_tokens.pop_back();
+
+        draft.erase(draft.begin());
+
+        return draft;
+    }
+
+    // whether the slot waits for the task that computes the prompt prefix it shares, see server_task::id_prefix_task
+    // it does not wait for a task that has no slot, or that is already past the prefix
+    bool is_prefix_pending(const server_slot &slot) const
+    {
+        if (slot.id_prefix_task < 0)
+        {
+            return false;
+        }
+
+        for (const server_slot &other : slots)
+        {
+            if (other.is_processing() && other.id_task == slot.id_prefix_task)
+            {
+                return other.n_prefix_publish > 0;
+            }
+        }
+
+        return false;
+    }
+
+    // reuse the longest prompt prefix cached by any other slot, if it is longer than the slot's own
+    void fork_prompt_prefix(server_slot &slot, const llama_tokens &prompt_tokens)
+    {
+        if (params_base.n_prefix_share_min <= 0 || llama_model_is_recurrent(model))
+        {
+            return;
+        }
+
+        int id_src = -1;
+        const int32_t n_match = prefix_tree.match(prompt_tokens, id_src, [&](int id)
+                                                  {
+                                                      const server_slot *other = get_slot_by_id(id);
+                                                      return id != slot.id && other != nullptr &&
+                                                             are_lora_equal(other->lora, slot.lora);
+                                                  });
+
+        if (id_src < 0 || n_match < slot.n_past + params_base.n_prefix_share_min)
+        {
+            return;
+        }
+
+        server_slot &src = *get_slot_by_id(id_src);
+
+        SLT_INF(slot, "forking %d prompt tokens from slot %d (own cached prefix: %d)\n", n_match, id_src, slot.n_past);
+
+        on_slot_kv_changed(slot, 0);
+
+        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+        llama_kv_cache_seq_cp(ctx, src.id, slot.id, 0, n_match);
+
+        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_match);
+        slot.n_past = n_match;
+
+        slot.n_kv_shared = n_match;
+        src.n_kv_shared = std::max(src.n_kv_shared, n_match);
+
+        metrics.n_prefix_hits_total++;
+        metrics.n_prefix_tokens_total += n_match;
+    }
+
+    // reuse a prompt prefix saved on disk, if it is longer than what the slot already has
+    void restore_prompt_prefix(server_slot &slot, const llama_tokens &prompt_tokens)
+    {
+        if (!prefix_store.enabled() || is_lora_active(slot.lora))
+        {
+            return;
+        }
+
+        metrics.n_prefix_disk_saves_total += prefix_store.collect();
+
+        size_t n_match = 0;
+        const server_prefix_store::entry *e = prefix_store.match(prompt_tokens, n_match);
+        if (e == nullptr || (int32_t)n_match < slot.n_past + std::max(params_base.n_prefix_share_min, 1))
+        {
+            return;
+        }
+
+        const std::string path = e->path;
+        const int64_t t_start = ggml_time_us();
+
+        if (load_prefix_file(slot, path) == 0)
+        {
+            slot.n_past = 0;
+            return;
+        }
+        prefix_store.touch(path);
+
+        slot.n_past = n_match;
+
+        SLT_INF(slot, "restored %zu prompt tokens from the prefix cache in %.2f ms\n", n_match,
+                (ggml_time_us() - t_start) / 1e3);
+    }
+
+    // persist the prefix the slot reused for its prompt once enough prompts reused it, to keep it across restarts
+    // only the copy of the KV cache of the slot happens here, the file is written by the prefix store in the background
+    // must be called while the KV cache of the slot holds exactly its cache_tokens
+    void save_prompt_prefix(server_slot &slot)
+    {
+        if (!prefix_store.enabled() || slot.is_non_causal() || is_lora_active(slot.lora) ||
+            slot.n_past < std::max(params_base.n_prefix_share_min, 1))
+        {
+            return;
+        }
+
+        metrics.n_prefix_disk_saves_total += prefix_store.collect();
+
+        const std::string path = prefix_store.path_for(slot.cache_tokens);
+        if (path.empty() || !prefix_store.hit(slot.cache_tokens, std::max(params_base.n_prefix_share_min, 1)))
+        {
+            return;
+        }
+
+        // the next prompt reusing the prefix will try again
+        if (prefix_store.busy())
+        {
+            SLT_DBG(slot, "%s", "the prefix cache is writing another file, not saving the prefix\n");
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        const size_t n_max = llama_state_seq_get_size(ctx, slot.id);
+        const size_t n = llama_state_seq_get_data(ctx, prefix_store.reserve(n_max), n_max, slot.id);
+        if (n == 0)
+        {
+            SLT_WRN(slot, "%s", "failed to copy the KV cache for the prefix cache\n");
+            return;
+        }
+
+        prefix_store.write(path, slot.cache_tokens, n);
+
+        SLT_INF(slot, "copied %zu prompt tokens for the prefix cache in %.2f ms, %.2f MiB\n", slot.cache_tokens.size(),
+                (ggml_time_us() - t_start) / 1e3, n / 1024.0 / 1024.0);
+    }
+
+    // keep the KV cache of the session held by the slot in memory, before the slot is reused
+    void save_session(server_slot &slot)
+    {
+        const std::string session = std::move(slot.session);
+        slot.session.clear();
+
+        if (session.empty() || !sessions.enabled() || slot.cache_tokens.empty())
+        {
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        // cache_tokens is what the next turn is matched against, drop the cells after it (e.g. rejected drafts)
+        llama_kv_cache_seq_rm(ctx, slot.id, slot.cache_tokens.size(), -1);
+
+        server_session_store::entry e;
+        const size_t n_state = llama_state_seq_get_size(ctx, slot.id);
+        if (n_state > sessions.n_bytes_max)
+        {
+            SLT_WRN(slot, "session '%s' does not fit in the session memory, %.2f MiB\n", session.c_str(),
+                    n_state / 1024.0 / 1024.0);
+            return;
+        }
+
+        e.kv_state.resize(n_state);
+        if (llama_state_seq_get_data(ctx, e.kv_state.data(), n_state, slot.id) != n_state)
+        {
+            SLT_WRN(slot, "failed to save the KV cache of session '%s'\n", session.c_str());
+            return;
+        }
+        e.tokens = slot.cache_tokens;
+
+        SLT_INF(slot, "saved session '%s' in %.2f ms, n_tokens = %zu, %.2f MiB\n", session.c_str(),
+                (ggml_time_us() - t_start) / 1e3, e.tokens.size(), n_state / 1024.0 / 1024.0);
+
+        sessions.put(session, std::move(e));
+        metrics.n_session_saves_total++;
+    }
+
+    // continue from the KV cache of the previous turn of the session, if it is longer than what the slot already has
+    void restore_session(server_slot &slot, const llama_tokens &prompt_tokens)
+    {
+        const server_session_store::entry *e = slot.session.empty() ? nullptr : sessions.find(slot.session);
+        if (e == nullptr)
+        {
+            return;
+        }
+
+        const int32_t n_match = common_lcp(e->tokens, prompt_tokens);
+        if (n_match <= slot.n_past)
+        {
+            // the snapshot is only redundant once the slot holds all of it
+            if (common_lcp(slot.cache_tokens, e->tokens) == e->tokens.size())
+            {
+                sessions.erase(slot.session);
+            }
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        on_slot_kv_changed(slot, 0);
+        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+        if (llama_state_seq_set_data(ctx, e->kv_state.data(), e->kv_state.size(), slot.id) == 0)
+        {
+            SLT_WRN(slot, "failed to restore the KV cache of session '%s'\n", slot.session.c_str());
+            slot.cache_tokens.clear();
+            slot.n_past = 0;
+            return;
+        }
+
+        slot.cache_tokens = e->tokens;
+        slot.n_past = n_match;
+        sessions.erase(slot.session);
+
+        metrics.n_session_restores_total++;
+        metrics.n_session_tokens_total += n_match;
+
+        SLT_INF(slot, "restored %d prompt tokens of session '%s' in %.2f ms\n", n_match, slot.session.c_str(),
+                (ggml_time_us() - t_start) / 1e3);
+    }
+
+    bool process_token(completion_token_output &result, server_slot &slot)
+    {
+        // remember which tokens were sampled - used for repetition penalties during sampling
+        const std::string token_str = result.text_to_send;
+        slot.sampled = result.tok;
+
+        slot.generated_text += token_str;
+        if (slot.params.return_tokens)
+        {
+            slot.generated_tokens.push_back(result.tok);
+        }
+        slot.has_next_token = true;
+
+        // check if there is incomplete UTF-8 character at the end
+        bool incomplete = validate_utf8(slot.generated_text) < slot.generated_text.size();
+
+        // search stop word and delete it
+        if (!incomplete)
+        {
+            size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
+
+            const std::string str_test = slot.generated_text.substr(pos);
+            bool send_text = true;
+
+            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), true);
+            if (stop_pos != std::string::npos)
+            {
+                slot.generated_text.erase(slot.generated_text.begin() + pos + stop_pos, slot.generated_text.end());
+                pos = std::min(slot.n_sent_text, slot.generated_text.size());
+            }
+            else if (slot.has_next_token)
+            {
+                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), false);
+                send_text = stop_pos == std::string::npos;
+            }
+
+            // check if there is any token to predict
+            if (send_text)
+            {
+                // no send the stop word in the response
+                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
+                slot.n_sent_text += result.text_to_send.size();
+                // add the token to slot queue and cache
+            }
+            else
+            {
+                result.text_to_send = "";
+            }
+
+            slot.add_token(result);
+            if (slot.params.stream)
+            {
+                send_partial_response(slot, result);
+            }
+        }
+
+        if (incomplete)
+        {
+            slot.has_next_token = true;
+        }
+
+        // check the limits
+        if (slot.n_decoded > 0 && slot.has_next_token && !slot.has_budget(params_base))
+        {
+            slot.stop = STOP_TYPE_LIMIT;
+            slot.has_next_token = false;
+
+            SLT_DBG(slot, "stopped by limit, n_decoded = %d, n_predict = %d\n", slot.n_decoded, slot.params.n_predict);
+        }
+
+        if (slot.has_new_line)
+        {
+            // if we have already seen a new line, we stop after a certain time limit
+            if (slot.params.t_max_predict_ms > 0 &&
+                (ggml_time_us() - slot.t_start_generation > 1000.0f * slot.params.t_max_predict_ms))
+            {
+                slot.stop = STOP_TYPE_LIMIT;
+                slot.has_next_token = false;
+
+                SLT_DBG(slot, "stopped by time limit, n_decoded = %d, t_max_predict_ms = %d ms\n", slot.n_decoded,
+                        (int)slot.params.t_max_predict_ms);
+            }
+
+            // require that each new line has a whitespace prefix (i.e. indentation) of at least slot.params.n_indent
+            if (slot.params.n_indent > 0)
+            {
+                // check the current indentation
+                // TODO: improve by not doing it more than once for each new line
+                if (slot.last_nl_pos > 0)
+                {
+                    size_t pos = slot.last_nl_pos;
+
+                    int n_indent = 0;
+                    while (pos < slot.generated_text.size() &&
+                           (slot.generated_text[pos] == ' ' || slot.generated_text[pos] == '\t'))
+                    {
+                        n_indent++;
+                        pos++;
+                    }
+
+                    if (pos < slot.generated_text.size() && n_indent < slot.params.n_indent)
+                    {
+                        slot.stop = STOP_TYPE_LIMIT;
+                        slot.has_next_token = false;
+
+                        // cut the last line
+                        slot.generated_text.erase(pos, std::string::npos);
+
+                        SLT_DBG(slot, "stopped by indentation limit, n_decoded = %d, n_indent = %d\n", slot.n_decoded,
+                                n_indent);
+                    }
+                }
+
+                // find the next new line
+                {
+                    const size_t pos = slot.generated_text.find('\n', slot.last_nl_pos);
+
+                    if (pos != std::string::npos)
+                    {
+                        slot.last_nl_pos = pos + 1;
+                    }
+                }
+            }
+        }
+
+        // check if there is a new line in the generated text
+        if (result.text_to_send.find('\n') != std::string::npos)
+        {
+            slot.has_new_line = true;
+        }
+
+        // if context shift is disabled, we stop when it reaches the context limit
+        if (slot.n_past >= slot.n_ctx)
+        {
+            slot.truncated = true;
+            slot.stop = STOP_TYPE_LIMIT;
+            slot.has_next_token = false;
+
+            SLT_DBG(slot,
+                    "stopped due to running out of context capacity, n_past = %d, n_prompt_tokens = %d, n_decoded = "
+                    "%d, n_ctx = %d\n",
+                    slot.n_decoded, slot.n_prompt_tokens, slot.n_past, slot.n_ctx);
+        }
+
+        if (llama_vocab_is_eog(vocab, result.tok))
+        {
+            slot.stop = STOP_TYPE_EOS;
+            slot.has_next_token = false;
+
+            SLT_DBG(slot, "%s", "stopped by EOS\n");
+        }
+
+        const auto n_ctx_train = llama_model_n_ctx_train(model);
+
+        if (slot.params.n_predict < 1 && slot.n_predict < 1 && slot.n_prompt_tokens + slot.n_decoded >= n_ctx_train)
+        {
+            slot.truncated = true;
+            slot.stop = STOP_TYPE_LIMIT;
+            slot.has_next_token = false; // stop prediction
+
+            SLT_WRN(slot,
+                    "n_predict (%d) is set for infinite generation. "
+                    "Limiting generated tokens to n_ctx_train (%d) to avoid EOS-less generation infinite loop\n",
+                    slot.params.n_predict, n_ctx_train);
+        }
+
+        SLT_DBG(slot, "n_decoded = %d, n_remaining = %d, next token: %5d '%s'\n", slot.n_decoded, slot.n_remaining,
+                result.tok, token_str.c_str());
+
+        return slot.has_next_token; // continue
+    }
+
+    void populate_token_probs(const server_slot &slot, completion_token_output &result, bool post_sampling,
+                              bool special, int idx)
+    {
+        size_t n_probs = slot.params.sampling.n_probs;
+        size_t n_vocab = llama_vocab_n_tokens(vocab);
+        if (post_sampling)
+        {
+            const auto *cur_p = common_sampler_get_candidates(slot.smpl);
+            const size_t max_probs = cur_p->size;
+
+            // set probability for sampled token
+            for (size_t i = 0; i < max_probs; i++)
+            {
+                if (cur_p->data[i].id == result.tok)
+                {
+                    result.prob = cur_p->data[i].p;
+                    break;
+                }
+            }
+
+            // set probability for top n_probs tokens
+            result.probs.reserve(max_probs);
+            for (size_t i = 0; i < std::min(max_probs, n_probs); i++)
+            {
+                result.probs.push_back(
+                    {cur_p->data[i].id, common_token_to_piece(ctx, cur_p->data[i].id, special), cur_p->data[i].p});
+            }
+        }
+        else
+        {
+            // TODO: optimize this with min-p optimization
+            std::vector<llama_token_data> cur = get_token_probabilities(ctx, idx);
+
+            // set probability for sampled token
+            for (size_t i = 0; i < n_vocab; i++)
+            {
+                // set probability for sampled token
+                if (cur[i].id == result.tok)
+                {
+                    result.prob = cur[i].p;
+                    break;
+                }
+            }
+
+            // set probability for top n_probs tokens
+            result.probs.reserve(n_probs);
+            for (size_t i = 0; i < std::min(n_vocab, n_probs); i++)
+            {
+                result.probs.push_back({cur[i].id, common_token_to_piece(ctx, cur[i].id, special), cur[i].p});
+            }
+        }
+    }
+
+    void send_error(const server_task &task, const std::string &error,
+                    const enum error_type type = ERROR_TYPE_SERVER)
+    {
+        send_error(task.id, error, type);
+    }
+
+    void send_error(const server_slot &slot, const std::string &error,
+                    const enum error_type type = ERROR_TYPE_SERVER)
+    {
+        send_error(slot.id_task, error, type);
+    }
+
+    void send_error(const int id_task, const std::string &error, const enum error_type type = ERROR_TYPE_SERVER)
+    {
+        SRV_ERR("task id = %d, error: %s\n", id_task, error.c_str());
+
+        auto res = std::make_unique<server_task_result_error>();
+        res->id = id_task;
+        res->err_type = type;
+        res->err_msg = error;
+
+        queue_results.send(std::move(res));
+    }
+
+    void send_partial_response(server_slot &slot, const completion_token_output &tkn)
+    {
+        auto res = std::make_unique<server_task_result_cmpl_partial>();
+
+        res->id = slot.id_task;
+        res->index = slot.index;
+        res->content = tkn.text_to_send;
+        res->tokens = {tkn.tok};
+
+        res->n_decoded = slot.n_decoded;
+        res->n_prompt_tokens = slot.n_prompt_tokens;
+        res->post_sampling_probs = slot.params.post_sampling_probs;
+
+        res->verbose = slot.params.verbose;
+        res->oaicompat = slot.params.oaicompat;
+        res->oaicompat_model = slot.params.oaicompat_model;
+        res->oaicompat_cmpl_id = slot.params.oaicompat_cmpl_id;
+
+        // populate res.probs_output
+        if (slot.params.sampling.n_probs > 0)
+        {
+            res->prob_output = tkn; // copy the token probs
+        }
+
+        // populate timings if this is final response or timings_per_token is enabled
+        if (slot.stop != STOP_TYPE_NONE || slot.params.timings_per_token)
+        {
+            res->timings = slot.get_timings();
+        }
+
+        queue_results.send(std::move(res));
+    }
+
+    void send_final_response(server_slot &slot)
+    {
+        auto res = std::make_unique<server_task_result_cmpl_final>();
+        res->id = slot.id_task;
+        res->id_slot = slot.id;
+
+        res->index = slot.index;
+        res->content = std::move(slot.generated_text);
+        res->tokens = std::move(slot.generated_tokens);
+        res->timings = slot.get_timings();
+        res->prompt = common_detokenize(ctx, slot.prompt_tokens, true);
+        res->response_fields = std::move(slot.params.response_fields);
+
+        res->truncated = slot.truncated;
+        res->n_decoded = slot.n_decoded;
+        res->n_prompt_tokens = slot.n_prompt_tokens;
+        res->n_tokens_cached = slot.n_past;
+        res->has_new_line = slot.has_new_line;
+        res->stopping_word = slot.stopping_word;
+        res->stop = slot.stop;
+        res->post_sampling_probs = slot.params.post_sampling_probs;
+
+        res->verbose = slot.params.verbose;
+        res->stream = slot.params.stream;
+        res->oaicompat = slot.params.oaicompat;
+        res->oaicompat_model = slot.params.oaicompat_model;
+        res->oaicompat_cmpl_id = slot.params.oaicompat_cmpl_id;
+        res->oaicompat_chat_format = slot.params.oaicompat_chat_format;
+        // populate res.probs_output
+        if (slot.params.sampling.n_probs > 0)
+        {
+            if (!slot.params.stream && slot.stop == STOP_TYPE_WORD)
+            {
+                const llama_tokens stop_word_toks = common_tokenize(ctx, slot.stopping_word, false);
+
+                size_t safe_offset = std::min(slot.generated_token_probs.size(), stop_word_toks.size());
+                res->probs_output = std::vector<completion_token_output>(
+                    slot.generated_token_probs.begin(), slot.generated_token_probs.end() - safe_offset);
+            }
+            else
+            {
+                res->probs_output = std::vector<completion_token_output>(slot.generated_token_probs.begin(),
+                                                                         slot.generated_token_probs.end());
+            }
+        }
+
+        res->generation_params = slot.params; // copy the parameters
+
+        queue_results.send(std::move(res));
+    }
+
+    void send_embedding(const server_slot &slot, const llama_batch &batch)
+    {
+        auto res = std::make_unique<server_task_result_embd>();
+        res->id = slot.id_task;
+        res->index = slot.index;
+        res->n_tokens = slot.n_prompt_tokens;
+        res->oaicompat = slot.params.oaicompat;
+
+        const int n_embd = llama_model_n_embd(model);
+
+        std::vector<float> embd_res(n_embd, 0.0f);
+
+        for (int i = 0; i < batch.n_tokens; ++i)
+        {
+            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id)
+            {
+                continue;
+            }
+
+            const float *embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
+            if (embd == NULL)
+            {
+                embd = llama_get_embeddings_ith(ctx, i);
+            }
+
+            if (embd == NULL)
+            {
+                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i],
+                        batch.seq_id[i][0]);
+
+                res->embedding.push_back(std::vector<float>(n_embd, 0.0f));
+                continue;
+            }
+
+            // normalize only when there is pooling
+            // TODO: configurable
+            if (llama_pooling_type(slot.ctx) != LLAMA_POOLING_TYPE_NONE)
+            {
+                common_embd_normalize(embd, embd_res.data(), n_embd, 2);
+                res->embedding.push_back(embd_res);
+            }
+            else
+            {
+                res->embedding.push_back({embd, embd + n_embd});
+            }
+        }
+
+        SLT_DBG(slot, "%s", "sending embeddings\n");
+
+        queue_results.send(std::move(res));
+    }
+
+    void send_rerank(const server_slot &slot, const llama_batch &batch)
+    {
+        auto res = std::make_unique<server_task_result_rerank>();
+        res->id = slot.id_task;
+        res->index = slot.index;
+        res->n_tokens = slot.n_prompt_tokens;
+
+        for (int i = 0; i < batch.n_tokens; ++i)
+        {
+            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id)
+            {
+                continue;
+            }
+
+            const float *embd = llama_get_embeddings_seq(ctx, batch.seq_id[i][0]);
+            if (embd == NULL)
+            {
+                embd = llama_get_embeddings_ith(ctx, i);
+            }
+
+            if (embd == NULL)
+            {
+                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i],
+                        batch.seq_id[i][0]);
+
+                res->score = -1e6;
+                continue;
+            }
+
+            res->score = embd[0];
+        }
+
+        SLT_DBG(slot, "sending rerank result, res.score = %f\n", res->score);
+
+        queue_results.send(std::move(res));
+    }
+
+    //
+    // Functions to create new task(s) and receive result(s)
+    //
+
+    void cancel_tasks(const std::unordered_set<int> &id_tasks)
+    {
+        std::vector<server_task> cancel_tasks;
+        cancel_tasks.reserve(id_tasks.size());
+        for (const auto &id_task : id_tasks)
+        {
+            SRV_WRN("cancel task, id_task = %d\n", id_task);
+
+            server_task task(SERVER_TASK_TYPE_CANCEL);
+            task.id_target = id_task;
+            queue_results.remove_waiting_task_id(id_task);
+            cancel_tasks.push_back(task);
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex_cancelled);
+            id_tasks_cancelled.insert(id_tasks.begin(), id_tasks.end());
+            n_tasks_cancelled = (int)id_tasks_cancelled.size();
+            update_decoding_cancelled();
+        }
+        // push to beginning of the queue, so it has highest priority
+        queue_tasks.post(cancel_tasks, true);
+    }
+
+    // called by the backends between graph nodes, a single atomic load
+    static bool abort_decode(void *data)
+    {
+        server_context *ctx_server = (server_context *)data;
+        return ctx_server->decoding_cancelled.load(std::memory_order_relaxed);
+    }
+
+    // whenever the batch view or the cancelled tasks change, with mutex_cancelled held
+    void update_decoding_cancelled()
+    {
+        bool all = !id_tasks_decoding.empty();
+        for (const int id_task : id_tasks_decoding)
+        {
+            if (id_tasks_cancelled.count(id_task) == 0)
+            {
+                all = false;
+                break;
+            }
+        }
+        decoding_cancelled.store(all, std::memory_order_relaxed);
+    }
+
+    bool is_task_cancelled(int id_task)
+    {
+        if (n_tasks_cancelled.load(std::memory_order_relaxed) == 0)
+        {
+            return false;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_cancelled);
+        return id_tasks_cancelled.count(id_task) != 0;
+    }
+
+    // the batch view was aborted because all of its tasks were cancelled: the ubatches decoded before the abort are in
+    // the KV cache, so drop everything the view added for each sequence and release the slots
+    void release_aborted_batch(const llama_batch &batch_view)
+    {
+        std::vector<llama_pos> p0(slots.size(), -1);
+        for (int32_t i = 0; i < batch_view.n_tokens; ++i)
+        {
+            const llama_seq_id seq = batch_view.seq_id[i][0];
+            if (p0[seq] < 0 || batch_view.pos[i] < p0[seq])
+            {
+                p0[seq] = batch_view.pos[i];
+            }
+        }
+
+        for (auto &slot : slots)
+        {
+            if (p0[slot.id] < 0)
+            {
+                continue;
+            }
+
+            llama_kv_cache_seq_rm(ctx, slot.id, p0[slot.id], -1);
+            if ((int32_t)slot.cache_tokens.size() > p0[slot.id])
+            {
+                slot.cache_tokens.resize(p0[slot.id]);
+            }
+            slot.n_past = std::min(slot.n_past, (int32_t)p0[slot.id]);
+            on_slot_kv_changed(slot, p0[slot.id]);
+
+            slot.i_batch = -1;
+            slot.release();
+        }
+    }
+
+    // receive the results from task(s)
+    void receive_multi_results(const std::unordered_set<int> &id_tasks,
+                               const std::function<void(std::vector<server_task_result_ptr> &)> &result_handler,
+                               const std::function<void(json)> &error_handler,
+                               const std::function<bool()> &is_connection_closed)
+    {
+        std::vector<server_task_result_ptr> results(id_tasks.size());
+        for (int i = 0; i < (int)id_tasks.size(); i++)
+        {
+            server_task_result_ptr result = queue_results.recv_with_timeout(id_tasks, HTTP_POLLING_SECONDS);
+
+            if (is_connection_closed())
+            {
+                cancel_tasks(id_tasks);
+                return;
+            }
+
+            if (result == nullptr)
+            {
+                if (!queue_results.is_waiting(id_tasks))
+                {
+                    // nobody will send the results anymore, give up like for a closed connection
+                    cancel_tasks(id_tasks);
+                    return;
+                }
+                i--; // retry
+                continue;
+            }
+
+            if (result->is_error())
+            {
+                error_handler(result->to_json());
+                cancel_tasks(id_tasks);
+                return;
+            }
+
+            GGML_ASSERT(dynamic_cast<server_task_result_cmpl_final *>(result.get()) != nullptr ||
+                        dynamic_cast<server_task_result_embd *>(result.get()) != nullptr ||
+                        dynamic_cast<server_task_result_rerank *>(result.get()) != nullptr);
+            const size_t idx = result->get_index();
+            GGML_ASSERT(idx < results.size() && "index out of range");
+            results[idx] = std::move(result);
+        }
+        result_handler(results);
+    }
+
+    // receive the results from task(s), in stream mode
+    void receive_cmpl_results_stream(const std::unordered_set<int> &id_tasks,
+                                     const std::function<bool(server_task_result_ptr &)> &result_handler,
+                                     const std::function<void(json)> &error_handler,
+                                     const std::function<bool()> &is_connection_closed)
+    {
+        size_t n_finished = 0;
+        while (true)
+        {
+            server_task_result_ptr result = queue_results.recv_with_timeout(id_tasks, HTTP_POLLING_SECONDS);
+
+            if (is_connection_closed())
+            {
+                cancel_tasks(id_tasks);
+                return;
+            }
+
+            if (result == nullptr)
+            {
+                if (!queue_results.is_waiting(id_tasks))
+                {
+                    // nobody will send the results anymore, give up like for a closed connection
+                    cancel_tasks(id_tasks);
+                    return;
+                }
+                continue; // retry
+            }
+
+            if (result->is_error())
+            {
+                error_handler(result->to_json());
+                cancel_tasks(id_tasks);
+                return;
+            }
+
+            GGML_ASSERT(dynamic_cast<server_task_result_cmpl_partial *>(result.get()) != nullptr ||
+                        dynamic_cast<server_task_result_cmpl_final *>(result.get()) != nullptr);
+            if (!result_handler(result))
+            {
+                cancel_tasks(id_tasks);
+                break;
+            }
+
+            if (result->is_stop())
+            {
+                if (++n_finished == id_tasks.size())
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    //
+    // Functions to process the task
+    //
+
+    void process_single_task(server_task task)
+    {
+        switch (task.type)
+        {
+        case SERVER_TASK_TYPE_COMPLETION:
+        case SERVER_TASK_TYPE_INFILL:
+        case SERVER_TASK_TYPE_EMBEDDING:
+        case SERVER_TASK_TYPE_RERANK:
+        {
+            if (task.t_received == 0)
+            {
+                task.t_received = ggml_time_us();
+                metrics.on_task_received(task);
+                tracer.add("queue", task.id, task.t_enqueued, task.t_received);
+            }
+
+            const int id_slot = task.id_selected_slot;
+
+            server_slot *slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
+
+            if (slot == nullptr && id_slot == -1)
+            {
+                // all slots are busy - make room by parking a task of lower priority, if any
+                server_slot *slot_preempt = get_preemptible_slot(task);
+                if (slot_preempt != nullptr && park_slot(*slot_preempt))
+                {
+                    slot = slot_preempt;
+                }
+            }
+
+            if (slot == nullptr)
+            {
+                // if no slot is available, we defer this task for processing later
+                SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
+                queue_tasks.defer(std::move(task));
+                break;
+            }
+            if (slot->is_processing())
+            {
+                // if requested slot is unavailable, we defer this task for processing later
+                SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
+                queue_tasks.defer(std::move(task));
+                break;
+            }
+
+            auto it_parked = parked_slots.find(task.id);
+            if (it_parked != parked_slots.end())
+            {
+                server_slot_parked parked = std::move(it_parked->second);
+                parked_slots.erase(it_parked);
+                n_parked_bytes -= parked.kv_state.size();
+
+                if (!resume_slot(*slot, parked))
+                {
+                    common_sampler_free(parked.slot.smpl);
+                    send_error(task, "failed to resume the preempted task", ERROR_TYPE_SERVER);
+                }
+                break;
+            }
+
+            metrics.on_task_started(task);
+            tracer.add("slot_wait", task.id, task.t_received, ggml_time_us());
+
+            if (!launch_slot_with_task(*slot, task))
+            {
+                SRV_ERR("failed to launch slot with task, id_task = %d\n", task.id);
+                break;
+            }
+        }
+        break;
+        case SERVER_TASK_TYPE_CANCEL:
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_cancelled);
+                id_tasks_cancelled.erase(task.id_target);
+                n_tasks_cancelled = (int)id_tasks_cancelled.size();
+                update_decoding_cancelled();
+            }
+
+            // release slot linked with the task id
+            for (auto &slot : slots)
+            {
+                if (slot.id_task == task.id_target && slot.is_processing())
+                {
+                    slot.release();
+                    break;
+                }
+            }
+
+            // or drop its parked state
+            auto it_parked = parked_slots.find(task.id_target);
+            if (it_parked != parked_slots.end())
+            {
+                common_sampler_free(it_parked->second.slot.smpl);
+                n_parked_bytes -= it_parked->second.kv_state.size();
+                parked_slots.erase(it_parked);
+            }
+        }
+        break;
+        case SERVER_TASK_TYPE_NEXT_RESPONSE:
+        {
+            // do nothing
+        }
+        break;
+        case SERVER_TASK_TYPE_METRICS:
+        {
+            json slots_data = json::array();
+
+            int n_idle_slots = 0;
+            int n_processing_slots = 0;
+
+            for (server_slot &slot : slots)
+            {
+                json slot_data = slot.to_json();
+
+                if (slot.is_processing())
+                {
+                    n_processing_slots++;
+                }
+                else
+                {
+                    n_idle_slots++;
+                }
+
+                slots_data.push_back(slot_data);
+            }
+            SRV_DBG("n_idle_slots = %d, n_processing_slots = %d\n", n_idle_slots, n_processing_slots);
+
+            auto res = std::make_unique<server_task_result_metrics>();
+            res->id = task.id;
+            res->slots_data = std::move(slots_data);
+            res->n_idle_slots = n_idle_slots;
+            res->n_processing_slots = n_processing_slots;
+            res->n_tasks_deferred = queue_tasks.queue_tasks_deferred.size();
+            res->t_start = metrics.t_start;
+
+            res->kv_cache_tokens_count = llama_get_kv_cache_token_count(ctx);
+            res->kv_cache_used_cells = llama_get_kv_cache_used_cells(ctx);
+
+            res->n_prompt_tokens_processed_total = metrics.n_prompt_tokens_processed_total;
+            res->t_prompt_processing_total = metrics.t_prompt_processing_total;
+            res->n_tokens_predicted_total = metrics.n_tokens_predicted_total;
+            res->t_tokens_generation_total = metrics.t_tokens_generation_total;
+
+            res->n_prompt_tokens_processed = metrics.n_prompt_tokens_processed;
+            res->t_prompt_processing = metrics.t_prompt_processing;
+            res->n_tokens_predicted = metrics.n_tokens_predicted;
+            res->t_tokens_generation = metrics.t_tokens_generation;
+
+            res->n_decode_total = metrics.n_decode_total;
+            res->n_busy_slots_total = metrics.n_busy_slots_total;
+
+            for (int i = 0; i < SERVER_TASK_PRIORITY_COUNT; i++)
+            {
+                res->n_tasks_started_total[i] = metrics.n_tasks_started_total[i];
+                res->t_queue_wait_total[i] = metrics.t_queue_wait_total[i];
+            }
+            res->n_preempted_total = metrics.n_preempted_total;
+            res->n_draft_total = metrics.n_draft_total;
+            res->n_draft_accepted_total = metrics.n_draft_accepted_total;
+            res->n_tasks_parked = parked_slots.size();
+            res->n_parked_bytes = n_parked_bytes;
+
+            res->n_prefix_hits_total = metrics.n_prefix_hits_total;
+            res->n_prefix_tokens_total = metrics.n_prefix_tokens_total;
+            res->n_prefix_disk_loads_total = metrics.n_prefix_disk_loads_total;
+            res->n_prefix_disk_saves_total = metrics.n_prefix_disk_saves_total;
+            res->n_prefix_batch_tokens_total = metrics.n_prefix_batch_tokens_total;
+            res->n_batches_aborted_total = metrics.n_batches_aborted_total;
+
+            res->n_session_saves_total = metrics.n_session_saves_total;
+            res->n_session_restores_total = metrics.n_session_restores_total;
+            res->n_session_tokens_total = metrics.n_session_tokens_total;
+            res->n_session_evictions_total = sessions.n_evicted_total;
+            res->n_sessions = sessions.entries.size();
+            res->n_session_bytes = sessions.n_bytes;
+
+            const llama_perf_context_data perf = llama_perf_context(ctx);
+            res->t_kv_defrag = perf.t_defrag_ms;
+            res->n_kv_defrag_total = perf.n_defrag;
+            res->n_kv_defrag_cells_total = perf.n_defrag_cells;
+
+            res->n_batch_decode_tokens_total = metrics.n_batch_decode_tokens_total;
+            res->n_batch_prompt_tokens_total = metrics.n_batch_prompt_tokens_total;
+            res->n_batch_decode_tokens_last = metrics.n_batch_decode_tokens_last;
+            res->n_batch_prompt_tokens_last = metrics.n_batch_prompt_tokens_last;
+
+            res->n_token_gaps = metrics.n_token_gaps;
+            res->t_token_gaps = metrics.t_token_gaps;
+            res->t_token_gap_max = metrics.t_token_gap_max;
+
+            if (task.metrics_reset_bucket)
+            {
+                metrics.reset_bucket();
+            }
+            queue_results.send(std::move(res));
+        }
+        break;
+        case SERVER_TASK_TYPE_SLOT_SAVE:
+        {
+            int id_slot = task.slot_action.slot_id;
+            server_slot *slot = get_slot_by_id(id_slot);
+            if (slot == nullptr)
+            {
+                send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
+                break;
+            }
+            if (slot->is_processing())
+            {
+                // if requested slot is unavailable, we defer this task for processing later
+                SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
+                queue_tasks.defer(std::move(task));
+                break;
+            }
+
+            const size_t token_count = slot->cache_tokens.size();
+            const int64_t t_start = ggml_time_us();
+
+            std::string filename = task.slot_action.filename;
+            std::string filepath = task.slot_action.filepath;
+
+            const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id,
+                                                            slot->cache_tokens.data(), token_count);
+
+            const int64_t t_end = ggml_time_us();
+            const double t_save_ms = (t_end - t_start) / 1000.0;
+
+            auto res = std::make_unique<server_task_result_slot_save_load>();
+            res->id = task.id;
+            res->id_slot = id_slot;
+            res->filename = filename;
+            res->is_save = true;
+            res->n_tokens = token_count;
+            res->n_bytes = nwrite;
+            res->t_ms = t_save_ms;
+            queue_results.send(std::move(res));
+        }
+        break;
+        case SERVER_TASK_TYPE_SLOT_RESTORE:
+        {
+            int id_slot = task.slot_action.slot_id;
+            server_slot *slot = get_slot_by_id(id_slot);
+            if (slot == nullptr)
+            {
+                send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
+                break;
+            }
+            if (slot->is_processing())
+            {
+                // if requested slot is unavailable, we defer this task for processing later
+                SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
+                queue_tasks.defer(std::move(task));
+                break;
+            }
+
+            const int64_t t_start = ggml_time_us();
+
+            std::string filename = task.slot_action.filename;
+            std::string filepath = task.slot_action.filepath;
+
+            save_session(*slot);
+            on_slot_kv_changed(*slot, 0);
+
+            slot->cache_tokens.resize(slot->n_ctx);
+            size_t token_count = 0;
+            size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, slot->cache_tokens.data(),
+                                                     slot->cache_tokens.size(), &token_count);
+            if (nread == 0)
+            {
+                slot->cache_tokens.resize(0);
+                send_error(task,
+                           "Unable to restore slot, no available space in KV cache or invalid slot save file",
+                           ERROR_TYPE_INVALID_REQUEST);
+                break;
+            }
+            slot->cache_tokens.resize(token_count);
+
+            const int64_t t_end = ggml_time_us();
+            const double t_restore_ms = (t_end - t_start) / 1000.0;
+
+            auto res = std::make_unique<server_task_result_slot_save_load>();
+            res->id = task.id;
+            res->id_slot = id_slot;
+            res->filename = filename;
+            res->is_save = false;
+            res->n_tokens = token_count;
+            res->n_bytes = nread;
+            res->t_ms = t_restore_ms;
+            queue_results.send(std::move(res));
+        }
+        break;
+        case SERVER_TASK_TYPE_SLOT_ERASE:
+        {
+            int id_slot = task.slot_action.slot_id;
+            server_slot *slot = get_slot_by_id(id_slot);
+            if (slot == nullptr)
+            {
+                send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
+                break;
+            }
+            if (slot->is_processing())
+            {
+                // if requested slot is unavailable, we defer this task for processing later
+                SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
+                queue_tasks.defer(std::move(task));
+                break;
+            }
+
+            // Erase token cache
+            const size_t n_erased = slot->cache_tokens.size();
+            llama_kv_cache_seq_rm(ctx, slot->id, -1, -1);
+            on_slot_kv_changed(*slot, 0);
+            slot->cache_tokens.clear();
+            slot->session.clear();
+
+            auto res = std::make_unique<server_task_result_slot_erase>();
+            res->id = task.id;
+            res->id_slot = id_slot;
+            res->n_erased = n_erased;
+            queue_results.send(std::move(res));
+        }
+        break;
+        case SERVER_TASK_TYPE_SET_LORA:
+        {
+            params_base.lora_adapters = std::move(task.set_lora);
+            auto res = std::make_unique<server_task_result_apply_lora>();
+            res->id = task.id;
+            queue_results.send(std::move(res));
+        }
+        break;
+        }
+    }
+
+    void update_slots()
+    {
+        server_trace_span span_update("update_slots");
+
+        n_kv_used = llama_get_kv_cache_used_cells(ctx);
+
+        // check if all slots are idle
+        {
+            bool all_idle = true;
+
+            for (auto &slot : slots)
+            {
+                if (slot.is_processing())
+                {
+                    all_idle = false;
+                    break;
+                }
+            }
+
+            if (all_idle)
+            {
+                SRV_INF("%s", "all slots are idle\n");
+                if (clean_kv_cache)
+                {
+                    kv_cache_clear();
+                }
+
+                return;
+            }
+        }
+
+        {
+            SRV_DBG("%s", "posting NEXT_RESPONSE\n");
+
+            server_task task(SERVER_TASK_TYPE_NEXT_RESPONSE);
+            task.id = queue_tasks.get_new_id();
+            queue_tasks.post(task);
+        }
+
+        // apply context-shift if needed
+        // TODO: simplify and improve
+        for (server_slot &slot : slots)
+        {
+            if (slot.is_processing() && slot.n_past + 1 >= slot.n_ctx)
+            {
+                if (!params_base.ctx_shift)
+                {
+                    // this check is redundant (for good)
+                    // we should never get here, because generation should already stopped in process_token()
+                    slot.release();
+                    send_error(slot, "context shift is disabled", ERROR_TYPE_SERVER);
+                    continue;
+                }
+
+                // Shift context
+                // cells shared with other slots cannot be shifted, so they are always kept
+                const int n_keep = std::max(slot.params.n_keep + add_bos_token, slot.n_kv_shared);
+                const int n_left = slot.n_past - n_keep;
+                int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+
+                // the shift must leave some of the window, otherwise the next token has no context after n_keep
+                if (n_discard >= n_left)
+                {
+                    SLT_WRN(slot, "n_discard = %d would discard all of n_left = %d, discarding half of it\n", n_discard,
+                            n_left);
+                    n_discard = n_left / 2;
+                }
+
+                if (n_discard <= 0)
+                {
+                    slot.release();
+                    send_error(slot, "context shift is not possible, the shared prompt prefix fills the context",
+                               ERROR_TYPE_SERVER);
+                    continue;
+                }
+
+                SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left,
+                        n_discard);
+
+                const int64_t t_shift_start = ggml_time_us();
+
+                // the position delta is applied to the keys lazily, by the K-shift of the next decode
+                llama_kv_cache_seq_rm(ctx, slot.id, n_keep, n_keep + n_discard);
+                llama_kv_cache_seq_add(ctx, slot.id, n_keep + n_discard, slot.n_past, -n_discard);
+                on_slot_kv_shifted(slot, n_keep, n_discard);
+
+                if (slot.params.cache_prompt)
+                {
+                    slot.cache_tokens.erase(slot.cache_tokens.begin() + n_keep,
+                                            slot.cache_tokens.begin() + n_keep + n_discard);
+                }
+
+                slot.n_past -= n_discard;
+
+                slot.truncated = true;
+
+                tracer.add("context_shift", slot.id_task, t_shift_start, ggml_time_us());
+            }
+        }
+
+        // the shared prefixes decoded by the last batch can now be forked by the other tasks of their request
+        for (server_slot &slot : slots)
+        {
+            if (slot.n_prefix_publish > 0 && slot.is_processing() && slot.state != SLOT_STATE_STARTED &&
+                slot.n_past >= slot.n_prefix_publish)
+            {
+                prefix_tree.insert(slot.id, slot.cache_tokens, slot.n_prefix_publish);
+                slot.n_prefix_publish = 0;
+            }
+        }
+
+        // start populating the batch for this iteration
+        const int64_t t_batch_start = ggml_time_us();
+        common_batch_clear(batch);
+
+        // track if given slot can be batched with slots already in the batch
+        server_slot *slot_batched = nullptr;
+
+        auto accept_special_token = [&](server_slot &slot, llama_token token)
+        {
+            return params_base.special ||
+                   slot.params.sampling.preserved_tokens.find(token) != slot.params.sampling.preserved_tokens.end();
+        };
+
+        // frist, add sampled tokens from any ongoing sequences
+        for (auto &slot : slots)
+        {
+            if (slot.state != SLOT_STATE_GENERATING)
+            {
+                continue;
+            }
+
+            // check if we can batch this slot with the previous one
+            if (!slot_batched)
+            {
+                slot_batched = &slot;
+            }
+            else if (!slot_batched->can_batch_with(slot))
+            {
+                continue;
+            }
+
+            slot.i_batch = batch.n_tokens;
+
+            common_batch_add(batch, slot.sampled, slot.n_past, {slot.id}, true);
+
+            slot.n_past += 1;
+
+            if (slot.params.cache_prompt)
+            {
+                slot.cache_tokens.push_back(slot.sampled);
+            }
+
+            SLT_DBG(slot, "slot decode token, n_ctx = %d, n_past = %d, n_cache_tokens = %d, truncated = %d\n",
+                    slot.n_ctx, slot.n_past, (int)slot.cache_tokens.size(), slot.truncated);
+        }
+
+        // process in chunks of params.n_batch
+        int32_t n_batch = llama_n_batch(ctx);
+        int32_t n_ubatch = llama_n_ubatch(ctx);
+
+        const int32_t n_batch_decode = batch.n_tokens;
+
+        // limit the prompt tokens of this batch, so that a long prompt does not stall the generating slots
+        int32_t n_prefill_budget = n_batch;
+        int32_t n_prefill_slot_max = n_batch;
+        if (params_base.prefill_policy != COMMON_PREFILL_POLICY_GREEDY && n_batch_decode > 0)
+        {
+            n_prefill_budget = params_base.n_prefill_budget > 0 ? params_base.n_prefill_budget : n_ubatch;
+
+            if (params_base.prefill_policy == COMMON_PREFILL_POLICY_FAIR)
+            {
+                int n_prefilling = 0;
+                for (const auto &slot : slots)
+                {
+                    if (!slot.is_non_causal() &&
+                        (slot.state == SLOT_STATE_STARTED || slot.state == SLOT_STATE_PROCESSING_PROMPT))
+                    {
+                        n_prefilling++;
+                    }
+                }
+                n_prefill_slot_max = std::max(1, n_prefill_budget / std::max(1, n_prefilling));
+            }
+        }
+        int32_t n_prefill = 0;
+
+        // next, batch any pending prompts without exceeding n_batch
+        if (params_base.cont_batching || batch.n_tokens == 0)
+        {
+            for (auto &slot : slots)
+            {
+                // the connection was closed while the prompt was being processed, don't queue its next chunk
+                if ((slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) &&
+                    is_task_cancelled(slot.id_task))
+                {
+                    SLT_INF(slot, "%s", "prompt processing cancelled\n");
+                    slot.release();
+                    continue;
+                }
+
+                // check if we can batch this slot with the previous one
+                if (slot.is_processing())
+                {
+                    if (!slot_batched)
+                    {
+                        slot_batched = &slot;
+                    }
+                    else if (!slot_batched->can_batch_with(slot))
+                    {
+                        continue;
+                    }
+                }
+
+                // wait for another task of the request to decode the shared prefix
+                if (slot.state == SLOT_STATE_STARTED && is_prefix_pending(slot))
+                {
+                    continue;
+                }
+
+                // this slot still has a prompt to be processed
+                if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED)
+                {
+                    auto &prompt_tokens = slot.prompt_tokens;
+
+                    // TODO: maybe move branch to outside of this loop in the future
+                    if (slot.state == SLOT_STATE_STARTED)
+                    {
+                        slot.t_start_process_prompt = ggml_time_us();
+                        slot.t_start_generation = 0;
+
+                        slot.n_past = 0;
+                        slot.n_prompt_tokens = prompt_tokens.size();
+                        slot.state = SLOT_STATE_PROCESSING_PROMPT;
+
+                        SLT_INF(slot, "new prompt, n_ctx_slot = %d, n_keep = %d, n_prompt_tokens = %d\n", slot.n_ctx,
+                                slot.params.n_keep, slot.n_prompt_tokens);
+
+                        // print prompt tokens (for debugging)
+                        if (1)
+                        {
+                            // first 16 tokens (avoid flooding logs)
+                            for (int i = 0; i < std::min<int>(16, prompt_tokens.size()); i++)
+                            {
+                                SLT_DBG(slot, "prompt token %3d: %6d '%s'\n", i, prompt_tokens[i],
+                                        common_token_to_piece(ctx, prompt_tokens[i]).c_str());
+                            }
+                        }
+                        else
+                        {
+                            // all
+                            for (int i = 0; i < (int)prompt_tokens.size(); i++)
+                            {
+                                SLT_DBG(slot, "prompt token %3d: %6d '%s'\n", i, prompt_tokens[i],
+                                        common_token_to_piece(ctx, prompt_tokens[i]).c_str());
+                            }
+                        }
+
+                        // empty prompt passed -> release the slot and send empty response
+                        if (prompt_tokens.empty())
+                        {
+                            SLT_WRN(slot, "%s", "empty prompt - releasing slot\n");
+
+                            slot.release();
+                            slot.print_timings();
+                            send_final_response(slot);
+                            continue;
+                        }
+
+                        if (slot.is_non_causal())
+                        {
+                            if (slot.n_prompt_tokens > n_ubatch)
+                            {
+                                slot.release();
+                                send_error(slot, "input is too large to process. increase the physical batch size",
+                                           ERROR_TYPE_SERVER);
+                                continue;
+                            }
+
+                            if (slot.n_prompt_tokens > slot.n_ctx)
+                            {
+                                slot.release();
+                                send_error(slot, "input is larger than the max context size. skipping",
+                                           ERROR_TYPE_SERVER);
+                                continue;
+                            }
+                        }
+                        else
+                        {
+                            if (!params_base.ctx_shift)
+                            {
+                                // if context shift is disabled, we make sure prompt size is smaller than KV size
+                                // TODO: there should be a separate parameter that control prompt truncation
+                                //       context shift should be applied only during the generation phase
+                                if (slot.n_prompt_tokens >= slot.n_ctx)
+                                {
+                                    slot.release();
+                                    send_error(slot,
+                                               "the request exceeds the available context size. try increasing the "
+                                               "context size or enable context shift",
+                                               ERROR_TYPE_INVALID_REQUEST);
+                                    continue;
+                                }
+                            }
+                            if (slot.params.n_keep < 0)
+                            {
+                                slot.params.n_keep = slot.n_prompt_tokens;
+                            }
+                            slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
+
+                            // if input prompt is too big, truncate it
+                            if (slot.n_prompt_tokens >= slot.n_ctx)
+                            {
+                                const int n_left = slot.n_ctx - slot.params.n_keep;
+
+                                const int n_block_size = n_left / 2;
+                                const int erased_blocks =
+                                    (slot.n_prompt_tokens - slot.params.n_keep - n_block_size) / n_block_size;
+
+                                llama_tokens new_tokens(prompt_tokens.begin(),
+                                                        prompt_tokens.begin() + slot.params.n_keep);
+
+                                new_tokens.insert(
+                                    new_tokens.end(),
+                                    prompt_tokens.begin() + slot.params.n_keep + erased_blocks * n_block_size,
+                                    prompt_tokens.end());
+
+                                prompt_tokens = std::move(new_tokens);
+
+                                slot.truncated = true;
+                                slot.n_prompt_tokens = prompt_tokens.size();
+
+                                SLT_WRN(slot,
+                                        "input truncated, n_ctx = %d, n_keep = %d, n_left = %d, n_prompt_tokens = %d\n",
+                                        slot.n_ctx, slot.params.n_keep, n_left, slot.n_prompt_tokens);
+
+                                GGML_ASSERT(slot.n_prompt_tokens < slot.n_ctx);
+                            }
+
+                            if (slot.params.cache_prompt)
+                            {
+                                // reuse any previously computed tokens that are common with the new prompt
+                                slot.n_past = common_lcp(slot.cache_tokens, prompt_tokens);
+
+                                // or a longer prefix computed by another slot
+                                const int32_t n_past_own = slot.n_past;
+                                fork_prompt_prefix(slot, prompt_tokens);
+                                if (slot.id_prefix_task >= 0)
+                                {
+                                    metrics.n_prefix_batch_tokens_total += std::max(slot.n_past - n_past_own, 0);
+                                    slot.id_prefix_task = -1;
+                                }
+
+                                // or the previous turn of the session
+                                restore_session(slot, prompt_tokens);
+
+                                // or one saved on disk, only loaded when it covers more than the session
+                                restore_prompt_prefix(slot, prompt_tokens);
+
+                                // reuse chunks from the cached prompt by shifting their KV cache in the new position
+                                if (params_base.n_cache_reuse > 0)
+                                {
+                                    on_slot_kv_changed(slot, slot.n_past);
+
+                                    size_t head_c = slot.n_past; // cache
+                                    size_t head_p = slot.n_past; // current prompt
+
+                                    SLT_DBG(slot, "trying to reuse chunks with size > %d, slot.n_past = %d\n",
+                                            params_base.n_cache_reuse, slot.n_past);
+
+                                    while (head_c < slot.cache_tokens.size() && head_p < prompt_tokens.size())
+                                    {
+                                        size_t n_match = 0;
+                                        while (head_c + n_match < slot.cache_tokens.size() &&
+                                               head_p + n_match < prompt_tokens.size() &&
+                                               slot.cache_tokens[head_c + n_match] == prompt_tokens[head_p + n_match])
+                                        {
+                                            n_match++;
+                                        }
+
+                                        if (n_match >= (size_t)params_base.n_cache_reuse &&
+                                            head_c >= (size_t)slot.n_kv_shared)
+                                        {
+                                            SLT_INF(slot,
+                                                    "reusing chunk with size %zu, shifting KV cache [%zu, %zu) -> "
+                                                    "[%zu, %zu)\n",
+                                                    n_match, head_c, head_c + n_match, head_p, head_p + n_match);
+                                            // for (size_t i = head_p; i < head_p + n_match; i++) {
+                                            //     SLT_DBG(slot, "cache token %3zu: %6d '%s'\n", i, prompt_tokens[i], common_token_to_piece(ctx, prompt_tokens[i]).c_str());
+                                            // }
+
+                                            const int64_t kv_shift = (int64_t)head_p - (int64_t)head_c;
+
+                                            llama_kv_cache_seq_rm(ctx, slot.id, head_p, head_c);
+                                            llama_kv_cache_seq_add(ctx, slot.id, head_c, -1, kv_shift);
+
+                                            for (size_t i = 0; i < n_match; i++)
+                                            {
+                                                slot.cache_tokens[head_p + i] = slot.cache_tokens[head_c + i];
+                                                slot.n_past++;
+                                            }
+
+                                            head_c += n_match;
+                                            head_p += n_match;
+                                        }
+                                        else
+                                        {
+                                            head_c += 1;
+                                        }
+                                    }
+
+                                    SLT_DBG(slot, "after context reuse, new slot.n_past = %d\n", slot.n_past);
+                                }
+                            }
+                        }
+
+                        if (slot.n_past == slot.n_prompt_tokens && slot.n_past > 0)
+                        {
+                            // we have to evaluate at least 1 token to generate logits.
+                            SLT_WRN(slot,
+                                    "need to evaluate at least 1 token to generate logits, n_past = %d, "
+                                    "n_prompt_tokens = %d\n",
+                                    slot.n_past, slot.n_prompt_tokens);
+
+                            slot.n_past--;
+                        }
+
+                        slot.n_prompt_tokens_processed = 0;
+                    }
+
+                    // non-causal tasks require to fit the entire prompt in the physical batch
+                    if (slot.is_non_causal())
+                    {
+                        // cannot fit the prompt in the current batch - will try next iter
+                        if (batch.n_tokens + slot.n_prompt_tokens > n_batch)
+                        {
+                            continue;
+                        }
+                    }
+
+                    // keep only the common part
+                    if (!llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1))
+                    {
+                        // could not partially delete (likely using a non-Transformer model)
+                        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+
+                        // there is no common part left
+                        slot.n_past = 0;
+                    }
+                    on_slot_kv_changed(slot, slot.n_past);
+
+                    SLT_INF(slot, "kv cache rm [%d, end)\n", slot.n_past);
+
+                    // remove the non-common part from the cache
+                    slot.cache_tokens.resize(slot.n_past);
+
+                    if (slot.n_prompt_tokens_processed == 0)
+                    {
+                        save_prompt_prefix(slot);
+                    }
+
+                    // add prompt tokens for processing in the current batch
+                    // non-causal prompts must be processed at once, so they are not subject to the prefill budget
+                    int32_t n_prefill_slot = 0;
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch &&
+                           (slot.is_non_causal() ||
+                            (n_prefill < n_prefill_budget && n_prefill_slot < n_prefill_slot_max)))
+                    {
+                        // without pooling, we want to output the embeddings for all the tokens in the batch
+                        const bool need_embd = slot.task_type == SERVER_TASK_TYPE_EMBEDDING &&
+                                               llama_pooling_type(slot.ctx) == LLAMA_POOLING_TYPE_NONE;
+
+                        common_batch_add(batch, prompt_tokens[slot.n_past], slot.n_past, {slot.id}, need_embd);
+
+                        if (slot.params.cache_prompt)
+                        {
+                            slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
                         }
-                        else
+
+                        slot.n_prompt_tokens_processed++;
+                        slot.n_past++;
+                        n_prefill++;
+                        n_prefill_slot++;
+
+                        // end the batch at the prefix shared with the other prompts of the request, so that they can
+                        // fork it as soon as it is decoded
+                        if (slot.n_past == slot.n_prefix_publish)
                         {
-                            // all
-                            for (int i = 0; i < (int)prompt_tokens.size(); i++)
-                            {
-                                SLT_DBG(slot, "prompt token %3d: %6d '%s'\n", i, prompt_tokens[i],
-                                        common_token_to_piece(ctx, prompt_tokens[i]).c_str());
-                            }
+                            break;
+                        }
+                    }
+
+                    SLT_INF(slot, "prompt processing progress, n_past = %d, n_tokens = %d, progress = %f\n",
+                            slot.n_past, batch.n_tokens, (float)slot.n_prompt_tokens_processed / slot.n_prompt_tokens);
+
+                    // entire prompt has been processed
+                    if (slot.n_past == slot.n_prompt_tokens)
+                    {
+                        slot.state = SLOT_STATE_DONE_PROMPT;
+
+                        GGML_ASSERT(batch.n_tokens > 0);
+
+                        common_sampler_reset(slot.smpl);
+
+                        // Process all prompt tokens through sampler system
+                        for (int i = 0; i < slot.n_prompt_tokens; ++i)
+                        {
+                            common_sampler_accept(slot.smpl, prompt_tokens[i], false);
                         }
 
-                        // empty prompt passed -> release the slot and send empty response
-                        if (prompt_tokens.empty())
-                        {
-                            SLT_WRN(slot, "%s", "empty prompt - releasing slot\n");
+                        // extract the logits only for the last token
+                        batch.logits[batch.n_tokens - 1] = true;
+
+                        slot.n_decoded = 0;
+                        slot.i_batch = batch.n_tokens - 1;
+
+                        SLT_INF(slot, "prompt done, n_past = %d, n_tokens = %d\n", slot.n_past, batch.n_tokens);
+                    }
+                }
+
+                if (batch.n_tokens >= n_batch || n_prefill >= n_prefill_budget)
+                {
+                    break;
+                }
+            }
+        }
+
+        if (batch.n_tokens == 0)
+        {
+            SRV_WRN("%s", "no tokens to decode\n");
+            return;
+        }
+
+        metrics.on_batch(n_batch_decode, batch.n_tokens - n_batch_decode);
+        tracer.add("batch", -1, t_batch_start, ggml_time_us());
+
+        SRV_DBG("decoding batch, n_tokens = %d\n", batch.n_tokens);
+
+        if (slot_batched)
+        {
+            // make sure we're in the right embedding mode
+            llama_set_embeddings(ctx, slot_batched->is_non_causal());
+            // apply lora, only need to do it once per batch
+            common_set_adapter_lora(ctx, slot_batched->lora);
+        }
+
+        // process the created batch of tokens
+        for (int32_t i = 0; i < batch.n_tokens; i += n_batch)
+        {
+            const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
+
+            llama_batch batch_view = {
+                n_tokens,
+                batch.token + i,
+                nullptr,
+                batch.pos + i,
+                batch.n_seq_id + i,
+                batch.seq_id + i,
+                batch.logits + i,
+            };
+
+            {
+                std::unique_lock<std::mutex> lock(mutex_cancelled);
+                id_tasks_decoding.clear();
+                for (int32_t j = 0; j < n_tokens; ++j)
+                {
+                    const int id_task = slots[batch_view.seq_id[j][0]].id_task;
+                    if (std::find(id_tasks_decoding.begin(), id_tasks_decoding.end(), id_task) ==
+                        id_tasks_decoding.end())
+                    {
+                        id_tasks_decoding.push_back(id_task);
+                    }
+                }
+                update_decoding_cancelled();
+            }
+
+            const int64_t t_decode_start = ggml_time_us();
+            const int ret = llama_decode(ctx, batch_view);
+            tracer.add("llama_decode", -1, t_decode_start, ggml_time_us());
+            metrics.on_decoded(slots);
+
+            {
+                std::unique_lock<std::mutex> lock(mutex_cancelled);
+                id_tasks_decoding.clear();
+                decoding_cancelled = false;
+            }
+
+            if (ret == 2)
+            {
+                SRV_WRN("batch aborted, all of its tasks were cancelled, i = %d, n_tokens = %d\n", i, n_tokens);
+                metrics.n_batches_aborted_total++;
+                release_aborted_batch(batch_view);
+                continue; // continue loop of n_batch
+            }
+
+            if (ret != 0)
+            {
+                if (n_batch == 1 || ret < 0)
+                {
+                    // if you get here, it means the KV cache is full - try increasing it via the context size
+                    SRV_ERR(
+                        "failed to decode the batch: KV cache is full - try increasing it via the context size, i = "
+                        "%d, n_batch = %d, ret = %d\n",
+                        i, n_batch, ret);
+                    for (auto &slot : slots)
+                    {
+                        slot.release();
+                        send_error(slot, "Input prompt is too big compared to KV size. Please try increasing KV size.");
+                    }
+                    break; // break loop of n_batch
+                }
+
+                // retry with half the batch size to try to find a free slot in the KV cache
+                n_batch /= 2;
+                i -= n_batch;
+
+                SRV_WRN(
+                    "failed to find free space in the KV cache, retrying with smaller batch size - try increasing it "
+                    "via the context size or enable defragmentation, i = %d, n_batch = %d, ret = %d\n",
+                    i, n_batch, ret);
+
+                continue; // continue loop of n_batch
+            }
+
+            for (auto &slot : slots)
+            {
+                if (slot.i_batch < (int)i || slot.i_batch >= (int)(i + n_tokens))
+                {
+                    continue; // continue loop of slots
+                }
+
+                if (slot.state == SLOT_STATE_DONE_PROMPT)
+                {
+                    if (slot.task_type == SERVER_TASK_TYPE_EMBEDDING)
+                    {
+                        // prompt evaluated for embedding
+                        send_embedding(slot, batch_view);
+                        slot.release();
+                        slot.i_batch = -1;
+                        continue; // continue loop of slots
+                    }
+
+                    if (slot.task_type == SERVER_TASK_TYPE_RERANK)
+                    {
+                        send_rerank(slot, batch_view);
+                        slot.release();
+                        slot.i_batch = -1;
+                        continue; // continue loop of slots
+                    }
+
+                    // prompt evaluated for next-token prediction
+                    slot.state = SLOT_STATE_GENERATING;
+
+                    // the KV cache of the prompt is now complete and can be shared with other slots
+                    if (slot.params.cache_prompt)
+                    {
+                        prefix_tree.insert(slot.id, slot.cache_tokens, slot.cache_tokens.size());
+                    }
+                }
+                else if (slot.state != SLOT_STATE_GENERATING)
+                {
+                    continue; // continue loop of slots
+                }
+
+                const int tok_idx = slot.i_batch - i;
+
+                const int64_t t_sample_start = ggml_time_us();
+                llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
+
+                slot.i_batch = -1;
+
+                common_sampler_accept(slot.smpl, id, true);
+                tracer.add("sample", slot.id_task, t_sample_start, ggml_time_us());
+
+                slot.n_decoded += 1;
+
+                const int64_t t_current = ggml_time_us();
+
+                if (slot.n_decoded == 1)
+                {
+                    slot.t_start_generation = t_current;
+                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
+                    metrics.on_prompt_eval(slot);
+                    metrics.on_first_token(slot);
+                }
+                else
+                {
+                    metrics.on_token_gap(t_current - slot.t_last_token);
+                }
+                slot.t_last_token = t_current;
+
+                slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
+
+                completion_token_output result;
+                result.tok = id;
+                result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+                result.prob = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
+
+                if (slot.params.sampling.n_probs > 0)
+                {
+                    populate_token_probs(slot, result, slot.params.post_sampling_probs, params_base.special, tok_idx);
+                }
+
+                if (!process_token(result, slot))
+                {
+                    // release slot because of stop condition
+                    slot.release();
+                    slot.print_timings();
+                    send_final_response(slot);
+                    metrics.on_prediction(slot);
+                    update_service_time(slot);
+                    continue;
+                }
+            }
+
+            // do speculative decoding
+            for (auto &slot : slots)
+            {
+                if (!slot.is_processing() || !slot.can_speculate())
+                {
+                    continue;
+                }
+
+                if (slot.state != SLOT_STATE_GENERATING)
+                {
+                    continue;
+                }
+
+                // determine the max draft that fits the current slot state
+                int n_draft_max = slot.params.speculative.n_max;
+
+                // note: n_past is not yet increased for the `id` token sampled above
+                //       also, need to leave space for 1 extra token to allow context shifts
+                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+
+                if (slot.n_remaining > 0)
+                {
+                    n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
+                }
+
+                SLT_DBG(slot, "max possible draft: %d\n", n_draft_max);
+
+                if (n_draft_max < slot.params.speculative.n_min)
+                {
+                    SLT_DBG(slot, "the max possible draft is too small: %d < %d - skipping speculative decoding\n",
+                            n_draft_max, slot.params.speculative.n_min);
+
+                    continue;
+                }
 
-                            slot.release();
-                            slot.print_timings();
-                            send_final_response(slot);
-                            continue;
-                        }
+                llama_token id = slot.sampled;
 
-                        if (slot.is_non_causal())
-                        {
-                            if (slot.n_prompt_tokens > n_ubatch)
-                            {
-                                slot.release();
-                                send_error(slot, "input is too large to process. increase the physical batch size",
-                                           ERROR_TYPE_SERVER);
-                                continue;
-                            }
+                llama_tokens draft;
+                if (slot.ctx_dft)
+                {
+                    struct common_speculative_params params_spec;
+                    params_spec.n_draft = n_draft_max;
+                    params_spec.n_reuse = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
+                    params_spec.p_min = slot.params.speculative.p_min;
 
-                            if (slot.n_prompt_tokens > slot.n_ctx)
-                            {
-                                slot.release();
-                                send_error(slot, "input is larger than the max context size. skipping",
-                                           ERROR_TYPE_SERVER);
-                                continue;
-                            }
-                        }
-                        else
-                        {
-                            if (!params_base.ctx_shift)
-                            {
-                                // if context shift is disabled, we make sure prompt size is smaller than KV size
-                                // TODO: there should be a separate parameter that control prompt truncation
-                                //       context shift should be applied only during the generation phase
-                                if (slot.n_prompt_tokens >= slot.n_ctx)
-                                {
-                                    slot.release();
-                                    send_error(slot,
-                                               "the request exceeds the available context size. try increasing the "
-                                               "context size or enable context shift",
-                                               ERROR_TYPE_INVALID_REQUEST);
-                                    continue;
-                                }
-                            }
-                            if (slot.params.n_keep < 0)
-                            {
-                                slot.params.n_keep = slot.n_prompt_tokens;
-                            }
-                            slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
+                    draft = common_speculative_gen_draft(slot.spec, params_spec, slot.cache_tokens, id);
+                }
+                else
+                {
+                    draft = gen_ngram_draft(slot, id, n_draft_max);
+                }
 
-                            // if input prompt is too big, truncate it
-                            if (slot.n_prompt_tokens >= slot.n_ctx)
-                            {
-                                const int n_left = slot.n_ctx - slot.params.n_keep;
+                // ignore small drafts
+                if (draft.empty() || slot.params.speculative.n_min > (int)draft.size())
+                {
+                    SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int)draft.size(), slot.params.speculative.n_min);
 
-                                const int n_block_size = n_left / 2;
-                                const int erased_blocks =
-                                    (slot.n_prompt_tokens - slot.params.n_keep - n_block_size) / n_block_size;
+                    continue;
+                }
 
-                                llama_tokens new_tokens(prompt_tokens.begin(),
-                                                        prompt_tokens.begin() + slot.params.n_keep);
+                // construct the speculation batch
+                common_batch_clear(slot.batch_spec);
+                common_batch_add(slot.batch_spec, id, slot.n_past, {slot.id}, true);
 
-                                new_tokens.insert(
-                                    new_tokens.end(),
-                                    prompt_tokens.begin() + slot.params.n_keep + erased_blocks * n_block_size,
-                                    prompt_tokens.end());
+                for (size_t i = 0; i < draft.size(); ++i)
+                {
+                    common_batch_add(slot.batch_spec, draft[i], slot.n_past + 1 + i, {slot.id}, true);
+                }
 
-                                prompt_tokens = std::move(new_tokens);
+                SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
 
-                                slot.truncated = true;
-                                slot.n_prompt_tokens = prompt_tokens.size();
+                const int64_t t_draft_start = ggml_time_us();
+                llama_decode(ctx, slot.batch_spec);
 
-                                SLT_WRN(slot,
-                                        "input truncated, n_ctx = %d, n_keep = %d, n_left = %d, n_prompt_tokens = %d\n",
-                                        slot.n_ctx, slot.params.n_keep, n_left, slot.n_prompt_tokens);
+                // the accepted tokens from the speculation
+                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+                tracer.add("llama_decode_draft", slot.id_task, t_draft_start, ggml_time_us());
 
-                                GGML_ASSERT(slot.n_prompt_tokens < slot.n_ctx);
-                            }
+                slot.n_past += ids.size();
+                slot.n_decoded += ids.size();
 
-                            if (slot.params.cache_prompt)
-                            {
-                                // reuse any previously computed tokens that are common with the new prompt
-                                slot.n_past = common_lcp(slot.cache_tokens, prompt_tokens);
+                slot.n_draft_total += draft.size();
+                slot.n_draft_accepted += ids.size() - 1;
+                metrics.n_draft_total += draft.size();
+                metrics.n_draft_accepted_total += ids.size() - 1;
 
-                                // reuse chunks from the cached prompt by shifting their KV cache in the new position
-                                if (params_base.n_cache_reuse > 0)
-                                {
-                                    size_t head_c = slot.n_past; // cache
-                                    size_t head_p = slot.n_past; // current prompt
+                slot.cache_tokens.push_back(id);
+                slot.cache_tokens.insert(slot.cache_tokens.end(), ids.begin(), ids.end() - 1);
 
-                                    SLT_DBG(slot, "trying to reuse chunks with size > %d, slot.n_past = %d\n",
-                                            params_base.n_cache_reuse, slot.n_past);
+                llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1);
+                on_slot_kv_changed(slot, slot.n_past);
 
-                                    while (head_c < slot.cache_tokens.size() && head_p < prompt_tokens.size())
-                                    {
-                                        size_t n_match = 0;
-                                        while (head_c + n_match < slot.cache_tokens.size() &&
-                                               head_p + n_match < prompt_tokens.size() &&
-                                               slot.cache_tokens[head_c + n_match] == prompt_tokens[head_p + n_match])
-                                        {
-                                            n_match++;
-                                        }
+                for (size_t i = 0; i < ids.size(); ++i)
+                {
+                    completion_token_output result;
 
-                                        if (n_match >= (size_t)params_base.n_cache_reuse)
-                                        {
-                                            SLT_INF(slot,
-                                                    "reusing chunk with size %zu, shifting KV cache [%zu, %zu) -> "
-                                                    "[%zu, %zu)\n",
-                                                    n_match, head_c, head_c + n_match, head_p, head_p + n_match);
-                                            // for (size_t i = head_p; i < head_p + n_match; i++) {
-                                            //     SLT_DBG(slot, "cache token %3zu: %6d '%s'\n", i, prompt_tokens[i], common_token_to_piece(ctx, prompt_tokens[i]).c_str());
-                                            // }
+                    result.tok = ids[i];
+                    result.text_to_send =
+                        common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+                    result.prob = 1.0f; // set later
 
-                                            const int64_t kv_shift = (int64_t)head_p - (int64_t)head_c;
+                    // TODO: set result.probs
 
-                                            llama_kv_cache_seq_rm(ctx, slot.id, head_p, head_c);
-                                            llama_kv_cache_seq_add(ctx, slot.id, head_c, -1, kv_shift);
+                    if (!process_token(result, slot))
+                    {
+                        // release slot because of stop condition
+                        slot.release();
+                        slot.print_timings();
+                        send_final_response(slot);
+                        metrics.on_prediction(slot);
+                        update_service_time(slot);
+                        break;
+                    }
+                }
 
-                                            for (size_t i = 0; i < n_match; i++)
-                                            {
-                                                slot.cache_tokens[head_p + i] = slot.cache_tokens[head_c + i];
-                                                slot.n_past++;
-                                            }
+                SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int)ids.size() - 1,
+                        (int)draft.size(), slot.n_past);
+            }
+        }
 
-                                            head_c += n_match;
-                                            head_p += n_match;
-                                        }
-                                        else
-                                        {
-                                            head_c += 1;
-                                        }
-                                    }
+        SRV_DBG("%s", "run slots completed\n");
+    }
 
-                                    SLT_DBG(slot, "after context reuse, new slot.n_past = %d\n", slot.n_past);
-                                }
-                            }
+    json model_meta() const
+    {
+        return json{
+            {"vocab_type", llama_vocab_type(vocab)},
+            {"n_vocab", llama_vocab_n_tokens(vocab)},
+            {"n_ctx_train", llama_model_n_ctx_train(model)},
+            {"n_embd", llama_model_n_embd(model)},
+            {"n_params", llama_model_n_params(model)},
+            {"size", llama_model_size(model)},
+        };
+    }
+};
+
+// fixed pool of workers that POST the results of /answer/callback requests back
+// the results are collected as the main loop sends them, so a request only takes a worker once they are all in, and
+// failed deliveries are retried from a timer instead of sleeping in the worker
+// keep-alive connections are pooled per callback host so bursts do not pay for a new handshake each
+struct server_callback_dispatcher
+{
+    using job_t = std::function<void()>;
+
+    int n_queue_max = 0;
+    int n_retries = 0;
+
+    std::atomic<bool> running{false};
+
+    // metrics
+    std::atomic<uint64_t> n_waiting{0};
+    std::atomic<uint64_t> n_queued{0};
+    std::atomic<uint64_t> n_delivered_total{0};
+    std::atomic<uint64_t> n_failed_total{0};
+    std::atomic<uint64_t> n_retries_total{0};
+    std::atomic<uint64_t> n_rejected_total{0};
+    server_histogram h_delivery; // deliver() of the delivered results, retries included
+
+    void start(int n_workers, int n_queue_max, int n_retries)
+    {
+        this->n_queue_max = n_queue_max;
+        this->n_retries = n_retries;
+        this->n_idle_clients_max = n_workers;
+
+        running = true;
+        workers.reserve(n_workers);
+        for (int i = 0; i < n_workers; i++)
+        {
+            workers.emplace_back([this]()
+                                 { worker_loop(); });
+        }
+        timer = std::thread([this]()
+                            { timer_loop(); });
+
+        SRV_INF("callback dispatcher started, workers = %d, queue size = %d, retries = %d\n", n_workers, n_queue_max,
+                n_retries);
+    }
+
+    // admission of a callback request, returns false if too many requests are already waiting for their results
+    bool reserve()
+    {
+        // reserve first, so that concurrent requests cannot all pass the check
+        if (n_waiting.fetch_add(1) >= (uint64_t)n_queue_max || !running)
+        {
+            n_waiting--;
+            n_rejected_total++;
+            return false;
+        }
+        return true;
+    }
+
+    // collect the results of the tasks of a reserved request as they are sent, and queue their delivery once all of
+    // them are in, or at the first error
+    // the hook runs in the thread that sends the results, so it only stores them
+    // model keeps the model of the request loaded until the results are delivered
+    void watch(server_context &ctx, const std::vector<server_task> &tasks, const std::string &callback_url,
+               const std::string &auth_header, std::shared_ptr<void> model)
+    {
+        auto request = std::make_shared<callback_request>(*this, tasks.size());
+        request->model = std::move(model);
+        const auto id_tasks = server_task::get_list_id(tasks);
+        const server_task_priority priority = tasks[0].priority;
+
+        ctx.queue_results.add_waiting_tasks(
+            tasks,
+            [this, request, ctx = &ctx, id_tasks, callback_url, auth_header, priority](server_task_result_ptr &&result)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(request->mutex);
+                    if (request->done)
+                    {
+                        return;
+                    }
+
+                    if (result->is_error())
+                    {
+                        request->error = std::move(result);
+                    }
+                    else
+                    {
+                        if (dynamic_cast<server_task_result_cmpl_partial *>(result.get()) != nullptr)
+                        {
+                            return; // the callback only gets the final results
                         }
+                        GGML_ASSERT(dynamic_cast<server_task_result_cmpl_final *>(result.get()) != nullptr ||
+                                    dynamic_cast<server_task_result_embd *>(result.get()) != nullptr ||
+                                    dynamic_cast<server_task_result_rerank *>(result.get()) != nullptr);
+                        const size_t idx = result->get_index();
+                        GGML_ASSERT(idx < request->results.size() && "index out of range");
+                        request->results[idx] = std::move(result);
+                        if (++request->n_received < request->results.size())
+                        {
+                            return;
+                        }
+                    }
+                    request->done = true;
+                    n_waiting--;
+                }
 
-                        if (slot.n_past == slot.n_prompt_tokens && slot.n_past > 0)
+                // released by the job, never by the main loop of the model itself
+                std::shared_ptr<void> model = std::move(request->model);
+
+                if (request->error)
+                {
+                    ctx->cancel_tasks(id_tasks);
+                }
+                else
+                {
+                    ctx->queue_results.remove_waiting_task_ids(id_tasks);
+                }
+
+                submit(
+                    [this, request, model, callback_url, auth_header, priority]()
+                    {
+                        json data;
+                        if (request->error)
                         {
-                            // we have to evaluate at least 1 token to generate logits.
-                            SLT_WRN(slot,
-                                    "need to evaluate at least 1 token to generate logits, n_past = %d, "
-                                    "n_prompt_tokens = %d\n",
-                                    slot.n_past, slot.n_prompt_tokens);
+                            data = request->error->to_json();
+                        }
+                        else if (request->results.size() == 1)
+                        {
+                            // single result
+                            data = request->results[0]->to_json();
+                        }
+                        else
+                        {
+                            // multiple results (multitask)
+                            data = json::array();
+                            for (auto &res : request->results)
+                            {
+                                data.push_back(res->to_json());
+                            }
+                        }
+                        deliver(data, callback_url, auth_header, priority);
+                    },
+                    priority);
+            });
+    }
+
+    // queue a job for the workers, the jobs of a higher priority first
+    // returns false once the dispatcher is stopped, the job is not executed in that case
+    bool submit(job_t &&job, server_task_priority priority = SERVER_TASK_PRIORITY_NORMAL)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_jobs);
+            if (!running)
+            {
+                return false;
+            }
+            jobs[priority].emplace_back(std::move(job));
+            n_queued++;
+        }
+        condition_jobs.notify_one();
+        return true;
+    }
+
+    void stop()
+    {
+        // destroyed outside of the lock, a job may hold the last reference to a model
+        std::deque<job_t> dropped[SERVER_TASK_PRIORITY_COUNT];
+        {
+            std::unique_lock<std::mutex> lock(mutex_jobs);
+            if (!running)
+            {
+                return;
+            }
+            running = false;
+            for (int i = 0; i < SERVER_TASK_PRIORITY_COUNT; i++)
+            {
+                dropped[i].swap(jobs[i]);
+            }
+            retries.clear();
+            n_queued = 0;
+        }
+        condition_jobs.notify_all();
+        condition_retries.notify_all();
 
-                            slot.n_past--;
-                        }
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+        workers.clear();
+        timer.join();
+    }
 
-                        slot.n_prompt_tokens_processed = 0;
-                    }
+    // POST the data to the callback URL, transport errors and 5xx are retried later with exponential backoff
+    void deliver(const json &data, const std::string &callback_url, const std::string &auth_header,
+                 server_task_priority priority = SERVER_TASK_PRIORITY_NORMAL)
+    {
+        auto d = std::make_shared<delivery>();
+        d->t_start = ggml_time_us();
+        d->priority = priority;
+        d->callback_url = callback_url;
 
-                    // non-causal tasks require to fit the entire prompt in the physical batch
-                    if (slot.is_non_causal())
-                    {
-                        // cannot fit the prompt in the current batch - will try next iter
-                        if (batch.n_tokens + slot.n_prompt_tokens > n_batch)
-                        {
-                            continue;
-                        }
-                    }
+        size_t pos = callback_url.find('/', callback_url.find("://") + 3);
+        d->base_url = (pos != std::string::npos) ? callback_url.substr(0, pos) : callback_url;
+        d->endpoint = (pos != std::string::npos) ? callback_url.substr(pos) : "/";
 
-                    // keep only the common part
-                    if (!llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1))
-                    {
-                        // could not partially delete (likely using a non-Transformer model)
-                        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+        if (auth_header != "")
+        {
+            d->headers.emplace("Authorization", auth_header);
+        }
+        d->body = safe_json_to_str(data);
 
-                        // there is no common part left
-                        slot.n_past = 0;
-                    }
+        attempt(d);
+    }
 
-                    SLT_INF(slot, "kv cache rm [%d, end)\n", slot.n_past);
+private:
+    // the results of a callback request, filled by the hook of its tasks
+    struct callback_request
+    {
+        server_callback_dispatcher &dispatcher;
 
-                    // remove the non-common part from the cache
-                    slot.cache_tokens.resize(slot.n_past);
+        std::mutex mutex;
+        std::shared_ptr<void> model;
+        std::vector<server_task_result_ptr> results;
+        server_task_result_ptr error;
+        size_t n_received = 0;
+        bool done = false;
 
-                    // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch)
-                    {
-                        // without pooling, we want to output the embeddings for all the tokens in the batch
-                        const bool need_embd = slot.task_type == SERVER_TASK_TYPE_EMBEDDING &&
-                                               llama_pooling_type(slot.ctx) == LLAMA_POOLING_TYPE_NONE;
+        callback_request(server_callback_dispatcher &dispatcher, size_t n_tasks) : dispatcher(dispatcher), results(n_tasks)
+        {
+        }
 
-                        common_batch_add(batch, prompt_tokens[slot.n_past], slot.n_past, {slot.id}, need_embd);
+        ~callback_request()
+        {
+            if (!done)
+            {
+                // dropped with its tasks before all the results came (e.g. its model was unloaded)
+                dispatcher.n_waiting--;
+            }
+        }
+    };
 
-                        if (slot.params.cache_prompt)
-                        {
-                            slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
-                        }
+    // a POST of a result, with the state of its retries
+    struct delivery
+    {
+        std::string callback_url;
+        std::string base_url;
+        std::string endpoint;
+        httplib::Headers headers;
+        std::string body;
 
-                        slot.n_prompt_tokens_processed++;
-                        slot.n_past++;
-                    }
+        server_task_priority priority = SERVER_TASK_PRIORITY_NORMAL;
+        int n_attempts = 0;
+        int64_t t_start = 0;
+    };
 
-                    SLT_INF(slot, "prompt processing progress, n_past = %d, n_tokens = %d, progress = %f\n",
-                            slot.n_past, batch.n_tokens, (float)slot.n_prompt_tokens_processed / slot.n_prompt_tokens);
+    std::vector<std::thread> workers;
+    std::thread timer;
 
-                    // entire prompt has been processed
-                    if (slot.n_past == slot.n_prompt_tokens)
-                    {
-                        slot.state = SLOT_STATE_DONE_PROMPT;
+    std::deque<job_t> jobs[SERVER_TASK_PRIORITY_COUNT];
+    std::mutex mutex_jobs;
+    std::condition_variable condition_jobs;
 
-                        GGML_ASSERT(batch.n_tokens > 0);
+    // failed deliveries by the time of their next attempt, under mutex_jobs
+    std::multimap<int64_t, std::shared_ptr<delivery>> retries;
+    std::condition_variable condition_retries;
 
-                        common_sampler_reset(slot.smpl);
+    // idle keep-alive clients, per base URL
+    int n_idle_clients_max = 0;
+    std::unordered_map<std::string, std::vector<std::unique_ptr<httplib::Client>>> idle_clients;
+    std::mutex mutex_clients;
 
-                        // Process all prompt tokens through sampler system
-                        for (int i = 0; i < slot.n_prompt_tokens; ++i)
+    void worker_loop()
+    {
+        while (true)
+        {
+            job_t job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_jobs);
+                const auto next = [&]()
+                {
+                    for (int i = SERVER_TASK_PRIORITY_COUNT - 1; i >= 0; i--)
+                    {
+                        if (!jobs[i].empty())
                         {
-                            common_sampler_accept(slot.smpl, prompt_tokens[i], false);
+                            return &jobs[i];
                         }
-
-                        // extract the logits only for the last token
-                        batch.logits[batch.n_tokens - 1] = true;
-
-                        slot.n_decoded = 0;
-                        slot.i_batch = batch.n_tokens - 1;
-
-                        SLT_INF(slot, "prompt done, n_past = %d, n_tokens = %d\n", slot.n_past, batch.n_tokens);
                     }
-                }
-
-                if (batch.n_tokens >= n_batch)
+                    return (std::deque<job_t> *)nullptr;
+                };
+                condition_jobs.wait(lock, [&]
+                                    { return !running || next() != nullptr; });
+                if (!running)
                 {
-                    break;
+                    return;
                 }
+                auto *queue = next();
+                job = std::move(queue->front());
+                queue->pop_front();
+                n_queued--;
+            }
+
+            try
+            {
+                job();
+            }
+            catch (const std::exception &e)
+            {
+                SRV_ERR("callback job failed: %s\n", e.what());
+                n_failed_total++;
             }
         }
+    }
 
-        if (batch.n_tokens == 0)
+    // moves the deliveries whose backoff has expired back to the jobs of the workers
+    void timer_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_jobs);
+        while (running)
         {
-            SRV_WRN("%s", "no tokens to decode\n");
-            return;
-        }
+            if (retries.empty())
+            {
+                condition_retries.wait(lock);
+                continue;
+            }
 
-        SRV_DBG("decoding batch, n_tokens = %d\n", batch.n_tokens);
+            const int64_t t_now = ggml_time_us();
+            auto it = retries.begin();
+            if (it->first > t_now)
+            {
+                condition_retries.wait_for(lock, std::chrono::microseconds(it->first - t_now));
+                continue;
+            }
 
-        if (slot_batched)
-        {
-            // make sure we're in the right embedding mode
-            llama_set_embeddings(ctx, slot_batched->is_non_causal());
-            // apply lora, only need to do it once per batch
-            common_set_adapter_lora(ctx, slot_batched->lora);
+            std::shared_ptr<delivery> d = std::move(it->second);
+            retries.erase(it);
+            jobs[d->priority].emplace_back([this, d]()
+                                           { attempt(d); });
+            n_queued++;
+            condition_jobs.notify_one();
         }
+    }
 
-        // process the created batch of tokens
-        for (int32_t i = 0; i < batch.n_tokens; i += n_batch)
+    // a single POST of the delivery, on failure it is scheduled again so that the worker is free in the meantime
+    void attempt(const std::shared_ptr<delivery> &d)
+    {
+        if (d->n_attempts > 0)
         {
-            const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
+            n_retries_total++;
+        }
+        d->n_attempts++;
 
-            llama_batch batch_view = {
-                n_tokens,
-                batch.token + i,
-                nullptr,
-                batch.pos + i,
-                batch.n_seq_id + i,
-                batch.seq_id + i,
-                batch.logits + i,
-            };
+        std::unique_ptr<httplib::Client> client = acquire_client(d->base_url);
+        auto res = client->Post(d->endpoint, d->headers, d->body, MIMETYPE_JSON);
+        if (!res)
+        {
+            // the connection is in an unknown state, do not return it to the pool
+            SRV_WRN("callback to '%s' failed (attempt %d): %s\n", d->callback_url.c_str(), d->n_attempts,
+                    httplib::to_string(res.error()).c_str());
+            retry_later(d);
+            return;
+        }
 
-            const int ret = llama_decode(ctx, batch_view);
-            metrics.on_decoded(slots);
+        release_client(d->base_url, std::move(client));
 
-            if (ret != 0)
-            {
-                if (n_batch == 1 || ret < 0)
-                {
-                    // if you get here, it means the KV cache is full - try increasing it via the context size
-                    SRV_ERR(
-                        "failed to decode the batch: KV cache is full - try increasing it via the context size, i = "
-                        "%d, n_batch = %d, ret = %d\n",
-                        i, n_batch, ret);
-                    for (auto &slot : slots)
-                    {
-                        slot.release();
-                        send_error(slot, "Input prompt is too big compared to KV size. Please try increasing KV size.");
-                    }
-                    break; // break loop of n_batch
-                }
+        if (res->status >= 500)
+        {
+            SRV_WRN("callback to '%s' failed (attempt %d): HTTP %d\n", d->callback_url.c_str(), d->n_attempts,
+                    res->status);
+            retry_later(d);
+            return;
+        }
 
-                // retry with half the batch size to try to find a free slot in the KV cache
-                n_batch /= 2;
-                i -= n_batch;
+        SRV_DBG("sent callback to '%s', status = %d\n", d->callback_url.c_str(), res->status);
+        n_delivered_total++;
+        h_delivery.record(ggml_time_us() - d->t_start);
+    }
 
-                SRV_WRN(
-                    "failed to find free space in the KV cache, retrying with smaller batch size - try increasing it "
-                    "via the context size or enable defragmentation, i = %d, n_batch = %d, ret = %d\n",
-                    i, n_batch, ret);
+    void retry_later(const std::shared_ptr<delivery> &d)
+    {
+        if (d->n_attempts > n_retries)
+        {
+            SRV_ERR("giving up on callback to '%s' after %d attempts\n", d->callback_url.c_str(), d->n_attempts);
+            n_failed_total++;
+            return;
+        }
 
-                continue; // continue loop of n_batch
+        const int64_t t_retry = ggml_time_us() + 1000 * (250 << std::min(d->n_attempts - 1, 6));
+        {
+            std::unique_lock<std::mutex> lock(mutex_jobs);
+            if (!running)
+            {
+                return;
             }
+            retries.emplace(t_retry, d);
+        }
+        condition_retries.notify_one();
+    }
 
-            for (auto &slot : slots)
+    std::unique_ptr<httplib::Client> acquire_client(const std::string &base_url)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_clients);
+            auto &idle = idle_clients[base_url];
+            if (!idle.empty())
             {
-                if (slot.i_batch < (int)i || slot.i_batch >= (int)(i + n_tokens))
-                {
-                    continue; // continue loop of slots
-                }
+                std::unique_ptr<httplib::Client> client = std::move(idle.back());
+                idle.pop_back();
+                return client;
+            }
+        }
 
-                if (slot.state == SLOT_STATE_DONE_PROMPT)
-                {
-                    if (slot.task_type == SERVER_TASK_TYPE_EMBEDDING)
-                    {
-                        // prompt evaluated for embedding
-                        send_embedding(slot, batch_view);
-                        slot.release();
-                        slot.i_batch = -1;
-                        continue; // continue loop of slots
-                    }
+        auto client = std::make_unique<httplib::Client>(base_url);
+        client->set_keep_alive(true);
+        // the headers and the body are separate writes, on a reused connection the body would wait for a delayed ACK
+        client->set_tcp_nodelay(true);
+        client->set_connection_timeout(5);
+        return client;
+    }
 
-                    if (slot.task_type == SERVER_TASK_TYPE_RERANK)
-                    {
-                        send_rerank(slot, batch_view);
-                        slot.release();
-                        slot.i_batch = -1;
-                        continue; // continue loop of slots
-                    }
+    void release_client(const std::string &base_url, std::unique_ptr<httplib::Client> &&client)
+    {
+        std::unique_lock<std::mutex> lock(mutex_clients);
+        auto &idle = idle_clients[base_url];
+        if ((int)idle.size() < n_idle_clients_max)
+        {
+            idle.emplace_back(std::move(client));
+        }
+    }
+};
 
-                    // prompt evaluated for next-token prediction
-                    slot.state = SLOT_STATE_GENERATING;
-                }
-                else if (slot.state != SLOT_STATE_GENERATING)
-                {
-                    continue; // continue loop of slots
-                }
+// a model served next to the main one, with its own slots and main loop thread
+// it stays loaded while a request holds it, even after the registry has unloaded it
+struct server_model
+{
+    std::string name;
+    server_context ctx;
+    std::thread loop;
 
-                const int tok_idx = slot.i_batch - i;
+    ~server_model()
+    {
+        if (loop.joinable())
+        {
+            ctx.queue_tasks.terminate();
+            loop.join();
+        }
+    }
+};
 
-                llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
+// the models selected by the "model" field of a request, loaded on their first request and unloaded in LRU order to
+// keep their memory within the budget
+// the memory of a model is its file size plus the KV cache and compute buffers of its context, which are only known
+// once it is loaded - until then only the file size counts, and the budget is enforced again after the load
+// the weights are mmap-ed, so they share the page cache instead of being copied
+struct server_model_registry
+{
+    enum status_t
+    {
+        MODEL_READY,
+        MODEL_LOADING,
+        MODEL_FAILED,
+    };
 
-                slot.i_batch = -1;
+    void init(const common_params &params)
+    {
+        params_base = params;
+        n_bytes_max = (size_t)std::max(params.extra_models_memory, 0) * 1024 * 1024;
 
-                common_sampler_accept(slot.smpl, id, true);
+        // the draft model and the LoRA adapters belong to the main model
+        params_base.speculative.model.clear();
+        params_base.speculative.hf_repo.clear();
+        params_base.lora_adapters.clear();
 
-                slot.n_decoded += 1;
+        for (const auto &it : params.extra_models)
+        {
+            entry &e = entries[it.first];
+            e.path = it.second;
+            e.n_bytes_file = model_size(e.path);
+            e.n_bytes = e.n_bytes_file;
+        }
+    }
 
-                const int64_t t_current = ggml_time_us();
+    bool has(const std::string &name) const { return entries.find(name) != entries.end(); }
 
-                if (slot.n_decoded == 1)
-                {
-                    slot.t_start_generation = t_current;
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
-                }
+    // the model if it is loaded, otherwise starts loading it in the background
+    status_t acquire(const std::string &name, std::shared_ptr<server_model> &model, std::string &error)
+    {
+        std::vector<std::shared_ptr<server_model>> unloaded; // released after the lock
 
-                slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
+        std::unique_lock<std::mutex> lock(mutex);
+        if (stopped)
+        {
+            error = "the server is shutting down";
+            return MODEL_FAILED;
+        }
 
-                completion_token_output result;
-                result.tok = id;
-                result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
-                result.prob = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
+        entry &e = entries.at(name);
+        e.t_last_used = ggml_time_us();
 
-                if (slot.params.sampling.n_probs > 0)
-                {
-                    populate_token_probs(slot, result, slot.params.post_sampling_probs, params_base.special, tok_idx);
-                }
+        if (e.model)
+        {
+            model = e.model;
+            return MODEL_READY;
+        }
+        if (e.loading)
+        {
+            return MODEL_LOADING;
+        }
+        if (!e.error.empty())
+        {
+            // reported once, the next request tries again
+            error = std::move(e.error);
+            e.error.clear();
+            return MODEL_FAILED;
+        }
 
-                if (!process_token(result, slot))
-                {
-                    // release slot because of stop condition
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                    metrics.on_prediction(slot);
-                    continue;
-                }
-            }
+        evict(e, unloaded);
 
-            // do speculative decoding
-            for (auto &slot : slots)
+        if (e.loader.joinable())
+        {
+            e.loader.join(); // done with the previous load of this model
+        }
+        e.loading = true;
+        e.loader = std::thread([this, name, path = e.path]()
+                               { load(name, path); });
+
+        return MODEL_LOADING;
+    }
+
+    void stop()
+    {
+        std::vector<std::thread> pending;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopped = true;
+            for (auto &it : entries)
             {
-                if (!slot.is_processing() || !slot.can_speculate())
+                if (it.second.loader.joinable())
                 {
-                    continue;
+                    pending.push_back(std::move(it.second.loader));
                 }
+            }
+        }
+        for (auto &loader : pending)
+        {
+            loader.join();
+        }
 
-                if (slot.state != SLOT_STATE_GENERATING)
-                {
-                    continue;
-                }
+        std::unique_lock<std::mutex> lock(mutex);
+        for (auto &it : entries)
+        {
+            it.second.model.reset();
+        }
+    }
 
-                // determine the max draft that fits the current slot state
-                int n_draft_max = slot.params.speculative.n_max;
+private:
+    struct entry
+    {
+        std::string path;
+        size_t n_bytes_file = 0;
+        size_t n_bytes = 0; // file size plus the buffers of the context, once loaded
 
-                // note: n_past is not yet increased for the `id` token sampled above
-                //       also, need to leave space for 1 extra token to allow context shifts
-                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+        std::shared_ptr<server_model> model;
+        bool loading = false;
+        std::thread loader;
+        std::string error;
+        int64_t t_last_used = 0;
+    };
 
-                if (slot.n_remaining > 0)
-                {
-                    n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
-                }
+    common_params params_base;
+    size_t n_bytes_max = 0;
 
-                SLT_DBG(slot, "max possible draft: %d\n", n_draft_max);
+    std::unordered_map<std::string, entry> entries;
+    bool stopped = false;
+    std::mutex mutex;
 
-                if (n_draft_max < slot.params.speculative.n_min)
-                {
-                    SLT_DBG(slot, "the max possible draft is too small: %d < %d - skipping speculative decoding\n",
-                            n_draft_max, slot.params.speculative.n_min);
+    // size of the model file, or of all its splits for <prefix>-00001-of-<count>.gguf
+    static size_t model_size(const std::string &path)
+    {
+        int split_count = 0;
+        const size_t pos = path.rfind("-of-");
+        if (pos != std::string::npos)
+        {
+            split_count = std::atoi(path.c_str() + pos + 4);
+        }
 
-                    continue;
-                }
+        std::vector<std::string> paths;
+        std::vector<char> prefix(path.size() + 1);
+        if (split_count > 1 && llama_split_prefix(prefix.data(), prefix.size(), path.c_str(), 1, split_count) > 0)
+        {
+            std::vector<char> split_path(path.size() + 32);
+            for (int i = 1; i <= split_count; i++)
+            {
+                llama_split_path(split_path.data(), split_path.size(), prefix.data(), i, split_count);
+                paths.emplace_back(split_path.data());
+            }
+        }
+        else
+        {
+            paths.push_back(path);
+        }
 
-                llama_token id = slot.sampled;
+        size_t n_bytes = 0;
+        for (const auto &p : paths)
+        {
+            std::error_code ec;
+            n_bytes += std::filesystem::file_size(p, ec);
+            if (ec)
+            {
+                SRV_WRN("cannot read the size of model file '%s': %s\n", p.c_str(), ec.message().c_str());
+                return 0;
+            }
+        }
+        return n_bytes;
+    }
 
-                struct common_speculative_params params_spec;
-                params_spec.n_draft = n_draft_max;
-                params_spec.n_reuse = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
-                params_spec.p_min = slot.params.speculative.p_min;
+    // unload the least recently used other models until the model of e fits in the budget
+    void evict(const entry &e, std::vector<std::shared_ptr<server_model>> &unloaded)
+    {
+        if (n_bytes_max == 0)
+        {
+            return;
+        }
 
-                llama_tokens draft = common_speculative_gen_draft(slot.spec, params_spec, slot.cache_tokens, id);
+        size_t n_bytes_used = 0;
+        for (const auto &it : entries)
+        {
+            if (&it.second != &e && (it.second.model || it.second.loading))
+            {
+                n_bytes_used += it.second.n_bytes;
+            }
+        }
 
-                // ignore small drafts
-                if (slot.params.speculative.n_min > (int)draft.size())
+        while (n_bytes_used + e.n_bytes > n_bytes_max)
+        {
+            entry *lru = nullptr;
+            for (auto &it : entries)
+            {
+                if (&it.second != &e && it.second.model && (lru == nullptr || it.second.t_last_used < lru->t_last_used))
                 {
-                    SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int)draft.size(), slot.params.speculative.n_min);
-
-                    continue;
+                    lru = &it.second;
                 }
+            }
+            if (lru == nullptr)
+            {
+                break; // the rest is loading, go over the budget rather than fail
+            }
 
-                // construct the speculation batch
-                common_batch_clear(slot.batch_spec);
-                common_batch_add(slot.batch_spec, id, slot.n_past, {slot.id}, true);
+            SRV_INF("unloading model '%s' to stay within the memory budget\n", lru->model->name.c_str());
+            n_bytes_used -= lru->n_bytes;
+            unloaded.push_back(std::move(lru->model));
+            lru->model.reset();
+        }
+    }
 
-                for (size_t i = 0; i < draft.size(); ++i)
-                {
-                    common_batch_add(slot.batch_spec, draft[i], slot.n_past + 1 + i, {slot.id}, true);
-                }
+    void load(const std::string &name, const std::string &path)
+    {
+        common_params params = params_base;
+        params.model = path;
+        params.model_alias = name;
 
-                SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
+        auto model = std::make_shared<server_model>();
+        model->name = name;
 
-                llama_decode(ctx, slot.batch_spec);
+        std::string error;
+        if (!model->ctx.load_model(params))
+        {
+            error = "failed to load model '" + name + "'";
+            model.reset();
+        }
+        else
+        {
+            model->ctx.init();
 
-                // the accepted tokens from the speculation
-                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+            server_context *ctx = &model->ctx;
+            ctx->queue_tasks.on_new_task([ctx](const server_task &task)
+                                         { ctx->process_single_task(task); });
+            ctx->queue_tasks.on_update_slots([ctx]()
+                                             { ctx->update_slots(); });
+            model->loop = std::thread([ctx]()
+                                      { ctx->queue_tasks.start_loop(); });
 
-                slot.n_past += ids.size();
-                slot.n_decoded += ids.size();
+            SRV_INF("model '%s' loaded, %.2f MiB of context buffers\n", name.c_str(),
+                    llama_context_size(model->ctx.ctx) / 1024.0 / 1024.0);
+        }
 
-                slot.cache_tokens.push_back(id);
-                slot.cache_tokens.insert(slot.cache_tokens.end(), ids.begin(), ids.end() - 1);
+        std::vector<std::shared_ptr<server_model>> unloaded; // released after the lock
 
-                llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1);
+        std::unique_lock<std::mutex> lock(mutex);
+        entry &e = entries.at(name);
+        e.loading = false;
+        e.model = std::move(model);
+        e.error = std::move(error);
+        e.t_last_used = ggml_time_us();
 
-                for (size_t i = 0; i < ids.size(); ++i)
-                {
-                    completion_token_output result;
+        if (e.model)
+        {
+            // the context buffers were not known when the room for the model was made
+            e.n_bytes = e.n_bytes_file + llama_context_size(e.model->ctx.ctx);
+            evict(e, unloaded);
+        }
+    }
+};
 
-                    result.tok = ids[i];
-                    result.text_to_send =
-                        common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
-                    result.prob = 1.0f; // set later
+// tokenizes the prompts of the HTTP handlers on the calling thread, with a cache of the first segments of prompts
+// a prompt sent in segments, e.g. "prompt": [["<system prompt>", "<user message>"]], is tokenized as their
+// concatenation (see tokenize_segments), the tokens of the first segment up to its last line are cached and reused
+// a prompt sent as a single string is not cached, it would only repeat as a whole
+struct server_tokenizer
+{
+    // metrics
+    std::atomic<uint64_t> n_cache_hits_total{0};
+    std::atomic<uint64_t> n_cache_misses_total{0};
 
-                    // TODO: set result.probs
+    void init(int n_cache)
+    {
+        this->n_cache = n_cache;
+        cache.n_max = std::max(n_cache, 1);
+    }
 
-                    if (!process_token(result, slot))
-                    {
-                        // release slot because of stop condition
-                        slot.release();
-                        slot.print_timings();
-                        send_final_response(slot);
-                        metrics.on_prediction(slot);
-                        break;
-                    }
-                }
+    // same as tokenize_input_prompts()
+    // the cache entries are keyed by the model name, which always names the same model file
+    std::vector<llama_tokens> tokenize(const llama_vocab *vocab, const std::string &model, const json &json_prompt,
+                                       bool add_special, bool parse_special)
+    {
+        server_trace_span span("tokenize");
 
-                SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int)ids.size() - 1,
-                        (int)draft.size(), slot.n_past);
-            }
+        if (n_cache <= 0)
+        {
+            return tokenize_input_prompts(vocab, json_prompt, add_special, parse_special);
         }
 
-        SRV_DBG("%s", "run slots completed\n");
+        const tokenize_head_t tokenize_head = [&](const std::string &text, bool add_special, bool parse_special)
+        {
+            return tokenize_head_cached(vocab, model, text, add_special, parse_special);
+        };
+
+        return tokenize_input_prompts(vocab, json_prompt, add_special, parse_special, tokenize_head);
     }
 
-    json model_meta() const
-    {
-        return json{
-            {"vocab_type", llama_vocab_type(vocab)},
-            {"n_vocab", llama_vocab_n_tokens(vocab)},
-            {"n_ctx_train", llama_model_n_ctx_train(model)},
-            {"n_embd", llama_model_n_embd(model)},
-            {"n_params", llama_model_n_params(model)},
-            {"size", llama_model_size(model)},
-        };
+private:
+    // keyed by the model name, the flags and the text
+    int n_cache = 0;
+    lru_cache<prompt_head> cache{1};
+    std::mutex mutex_cache;
+
+    prompt_head tokenize_head_cached(const llama_vocab *vocab, const std::string &model, const std::string &text,
+                                     bool add_special, bool parse_special)
+    {
+        std::string key;
+        key.reserve(model.size() + text.size() + 3);
+        key += model;
+        key += '\0';
+        key += add_special ? '1' : '0';
+        key += parse_special ? '1' : '0';
+        key += text;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_cache);
+            const prompt_head *head = cache.get(key);
+            if (head != nullptr)
+            {
+                n_cache_hits_total++;
+                return *head;
+            }
+        }
+
+        n_cache_misses_total++;
+        prompt_head head = tokenize_prompt_head(vocab, text, add_special, parse_special);
+
+        std::unique_lock<std::mutex> lock(mutex_cache);
+        cache.put(key, head);
+        return head;
     }
 };
 
+// tests/test-server.cpp includes this file without its main()
+#ifndef LLAMA_SERVER_NO_MAIN
+
 static void log_server_request(const httplib::Request &req, const httplib::Response &res)
 {
     // skip GH copilot requests when using default port
@@ -3815,6 +7309,15 @@ int main(int argc, char **argv)
     // struct that contains llama context and inference
     server_context ctx_server;
 
+    // delivers the results of /answer/callback requests
+    server_callback_dispatcher callback_dispatcher;
+
+    // tokenizes the prompts of the HTTP handlers
+    server_tokenizer tokenizer;
+
+    // the models selected by the "model" field of the requests
+    server_model_registry models;
+
     llama_backend_init();
     llama_numa_init(params.numa);
 
@@ -3870,22 +7373,6 @@ int main(int argc, char **argv)
         res.status = 202;
     };
 
-    auto res_callback = [](const json &data, const std::string &callback_url, const std::string &auth_header)
-    {
-        size_t pos = callback_url.find('/', callback_url.find("://") + 3);
-        std::string base_url = (pos != std::string::npos) ? callback_url.substr(0, pos) : callback_url;
-        std::string endpoint = (pos != std::string::npos) ? callback_url.substr(pos + 1) : "";
-        httplib::Client client(base_url);
-        httplib::Headers headers = {{"Content-Type", "application/json"}};
-        if (auth_header != "")
-        {
-            headers.emplace("Authorization", auth_header);
-        }
-
-        auto res = client.Post(("/" + endpoint).c_str(), headers, safe_json_to_str(data), "application/json");
-        SRV_ERR("Sent POST request to endpoint: '%s'\n", endpoint.c_str());
-    };
-
     svr->set_exception_handler(
         [&res_error](const httplib::Request &, httplib::Response &res, const std::exception_ptr &ep)
         {
@@ -4135,6 +7622,24 @@ int main(int argc, char **argv)
               {{"name", "n_decode_total"},
                {"help", "Total number of llama_decode() calls"},
                {"value", res_metrics->n_decode_total}},
+              {{"name", "callbacks_delivered_total"},
+               {"help", "Number of callback results delivered."},
+               {"value", (uint64_t)callback_dispatcher.n_delivered_total}},
+              {{"name", "callbacks_failed_total"},
+               {"help", "Number of callback results dropped after all retries."},
+               {"value", (uint64_t)callback_dispatcher.n_failed_total}},
+              {{"name", "callbacks_retries_total"},
+               {"help", "Number of callback delivery retries."},
+               {"value", (uint64_t)callback_dispatcher.n_retries_total}},
+              {{"name", "callbacks_rejected_total"},
+               {"help", "Number of callback requests rejected because the queue was full."},
+               {"value", (uint64_t)callback_dispatcher.n_rejected_total}},
+              {{"name", "tokenize_cache_hits_total"},
+               {"help", "Number of first prompt segments whose tokens were found in the tokenize cache."},
+               {"value", (uint64_t)tokenizer.n_cache_hits_total}},
+              {{"name", "tokenize_cache_misses_total"},
+               {"help", "Number of first prompt segments tokenized because they were not in the tokenize cache."},
+               {"value", (uint64_t)tokenizer.n_cache_misses_total}},
               {{"name", "n_busy_slots_per_decode"},
                {"help", "Average number of busy slots per llama_decode() call"},
                {"value", (float)res_metrics->n_busy_slots_total /
@@ -4157,7 +7662,114 @@ int main(int argc, char **argv)
                {"value", (uint64_t)res_metrics->n_processing_slots}},
               {{"name", "requests_deferred"},
                {"help", "Number of requests deferred."},
-               {"value", (uint64_t)res_metrics->n_tasks_deferred}}}}};
+               {"value", (uint64_t)res_metrics->n_tasks_deferred}},
+              {{"name", "callbacks_waiting"},
+               {"help", "Number of callback requests waiting for their results."},
+               {"value", (uint64_t)callback_dispatcher.n_waiting}},
+              {{"name", "callbacks_queued"},
+               {"help", "Number of callback results waiting for a worker."},
+               {"value", (uint64_t)callback_dispatcher.n_queued}}}}};
+
+        for (int i = 0; i < SERVER_TASK_PRIORITY_COUNT; i++)
+        {
+            const std::string name = server_task_priority_name((server_task_priority)i);
+            all_metrics_def["counter"].push_back(
+                {{"name", "requests_started_total_" + name},
+                 {"help", "Number of " + name + " priority requests assigned to a slot."},
+                 {"value", res_metrics->n_tasks_started_total[i]}});
+            all_metrics_def["counter"].push_back(
+                {{"name", "queue_wait_seconds_total_" + name},
+                 {"help", "Time " + name + " priority requests waited for a slot."},
+                 {"value", res_metrics->t_queue_wait_total[i] / 1.e3}});
+        }
+        all_metrics_def["counter"].push_back({{"name", "requests_preempted_total"},
+                                              {"help", "Number of requests parked to make room for a higher priority one."},
+                                              {"value", res_metrics->n_preempted_total}});
+        all_metrics_def["counter"].push_back({{"name", "speculative_draft_tokens_total"},
+                                              {"help", "Number of drafted tokens verified by speculative decoding."},
+                                              {"value", res_metrics->n_draft_total}});
+        all_metrics_def["counter"].push_back({{"name", "speculative_accepted_tokens_total"},
+                                              {"help", "Number of drafted tokens accepted by speculative decoding."},
+                                              {"value", res_metrics->n_draft_accepted_total}});
+        all_metrics_def["counter"].push_back({{"name", "prefix_cache_hits_total"},
+                                              {"help", "Number of prompts that forked their prefix from another slot."},
+                                              {"value", res_metrics->n_prefix_hits_total}});
+        all_metrics_def["counter"].push_back({{"name", "prefix_cache_tokens_total"},
+                                              {"help", "Number of prompt tokens forked from another slot."},
+                                              {"value", res_metrics->n_prefix_tokens_total}});
+        all_metrics_def["counter"].push_back({{"name", "prefix_batch_tokens_total"},
+                                              {"help", "Number of prompt tokens forked from the prefix shared by the prompts of a request."},
+                                              {"value", res_metrics->n_prefix_batch_tokens_total}});
+        all_metrics_def["counter"].push_back({{"name", "batches_aborted_total"},
+                                              {"help", "Number of batches aborted during llama_decode() because all of their requests were cancelled."},
+                                              {"value", res_metrics->n_batches_aborted_total}});
+        all_metrics_def["counter"].push_back({{"name", "session_saves_total"},
+                                              {"help", "Number of chat sessions whose KV cache was saved in memory when their slot was reused."},
+                                              {"value", res_metrics->n_session_saves_total}});
+        all_metrics_def["counter"].push_back({{"name", "session_restores_total"},
+                                              {"help", "Number of chat sessions whose KV cache was restored from memory."},
+                                              {"value", res_metrics->n_session_restores_total}});
+        all_metrics_def["counter"].push_back({{"name", "session_tokens_total"},
+                                              {"help", "Number of prompt tokens restored from the KV cache of chat sessions."},
+                                              {"value", res_metrics->n_session_tokens_total}});
+        all_metrics_def["counter"].push_back({{"name", "session_evictions_total"},
+                                              {"help", "Number of chat sessions evicted from the session memory."},
+                                              {"value", res_metrics->n_session_evictions_total}});
+        all_metrics_def["gauge"].push_back({{"name", "sessions"},
+                                            {"help", "Number of chat sessions in the session memory."},
+                                            {"value", res_metrics->n_sessions}});
+        all_metrics_def["gauge"].push_back({{"name", "session_memory_bytes"},
+                                            {"help", "Size of the KV cache of the chat sessions in the session memory."},
+                                            {"value", res_metrics->n_session_bytes}});
+        all_metrics_def["counter"].push_back({{"name", "kv_defrag_seconds_total"},
+                                              {"help", "Time spent defragmenting the KV cache."},
+                                              {"value", res_metrics->t_kv_defrag / 1.e3}});
+        all_metrics_def["counter"].push_back({{"name", "kv_defrag_steps_total"},
+                                              {"help", "Number of KV cache defragmentation steps, each moving at most --defrag-step cells."},
+                                              {"value", res_metrics->n_kv_defrag_total}});
+        all_metrics_def["counter"].push_back({{"name", "kv_defrag_cells_total"},
+                                              {"help", "Number of KV cells moved by defragmentation."},
+                                              {"value", res_metrics->n_kv_defrag_cells_total}});
+        all_metrics_def["counter"].push_back({{"name", "prefix_cache_disk_loads_total"},
+                                              {"help", "Number of prompt prefixes loaded from the prefix cache on disk."},
+                                              {"value", res_metrics->n_prefix_disk_loads_total}});
+        all_metrics_def["counter"].push_back({{"name", "prefix_cache_disk_saves_total"},
+                                              {"help", "Number of prompt prefixes saved to the prefix cache on disk."},
+                                              {"value", res_metrics->n_prefix_disk_saves_total}});
+        all_metrics_def["counter"].push_back({{"name", "batch_decode_tokens_total"},
+                                              {"help", "Number of generated tokens submitted in the batches."},
+                                              {"value", res_metrics->n_batch_decode_tokens_total}});
+        all_metrics_def["counter"].push_back({{"name", "batch_prompt_tokens_total"},
+                                              {"help", "Number of prompt tokens submitted in the batches."},
+                                              {"value", res_metrics->n_batch_prompt_tokens_total}});
+        all_metrics_def["gauge"].push_back({{"name", "batch_decode_tokens"},
+                                            {"help", "Number of generated tokens in the last batch."},
+                                            {"value", res_metrics->n_batch_decode_tokens_last}});
+        all_metrics_def["gauge"].push_back({{"name", "batch_prompt_tokens"},
+                                            {"help", "Number of prompt tokens in the last batch."},
+                                            {"value", res_metrics->n_batch_prompt_tokens_last}});
+        all_metrics_def["gauge"].push_back(
+            {{"name", "inter_token_latency_seconds"},
+             {"help", "Average time between two consecutive tokens of a request."},
+             {"value", res_metrics->n_token_gaps ? res_metrics->t_token_gaps / 1.e6 / res_metrics->n_token_gaps : 0.}});
+        all_metrics_def["gauge"].push_back({{"name", "inter_token_latency_max_seconds"},
+                                            {"help", "Longest time between two consecutive tokens of a request."},
+                                            {"value", res_metrics->t_token_gap_max / 1.e6}});
+        all_metrics_def["counter"].push_back({{"name", "requests_rejected_total"},
+                                              {"help", "Number of requests rejected by admission control."},
+                                              {"value", (uint64_t)ctx_server.n_requests_rejected_total}});
+        all_metrics_def["gauge"].push_back({{"name", "requests_waiting"},
+                                            {"help", "Number of requests waiting for a slot."},
+                                            {"value", ctx_server.queue_tasks.n_incoming + ctx_server.queue_tasks.n_deferred}});
+        all_metrics_def["gauge"].push_back({{"name", "prompt_tokens_waiting"},
+                                            {"help", "Number of prompt tokens of the requests waiting for a slot."},
+                                            {"value", ctx_server.queue_tasks.n_incoming_tokens + ctx_server.queue_tasks.n_deferred_tokens}});
+        all_metrics_def["gauge"].push_back({{"name", "requests_parked"},
+                                            {"help", "Number of preempted requests waiting to resume."},
+                                            {"value", res_metrics->n_tasks_parked}});
+        all_metrics_def["gauge"].push_back({{"name", "park_memory_bytes"},
+                                            {"help", "Size of the KV cache of the preempted requests."},
+                                            {"value", res_metrics->n_parked_bytes}});
 
         std::stringstream prometheus;
 
@@ -4178,12 +7790,38 @@ int main(int argc, char **argv)
             }
         }
 
+        // the histograms are read directly, the main loop only increments them
+        const server_metrics &metrics = ctx_server.metrics;
+        metrics.h_queue_wait.to_prometheus(prometheus, "request_queue_seconds",
+                                           "Time between posting a request and the main loop picking it up.");
+        metrics.h_slot_wait.to_prometheus(prometheus, "slot_wait_seconds",
+                                          "Time requests waited for a slot.");
+        metrics.h_prefill.to_prometheus(prometheus, "prefill_seconds", "Prompt processing time.");
+        metrics.h_ttft.to_prometheus(prometheus, "time_to_first_token_seconds",
+                                     "Time between posting a request and its first token.");
+        metrics.h_token_gap.to_prometheus(prometheus, "token_gap_seconds",
+                                          "Time between two consecutive tokens of a slot.");
+        callback_dispatcher.h_delivery.to_prometheus(prometheus, "callback_delivery_seconds",
+                                                     "Time to deliver a callback result, retries included.");
+
         res.set_header("Process-Start-Time-Unix", std::to_string(res_metrics->t_start));
 
         res.set_content(prometheus.str(), "text/plain; version=0.0.4");
         res.status = 200; // HTTP OK
     };
 
+    const auto handle_trace = [&res_error, &res_ok](const httplib::Request &, httplib::Response &res)
+    {
+        if (!tracer.enabled())
+        {
+            res_error(res, format_error_response("This server does not record traces. Start it with `--trace N`",
+                                                 ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
+        res_ok(res, tracer.to_json());
+    };
+
     const auto handle_slots_save = [&ctx_server, &res_error, &res_ok, &params](const httplib::Request &req,
                                                                                httplib::Response &res, int id_slot)
     {
@@ -4361,16 +7999,44 @@ int main(int argc, char **argv)
         res_ok(res, {{"success", true}});
     };
 
+    // the context serving the "model" of a request, an extra model stays loaded while `model` holds it
+    // sends an error and returns nullptr if the model is not ready yet
+    const auto resolve_model = [&ctx_server, &models, &res_error](const json &data, httplib::Response &res,
+                                                                std::shared_ptr<server_model> &model) -> server_context *
+    {
+        const std::string name =
+            data.contains("model") && data.at("model").is_string() ? data.at("model").get<std::string>() : "";
+        if (!models.has(name))
+        {
+            return &ctx_server;
+        }
+
+        std::string error;
+        switch (models.acquire(name, model, error))
+        {
+        case server_model_registry::MODEL_READY:
+            return &model->ctx;
+        case server_model_registry::MODEL_LOADING:
+            res.set_header("Retry-After", "5");
+            res_error(res, format_error_response("Model '" + name + "' is loading, retry later", ERROR_TYPE_UNAVAILABLE));
+            return nullptr;
+        default:
+            res_error(res, format_error_response(error, ERROR_TYPE_SERVER));
+            return nullptr;
+        }
+    };
+
     // handle completion-like requests (completion, chat, infill)
     // we can optionally provide a custom format for partial results and final results
-    const auto handle_answer_impl = [&ctx_server, &res_error, &res_ok, &res_accepted, &res_callback](server_task_type type, json &data,
-                                                                                                     const httplib::Request &req,
-                                                                                                     httplib::Response &res,
-                                                                                                     oaicompat_type oaicompat)
+    // ctx is the context of the requested model, see resolve_model()
+    const auto handle_answer_impl = [&callback_dispatcher, &tokenizer, &res_error, &res_ok, &res_accepted](
+                                        server_context &ctx, std::shared_ptr<server_model> model, server_task_type type,
+                                        json &data, const httplib::Request &req, httplib::Response &res,
+                                        oaicompat_type oaicompat)
     {
         GGML_ASSERT(type == SERVER_TASK_TYPE_COMPLETION || type == SERVER_TASK_TYPE_INFILL);
 
-        if (ctx_server.params_base.embedding)
+        if (ctx.params_base.embedding)
         {
             res_error(res,
                       format_error_response("This server does not support completions. Start it without `--embeddings`",
@@ -4387,18 +8053,25 @@ int main(int argc, char **argv)
             // TODO: this log can become very long, put it behind a flag or think about a more compact format
             // SRV_DBG("Prompt: %s\n", prompt.is_string() ? prompt.get<std::string>().c_str() : prompt.dump(2).c_str());
 
-            std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
+            std::vector<llama_tokens> tokenized_prompts =
+                tokenizer.tokenize(ctx.vocab, model ? model->name : "", prompt, true, true);
             tasks.reserve(tokenized_prompts.size());
             for (size_t i = 0; i < tokenized_prompts.size(); i++)
             {
                 server_task task = server_task(type);
 
-                task.id = ctx_server.queue_tasks.get_new_id();
+                task.id = ctx.queue_tasks.get_new_id();
                 task.index = i;
 
                 task.prompt_tokens = std::move(tokenized_prompts[i]);
-                task.params = server_task::params_from_json_cmpl(ctx_server.ctx, ctx_server.params_base, data);
+                task.params = server_task::params_from_json_cmpl(ctx.ctx, ctx.params_base,
+                                                                 ctx.grammars, data);
                 task.id_selected_slot = json_value(data, "id_slot", -1);
+                task.sched_from_json(data);
+                if (tokenized_prompts.size() == 1)
+                {
+                    task.session = json_value(data, "session", std::string());
+                }
 
                 // OAI-compat
                 task.params.oaicompat = oaicompat;
@@ -4414,67 +8087,91 @@ int main(int argc, char **argv)
             return;
         }
 
-        ctx_server.queue_results.add_waiting_tasks(tasks);
-        ctx_server.queue_tasks.post(tasks);
+        // the prompts of a batch usually start with the same instructions: the first task decodes them once and the
+        // others fork its KV cache, see server_context::is_prefix_pending()
+        if (tasks.size() > 1 && tasks[0].params.cache_prompt && ctx.params_base.n_prefix_share_min > 0)
+        {
+            size_t n_common = tasks[0].prompt_tokens.size();
+            for (size_t i = 1; i < tasks.size(); i++)
+            {
+                n_common = std::min(n_common, common_lcp(tasks[0].prompt_tokens, tasks[i].prompt_tokens));
+            }
+
+            if (n_common >= (size_t)ctx.params_base.n_prefix_share_min)
+            {
+                tasks[0].n_prefix_publish = n_common;
+                for (size_t i = 1; i < tasks.size(); i++)
+                {
+                    tasks[i].id_prefix_task = tasks[0].id;
+                }
+            }
+        }
 
         bool stream = json_value(data, "stream", false);
         bool callback = data.contains("callback");
+        const std::string callback_url = callback ? data["callback"].get<std::string>() : "";
         const auto task_ids = server_task::get_list_id(tasks);
 
-        if (callback)
+        int64_t n_tokens = 0;
+        for (const auto &task : tasks)
         {
-            res_accepted(res);
-            auto callback_url = data["callback"].get<std::string>();
-            auto auth_header = req.get_header_value("Authorization");
-
-            std::thread([task_ids, &ctx_server, &req, &res_callback, callback_url, auth_header]()
-                        {
-                std::vector<server_task_result_ptr> results;
-                bool error_occurred = false;
-                json error_data;
+            n_tokens += task.prompt_tokens.size();
+        }
 
-                ctx_server.receive_multi_results(
-                    task_ids,
-                    [&](std::vector<server_task_result_ptr> &res_results)
-                    {
-                        results = std::move(res_results);
-                    },
-                    [&](const json &err_data)
-                    { 
-                        error_occurred = true;
-                        error_data = err_data;
-                    },
-                    []() { return false; }); // Never consider connection closed for async processing
+        {
+            // a callback request does not hold its HTTP thread
+            int retry_after = 0;
+            std::string reason;
+            if (!ctx.admit_tasks(tasks.size(), n_tokens, !callback, retry_after, reason))
+            {
+                res.set_header("Retry-After", std::to_string(retry_after));
+                res_error(res, format_error_response("Server is overloaded (" + reason + "), retry later",
+                                                     ERROR_TYPE_UNAVAILABLE));
+                return;
+            }
+        }
 
-                ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+        if (callback)
+        {
+            if (!callback_dispatcher.reserve())
+            {
+                ctx.end_admission(tasks.size(), n_tokens);
+                res_error(res, format_error_response("Callback queue is full, retry later", ERROR_TYPE_UNAVAILABLE));
+                return;
+            }
 
-                // Send results to callback URL
-                if (!error_occurred) {
-                    json response_data;
-                    if (results.size() == 1) {
-                        // single result
-                        response_data = results[0]->to_json();
-                    } else {
-                        // multiple results (multitask)
-                        response_data = json::array();
-                        for (auto &res : results) {
-                            response_data.push_back(res->to_json());
-                        }
-                    }
-                    res_callback(response_data, callback_url, auth_header);
-                } else {
-                    res_callback(error_data, callback_url, auth_header);
-                } })
-                .detach();
+            callback_dispatcher.watch(ctx, tasks, callback_url, req.get_header_value("Authorization"), model);
+            ctx.queue_tasks.post(tasks);
+            ctx.end_admission(tasks.size(), n_tokens);
+            res_accepted(res);
+            return;
         }
-        else if (stream)
+
+        ctx.queue_results.add_waiting_tasks(tasks);
+        ctx.queue_tasks.post(tasks);
+        ctx.end_admission(tasks.size(), n_tokens);
+
+        if (stream)
         {
-            const auto chunked_content_provider = [task_ids, &ctx_server, oaicompat](size_t, httplib::DataSink &sink)
+            const auto chunked_content_provider = [task_ids, ctx = &ctx, model, oaicompat](size_t, httplib::DataSink &sink)
             {
-                ctx_server.receive_cmpl_results_stream(
+                // reused by the chunks of the stream, so that they do not allocate once it has grown
+                std::string buf;
+
+                ctx->receive_cmpl_results_stream(
                     task_ids,
                     [&](server_task_result_ptr &result) -> bool
                     {
+                        server_trace_span span("serialize", result->id);
+
+                        buf.clear();
+                        if (result->to_sse(buf))
+                        {
+                            LOG_DBG("data stream, to_send: %s", buf.c_str());
+
+                            return sink.write(buf.data(), buf.size());
+                        }
+
                         json res_json = result->to_json();
                         if (res_json.is_array())
                         {
@@ -4509,19 +8206,22 @@ int main(int argc, char **argv)
                 return false;
             };
 
-            auto on_complete = [task_ids, &ctx_server](bool)
+            auto on_complete = [task_ids, ctx = &ctx, model](bool)
             {
-                ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+                ctx->queue_results.remove_waiting_task_ids(task_ids);
+                ctx->n_requests_inflight--;
             };
 
             res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
         }
         else
         {
-            ctx_server.receive_multi_results(
+            ctx.receive_multi_results(
                 task_ids,
                 [&](std::vector<server_task_result_ptr> &results)
                 {
+                    server_trace_span span("serialize", results[0]->id);
+
                     if (results.size() == 1)
                     {
                         // single result
@@ -4541,29 +8241,52 @@ int main(int argc, char **argv)
                 [&](const json &error_data)
                 { res_error(res, error_data); }, req.is_connection_closed);
 
-            ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+            ctx.queue_results.remove_waiting_task_ids(task_ids);
+            ctx.n_requests_inflight--;
         }
     };
 
-    const auto handle_answer = [&handle_answer_impl](const httplib::Request &req, httplib::Response &res)
+    const auto handle_answer = [&resolve_model, &handle_answer_impl](const httplib::Request &req, httplib::Response &res)
     {
         json data = json::parse(req.body);
-        return handle_answer_impl(SERVER_TASK_TYPE_COMPLETION, data, req, res,
+        std::shared_ptr<server_model> model;
+        server_context *ctx = resolve_model(data, res, model);
+        if (ctx == nullptr)
+        {
+            return;
+        }
+        return handle_answer_impl(*ctx, model, SERVER_TASK_TYPE_COMPLETION, data, req, res,
                                   OAICOMPAT_TYPE_NONE);
     };
 
-    const auto handle_answer_callback = [&handle_answer_impl](const httplib::Request &req, httplib::Response &res)
+    const auto handle_answer_callback = [&resolve_model, &handle_answer_impl](const httplib::Request &req,
+                                                                              httplib::Response &res)
     {
         json data = json::parse(req.body);
-        return handle_answer_impl(SERVER_TASK_TYPE_COMPLETION, data, req, res,
+        std::shared_ptr<server_model> model;
+        server_context *ctx = resolve_model(data, res, model);
+        if (ctx == nullptr)
+        {
+            return;
+        }
+        return handle_answer_impl(*ctx, model, SERVER_TASK_TYPE_COMPLETION, data, req, res,
                                   OAICOMPAT_TYPE_NONE);
     };
 
-    const auto handle_chat_answer = [&ctx_server, &params, &res_error, &handle_answer_impl](
+    const auto handle_chat_answer = [&params, &res_error, &resolve_model, &handle_answer_impl](
                                         const httplib::Request &req, httplib::Response &res)
     {
         LOG_DBG("request: %s\n", req.body.c_str());
-        if (ctx_server.params_base.embedding)
+
+        auto body = json::parse(req.body);
+        std::shared_ptr<server_model> model;
+        server_context *ctx = resolve_model(body, res, model);
+        if (ctx == nullptr)
+        {
+            return;
+        }
+
+        if (ctx->params_base.embedding)
         {
             res_error(res,
                       format_error_response("This server does not support completions. Start it without `--embeddings`",
@@ -4571,11 +8294,10 @@ int main(int argc, char **argv)
             return;
         }
 
-        auto body = json::parse(req.body);
         json data = oaicompat_completion_params_parse(body, params.use_jinja, params.reasoning_format,
-                                                      ctx_server.chat_templates.get());
+                                                      ctx->chat_templates.get());
 
-        return handle_answer_impl(SERVER_TASK_TYPE_COMPLETION, data, req, res,
+        return handle_answer_impl(*ctx, model, SERVER_TASK_TYPE_COMPLETION, data, req, res,
                                   OAICOMPAT_TYPE_CHAT);
     };
 
@@ -4668,7 +8390,7 @@ int main(int argc, char **argv)
         res_ok(res, data);
     };
 
-    const auto handle_embeddings_impl = [&ctx_server, &res_error, &res_ok](const httplib::Request &req,
+    const auto handle_embeddings_impl = [&ctx_server, &tokenizer, &res_error, &res_ok](const httplib::Request &req,
                                                                            httplib::Response &res,
                                                                            oaicompat_type oaicompat)
     {
@@ -4717,7 +8439,7 @@ int main(int argc, char **argv)
             }
         }
 
-        std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
+        std::vector<llama_tokens> tokenized_prompts = tokenizer.tokenize(ctx_server.vocab, "", prompt, true, true);
         for (const auto &tokens : tokenized_prompts)
         {
             // this check is necessary for models that do not add BOS token to the input
@@ -4794,7 +8516,7 @@ int main(int argc, char **argv)
         handle_embeddings_impl(req, res, OAICOMPAT_TYPE_EMBEDDING);
     };
 
-    const auto handle_rerank = [&ctx_server, &res_error, &res_ok](const httplib::Request &req,
+    const auto handle_rerank = [&ctx_server, &tokenizer, &res_error, &res_ok](const httplib::Request &req,
                                                                   httplib::Response &res)
     {
         if (!ctx_server.params_base.reranking || ctx_server.params_base.embedding)
@@ -4849,7 +8571,7 @@ int main(int argc, char **argv)
         }
 
         llama_tokens tokenized_query =
-            tokenize_input_prompts(ctx_server.vocab, query, /* add_special */ false, true)[0];
+            tokenizer.tokenize(ctx_server.vocab, "", query, /* add_special */ false, true)[0];
 
         // create and queue the task
         json responses = json::array();
@@ -4857,7 +8579,7 @@ int main(int argc, char **argv)
         {
             std::vector<server_task> tasks;
             std::vector<llama_tokens> tokenized_docs =
-                tokenize_input_prompts(ctx_server.vocab, documents, /* add_special */ false, true);
+                tokenizer.tokenize(ctx_server.vocab, "", documents, /* add_special */ false, true);
             tasks.reserve(tokenized_docs.size());
             for (size_t i = 0; i < tokenized_docs.size(); i++)
             {
@@ -4988,6 +8710,7 @@ int main(int argc, char **argv)
     // register API routes
     svr->Get("/health", handle_health); // public endpoint (no API key check)
     svr->Get("/metrics", handle_metrics);
+    svr->Get("/trace", handle_trace);
     svr->Post("/answer", handle_answer);
     svr->Post("/answer/callback", handle_answer_callback);
     svr->Post("/chat/answer", handle_chat_answer);
@@ -5016,16 +8739,26 @@ int main(int argc, char **argv)
         params.n_threads_http = std::max(params.n_parallel + 2, (int32_t)std::thread::hardware_concurrency() - 1);
     }
     log_data["n_threads_http"] = std::to_string(params.n_threads_http);
+    if (params.n_threads_callback < 1)
+    {
+        // roughly one delivery in flight per slot
+        params.n_threads_callback = params.n_parallel;
+    }
+    callback_dispatcher.start(params.n_threads_callback, std::max(params.n_callback_queue, 1),
+                              std::max(params.n_callback_retries, 0));
+    tracer.init(std::max(params.n_trace_spans, 0));
     svr->new_task_queue = [&params]
     {
         return new httplib::ThreadPool(params.n_threads_http);
     };
 
     // clean up function, to be called before exit
-    auto clean_up = [&svr]()
+    auto clean_up = [&svr, &callback_dispatcher, &tokenizer, &models]()
     {
         SRV_INF("%s: cleaning up before exit...\n", __func__);
         svr->stop();
+        callback_dispatcher.stop();
+        models.stop();
         llama_backend_free();
     };
 
@@ -5072,6 +8805,8 @@ int main(int argc, char **argv)
     }
 
     ctx_server.init();
+    tokenizer.init(std::max(params.n_tokenize_cache, 0));
+    models.init(params);
     state.store(SERVER_STATE_READY);
 
     LOG_INF("%s: model loaded\n", __func__);
@@ -5120,3 +8855,5 @@ int main(int argc, char **argv)
 
     return 0;
 }
+
+#endif // LLAMA_SERVER_NO_MAIN
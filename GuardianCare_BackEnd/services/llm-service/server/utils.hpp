@@ -14,6 +14,9 @@
 #include "json.hpp"
 #include "chat.h"
 
+#include <charconv>
+#include <functional>
+#include <list>
 #include <random>
 #include <sstream>
 #include <string>
@@ -88,6 +91,19 @@ static bool json_is_array_of_mixed_numbers_strings(const json & data) {
     return false;
 }
 
+// is a non-empty array of strings only?
+static bool json_is_array_of_strings(const json & data) {
+    if (!data.is_array() || data.empty()) {
+        return false;
+    }
+    for (const auto & e : data) {
+        if (!e.is_string()) {
+            return false;
+        }
+    }
+    return true;
+}
+
 // get value by path(key1 / key2)
 static json json_get_nested_values(const std::vector<std::string> & paths, const json & js) {
     json result = json::object();
@@ -151,6 +167,90 @@ static llama_tokens tokenize_mixed(const llama_vocab * vocab, const json & json_
     return prompt_tokens;
 }
 
+// tokenizes text starting with a newline as it is tokenized after the text before it, in the same string
+// the SPM vocabs prefix the text of a tokenization with a space, it is dropped when it is a token of its own
+// returns false when the text is not tokenized the same way on its own
+static bool tokenize_after_newline(const llama_vocab * vocab, const std::string & text, bool parse_special, llama_tokens & result) {
+    result = common_tokenize(vocab, text, false, parse_special);
+    if (text.empty() || text[0] != '\n' || result.empty()) {
+        return false;
+    }
+
+    if (common_token_to_piece(vocab, result[0], parse_special) == " ") {
+        result.erase(result.begin());
+    }
+
+    return !result.empty() && common_token_to_piece(vocab, result[0], parse_special)[0] == '\n';
+}
+
+// tokens of the first segment of a prompt up to its last line, the rest is tokenized with the next segments
+// n_text is 0 when the segment has no line where its tokenization can be split
+struct prompt_head {
+    llama_tokens tokens;
+    size_t       n_text = 0;
+};
+
+// splits the text at the last newline after a visible character, only if its tokens are the same as the ones of
+// the whole text
+static prompt_head tokenize_prompt_head(const llama_vocab * vocab, const std::string & text, bool add_special, bool parse_special) {
+    prompt_head head;
+
+    size_t pos = text.rfind('\n');
+    while (pos != std::string::npos && pos > 0 && isspace((unsigned char) text[pos - 1])) {
+        pos = text.rfind('\n', pos - 1);
+    }
+    if (pos == std::string::npos || pos == 0) {
+        return head;
+    }
+
+    llama_tokens tokens = common_tokenize(vocab, text.substr(0, pos), add_special, parse_special);
+
+    llama_tokens rest;
+    if (!tokenize_after_newline(vocab, text.substr(pos), parse_special, rest)) {
+        return head;
+    }
+
+    const size_t n_tokens = tokens.size();
+    tokens.insert(tokens.end(), rest.begin(), rest.end());
+    if (tokens != common_tokenize(vocab, text, add_special, parse_special)) {
+        return head;
+    }
+
+    tokens.resize(n_tokens);
+    head.tokens = std::move(tokens);
+    head.n_text = pos;
+
+    return head;
+}
+
+// computes the head of the first segment of a prompt, lets the caller cache it
+using tokenize_head_t = std::function<prompt_head(const std::string & text, bool add_special, bool parse_special)>;
+
+/**
+ * a prompt sent in segments, example: ["system prompt", "user message"]
+ * the segments are one string, the tokens are the same as the ones of their concatenation
+ * with tokenize_head, the first segment is only tokenized up to its last line once, e.g. a repeated system prompt
+ */
+static llama_tokens tokenize_segments(const llama_vocab * vocab, const tokenize_head_t & tokenize_head, const json & json_prompt, bool add_special, bool parse_special) {
+    std::string text;
+    for (const auto & p : json_prompt) {
+        text += p.template get<std::string>();
+    }
+
+    if (tokenize_head) {
+        const prompt_head head = tokenize_head(json_prompt[0].template get<std::string>(), add_special, parse_special);
+
+        llama_tokens rest;
+        if (head.n_text > 0 && tokenize_after_newline(vocab, text.substr(head.n_text), parse_special, rest)) {
+            llama_tokens prompt_tokens = head.tokens;
+            prompt_tokens.insert(prompt_tokens.end(), rest.begin(), rest.end());
+            return prompt_tokens;
+        }
+    }
+
+    return common_tokenize(vocab, text, add_special, parse_special);
+}
+
 /**
  * break the input "prompt" object into multiple prompt if needed, then tokenize them
  * this supports these cases:
@@ -162,8 +262,11 @@ static llama_tokens tokenize_mixed(const llama_vocab * vocab, const json & json_
  * - "prompt": ["string1", [12, 34, 56]]
  * - "prompt": [[12, 34, 56], [78, 90, 12]]
  * - "prompt": [[12, 34, "string", 56, 78], [12, 34, 56]]
+ * an array of strings inside the array is one prompt sent in segments (see tokenize_segments):
+ * - "prompt": [["system prompt", "user message"]]
  */
-static std::vector<llama_tokens> tokenize_input_prompts(const llama_vocab * vocab, const json & json_prompt, bool add_special, bool parse_special) {
+static std::vector<llama_tokens> tokenize_input_prompts(const llama_vocab * vocab, const json & json_prompt, bool add_special, bool parse_special,
+        const tokenize_head_t & tokenize_head = nullptr) {
     std::vector<llama_tokens> result;
     if (json_prompt.is_string() || json_is_array_of_mixed_numbers_strings(json_prompt)) {
         // string or mixed
@@ -177,11 +280,13 @@ static std::vector<llama_tokens> tokenize_input_prompts(const llama_vocab * voca
         for (const auto & p : json_prompt) {
             if (p.is_string() || json_is_array_of_mixed_numbers_strings(p)) {
                 result.push_back(tokenize_mixed(vocab, p, add_special, parse_special));
+            } else if (json_is_array_of_strings(p)) {
+                result.push_back(tokenize_segments(vocab, tokenize_head, p, add_special, parse_special));
             } else if (json_is_array_of_numbers(p)) {
                 // array of tokens
                 result.push_back(p.get<llama_tokens>());
             } else {
-                throw std::runtime_error("element of \"prompt\" must be a string, an list of tokens, or a list of mixed strings & tokens");
+                throw std::runtime_error("element of \"prompt\" must be a string, an list of tokens, a list of strings, or a list of mixed strings & tokens");
             }
         }
     } else {
@@ -457,6 +562,46 @@ static size_t find_partial_stop_string(const std::string &stop, const std::strin
     return std::string::npos;
 }
 
+// map keeping only the n_max most recently used entries, not thread-safe
+template <typename T>
+struct lru_cache {
+    using entry = std::pair<std::string, T>;
+
+    size_t n_max;
+
+    std::list<entry> entries; // most recently used first
+    std::unordered_map<std::string, typename std::list<entry>::iterator> index;
+
+    explicit lru_cache(size_t n_max) : n_max(n_max) {}
+
+    T * get(const std::string & key) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->second;
+    }
+
+    T & put(const std::string & key, T value) {
+        auto it = index.find(key);
+        if (it != index.end()) {
+            entries.erase(it->second);
+            index.erase(it);
+        }
+
+        entries.emplace_front(key, std::move(value));
+        index[key] = entries.begin();
+
+        while (entries.size() > std::max<size_t>(n_max, 1)) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+
+        return entries.front().second;
+    }
+};
+
 // TODO: reuse llama_detokenize
 template <class Iter>
 static std::string tokens_to_str(llama_context * ctx, Iter begin, Iter end) {
@@ -495,6 +640,84 @@ static bool server_sent_event(httplib::DataSink & sink, const char * event, cons
     return sink.write(str.c_str(), str.size());
 }
 
+// append str to out as a JSON string, the same way as json::dump() with error_handler_t::replace
+// escaping and UTF-8 validation are done in a single pass, invalid sequences are replaced with U+FFFD
+static void json_append_string(std::string & out, const std::string & str) {
+    static const char hex[] = "0123456789abcdef";
+
+    out += '"';
+
+    const size_t n = str.size();
+    size_t i = 0;
+    while (i < n) {
+        const unsigned char c = str[i];
+
+        if (c < 0x80) {
+            switch (c) {
+                case '"':  out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\b': out += "\\b";  break;
+                case '\f': out += "\\f";  break;
+                case '\n': out += "\\n";  break;
+                case '\r': out += "\\r";  break;
+                case '\t': out += "\\t";  break;
+                default:
+                    if (c < 0x20) {
+                        out += "\\u00";
+                        out += hex[c >> 4];
+                        out += hex[c & 0xf];
+                    } else {
+                        out += (char) c;
+                    }
+            }
+            i++;
+            continue;
+        }
+
+        // length of the sequence and valid range of its second byte (no overlongs, surrogates or > U+10FFFF)
+        size_t len = 0;
+        unsigned char lo = 0x80;
+        unsigned char hi = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) {
+            len = 2;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            len = 3;
+            lo = c == 0xe0 ? 0xa0 : lo;
+            hi = c == 0xed ? 0x9f : hi;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            len = 4;
+            lo = c == 0xf0 ? 0x90 : lo;
+            hi = c == 0xf4 ? 0x8f : hi;
+        }
+
+        size_t k = 1;
+        while (k < len && i + k < n) {
+            const unsigned char cc = str[i + k];
+            if (cc < (k == 1 ? lo : 0x80) || cc > (k == 1 ? hi : 0xbf)) {
+                break;
+            }
+            k++;
+        }
+
+        if (len > 0 && k == len) {
+            out.append(str, i, len);
+            i += len;
+        } else {
+            // the byte that broke the sequence may start a valid one, so it is processed again
+            out += "\xef\xbf\xbd";
+            i += k;
+        }
+    }
+
+    out += '"';
+}
+
+static void json_append_int(std::string & out, int64_t value) {
+    char buf[24];
+    const auto res = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, res.ptr);
+}
+
 //
 // OAI utils
 //
@@ -850,6 +1073,15 @@ static bool are_lora_equal(
     return true;
 }
 
+static bool is_lora_active(const std::vector<common_adapter_lora_info> & lora) {
+    for (const auto & la : lora) {
+        if (la.scale != 0.0f) {
+            return true;
+        }
+    }
+    return false;
+}
+
 // parse lora config from JSON request, returned a copy of lora_base with updated scale
 static std::vector<common_adapter_lora_info> parse_lora_request(
         const std::vector<common_adapter_lora_info> & lora_base,
@@ -3,6 +3,7 @@
 #include "llama-impl.h"
 #include "llama-mmap.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstring>
@@ -129,11 +130,7 @@ void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch) {
     if (lctx.inp_KQ_mask || lctx.inp_KQ_mask_swa) {
         // NOTE: hparams.causal_attn indicates the model is capable of generation and uses the kv cache.
         if (cparams.causal_attn && !lctx.is_encoding) {
-            const int64_t n_kv         = kv_self.n;
-            const int64_t n_tokens     = ubatch.n_tokens;
-            const int64_t n_seq_tokens = ubatch.n_seq_tokens;
-            const int64_t n_seqs       = ubatch.n_seqs;
-
+            const int64_t n_kv = kv_self.n;
 
             float * data     = nullptr;
             float * data_swa = nullptr;
@@ -148,59 +145,7 @@ void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch) {
                 data_swa = (float *) lctx.inp_KQ_mask_swa->data;
             }
 
-            // For causal attention, use only the previous KV cells
-            // of the correct sequence for each token of the ubatch.
-            // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
-            for (int h = 0; h < 1; ++h) {
-                for (int s = 0; s < n_seqs; ++s) {
-                    const llama_seq_id seq_id = ubatch.seq_id[s][0];
-
-                    for (int j = 0; j < n_seq_tokens; ++j) {
-                        const llama_pos pos = ubatch.pos[s*n_seq_tokens + j];
-
-                        for (int i = 0; i < n_kv; ++i) {
-                            float f;
-                            if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                                f = -INFINITY;
-                            } else {
-                                if (hparams.use_alibi) {
-                                    f = -std::abs(kv_self.cells[i].pos - pos);
-                                } else {
-                                    f = 0.0f;
-                                }
-                            }
-
-                            if (data) {
-                                data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
-                            }
-
-                            // may need to cut off old tokens for sliding window
-                            if (data_swa) {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
-                                }
-                                data_swa[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
-                            }
-                        }
-                    }
-                }
-
-                if (data) {
-                    for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                        for (int j = 0; j < n_kv; ++j) {
-                            data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                        }
-                    }
-                }
-
-                if (data_swa) {
-                    for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                        for (int j = 0; j < n_kv; ++j) {
-                            data_swa[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                        }
-                    }
-                }
-            }
+            llama_kv_cache_set_kq_mask(kv_self, ubatch, n_kv, hparams.use_alibi, hparams.n_swa, data, data_swa);
         } else {
             const int64_t n_tokens     = ubatch.n_tokens;
             const int64_t n_seq_tokens = ubatch.n_seq_tokens;
@@ -602,6 +547,20 @@ uint32_t llama_n_seq_max(const struct llama_context * ctx) {
     return ctx->kv_self.size;
 }
 
+size_t llama_context_size(const struct llama_context * ctx) {
+    size_t size = ctx->kv_self.total_size();
+
+    if (ctx->buf_output) {
+        size += ggml_backend_buffer_get_size(ctx->buf_output.get());
+    }
+
+    for (const auto & backend : ctx->backends) {
+        size += ggml_backend_sched_get_buffer_size(ctx->sched.get(), backend.get());
+    }
+
+    return size;
+}
+
 const struct llama_model * llama_get_model(const struct llama_context * ctx) {
     return &ctx->model;
 }
@@ -1053,6 +1012,9 @@ struct llama_data_read {
     virtual size_t get_size_read() = 0;
     virtual ~llama_data_read() = default;
 
+    // the [begin, end) ranges of cells the KV data is read into, in order, set by read_kv_cache_meta
+    std::vector<std::pair<uint32_t, uint32_t>> kv_cells;
+
     void read_string(std::string & str) {
         uint32_t str_size;
         read_to(&str_size, sizeof(str_size));
@@ -1165,18 +1127,39 @@ struct llama_data_read {
             }
             batch.n_seq_id[0] = 1;
             batch.seq_id[0] = &dest_seq_id;
-            if (!llama_kv_cache_find_slot(kv_self, batch)) {
+
+            // with the paged layout the state is scattered over free blocks like a prompt, so that it does not need
+            // a contiguous range of cells, which nothing creates when defragmentation is off
+            // no graph is built for the copy, the number of runs is not limited
+            const uint32_t max_runs = kv_self.max_runs;
+            kv_self.max_runs = kv_self.size;
+            const auto slot = llama_kv_cache_find_slot(kv_self, batch);
+            kv_self.max_runs = max_runs;
+            kv_self.runs.clear();
+            if (!slot) {
                 LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
                 return false;
             }
 
-            // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
-            // Assume that this is one contiguous block of cells
-            GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
-            GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-            GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+            kv_cells = slot.cells;
+            if (kv_self.recurrent) {
+                kv_cells = { { kv_self.head, kv_self.head + cell_count } };
+            }
+
+            // DEBUG CHECK: the cells hold the positions of the state in order (verify seq_id and pos values)
+            uint32_t i = 0;
+            for (const auto & range : kv_cells) {
+                if (range.first == range.second) {
+                    continue;
+                }
+                GGML_ASSERT(range.second <= kv_self.size);
+                GGML_ASSERT(kv_self.cells[range.first].pos == batch.pos[i]);
+                GGML_ASSERT(kv_self.cells[range.second - 1].pos == batch.pos[i + range.second - range.first - 1]);
+                GGML_ASSERT(kv_self.cells[range.first].has_seq_id(dest_seq_id));
+                GGML_ASSERT(kv_self.cells[range.second - 1].has_seq_id(dest_seq_id));
+                i += range.second - range.first;
+            }
+            GGML_ASSERT(i == cell_count);
         } else {
             // whole KV cache restore
 
@@ -1220,8 +1203,12 @@ struct llama_data_read {
                 }
             }
 
+            llama_kv_cache_seq_index_rebuild(kv_self);
+
             kv_self.head = 0;
             kv_self.used = cell_count;
+
+            kv_cells = { { 0, cell_count } };
         }
 
         if (kv_self.recurrent) {
@@ -1279,8 +1266,13 @@ struct llama_data_read {
             }
 
             if (cell_count) {
-                // Read and set the keys for the whole cell range
-                ggml_backend_tensor_set(kv_self.k_l[il], read(cell_count * k_size_row), kv_self.head * k_size_row, cell_count * k_size_row);
+                // Read the keys for the whole cell range and set them in each range of cells
+                const uint8_t * src = read(cell_count * k_size_row);
+                for (const auto & range : kv_cells) {
+                    const size_t n = range.second - range.first;
+                    ggml_backend_tensor_set(kv_self.k_l[il], src, range.first * k_size_row, n * k_size_row);
+                    src += n * k_size_row;
+                }
             }
         }
 
@@ -1307,8 +1299,13 @@ struct llama_data_read {
                 }
 
                 if (cell_count) {
-                    // Read and set the values for the whole cell range
-                    ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_row), kv_self.head * v_size_row, cell_count * v_size_row);
+                    // Read the values for the whole cell range and set them in each range of cells
+                    const uint8_t * src = read(cell_count * v_size_row);
+                    for (const auto & range : kv_cells) {
+                        const size_t n = range.second - range.first;
+                        ggml_backend_tensor_set(kv_self.v_l[il], src, range.first * v_size_row, n * v_size_row);
+                        src += n * v_size_row;
+                    }
                 }
             }
         } else {
@@ -1345,8 +1342,13 @@ struct llama_data_read {
                 if (cell_count) {
                     // For each row in the transposed matrix, read the values for the whole cell range
                     for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                        const size_t dst_offset = (kv_self.head + j * kv_self.size) * v_size_el;
-                        ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+                        const uint8_t * src = read(cell_count * v_size_el);
+                        for (const auto & range : kv_cells) {
+                            const size_t n = range.second - range.first;
+                            const size_t dst_offset = (range.first + j * kv_self.size) * v_size_el;
+                            ggml_backend_tensor_set(kv_self.v_l[il], src, dst_offset, n * v_size_el);
+                            src += n * v_size_el;
+                        }
                     }
                 }
             }
@@ -50,6 +50,10 @@ struct llama_context {
     mutable int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     mutable int32_t n_eval   = 0; // number of eval calls
 
+    int64_t  t_defrag_us    = 0;
+    uint64_t n_defrag       = 0; // number of defrag steps
+    uint64_t n_defrag_cells = 0; // number of KV cells moved by defrag
+
     // host buffer for the model output (logits and embeddings)
     ggml_backend_buffer_ptr buf_output;
 
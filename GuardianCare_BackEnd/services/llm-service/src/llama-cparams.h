@@ -4,6 +4,8 @@
 
 #include <cstdint>
 
+#define LLAMA_MAX_PARALLEL_SEQUENCES 64
+
 struct llama_cparams {
     uint32_t n_ctx;           // context size used during inference
     uint32_t n_batch;
@@ -24,6 +26,9 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t n_kv_block; // 0 = contiguous KV cache
+    uint32_t defrag_step; // 0 = defragment in one go
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
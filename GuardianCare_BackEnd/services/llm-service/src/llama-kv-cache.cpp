@@ -6,11 +6,104 @@
 #include "llama-model.h"
 
 #include <algorithm>
+#include <cmath>
 #include <limits>
 #include <map>
 
 static const llama_kv_cache_slot_info llama_kv_cache_slot_info_failed{false};
 
+// the seq_id of the cells are changed through these, to keep llama_kv_cache::seq_cells and the free blocks in sync
+
+static void llama_kv_cell_block_ref(struct llama_kv_cache & cache, uint32_t i) {
+    const uint32_t block = i/cache.block_size;
+    if (cache.block_used[block]++ == 0) {
+        cache.blocks_free[block/64] &= ~(uint64_t(1) << (block%64));
+    }
+}
+
+static void llama_kv_cell_block_unref(struct llama_kv_cache & cache, uint32_t i) {
+    const uint32_t block = i/cache.block_size;
+    if (--cache.block_used[block] == 0) {
+        cache.blocks_free[block/64] |= uint64_t(1) << (block%64);
+    }
+}
+
+static void llama_kv_cell_seq_add(struct llama_kv_cache & cache, uint32_t i, llama_seq_id seq_id) {
+    if (cache.block_size > 0 && cache.cells[i].is_empty()) {
+        llama_kv_cell_block_ref(cache, i);
+    }
+    cache.cells[i].seq_id.insert(seq_id);
+    cache.seq_cells[seq_id][i/64] |= uint64_t(1) << (i%64);
+}
+
+static void llama_kv_cell_seq_erase(struct llama_kv_cache & cache, uint32_t i, llama_seq_id seq_id) {
+    const bool used = !cache.cells[i].is_empty();
+    cache.cells[i].seq_id.erase(seq_id);
+    cache.seq_cells[seq_id][i/64] &= ~(uint64_t(1) << (i%64));
+    if (cache.block_size > 0 && used && cache.cells[i].is_empty()) {
+        llama_kv_cell_block_unref(cache, i);
+    }
+}
+
+static void llama_kv_cell_seq_clear(struct llama_kv_cache & cache, uint32_t i) {
+    if (cache.block_size > 0 && !cache.cells[i].is_empty()) {
+        llama_kv_cell_block_unref(cache, i);
+    }
+    for (const llama_seq_id seq_id : cache.cells[i].seq_id) {
+        cache.seq_cells[seq_id][i/64] &= ~(uint64_t(1) << (i%64));
+    }
+    cache.cells[i].seq_id.clear();
+}
+
+void llama_kv_cache_seq_index_rebuild(struct llama_kv_cache & cache) {
+    for (auto & words : cache.seq_cells) {
+        words.assign((cache.size + 63)/64, 0);
+    }
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        for (const llama_seq_id seq_id : cache.cells[i].seq_id) {
+            cache.seq_cells[seq_id][i/64] |= uint64_t(1) << (i%64);
+        }
+    }
+
+    cache.blocks_free.clear();
+    cache.block_used.clear();
+
+    if (cache.block_size > 0) {
+        const uint32_t n_blocks = (cache.size + cache.block_size - 1)/cache.block_size;
+
+        cache.blocks_free.assign((n_blocks + 63)/64, 0);
+        cache.block_used.assign(n_blocks, 0);
+
+        for (uint32_t i = 0; i < cache.size; ++i) {
+            if (!cache.cells[i].is_empty()) {
+                cache.block_used[i/cache.block_size]++;
+            }
+        }
+        for (uint32_t block = 0; block < n_blocks; ++block) {
+            if (cache.block_used[block] == 0) {
+                cache.blocks_free[block/64] |= uint64_t(1) << (block%64);
+            }
+        }
+    }
+
+    std::fill(std::begin(cache.seq_next), std::end(cache.seq_next), -1);
+}
+
+void llama_kv_cache_cell_move(struct llama_kv_cache & cache, uint32_t dst, uint32_t src) {
+    const llama_kv_seq_set seq_ids = cache.cells[src].seq_id;
+
+    llama_kv_cell_seq_clear(cache, dst);
+    llama_kv_cell_seq_clear(cache, src);
+
+    cache.cells[dst] = cache.cells[src];
+    cache.cells[src] = llama_kv_cell();
+
+    for (const llama_seq_id seq_id : seq_ids) {
+        llama_kv_cell_seq_add(cache, dst, seq_id);
+    }
+}
+
 uint32_t llama_kv_cache_get_padding(const struct llama_cparams & cparams) {
     // the FA kernels require padding to avoid extra runtime boundary checks
     return cparams.flash_attn ? 256u : 32u;
@@ -47,6 +140,17 @@ bool llama_kv_cache_init(
     cache.cells.clear();
     cache.cells.resize(kv_size);
 
+    cache.block_size = cache.recurrent ? 0 : std::min(cparams.n_kv_block, kv_size);
+    cache.max_runs   = std::max<uint32_t>(1, model.max_nodes()/2 / (8*n_layer));
+    cache.block_tables.clear();
+    cache.runs.clear();
+
+    llama_kv_cache_seq_index_rebuild(cache);
+
+    if (cache.block_size > 0) {
+        LLAMA_LOG_INFO("%s: paged layout, block_size = %u, max_runs = %u\n", __func__, cache.block_size, cache.max_runs);
+    }
+
     // create a context for each buffer type
     std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
     auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
@@ -117,6 +221,204 @@ bool llama_kv_cache_init(
     return true;
 }
 
+// next cell of the tokens of the sequences seq_ids in the last block of the table of seq_id, one of them, -1 if the
+// block is full or also holds other cells
+// follows the cursor of seq_id, the block is only scanned when the cursor was invalidated
+static int32_t llama_kv_cache_block_next(struct llama_kv_cache & cache, llama_seq_id seq_id, const llama_kv_seq_set & seq_ids) {
+    const auto it = cache.block_tables.find(seq_id);
+    if (it == cache.block_tables.end() || it->second.empty()) {
+        return -1;
+    }
+
+    const uint32_t begin = it->second.back()*cache.block_size;
+    const uint32_t end   = std::min(begin + cache.block_size, cache.size);
+
+    int32_t & next = cache.seq_next[seq_id];
+    if (next > (int32_t) begin && next <= (int32_t) end) {
+        if (next == (int32_t) end) {
+            return -1;
+        }
+        // other tokens can be written to the empty cells of the block when no block is free
+        if (cache.cells[next].is_empty() && cache.cells[next - 1].seq_id == seq_ids) {
+            return next;
+        }
+    }
+
+    next = begin;
+    for (uint32_t i = begin; i < end; ++i) {
+        const llama_kv_cell & cell = cache.cells[i];
+        if (cell.is_empty()) {
+            continue;
+        }
+        if (!(cell.seq_id == seq_ids)) {
+            next = end;
+            return -1;
+        }
+        next = i + 1;
+    }
+
+    return next < (int32_t) end ? next : -1;
+}
+
+static bool llama_kv_cache_block_has_seq(const struct llama_kv_cache & cache, uint32_t block, llama_seq_id seq_id) {
+    const uint32_t begin = block*cache.block_size;
+    const uint32_t end   = std::min(begin + cache.block_size, cache.size);
+
+    const auto & words = cache.seq_cells[seq_id];
+    for (uint32_t i = begin; i < end; i = (i/64 + 1)*64) {
+        const uint32_t n = std::min(end, (i/64 + 1)*64) - i;
+
+        uint64_t bits = words[i/64] >> (i%64);
+        if (n < 64) {
+            bits &= (uint64_t(1) << n) - 1;
+        }
+        if (bits) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// lowest block without any used cell, -1 if none
+static int32_t llama_kv_cache_block_free(const struct llama_kv_cache & cache) {
+    for (size_t w = 0; w < cache.blocks_free.size(); ++w) {
+        if (cache.blocks_free[w]) {
+            return (int32_t) (w*64 + llama_kv_ctz64(cache.blocks_free[w]));
+        }
+    }
+
+    return -1;
+}
+
+// forget the blocks the sequence does not use anymore, after its cells were removed
+static void llama_kv_cache_block_table_prune(struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    const auto it = cache.block_tables.find(seq_id);
+    if (it == cache.block_tables.end()) {
+        return;
+    }
+
+    auto & table = it->second;
+    table.erase(std::remove_if(table.begin(), table.end(), [&](uint32_t b) {
+        return !llama_kv_cache_block_has_seq(cache, b, seq_id);
+    }), table.end());
+
+    if (table.empty()) {
+        cache.block_tables.erase(it);
+    }
+}
+
+// place each token after the last one of its sequence, in a new block when the last one is full or shared
+// the tokens of several sequences go to blocks of their own, added to the block table of each of the sequences
+// fails if the tokens end up in more than max_runs runs of cells, the caller then looks for a contiguous range
+static struct llama_kv_cache_slot_info llama_kv_cache_find_slot_paged(
+           struct llama_kv_cache & cache,
+       const struct llama_ubatch & ubatch) {
+    const uint32_t n_tokens     = ubatch.n_tokens;
+    const uint32_t n_seqs       = ubatch.n_seqs;
+    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
+
+    std::vector<uint32_t> ids;
+    ids.reserve(n_tokens);
+
+    uint32_t i_any = 0; // when no block is free, any empty cell will do
+
+    std::vector<llama_seq_id> pushed; // the block tables that got a new block, to undo
+
+    for (uint32_t s = 0; s < n_seqs && ids.size() == s*n_seq_tokens; ++s) {
+        const int32_t      n_seq_id = ubatch.n_seq_id[s];
+        const llama_seq_id seq_id   = ubatch.seq_id[s][0]; // the cursor of the tokens is the one of this sequence
+
+        llama_kv_seq_set seq_ids;
+        for (int32_t j = 0; j < n_seq_id; j++) {
+            seq_ids.insert(ubatch.seq_id[s][j]);
+        }
+
+        for (uint32_t i = 0; i < n_seq_tokens; ++i) {
+            const uint32_t k = s*n_seq_tokens + i;
+
+            int32_t id = llama_kv_cache_block_next(cache, seq_id, seq_ids);
+            if (id < 0) {
+                const int32_t block = llama_kv_cache_block_free(cache);
+                if (block >= 0) {
+                    for (const llama_seq_id other : seq_ids) {
+                        cache.block_tables[other].push_back(block);
+                        pushed.push_back(other);
+                    }
+                    id = block*cache.block_size;
+
+                    // the block is shared, the next token of the other sequences alone goes to a new block
+                    for (const llama_seq_id other : seq_ids) {
+                        if (other != seq_id) {
+                            cache.seq_next[other] = (int32_t) std::min<uint32_t>(id + cache.block_size, cache.size);
+                        }
+                    }
+                }
+            }
+
+            const bool in_block = id >= 0;
+            if (!in_block) {
+                while (i_any < cache.size && !cache.cells[i_any].is_empty()) {
+                    i_any++;
+                }
+                if (i_any == cache.size) {
+                    break;
+                }
+                id = i_any;
+            }
+
+            cache.cells[id].pos = ubatch.pos[k];
+            for (int32_t j = 0; j < n_seq_id; j++) {
+                llama_kv_cell_seq_add(cache, id, ubatch.seq_id[s][j]);
+            }
+            ids.push_back(id);
+
+            if (in_block) {
+                cache.seq_next[seq_id] = id + 1;
+            }
+        }
+    }
+
+    cache.runs.clear();
+    for (uint32_t k = 0; k < ids.size(); ++k) {
+        if (!cache.runs.empty() && cache.runs.back().cell + cache.runs.back().n == ids[k]) {
+            cache.runs.back().n++;
+        } else {
+            cache.runs.push_back({k, ids[k], 1});
+        }
+    }
+
+    if (ids.size() < n_tokens || cache.runs.size() > cache.max_runs) {
+        for (const uint32_t id : ids) {
+            cache.cells[id].pos = -1;
+            llama_kv_cell_seq_clear(cache, id);
+        }
+        for (auto it = pushed.rbegin(); it != pushed.rend(); ++it) {
+            cache.block_tables[*it].pop_back();
+        }
+        std::fill(std::begin(cache.seq_next), std::end(cache.seq_next), -1);
+        cache.runs.clear();
+
+        return llama_kv_cache_slot_info_failed;
+    }
+
+    cache.used += n_tokens;
+
+    const auto minmax = std::minmax_element(ids.begin(), ids.end());
+
+    // the graph stores the runs, head only marks the lowest cell
+    cache.head = *minmax.first;
+
+    // the cells between the runs belong to other sequences, a rollback must only clear the runs
+    llama_kv_cache_slot_info slot(*minmax.first, *minmax.second + 1);
+    slot.cells.clear();
+    for (const auto & run : cache.runs) {
+        slot.cells.emplace_back(run.cell, run.cell + run.n);
+    }
+
+    return slot;
+}
+
 struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
            struct llama_kv_cache & cache,
        const struct llama_ubatch & ubatch) {
@@ -124,6 +426,8 @@ struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
     const uint32_t n_seqs   = ubatch.n_seqs;
     const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
 
+    cache.runs.clear();
+
     if (cache.recurrent) {
         // For recurrent state architectures (like Mamba or RWKV),
         // each cache cell can store the state for a whole sequence.
@@ -153,7 +457,7 @@ struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
                         llama_kv_cell & cell = cache.cells[seq.tail];
                         // clear cells from seq_ids that become shared
                         // (should not normally happen, but let's handle it anyway)
-                        cell.seq_id.erase(seq_id);
+                        llama_kv_cell_seq_erase(cache, seq.tail, seq_id);
                         seq.tail = -1;
                         if (cell.seq_id.empty()) {
                             cell.pos = -1;
@@ -277,6 +581,9 @@ struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
             }
         }
 
+        // the cells moved around, there are only n_seq_max of them
+        llama_kv_cache_seq_index_rebuild(cache);
+
         // allow getting the range of used cells, from head to head + n
         cache.head = min;
         cache.n    = max - min + 1;
@@ -288,6 +595,22 @@ struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
     }
     // otherwise, one cell per token.
 
+    llama_kv_seq_set seq_ids;
+    for (uint32_t s = 0; s < n_seqs; s++) {
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; j++) {
+            seq_ids.insert(ubatch.seq_id[s][j]);
+        }
+    }
+
+    if (cache.block_size > 0) {
+        auto slot = llama_kv_cache_find_slot_paged(cache, ubatch);
+        if (slot) {
+            slot.seq_ids = seq_ids;
+            return slot;
+        }
+        // too scattered for a single graph, try a contiguous range instead
+    }
+
     if (n_tokens > cache.size) {
         LLAMA_LOG_ERROR("%s: n_tokens=%d > cache.size=%d\n", __func__, n_tokens, cache.size);
         return llama_kv_cache_slot_info_failed;
@@ -328,14 +651,128 @@ struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
             cache.cells[cache.head + k].pos = ubatch.pos[k];
 
             for (int32_t j = 0; j < ubatch.n_seq_id[s]; j++) {
-                cache.cells[cache.head + k].seq_id.insert(ubatch.seq_id[s][j]);
+                llama_kv_cell_seq_add(cache, cache.head + k, ubatch.seq_id[s][j]);
             }
         }
     }
 
     cache.used += n_tokens;
 
-    return llama_kv_cache_slot_info(cache.head, cache.head + n_tokens);
+    // the sequences append to the last block they hold, including the ones of a contiguous fallback
+    if (cache.block_size > 0) {
+        for (uint32_t block = cache.head/cache.block_size; block <= (cache.head + n_tokens - 1)/cache.block_size; ++block) {
+            for (const llama_seq_id seq_id : seq_ids) {
+                auto & table = cache.block_tables[seq_id];
+                table.erase(std::remove(table.begin(), table.end(), block), table.end());
+                table.push_back(block);
+            }
+        }
+        for (const llama_seq_id seq_id : seq_ids) {
+            cache.seq_next[seq_id] = -1;
+        }
+    }
+
+    llama_kv_cache_slot_info slot(cache.head, cache.head + n_tokens);
+    slot.seq_ids = seq_ids;
+
+    return slot;
+}
+
+void llama_kv_cache_slot_rm(
+                   struct llama_kv_cache & cache,
+    const struct llama_kv_cache_slot_info & slot) {
+    for (const auto & range : slot.cells) {
+        for (uint32_t i = range.first; i < range.second; ++i) {
+            llama_kv_cell & cell = cache.cells[i];
+            if (cell.is_empty()) {
+                continue;
+            }
+
+            for (const llama_seq_id seq_id : slot.seq_ids) {
+                if (cell.has_seq_id(seq_id)) {
+                    llama_kv_cell_seq_erase(cache, i, seq_id);
+                }
+            }
+
+            if (cell.is_empty()) {
+                cache.used--;
+
+                cell.pos = -1;
+                cell.src = -1;
+            }
+        }
+    }
+
+    if (cache.block_size > 0) {
+        for (const llama_seq_id seq_id : slot.seq_ids) {
+            llama_kv_cache_block_table_prune(cache, seq_id);
+            cache.seq_next[seq_id] = -1;
+        }
+    }
+}
+
+void llama_kv_cache_set_kq_mask(
+    const struct llama_kv_cache & cache,
+      const struct llama_ubatch & ubatch,
+                        int64_t   n_kv,
+                           bool   use_alibi,
+                       uint32_t   n_swa,
+                          float * data,
+                          float * data_swa) {
+    const int64_t n_tokens     = ubatch.n_tokens;
+    const int64_t n_seq_tokens = ubatch.n_seq_tokens;
+    const int64_t n_seqs       = ubatch.n_seqs;
+
+    // For causal attention, use only the previous KV cells
+    // of the correct sequence for each token of the ubatch.
+    // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
+    for (int h = 0; h < 1; ++h) {
+        for (int s = 0; s < n_seqs; ++s) {
+            const llama_seq_id seq_id = ubatch.seq_id[s][0];
+
+            for (int j = 0; j < n_seq_tokens; ++j) {
+                const llama_pos pos = ubatch.pos[s*n_seq_tokens + j];
+
+                float * row     = data     ? data     + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv : nullptr;
+                float * row_swa = data_swa ? data_swa + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv : nullptr;
+
+                if (row) {
+                    std::fill(row, row + n_kv, -INFINITY);
+                }
+                if (row_swa) {
+                    std::fill(row_swa, row_swa + n_kv, -INFINITY);
+                }
+
+                llama_kv_cache_seq_for_each(cache, seq_id, n_kv, [&](uint32_t i) {
+                    const llama_pos p = cache.cells[i].pos;
+                    if (p > pos) {
+                        return;
+                    }
+
+                    const float f = use_alibi ? -std::abs(p - pos) : 0.0f;
+
+                    if (row) {
+                        row[i] = f;
+                    }
+
+                    // may need to cut off old tokens for sliding window
+                    if (row_swa && pos - p < (int32_t) n_swa) {
+                        row_swa[i] = f;
+                    }
+                });
+            }
+        }
+
+        if (data) {
+            std::fill(data + h*(n_kv*n_tokens) + n_tokens*n_kv,
+                      data + h*(n_kv*n_tokens) + GGML_PAD(n_tokens, GGML_KQ_MASK_PAD)*n_kv, -INFINITY);
+        }
+
+        if (data_swa) {
+            std::fill(data_swa + h*(n_kv*n_tokens) + n_tokens*n_kv,
+                      data_swa + h*(n_kv*n_tokens) + GGML_PAD(n_tokens, GGML_KQ_MASK_PAD)*n_kv, -INFINITY);
+        }
+    }
 }
 
 uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
@@ -359,6 +796,9 @@ void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     }
     cache.head = 0;
     cache.used = 0;
+    cache.block_tables.clear();
+
+    llama_kv_cache_seq_index_rebuild(cache);
 
     for (auto & buf : cache.bufs) {
         ggml_backend_buffer_clear(buf.get(), 0);
@@ -402,29 +842,59 @@ bool llama_kv_cache_seq_rm(
         }
     }
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
-            } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
-            } else {
-                continue;
-            }
-            if (cache.cells[i].is_empty()) {
-                // keep count of the number of used cells
-                if (cache.cells[i].pos >= 0) cache.used--;
+    const auto rm_cell = [&](uint32_t i) {
+        if (cache.cells[i].pos < p0 || cache.cells[i].pos >= p1) {
+            return;
+        }
+        if (seq_id < 0) {
+            llama_kv_cell_seq_clear(cache, i);
+        } else {
+            llama_kv_cell_seq_erase(cache, i, seq_id);
+        }
+        if (cache.cells[i].is_empty()) {
+            // keep count of the number of used cells
+            if (cache.cells[i].pos >= 0) cache.used--;
 
-                cache.cells[i].pos = -1;
-                cache.cells[i].src = -1;
-                if (new_head == cache.size) new_head = i;
-            }
+            cache.cells[i].pos = -1;
+            cache.cells[i].src = -1;
+            if (new_head == cache.size) new_head = i;
+        }
+    };
+
+    if (seq_id < 0) {
+        for (uint32_t i = 0; i < cache.size; ++i) {
+            rm_cell(i);
         }
+    } else {
+        llama_kv_cache_seq_for_each(cache, seq_id, cache.size, rm_cell);
     }
 
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
 
+    if (cache.block_size > 0) {
+        if (p0 == 0 && p1 == std::numeric_limits<llama_pos>::max()) {
+            if (seq_id < 0) {
+                cache.block_tables.clear();
+            } else {
+                cache.block_tables.erase(seq_id);
+            }
+        } else if (seq_id < 0) {
+            for (llama_seq_id s = 0; s < LLAMA_MAX_PARALLEL_SEQUENCES; ++s) {
+                llama_kv_cache_block_table_prune(cache, s);
+            }
+        } else if ((uint32_t) seq_id < LLAMA_MAX_PARALLEL_SEQUENCES) {
+            llama_kv_cache_block_table_prune(cache, seq_id);
+        }
+
+        // the cells freed in the last block can be written again
+        if (seq_id < 0) {
+            std::fill(std::begin(cache.seq_next), std::end(cache.seq_next), -1);
+        } else if ((uint32_t) seq_id < LLAMA_MAX_PARALLEL_SEQUENCES) {
+            cache.seq_next[seq_id] = -1;
+        }
+    }
+
     return true;
 }
 
@@ -445,7 +915,7 @@ void llama_kv_cache_seq_cp(
                 // clear destination seq_id if it wasn't empty
                 llama_kv_cell & cell_dst = cache.cells[tail_dst.tail];
 
-                cell_dst.seq_id.erase(seq_id_dst);
+                llama_kv_cell_seq_erase(cache, tail_dst.tail, seq_id_dst);
                 tail_dst.tail = -1;
                 if (cell_dst.seq_id.empty()) {
                     cell_dst.pos = -1;
@@ -455,9 +925,7 @@ void llama_kv_cache_seq_cp(
                 }
             }
             if (tail_src.tail >= 0) {
-                llama_kv_cell & cell_src = cache.cells[tail_src.tail];
-
-                cell_src.seq_id.insert(seq_id_dst);
+                llama_kv_cell_seq_add(cache, tail_src.tail, seq_id_dst);
                 tail_dst.tail = tail_src.tail;
             }
         }
@@ -468,10 +936,25 @@ void llama_kv_cache_seq_cp(
 
     cache.head = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+    if ((uint32_t) seq_id_dst >= LLAMA_MAX_PARALLEL_SEQUENCES) {
+        return;
+    }
+
+    llama_kv_cache_seq_for_each(cache, seq_id_src, cache.size, [&](uint32_t i) {
+        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+            llama_kv_cell_seq_add(cache, i, seq_id_dst);
         }
+    });
+
+    // the blocks are shared, the next token of either sequence goes to a new block
+    if (cache.block_size > 0 && seq_id_src != seq_id_dst && (uint32_t) seq_id_src < LLAMA_MAX_PARALLEL_SEQUENCES) {
+        const auto it = cache.block_tables.find(seq_id_src);
+        if (it != cache.block_tables.end()) {
+            auto & table = cache.block_tables[seq_id_dst];
+            table.insert(table.end(), it->second.begin(), it->second.end());
+        }
+        cache.seq_next[seq_id_src] = -1;
+        cache.seq_next[seq_id_dst] = -1;
     }
 }
 
@@ -486,16 +969,21 @@ void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id)
             if (cache.cells[i].pos >= 0) cache.used--;
             cache.cells[i].pos = -1;
             cache.cells[i].src = -1;
-            cache.cells[i].seq_id.clear();
+            llama_kv_cell_seq_clear(cache, i);
             if (new_head == cache.size) new_head = i;
         } else {
-            cache.cells[i].seq_id.clear();
-            cache.cells[i].seq_id.insert(seq_id);
+            llama_kv_cell_seq_clear(cache, i);
+            llama_kv_cell_seq_add(cache, i, seq_id);
         }
     }
 
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+
+    for (auto it = cache.block_tables.begin(); it != cache.block_tables.end();) {
+        it = it->first == seq_id ? std::next(it) : cache.block_tables.erase(it);
+    }
+    std::fill(std::begin(cache.seq_next), std::end(cache.seq_next), -1);
 }
 
 void llama_kv_cache_seq_add(
@@ -525,8 +1013,8 @@ void llama_kv_cache_seq_add(
         return;
     }
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+    llama_kv_cache_seq_for_each(cache, seq_id, cache.size, [&](uint32_t i) {
+        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             cache.has_shift = true;
             cache.cells[i].pos   += delta;
             cache.cells[i].delta += delta;
@@ -536,13 +1024,13 @@ void llama_kv_cache_seq_add(
                     cache.used--;
                 }
                 cache.cells[i].pos = -1;
-                cache.cells[i].seq_id.clear();
+                llama_kv_cell_seq_clear(cache, i);
                 if (new_head == cache.size) {
                     new_head = i;
                 }
             }
         }
-    }
+    });
 
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
@@ -574,8 +1062,8 @@ void llama_kv_cache_seq_div(
         return;
     }
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+    llama_kv_cache_seq_for_each(cache, seq_id, cache.size, [&](uint32_t i) {
+        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             cache.has_shift = true;
 
             {
@@ -584,17 +1072,15 @@ void llama_kv_cache_seq_div(
                 cache.cells[i].delta += cache.cells[i].pos - p_old;
             }
         }
-    }
+    });
 }
 
 llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     llama_pos result = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id)) {
-            result = std::max(result, cache.cells[i].pos);
-        }
-    }
+    llama_kv_cache_seq_for_each(cache, seq_id, cache.size, [&](uint32_t i) {
+        result = std::max(result, cache.cells[i].pos);
+    });
 
     return result;
 }
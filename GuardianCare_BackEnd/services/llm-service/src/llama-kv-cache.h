@@ -1,22 +1,78 @@
 #pragma once
 
 #include "llama.h"
+#include "llama-cparams.h"
 
 #include "ggml-cpp.h"
 
-#include <set>
+#include <algorithm>
+#include <map>
 #include <vector>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static_assert(LLAMA_MAX_PARALLEL_SEQUENCES <= 64, "the sequences of a cell are a 64-bit mask");
+
+static inline int llama_kv_ctz64(uint64_t x) {
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (int) i;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+static inline int llama_kv_popcount64(uint64_t x) {
+#if defined(_MSC_VER)
+    return (int) __popcnt64(x);
+#else
+    return __builtin_popcountll(x);
+#endif
+}
+
+// sequences of a cell, one bit per sequence
+// same interface as the std::set it replaces, without the allocations and the tree walks
+struct llama_kv_seq_set {
+    uint64_t bits = 0;
+
+    struct iterator {
+        uint64_t bits;
+
+        llama_seq_id operator*() const { return llama_kv_ctz64(bits); }
+        iterator & operator++() { bits &= bits - 1; return *this; }
+        bool operator!=(const iterator & other) const { return bits != other.bits; }
+    };
+
+    iterator begin() const { return { bits }; }
+    iterator end()   const { return { 0 }; }
+
+    bool   empty() const { return bits == 0; }
+    size_t size()  const { return llama_kv_popcount64(bits); }
+
+    bool count(llama_seq_id id) const {
+        return (uint32_t) id < LLAMA_MAX_PARALLEL_SEQUENCES && ((bits >> id) & 1);
+    }
+
+    void insert(llama_seq_id id) { bits |=  (uint64_t(1) << id); }
+    void erase (llama_seq_id id) { bits &= ~(uint64_t(1) << id); }
+    void clear() { bits = 0; }
+
+    bool operator==(const llama_kv_seq_set & other) const { return bits == other.bits; }
+};
+
 struct llama_kv_cell {
     llama_pos pos   = -1;
     llama_pos delta = 0;
     int32_t   src   = -1; // used by recurrent state models to copy states
     int32_t   tail  = -1;
 
-    std::set<llama_seq_id> seq_id;
+    llama_kv_seq_set seq_id;
 
     bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return seq_id.count(id);
     }
 
     bool is_empty() const {
@@ -28,6 +84,13 @@ struct llama_kv_cell {
     }
 };
 
+// cells written by consecutive tokens of a ubatch
+struct llama_kv_cell_run {
+    uint32_t i_token; // first token in the ubatch
+    uint32_t cell;    // first cell
+    uint32_t n;
+};
+
 // ring-buffer of cached KV data
 struct llama_kv_cache {
     bool has_shift = false;
@@ -51,6 +114,35 @@ struct llama_kv_cache {
 
     std::vector<llama_kv_cell> cells;
 
+    // paged layout: the cells are grouped in blocks of block_size and a sequence appends its tokens to the last block
+    // of its block table, the attention reads all the cells through the KQ mask so a sequence can be scattered
+    // a block also used by another sequence (llama_kv_cache_seq_cp) is not appended to - the cells are written once,
+    // so the copy-on-write of a shared block never has to copy anything
+    // the tokens of several sequences at once go to blocks of their own, in the block table of each of them
+    // the saved state of a sequence is read back into free blocks the same way, it does not need contiguous cells
+    uint32_t block_size = 0; // 0 = contiguous layout
+    uint32_t max_runs   = 0; // limit on the runs of a ubatch, each of them adds nodes to the graph
+
+    std::map<llama_seq_id, std::vector<uint32_t>> block_tables;
+
+    // the free blocks, one bit per block, and the used cells of each block, so that a new block is found without
+    // scanning the cells
+    std::vector<uint64_t> blocks_free;
+    std::vector<uint32_t> block_used;
+
+    // next cell of each sequence in the last block of its table, so that a token does not scan the block
+    // -1 when unknown, the block is then scanned once; the end of the block when it cannot be appended to
+    int32_t seq_next[LLAMA_MAX_PARALLEL_SEQUENCES] = {};
+
+    // cells of each sequence, one bit per cell, so that the llama_kv_cache_seq_* functions visit the cells of the
+    // sequence instead of the whole cache
+    // kept in sync by the functions of llama-kv-cache.cpp, call llama_kv_cache_seq_index_rebuild() after changing
+    // the seq_id of cells directly
+    std::vector<uint64_t> seq_cells[LLAMA_MAX_PARALLEL_SEQUENCES];
+
+    // where the tokens of the current ubatch are stored when they are not contiguous from head
+    std::vector<llama_kv_cell_run> runs;
+
     std::vector<struct ggml_tensor *> k_l; // per layer
     std::vector<struct ggml_tensor *> v_l;
 
@@ -82,8 +174,12 @@ struct llama_kv_cache_slot_info {
     std::pair<uint32_t, uint32_t> boundaries; // slot boundaries [begin, end)
     bool found = false;                       // the slot was found
 
+    // the cells filled with the tokens, as [begin, end) ranges, and the sequences added to them
+    std::vector<std::pair<uint32_t, uint32_t>> cells;
+    llama_kv_seq_set seq_ids;
+
     explicit llama_kv_cache_slot_info(bool found_) : found{found_} {}
-    llama_kv_cache_slot_info(uint32_t begin, uint32_t end) : boundaries{begin, end}, found{true} {}
+    llama_kv_cache_slot_info(uint32_t begin, uint32_t end) : boundaries{begin, end}, found{true}, cells{{begin, end}} {}
 
     operator bool() const { return found; }
 };
@@ -109,9 +205,53 @@ struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
            struct llama_kv_cache & cache,
        const struct llama_ubatch & batch);
 
+// remove the sequences of the slot from the cells it filled, to undo llama_kv_cache_find_slot
+// the cells are addressed by index: the positions they hold can also be used by the other cells of the sequences
+void llama_kv_cache_slot_rm(
+                   struct llama_kv_cache & cache,
+    const struct llama_kv_cache_slot_info & slot);
+
 // find how many cells are currently in use
 uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache);
 
+// recompute llama_kv_cache::seq_cells and the free blocks from the cells
+void llama_kv_cache_seq_index_rebuild(struct llama_kv_cache & cache);
+
+// move the cell src to the empty cell dst, updating the bitmaps of the two cells only
+void llama_kv_cache_cell_move(struct llama_kv_cache & cache, uint32_t dst, uint32_t src);
+
+// calls f(i) for the cells i < n of the sequence in increasing order, f can remove the sequence from the cell
+template <typename F>
+void llama_kv_cache_seq_for_each(const struct llama_kv_cache & cache, llama_seq_id seq_id, uint32_t n, F && f) {
+    if ((uint32_t) seq_id >= LLAMA_MAX_PARALLEL_SEQUENCES) {
+        return;
+    }
+
+    const auto & words = cache.seq_cells[seq_id];
+    const size_t n_words = std::min<size_t>(words.size(), (n + 63)/64);
+    for (size_t w = 0; w < n_words; ++w) {
+        uint64_t bits = words[w];
+        if ((w + 1)*64 > n) {
+            bits &= (uint64_t(1) << (n % 64)) - 1;
+        }
+        for (; bits; bits &= bits - 1) {
+            f((uint32_t) (w*64 + llama_kv_ctz64(bits)));
+        }
+    }
+}
+
+// fill the causal KQ mask of the ubatch over the first n_kv cells, and the sliding window one when data_swa is set
+// each row starts fully masked and only the cells of the sequence are visited, through llama_kv_cache::seq_cells,
+// instead of testing every cell of the view
+void llama_kv_cache_set_kq_mask(
+    const struct llama_kv_cache & cache,
+      const struct llama_ubatch & ubatch,
+                        int64_t   n_kv,
+                           bool   use_alibi,
+                       uint32_t   n_swa,
+                          float * data,
+                          float * data_swa);
+
 void llama_kv_cache_clear(struct llama_kv_cache & cache);
 
 bool llama_kv_cache_seq_rm(
@@ -179,7 +319,7 @@ struct llama_kv_slot_restorer {
 
     // for non-recurrent models only
     // list of slots to restore
-    std::vector<std::pair<uint32_t, uint32_t>> slot_boundaries;
+    std::vector<llama_kv_cache_slot_info> slots;
 
     bool do_restore = false;
 
@@ -192,8 +332,8 @@ struct llama_kv_slot_restorer {
     void save(const struct llama_kv_cache_slot_info & slot) {
         if (slot) {
             do_restore = true;
-            if (slot.boundaries.first != slot.boundaries.second) {
-                slot_boundaries.push_back(slot.boundaries);
+            if (!slot.cells.empty()) {
+                slots.push_back(slot);
             }
         }
     }
@@ -208,8 +348,8 @@ struct llama_kv_slot_restorer {
             if (cache.recurrent) { // recurrent models like Mamba or RWKV can't have a state partially erased
                 llama_kv_cache_seq_rm(cache, -1, -1, -1);
             } else {
-                for (auto & slot : slot_boundaries) {
-                    llama_kv_cache_seq_rm(cache, -1, slot.first, slot.second);
+                for (auto it = slots.rbegin(); it != slots.rend(); ++it) {
+                    llama_kv_cache_slot_rm(cache, *it);
                 }
             }
         }
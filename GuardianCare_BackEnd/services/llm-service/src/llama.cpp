@@ -173,6 +173,42 @@ static void llm_build_kv_store(
 
     GGML_ASSERT(kv.size == n_ctx);
 
+    // paged layout: one copy per run of cells
+    if (!kv.runs.empty()) {
+        if (!ggml_is_contiguous(k_cur)) {
+            k_cur = ggml_cont(ctx, k_cur);
+        }
+        k_cur = ggml_reshape_2d(ctx, k_cur, n_embd_k_gqa, n_tokens);
+
+        assert(v_cur->ne[0] == n_embd_v_gqa && v_cur->ne[1] == n_tokens);
+
+        for (const auto & run : kv.runs) {
+            struct ggml_tensor * k_run = ggml_view_2d(ctx, k_cur, n_embd_k_gqa, run.n, k_cur->nb[1], k_cur->nb[1]*run.i_token);
+            struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], run.n*n_embd_k_gqa, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*run.cell);
+            cb(k_cache_view, "k_cache_view", il);
+
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, k_run, k_cache_view));
+
+            struct ggml_tensor * v_run = ggml_view_2d(ctx, v_cur, n_embd_v_gqa, run.n, v_cur->nb[1], v_cur->nb[1]*run.i_token);
+            struct ggml_tensor * v_cache_view = nullptr;
+
+            if (cparams.flash_attn) {
+                v_cache_view = ggml_view_1d(ctx, kv.v_l[il], run.n*n_embd_v_gqa, ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa)*run.cell);
+            } else {
+                v_cache_view = ggml_view_2d(ctx, kv.v_l[il], run.n, n_embd_v_gqa,
+                        (  n_ctx)*ggml_element_size(kv.v_l[il]),
+                        (run.cell)*ggml_element_size(kv.v_l[il]));
+
+                v_run = ggml_transpose(ctx, v_run);
+            }
+            cb(v_cache_view, "v_cache_view", il);
+
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, v_run, v_cache_view));
+        }
+
+        return;
+    }
+
     struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*kv_head);
     cb(k_cache_view, "k_cache_view", il);
 
@@ -8152,6 +8188,11 @@ static struct ggml_cgraph * llama_build_graph(
                   bool   worst_case) {
     const auto & model = lctx.model;
 
+    // the worst case stores a contiguous range, the runs of the previous ubatch do not apply
+    if (worst_case) {
+        lctx.kv_self.runs.clear();
+    }
+
     // this callback allows us to apply custom logic to each tensor (e.g. ggml-alloc, offloading, etc.)
     llm_build_cb cb = [&](struct ggml_tensor * cur, const char * name, int il) {
         if (il >= 0) {
@@ -8466,6 +8507,16 @@ static int llama_prepare_sbatch(
             }
         }
     }
+    if (batch.seq_id) {
+        for (uint32_t i = 0; i < n_tokens_all; ++i) {
+            for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+                if (batch.seq_id[i][s] < 0 || batch.seq_id[i][s] >= LLAMA_MAX_PARALLEL_SEQUENCES) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id[%d][%d] = %d, must be in [0, %d)\n", __func__, i, s, batch.seq_id[i][s], LLAMA_MAX_PARALLEL_SEQUENCES);
+                    return -1;
+                }
+            }
+        }
+    }
     GGML_ASSERT(n_tokens_all <= cparams.n_batch);
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
 
@@ -8542,6 +8593,9 @@ static int llama_prepare_ubatch(
         lctx.n_outputs = n_outputs_new;
     }
 
+    // set by llama_kv_cache_find_slot() for this ubatch
+    kv_self.runs.clear();
+
     // non-causal masks do not use the KV cache
     if (hparams.causal_attn) {
         llama_kv_cache_update(&lctx);
@@ -8801,7 +8855,8 @@ static int llama_decode_impl(
     //llama_synchronize(&lctx);
 
     // decide if we need to defrag the kv cache
-    if (cparams.causal_attn && cparams.defrag_thold > 0.0f) {
+    // with the paged layout, freed blocks are reused as a whole and the holes do not prevent allocations
+    if (cparams.causal_attn && cparams.defrag_thold > 0.0f && kv_self.block_size == 0) {
         // - do not defrag small contexts (i.e. < 2048 tokens)
         // - count the padding towards the number of used tokens
         const float fragmentation = kv_self.n >= 2048 ? std::max(0.0f, 1.0f - float(kv_self.used + llama_kv_cache_get_padding(cparams))/float(kv_self.n)) : 0.0f;
@@ -8890,6 +8945,8 @@ static int llama_encode_impl(
     lctx.inp_embd_enc = NULL;
     lctx.n_outputs = n_tokens;
 
+    lctx.kv_self.runs.clear();
+
     int n_threads = n_tokens == 1 ? cparams.n_threads : cparams.n_threads_batch;
     ggml_threadpool_t threadpool = n_tokens == 1 ? lctx.threadpool : lctx.threadpool_batch;
 
@@ -9012,7 +9069,8 @@ static int llama_encode_impl(
 }
 
 // find holes from the beginning of the KV cache and fill them by moving data from the end of the cache
-static void llama_kv_cache_defrag_impl(struct llama_context & lctx) {
+// returns true if cells are left to move, because of the graph size or of cparams.defrag_step
+static bool llama_kv_cache_defrag_impl(struct llama_context & lctx) {
     auto & kv_self = lctx.kv_self;
 
     const auto & hparams = lctx.model.hparams;
@@ -9026,9 +9084,17 @@ static void llama_kv_cache_defrag_impl(struct llama_context & lctx) {
 
     //const int64_t t_start = ggml_time_us();
 
-    // number of cells moved
+    // number of continuous blocks of cells moved
     uint32_t n_moves = 0;
 
+    // number of cells moved, bounded by defrag_step so that a single update does not stall the decoding for long
+    uint32_t n_cells = 0;
+
+    const uint32_t max_cells = lctx.cparams.defrag_step > 0 ? lctx.cparams.defrag_step : n_kv;
+
+    // stopped before all the holes were filled
+    bool partial = false;
+
     // each move requires 6*n_layer tensors (see build_defrag)
     //   - source view, destination view, copy operation
     //   - x2 for keys and values
@@ -9096,7 +9162,7 @@ static void llama_kv_cache_defrag_impl(struct llama_context & lctx) {
 
         // go back and move the nf cells to the hole
         for (; i1 < n_kv; ++i1) {
-            auto & cell1 = kv_self.cells[i1];
+            const auto & cell1 = kv_self.cells[i1];
 
             if (cell1.is_empty() || ids[i1] != n_kv) {
                 if (n_moves == max_moves) {
@@ -9108,14 +9174,16 @@ static void llama_kv_cache_defrag_impl(struct llama_context & lctx) {
                 continue;
             }
 
+            if (n_cells == max_cells) {
+                stop = true;
+                break;
+            }
+
             // this cell goes to (i0 + nf)
             ids[i1] = i0 + nf;
 
-            // move the cell meta data
-            kv_self.cells[i0 + nf] = cell1;
-
-            // clear the old cell and move the head there
-            cell1 = llama_kv_cell();
+            // move the cell meta data and clear the old cell, then move the head there
+            llama_kv_cache_cell_move(kv_self, i0 + nf, i1);
             kv_self.head = n_used;
 
             if (!cont) {
@@ -9123,6 +9191,7 @@ static void llama_kv_cache_defrag_impl(struct llama_context & lctx) {
                 cont = true;
             }
 
+            n_cells++;
             nf++;
 
             if (nf == nh) {
@@ -9131,6 +9200,7 @@ static void llama_kv_cache_defrag_impl(struct llama_context & lctx) {
         }
 
         if (stop || n_moves == max_moves) {
+            partial = true;
             break;
         }
 
@@ -9140,9 +9210,11 @@ static void llama_kv_cache_defrag_impl(struct llama_context & lctx) {
     }
 
     if (n_moves == 0) {
-        return;
+        return false;
     }
 
+    lctx.n_defrag_cells += n_cells;
+
     //LLAMA_LOG_INFO("(tmp log) KV defrag cell moves: %u\n", n_moves);
 
     //LLAMA_LOG_INFO("expected gf nodes: %u\n", 6*n_moves*n_layer);
@@ -9230,6 +9302,8 @@ static void llama_kv_cache_defrag_impl(struct llama_context & lctx) {
     //const int64_t t_end = ggml_time_us();
 
     //LLAMA_LOG_INFO("(tmp log) KV defrag time: %.3f ms\n", (t_end - t_start)/1000.0);
+
+    return partial;
 }
 
 static void llama_kv_cache_update_impl(struct llama_context & lctx) {
@@ -9267,12 +9341,19 @@ static void llama_kv_cache_update_impl(struct llama_context & lctx) {
     }
 
     // defragment the KV cache if needed
+    // with cparams.defrag_step, this moves a bounded number of cells and the next updates continue
     if (lctx.kv_self.do_defrag) {
-        llama_kv_cache_defrag_impl(lctx);
+        const int64_t t_start_us = ggml_time_us();
+
+        lctx.kv_self.do_defrag = llama_kv_cache_defrag_impl(lctx);
 
-        need_reserve = true;
+        lctx.t_defrag_us += ggml_time_us() - t_start_us;
+        lctx.n_defrag++;
 
-        lctx.kv_self.do_defrag = false;
+        // reserve once the defragmentation is done, not after every step
+        if (!lctx.kv_self.do_defrag) {
+            need_reserve = true;
+        }
     }
 
     // reserve a worst case graph again
@@ -9350,6 +9431,8 @@ struct llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.n_kv_block                  =*/ 0,
+        /*.defrag_step                 =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
@@ -9574,7 +9657,16 @@ struct llama_context * llama_init_from_model(
     }
 
     if (ggml_is_quantized(params.type_v) && !params.flash_attn) {
-        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+        if (model->arch == LLM_ARCH_GROK || model->hparams.n_embd_head_k != model->hparams.n_embd_head_v) {
+            LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+            return nullptr;
+        }
+        LLAMA_LOG_WARN("%s: V cache quantization requires flash_attn - forcing on\n", __func__);
+        params.flash_attn = true;
+    }
+
+    if (params.n_seq_max > LLAMA_MAX_PARALLEL_SEQUENCES) {
+        LLAMA_LOG_ERROR("%s: n_seq_max must be <= %d\n", __func__, LLAMA_MAX_PARALLEL_SEQUENCES);
         return nullptr;
     }
 
@@ -9591,6 +9683,8 @@ struct llama_context * llama_init_from_model(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.n_kv_block       = params.n_kv_block;
+    cparams.defrag_step      = params.defrag_step;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
@@ -10103,6 +10197,10 @@ struct llama_perf_context_data llama_perf_context(const struct llama_context * c
     data.n_p_eval    = std::max(1, ctx->n_p_eval);
     data.n_eval      = std::max(1, ctx->n_eval);
 
+    data.t_defrag_ms    = 1e-3 * ctx->t_defrag_us;
+    data.n_defrag       = ctx->n_defrag;
+    data.n_defrag_cells = ctx->n_defrag_cells;
+
     return data;
 }
 
@@ -10123,4 +10221,6 @@ void llama_perf_context_reset(struct llama_context * ctx) {
     ctx->t_start_us  = ggml_time_us();
     ctx->t_eval_us   = ctx->n_eval = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
+    ctx->t_defrag_us = 0;
+    ctx->n_defrag    = ctx->n_defrag_cells = 0;
 }
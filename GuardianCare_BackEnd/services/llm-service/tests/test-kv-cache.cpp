@@ -0,0 +1,572 @@
+#include "llama-batch.h"
+#include "llama-kv-cache.h"
+
+#include "ggml.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// a ubatch with one group of sequences per token, as llama_sbatch::split_simple makes them
+struct test_ubatch {
+    std::vector<llama_token>               token;
+    std::vector<llama_pos>                 pos;
+    std::vector<int32_t>                   n_seq_id;
+    std::vector<std::vector<llama_seq_id>> seq;
+    std::vector<llama_seq_id *>            seq_id;
+    std::vector<int8_t>                    output;
+
+    // n tokens of the sequences s from the position p0
+    void add(const std::vector<llama_seq_id> & s, llama_pos p0, uint32_t n) {
+        for (uint32_t i = 0; i < n; ++i) {
+            token.push_back(0);
+            pos.push_back(p0 + i);
+            n_seq_id.push_back(s.size());
+            seq.push_back(s);
+            output.push_back(0);
+        }
+    }
+
+    void add(llama_seq_id s, llama_pos p0, uint32_t n) {
+        add(std::vector<llama_seq_id>{s}, p0, n);
+    }
+
+    llama_ubatch get() {
+        seq_id.clear();
+        for (auto & s : seq) {
+            seq_id.push_back(s.data());
+        }
+
+        const uint32_t n_tokens = token.size();
+
+        return { false, n_tokens, 1, n_tokens, token.data(), nullptr, pos.data(), n_seq_id.data(), seq_id.data(), output.data() };
+    }
+};
+
+static void init_cache(llama_kv_cache & cache, uint32_t size, uint32_t block_size = 0, uint32_t max_runs = 0) {
+    cache.size = size;
+    cache.cells.resize(size);
+    cache.block_size = block_size;
+    cache.max_runs   = max_runs;
+    llama_kv_cache_seq_index_rebuild(cache);
+}
+
+static void decode(llama_kv_cache & cache, llama_kv_slot_restorer & restorer, test_ubatch & ub) {
+    const auto slot = llama_kv_cache_find_slot(cache, ub.get());
+    assert(slot);
+    restorer.save(slot);
+    cache.head += ub.token.size();
+}
+
+static uint32_t count_cells(const llama_kv_cache & cache, llama_seq_id seq_id) {
+    uint32_t n = 0;
+    llama_kv_cache_seq_for_each(cache, seq_id, cache.size, [&](uint32_t) { n++; });
+    return n;
+}
+
+// the free blocks match the cells
+static void check_blocks(const llama_kv_cache & cache) {
+    for (uint32_t block = 0; block < cache.block_used.size(); ++block) {
+        uint32_t n = 0;
+        for (uint32_t i = block*cache.block_size; i < std::min((block + 1)*cache.block_size, cache.size); ++i) {
+            n += !cache.cells[i].is_empty();
+        }
+        assert(cache.block_used[block] == n);
+        assert(((cache.blocks_free[block/64] >> (block%64)) & 1) == (n == 0));
+    }
+}
+
+// an aborted ubatch of one sequence must not touch the cells of the others,
+// even when their positions fall in the range of the cells it was given
+static void test_restore_keeps_other_sequences() {
+    llama_kv_cache cache;
+    init_cache(cache, 64);
+
+    // sequence 0 holds the positions 10..29 in the cells 0..19, e.g. after a context shift
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add(0, 10, 20);
+        decode(cache, restorer, ub);
+    }
+
+    // sequence 1 gets the cells 20..27 and is aborted
+    const uint32_t head = cache.head;
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add(1, 0, 8);
+        decode(cache, restorer, ub);
+        assert(count_cells(cache, 1) == 8);
+        restorer.restore(cache);
+    }
+
+    assert(cache.head == head);
+    assert(cache.used == 20);
+    assert(count_cells(cache, 0) == 20);
+    assert(count_cells(cache, 1) == 0);
+    for (uint32_t i = 0; i < 20; ++i) {
+        assert(cache.cells[i].has_seq_id(0));
+        assert(cache.cells[i].pos == (llama_pos) (10 + i));
+    }
+    for (uint32_t i = 20; i < cache.size; ++i) {
+        assert(cache.cells[i].is_empty() && cache.cells[i].pos == -1);
+    }
+}
+
+// a batch split in several ubatches is rolled back as a whole, the earlier cells of its sequences stay
+static void test_restore_ubatches() {
+    llama_kv_cache cache;
+    init_cache(cache, 64);
+
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add(0, 0, 4);
+        ub.add(1, 0, 4);
+        decode(cache, restorer, ub);
+    }
+
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub0;
+        ub0.add(0, 4, 2);
+        ub0.add(1, 4, 2);
+        decode(cache, restorer, ub0);
+
+        test_ubatch ub1;
+        ub1.add(1, 6, 3);
+        decode(cache, restorer, ub1);
+
+        restorer.restore(cache);
+    }
+
+    assert(cache.used == 8);
+    assert(count_cells(cache, 0) == 4);
+    assert(count_cells(cache, 1) == 4);
+    assert(llama_kv_cache_seq_pos_max(cache, 0) == 3);
+    assert(llama_kv_cache_seq_pos_max(cache, 1) == 3);
+}
+
+// with the paged layout the cells of an aborted ubatch are scattered, the cells between them must stay
+static void test_restore_paged() {
+    llama_kv_cache cache;
+    init_cache(cache, 64, 8, 16);
+
+    // sequence 0 in the cells 0..5 of the block 0, sequence 1 in the cells 8..13 of the block 1
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add(0, 0, 6);
+        ub.add(1, 0, 6);
+        decode(cache, restorer, ub);
+    }
+
+    // the cells 6 and 14 are aborted
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add(0, 6, 1);
+        ub.add(1, 6, 1);
+        decode(cache, restorer, ub);
+        assert(cache.cells[6].has_seq_id(0) && cache.cells[14].has_seq_id(1));
+        restorer.restore(cache);
+    }
+
+    assert(cache.used == 12);
+    assert(count_cells(cache, 0) == 6);
+    assert(count_cells(cache, 1) == 6);
+    for (uint32_t i = 0; i < 6; ++i) {
+        assert(cache.cells[i].has_seq_id(0));
+        assert(cache.cells[8 + i].has_seq_id(1));
+    }
+    assert(cache.cells[6].is_empty() && cache.cells[14].is_empty());
+}
+
+// the blocks filled by the contiguous fallback are appended to like the others
+static void test_paged_fallback_block_tables() {
+    llama_kv_cache cache;
+    init_cache(cache, 64, 8, 1);
+
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub0;
+        ub0.add(0, 0, 6);
+        decode(cache, restorer, ub0);
+
+        test_ubatch ub1;
+        ub1.add(1, 0, 2);
+        decode(cache, restorer, ub1);
+    }
+    assert(cache.cells[8].has_seq_id(1));
+
+    // 4 more tokens of sequence 0 would be in the blocks 0 and 2, more runs than allowed
+    cache.head = 24;
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add(0, 6, 4);
+        decode(cache, restorer, ub);
+    }
+    for (uint32_t i = 24; i < 28; ++i) {
+        assert(cache.cells[i].has_seq_id(0));
+    }
+
+    // the next token goes after them, not in a new block
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add(0, 10, 1);
+        decode(cache, restorer, ub);
+    }
+    assert(cache.cells[28].has_seq_id(0));
+    assert(cache.cells[28].pos == 10);
+}
+
+// the tokens of several sequences fill blocks added to the table of each of them, then each sequence goes on alone
+static void test_paged_shared_tokens() {
+    llama_kv_cache cache;
+    init_cache(cache, 64, 8, 16);
+
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add({0, 1}, 0, 10);
+        decode(cache, restorer, ub);
+    }
+    for (uint32_t i = 0; i < 10; ++i) {
+        assert(cache.cells[i].has_seq_id(0) && cache.cells[i].has_seq_id(1));
+    }
+    assert((cache.block_tables[0] == std::vector<uint32_t>{0, 1}));
+    assert((cache.block_tables[1] == std::vector<uint32_t>{0, 1}));
+
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add(0, 10, 2);
+        ub.add(1, 10, 2);
+        decode(cache, restorer, ub);
+    }
+    assert(cache.cells[16].seq_id.size() == 1 && cache.cells[16].has_seq_id(0) && cache.cells[17].has_seq_id(0));
+    assert(cache.cells[24].seq_id.size() == 1 && cache.cells[24].has_seq_id(1) && cache.cells[25].has_seq_id(1));
+    assert((cache.block_tables[0] == std::vector<uint32_t>{0, 1, 2}));
+    assert((cache.block_tables[1] == std::vector<uint32_t>{0, 1, 3}));
+    check_blocks(cache);
+}
+
+// the removed cells free their blocks and the next token of a sequence follows its remaining cells
+static void test_paged_seq_rm_cp() {
+    llama_kv_cache cache;
+    init_cache(cache, 64, 8, 16);
+
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add(0, 0, 20);
+        decode(cache, restorer, ub);
+    }
+
+    // the block 0 is free again and goes to sequence 1
+    llama_kv_cache_seq_rm(cache, 0, 0, 8);
+    assert((cache.block_tables[0] == std::vector<uint32_t>{1, 2}));
+    check_blocks(cache);
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add(1, 0, 1);
+        decode(cache, restorer, ub);
+    }
+    assert(cache.cells[0].has_seq_id(1));
+
+    // the last tokens are removed, their cells are written again
+    llama_kv_cache_seq_rm(cache, 0, 16, -1);
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add(0, 16, 1);
+        decode(cache, restorer, ub);
+    }
+    assert(cache.cells[16].has_seq_id(0) && cache.cells[16].pos == 16);
+
+    // after a copy, the blocks are shared and both sequences go on in new blocks
+    llama_kv_cache_seq_cp(cache, 0, 2, -1, -1);
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add(0, 17, 1);
+        ub.add(2, 17, 1);
+        decode(cache, restorer, ub);
+    }
+    assert(cache.cells[24].has_seq_id(0) && !cache.cells[24].has_seq_id(2));
+    assert(cache.cells[32].has_seq_id(2) && !cache.cells[32].has_seq_id(0));
+    check_blocks(cache);
+
+    // the sequence 0 leaves the blocks it shared
+    llama_kv_cache_seq_rm(cache, 0, 0, 17);
+    assert((cache.block_tables[0] == std::vector<uint32_t>{3}));
+    assert((cache.block_tables[2] == std::vector<uint32_t>{1, 2, 4}));
+    check_blocks(cache);
+
+    llama_kv_cache_clear(cache);
+    assert(cache.used == 0 && cache.block_tables.empty());
+    check_blocks(cache);
+}
+
+// a defragmentation step moves cells one by one, their bitmaps follow without a rebuild
+static void test_cell_move() {
+    llama_kv_cache cache;
+    init_cache(cache, 64);
+
+    {
+        llama_kv_slot_restorer restorer(cache);
+        test_ubatch ub;
+        ub.add(0, 0, 8);
+        ub.add({1, 2}, 0, 8);
+        decode(cache, restorer, ub);
+    }
+    llama_kv_cache_seq_rm(cache, 0, 2, 6);
+
+    // the last 4 cells fill the hole
+    for (uint32_t i = 0; i < 4; ++i) {
+        llama_kv_cache_cell_move(cache, 2 + i, 12 + i);
+    }
+
+    std::vector<uint64_t> moved[3];
+    for (llama_seq_id s = 0; s < 3; ++s) {
+        moved[s] = cache.seq_cells[s];
+    }
+    llama_kv_cache_seq_index_rebuild(cache);
+    for (llama_seq_id s = 0; s < 3; ++s) {
+        assert(moved[s] == cache.seq_cells[s]);
+    }
+    assert(count_cells(cache, 0) == 4 && count_cells(cache, 1) == 8 && count_cells(cache, 2) == 8);
+    assert(cache.cells[2].has_seq_id(1) && cache.cells[2].has_seq_id(2) && cache.cells[2].pos == 4);
+    assert(cache.cells[12].is_empty() && cache.cells[12].pos == -1);
+}
+
+// the bitmaps of the sequences, the used count and the free blocks match the cells after any operation
+static void check_index(const llama_kv_cache & cache, llama_seq_id n_seq) {
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        used += !cache.cells[i].is_empty();
+        for (llama_seq_id s = 0; s < n_seq; ++s) {
+            const bool bit = (cache.seq_cells[s][i/64] >> (i%64)) & 1;
+            assert(bit == cache.cells[i].has_seq_id(s));
+        }
+    }
+    assert(cache.used == used);
+    check_blocks(cache);
+}
+
+static void test_random_ops(uint32_t block_size) {
+    const llama_seq_id n_seq = 8;
+    const int          n_ops = 20000;
+
+    llama_kv_cache cache;
+    init_cache(cache, 256, block_size, 16);
+
+    std::mt19937 rng(42);
+    const auto rand = [&](uint32_t n) { return (uint32_t) (rng() % n); };
+
+    llama_pos pos[n_seq] = {};
+
+    for (int op = 0; op < n_ops; ++op) {
+        const llama_seq_id s = rand(n_seq);
+
+        switch (rand(9)) {
+            case 0:
+            case 1:
+            case 2:
+                {
+                    // decode, of the tokens of one or two sequences, sometimes aborted
+                    test_ubatch ub;
+                    if (rand(4) == 0) {
+                        const llama_seq_id s1 = (s + 1) % n_seq;
+                        ub.add({s, s1}, std::max(pos[s], pos[s1]), 1 + rand(8));
+                    } else {
+                        ub.add(s, pos[s], 1 + rand(16));
+                    }
+
+                    llama_kv_slot_restorer restorer(cache);
+                    const auto slot = llama_kv_cache_find_slot(cache, ub.get());
+                    if (!slot) {
+                        break;
+                    }
+                    restorer.save(slot);
+                    if (rand(8) == 0) {
+                        restorer.restore(cache);
+                        break;
+                    }
+                    for (const auto & seq : ub.seq) {
+                        for (const llama_seq_id id : seq) {
+                            pos[id] = std::max(pos[id], ub.pos.back() + 1);
+                        }
+                    }
+                } break;
+            case 3:
+                {
+                    const llama_pos p0 = rand(pos[s] + 1);
+                    llama_kv_cache_seq_rm(cache, rand(16) == 0 ? -1 : s, p0, rand(2) ? -1 : p0 + rand(16));
+                } break;
+            case 4:
+                llama_kv_cache_seq_cp(cache, s, rand(n_seq), -1, rand(2) ? -1 : rand(pos[s] + 1));
+                break;
+            case 5:
+                if (rand(32) == 0) {
+                    llama_kv_cache_seq_keep(cache, s);
+                }
+                break;
+            case 6:
+                llama_kv_cache_seq_add(cache, s, rand(pos[s] + 1), -1, (llama_pos) rand(16) - 8);
+                break;
+            case 7:
+                llama_kv_cache_seq_div(cache, s, rand(pos[s] + 1), -1, 2);
+                break;
+            case 8:
+                {
+                    // a defragmentation move
+                    const uint32_t dst = rand(cache.size);
+                    const uint32_t src = rand(cache.size);
+                    if (dst != src && cache.cells[dst].is_empty() && !cache.cells[src].is_empty()) {
+                        llama_kv_cache_cell_move(cache, dst, src);
+                    }
+                } break;
+        }
+
+        if (rand(512) == 0) {
+            llama_kv_cache_clear(cache);
+        }
+
+        check_index(cache, n_seq);
+    }
+}
+
+// the causal mask as it was built before the sequence bitmaps, testing every cell of the view
+static void set_kq_mask_ref(const llama_kv_cache & cache, const llama_ubatch & ubatch, int64_t n_kv, bool use_alibi,
+        uint32_t n_swa, float * data, float * data_swa) {
+    const int64_t n_tokens     = ubatch.n_tokens;
+    const int64_t n_seq_tokens = ubatch.n_seq_tokens;
+    const int64_t n_seqs       = ubatch.n_seqs;
+
+    for (int s = 0; s < n_seqs; ++s) {
+        const llama_seq_id seq_id = ubatch.seq_id[s][0];
+
+        for (int j = 0; j < n_seq_tokens; ++j) {
+            const llama_pos pos = ubatch.pos[s*n_seq_tokens + j];
+
+            for (int i = 0; i < n_kv; ++i) {
+                float f;
+                if (!cache.cells[i].has_seq_id(seq_id) || cache.cells[i].pos > pos) {
+                    f = -INFINITY;
+                } else {
+                    if (use_alibi) {
+                        f = -std::abs(cache.cells[i].pos - pos);
+                    } else {
+                        f = 0.0f;
+                    }
+                }
+
+                data[s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
+
+                if (pos - cache.cells[i].pos >= (int32_t) n_swa) {
+                    f = -INFINITY;
+                }
+                data_swa[s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
+            }
+        }
+    }
+
+    for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
+        for (int j = 0; j < n_kv; ++j) {
+            data[i*n_kv + j]     = -INFINITY;
+            data_swa[i*n_kv + j] = -INFINITY;
+        }
+    }
+}
+
+// the mask built from the sequence bitmaps is the same as the reference one, bit for bit
+static void test_kq_mask(uint32_t block_size) {
+    const llama_seq_id n_seq = 8;
+
+    llama_kv_cache cache;
+    init_cache(cache, 512, block_size, 64);
+
+    std::mt19937 rng(7);
+    const auto rand = [&](uint32_t n) { return (uint32_t) (rng() % n); };
+
+    llama_pos pos[n_seq] = {};
+
+    for (int step = 0; step < 200; ++step) {
+        // interleaved sequences, with holes and some shared tokens
+        {
+            test_ubatch ub;
+            const llama_seq_id s = rand(n_seq);
+            if (rand(4) == 0) {
+                const llama_seq_id s1 = (s + 1) % n_seq;
+                const llama_pos p0 = std::max(pos[s], pos[s1]);
+                ub.add({s, s1}, p0, 1 + rand(8));
+                pos[s] = pos[s1] = ub.pos.back() + 1;
+            } else {
+                ub.add(s, pos[s], 1 + rand(32));
+                pos[s] = ub.pos.back() + 1;
+            }
+            llama_kv_slot_restorer restorer(cache);
+            if (!llama_kv_cache_find_slot(cache, ub.get())) {
+                llama_kv_cache_seq_rm(cache, s, 0, pos[s]/2);
+            }
+        }
+        if (rand(8) == 0) {
+            const llama_seq_id s = rand(n_seq);
+            llama_kv_cache_seq_rm(cache, s, rand(pos[s] + 1), -1);
+        }
+
+        // a ubatch of the next tokens of a few sequences
+        test_ubatch ub;
+        for (llama_seq_id s = 0; s < n_seq; ++s) {
+            if (rand(2)) {
+                ub.add(s, pos[s] - rand(4), 1);
+            }
+        }
+        if (ub.token.empty()) {
+            continue;
+        }
+        const llama_ubatch ubatch = ub.get();
+
+        const int64_t n_kv   = GGML_PAD(llama_kv_cache_cell_max(cache), 32);
+        const int64_t n_rows = GGML_PAD(ubatch.n_tokens, GGML_KQ_MASK_PAD);
+
+        for (const bool use_alibi : { false, true }) {
+            const uint32_t n_swa = 1 + rand(64);
+
+            std::vector<float> ref(n_kv*n_rows), ref_swa(n_kv*n_rows), mask(n_kv*n_rows), mask_swa(n_kv*n_rows);
+            set_kq_mask_ref(cache, ubatch, n_kv, use_alibi, n_swa, ref.data(), ref_swa.data());
+            llama_kv_cache_set_kq_mask(cache, ubatch, n_kv, use_alibi, n_swa, mask.data(), mask_swa.data());
+
+            assert(memcmp(ref.data(),     mask.data(),     ref.size()*sizeof(float)) == 0);
+            assert(memcmp(ref_swa.data(), mask_swa.data(), ref.size()*sizeof(float)) == 0);
+        }
+    }
+}
+
+int main(void) {
+    test_restore_keeps_other_sequences();
+    test_restore_ubatches();
+    test_restore_paged();
+    test_paged_fallback_block_tables();
+    test_paged_shared_tokens();
+    test_paged_seq_rm_cp();
+    test_cell_move();
+    test_random_ops(0);
+    test_random_ops(16);
+    test_kq_mask(0);
+    test_kq_mask(16);
+
+    printf("OK\n");
+
+    return 0;
+}
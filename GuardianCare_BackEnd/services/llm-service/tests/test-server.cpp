@@ -0,0 +1,1357 @@
+// tests of the server components, server.cpp is built without its main()
+//
+//   test-server                      run the tests
+//   test-server perf [NAME] [-m F]   run the benchmarks, or only NAME - the ones that decode tokens need the model F
+
+// the callback benchmarks open many connections at once to their stub receiver
+#define CPPHTTPLIB_LISTEN_BACKLOG 128
+
+#include "server.cpp"
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static double t_ms(int64_t t_start_us) {
+    return (ggml_time_us() - t_start_us) / 1e3;
+}
+
+// heap allocations of the whole process, for the benchmarks that count them
+static std::atomic<uint64_t> n_allocs{0};
+
+// not inlined, so that the compiler does not pair the free() below with the new of the caller
+__attribute__((noinline)) void * operator new(size_t size) {
+    n_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void * ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void * ptr) noexcept {
+    std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void * ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+//
+// server_token_index
+//
+
+// longest common substring by brute force
+static size_t lcs_ref(const llama_tokens & a, const llama_tokens & b) {
+    size_t n_best = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        for (size_t j = 0; j < b.size(); ++j) {
+            size_t n = 0;
+            while (i + n < a.size() && j + n < b.size() && a[i + n] == b[j + n]) {
+                n++;
+            }
+            n_best = std::max(n_best, n);
+        }
+    }
+    return n_best;
+}
+
+static llama_tokens random_tokens(std::mt19937 & rng, size_t n, int n_vocab) {
+    llama_tokens tokens(n);
+    for (auto & t : tokens) {
+        t = rng() % n_vocab;
+    }
+    return tokens;
+}
+
+// the index follows the cache tokens of a slot through appends, truncations and overwrites
+static void test_token_index() {
+    std::mt19937 rng(42);
+
+    for (int n_vocab : { 2, 4, 64 }) {
+        server_token_index index;
+        llama_tokens cache;
+
+        for (int i = 0; i < 2000; ++i) {
+            switch (rng() % 4) {
+                case 0:
+                case 1: {
+                    // new tokens of a prompt or of the generation
+                    const llama_tokens more = random_tokens(rng, 1 + rng() % 32, n_vocab);
+                    cache.insert(cache.end(), more.begin(), more.end());
+                } break;
+                case 2: {
+                    // a new prompt reusing a prefix of the cache, or a context shift
+                    cache.resize(cache.empty() ? 0 : rng() % cache.size());
+                } break;
+                case 3: {
+                    // a cached token replaced in place
+                    if (!cache.empty()) {
+                        cache[rng() % cache.size()] = rng() % n_vocab;
+                    }
+                } break;
+            }
+            if (cache.size() > 256) {
+                cache.resize(128);
+            }
+
+            index.sync(cache);
+            assert(index.tokens == cache);
+
+            // prompts made of pieces of the cache and of random tokens
+            llama_tokens prompt = random_tokens(rng, rng() % 16, n_vocab);
+            if (!cache.empty()) {
+                const size_t i0 = rng() % cache.size();
+                const size_t n  = rng() % (cache.size() - i0 + 1);
+                prompt.insert(prompt.end(), cache.begin() + i0, cache.begin() + i0 + n);
+            }
+            const llama_tokens tail = random_tokens(rng, rng() % 16, n_vocab);
+            prompt.insert(prompt.end(), tail.begin(), tail.end());
+
+            assert(index.lcs(prompt) == lcs_ref(cache, prompt));
+        }
+    }
+}
+
+// slot selection: the longest common substring of a 4k-token prompt with the cache of every idle slot
+static void perf_token_index() {
+    std::mt19937 rng(42);
+
+    const int n_prompt = 4096;
+    const int n_vocab  = 32000;
+
+    printf("%-8s %-8s %14s %14s %14s\n", "n_slots", "n_prompt", "common_lcs ms", "index sync ms", "index lcs ms");
+
+    for (int n_slots : { 16, 32, 64 }) {
+        // the slots hold prompts that share a system prompt, with the generated tokens after them
+        const llama_tokens system = random_tokens(rng, 1024, n_vocab);
+
+        std::vector<llama_tokens> caches(n_slots);
+        for (auto & cache : caches) {
+            cache = system;
+            const llama_tokens rest = random_tokens(rng, n_prompt - system.size(), n_vocab);
+            cache.insert(cache.end(), rest.begin(), rest.end());
+        }
+
+        llama_tokens prompt = system;
+        const llama_tokens rest = random_tokens(rng, n_prompt - system.size(), n_vocab);
+        prompt.insert(prompt.end(), rest.begin(), rest.end());
+
+        int64_t t_start = ggml_time_us();
+        size_t n_ref = 0;
+        for (const auto & cache : caches) {
+            n_ref = std::max(n_ref, common_lcs(cache, prompt));
+        }
+        const double t_ref = t_ms(t_start);
+
+        // the index of a slot is built once, then only extended by the tokens of its next turns
+        std::vector<server_token_index> indices(n_slots);
+        t_start = ggml_time_us();
+        for (int i = 0; i < n_slots; ++i) {
+            indices[i].sync(caches[i]);
+        }
+        const double t_sync = t_ms(t_start);
+
+        t_start = ggml_time_us();
+        size_t n_index = 0;
+        for (int i = 0; i < n_slots; ++i) {
+            indices[i].sync(caches[i]);
+            n_index = std::max(n_index, indices[i].lcs(prompt));
+        }
+        const double t_lcs = t_ms(t_start);
+
+        GGML_ASSERT(n_index == n_ref);
+
+        printf("%-8d %-8d %14.2f %14.2f %14.2f\n", n_slots, n_prompt, t_ref, t_sync, t_lcs);
+    }
+}
+
+//
+// server_task_result_cmpl_partial::to_sse
+//
+
+// what the stream sends for a result without to_sse(), see handle_answer_impl
+static std::string sse_ref(server_task_result & result) {
+    const json data = result.to_json();
+
+    std::string out;
+    for (const auto & d : data.is_array() ? data : json::array({ data })) {
+        out += "data: " + d.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+    }
+    return out;
+}
+
+// strings that json::dump() escapes or replaces: control characters, quotes, and invalid, overlong, surrogate and
+// truncated UTF-8 sequences, next to valid ones of every length
+static std::vector<std::string> sse_strings(std::mt19937 & rng) {
+    std::vector<std::string> strs = {
+        "", " hello", "\"quoted\" \\ back\\slash", "\b\f\n\r\t", std::string("nul\0byte", 8), "\x01\x1f\x7f",
+        "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xef\xbf\xbd",
+        "\x80", "\xbf", "\xc0\x80", "\xc1\xbf", "\xe0\x80\x80", "\xe0\x9f\xbf", "\xf0\x80\x80\x80", "\xf0\x8f\xbf\xbf",
+        "\xed\xa0\x80", "\xed\xbf\xbf", "\xed\x9f\xbf", "\xf4\x90\x80\x80", "\xf5\x80\x80\x80", "\xff", "\xfe",
+        "\xc3", "\xe2\x82", "\xf0\x9f\x98", "a\xc3", "\xe2\x82" "a", "\xf0\x9f\x98\xc3\xa9", "\xc3\xc3\xa9", "\xe2\x28\xa1",
+        "\xf0\x9f\x98\x80\x80", "\xc3\xa9\xa9",
+    };
+
+    // random bytes, and random picks of the pieces above
+    for (int i = 0; i < 2000; ++i) {
+        std::string str;
+        const int n = rng() % 16;
+        for (int j = 0; j < n; ++j) {
+            if (i % 2 == 0) {
+                str += (char) (rng() % 256);
+            } else {
+                str += strs[rng() % 35];
+            }
+        }
+        strs.push_back(str);
+    }
+    return strs;
+}
+
+// to_sse() writes the same bytes as the json path for every chunk it handles
+static void test_to_sse() {
+    std::mt19937 rng(42);
+
+    const std::vector<std::string> strs = sse_strings(rng);
+
+    int n_direct = 0;
+    for (size_t i = 0; i < strs.size(); ++i) {
+        for (oaicompat_type oaicompat : { OAICOMPAT_TYPE_NONE, OAICOMPAT_TYPE_COMPLETION, OAICOMPAT_TYPE_CHAT }) {
+            server_task_result_cmpl_partial res;
+            res.id                = 1;
+            res.id_slot           = i % 3;
+            res.index             = i % 2;
+            res.content           = strs[i];
+            res.tokens            = llama_tokens(i % 3, (llama_token) i);
+            res.n_decoded         = i % 4;
+            res.n_prompt_tokens   = 17;
+            res.oaicompat         = oaicompat;
+            res.oaicompat_model   = strs[(i * 7) % strs.size()];
+            res.oaicompat_cmpl_id = strs[(i * 13) % strs.size()];
+            res.post_sampling_probs = false;
+            res.timings.prompt_n  = i % 5 == 0 ? 4 : -1;
+
+            // "created" is the current time, both must be taken in the same second
+            std::string out;
+            std::string ref;
+            bool direct;
+            std::time_t t_start;
+            do {
+                t_start = std::time(0);
+                out.clear();
+                direct = res.to_sse(out);
+                ref = sse_ref(res);
+            } while (std::time(0) != t_start);
+
+            if (direct) {
+                n_direct++;
+                if (out != ref) {
+                    fprintf(stderr, "to_sse: %s\njson:   %s\n", out.c_str(), ref.c_str());
+                }
+                assert(out == ref);
+            } else {
+                assert(out.empty());
+            }
+        }
+    }
+
+    // most chunks take the direct path
+    assert(n_direct > (int) strs.size());
+}
+
+// serialization of the chunks of a chat stream, through the json and directly into the buffer of the stream
+static void perf_to_sse() {
+    const int n_tokens = 200000;
+
+    const char * pieces[] = { " the", " patient", " reported", " feeling", " well", ",", " no", " pain", ".", "\n" };
+
+    printf("%-10s %14s %14s\n", "path", "tokens/s", "allocs/token");
+
+    for (bool direct : { false, true }) {
+        server_task_result_cmpl_partial res;
+        res.oaicompat         = OAICOMPAT_TYPE_CHAT;
+        res.oaicompat_model   = "mistral-7b-instruct-v0.3";
+        res.oaicompat_cmpl_id = gen_chatcmplid();
+        res.n_prompt_tokens   = 512;
+        res.post_sampling_probs = false;
+
+        std::string buf;
+        size_t n_bytes = 0;
+
+        const uint64_t n_allocs_start = n_allocs;
+        const int64_t t_start = ggml_time_us();
+
+        for (int i = 0; i < n_tokens; ++i) {
+            res.content   = pieces[i % 10];
+            res.n_decoded = i + 1;
+
+            buf.clear();
+            if (direct) {
+                res.to_sse(buf);
+            } else {
+                const json data = res.to_json();
+                for (const auto & d : data) {
+                    buf += "data: " + d.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+                }
+            }
+            n_bytes += buf.size();
+        }
+
+        const double t = t_ms(t_start) / 1e3;
+        const double allocs = (double) (n_allocs - n_allocs_start) / n_tokens;
+
+        GGML_ASSERT(n_bytes > 0);
+        printf("%-10s %14.0f %14.2f\n", direct ? "to_sse" : "to_json", n_tokens / t, allocs);
+    }
+}
+
+//
+// server_queue
+//
+
+// a completion task of producer p, with its sequence number in that producer
+static server_task queue_task(server_queue & queue, int p, int seq, int n_prompt) {
+    server_task task(SERVER_TASK_TYPE_COMPLETION);
+    task.id               = queue.get_new_id();
+    task.index            = p;
+    task.id_selected_slot = seq;
+    task.prompt_tokens    = llama_tokens(n_prompt, 1);
+    return task;
+}
+
+// every task posted by concurrent producers reaches the main loop exactly once and in the order of its producer
+// in the first phase each producer waits for its task before posting the next one, so the main loop goes to sleep
+// between most tasks: a lost wakeup leaves a producer waiting until the deadline
+static void test_queue() {
+    const int n_producers = 8;
+    const int n_tasks     = 2000;
+
+    server_queue queue;
+
+    std::unique_ptr<std::atomic<int>[]> n_done(new std::atomic<int>[n_producers]);
+    for (int p = 0; p < n_producers; ++p) {
+        n_done[p] = 0;
+    }
+    std::atomic<bool> in_order{true};
+
+    queue.on_new_task([&](server_task task) {
+        const int p = task.index;
+        if (task.id_selected_slot != n_done[p]) {
+            in_order = false;
+        }
+        n_done[p]++;
+    });
+    queue.on_update_slots([]() {});
+
+    std::thread loop([&]() { queue.start_loop(); });
+
+    const auto wait_done = [&](int p, int n) {
+        const int64_t t_deadline = ggml_time_us() + 10 * 1000 * 1000;
+        while (n_done[p] < n) {
+            if (ggml_time_us() > t_deadline) {
+                fprintf(stderr, "producer %d: the main loop did not process task %d\n", p, n - 1);
+                assert(false);
+            }
+            std::this_thread::yield();
+        }
+    };
+
+    // one task at a time, alone, in pairs and at the front
+    {
+        std::vector<std::thread> producers;
+        for (int p = 0; p < n_producers; ++p) {
+            producers.emplace_back([&, p]() {
+                for (int seq = 0; seq < n_tasks;) {
+                    if (seq % 3 == 2 && seq + 1 < n_tasks) {
+                        std::vector<server_task> tasks;
+                        tasks.push_back(queue_task(queue, p, seq, 16));
+                        tasks.push_back(queue_task(queue, p, seq + 1, 16));
+                        queue.post(tasks, seq % 2 == 0);
+                        seq += 2;
+                    } else {
+                        queue.post(queue_task(queue, p, seq, 16), seq % 5 == 0);
+                        seq += 1;
+                    }
+                    wait_done(p, seq);
+                }
+            });
+        }
+        for (auto & t : producers) {
+            t.join();
+        }
+    }
+
+    // all at once, the pushes race with each other and with the drains
+    {
+        std::vector<std::thread> producers;
+        for (int p = 0; p < n_producers; ++p) {
+            producers.emplace_back([&, p]() {
+                for (int seq = n_tasks; seq < 2 * n_tasks; ++seq) {
+                    queue.post(queue_task(queue, p, seq, 16));
+                }
+                wait_done(p, 2 * n_tasks);
+            });
+        }
+        for (auto & t : producers) {
+            t.join();
+        }
+    }
+
+    queue.terminate();
+    loop.join();
+
+    assert(in_order);
+    for (int p = 0; p < n_producers; ++p) {
+        assert(n_done[p] == 2 * n_tasks);
+    }
+    assert(queue.n_incoming == 0);
+    assert(queue.n_incoming_tokens == 0);
+}
+
+// the queue before the lock-free one: each post and each pop takes the mutex, the main loop copies each task
+struct locked_queue {
+    std::deque<server_task> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool running = true;
+
+    void post(server_task task) {
+        std::unique_lock<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+        condition.notify_one();
+    }
+
+    void start_loop(const std::function<void(server_task)> & callback) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [&]() { return !tasks.empty() || !running; });
+            if (!running) {
+                return;
+            }
+            server_task task = tasks.front();
+            tasks.pop_front();
+            lock.unlock();
+
+            callback(std::move(task));
+        }
+    }
+
+    void terminate() {
+        std::unique_lock<std::mutex> lock(mutex);
+        running = false;
+        condition.notify_all();
+    }
+};
+
+// HTTP threads posting completion tasks with 512-token prompts at once, until the main loop has taken them all
+static void perf_queue() {
+    const int n_tasks  = 64000;
+    const int n_prompt = 512;
+
+    printf("%-12s %16s %16s\n", "n_producers", "locked tasks/s", "lock-free tasks/s");
+
+    for (int n_producers : { 1, 4, 16, 64 }) {
+        double tps[2];
+
+        for (int lock_free = 0; lock_free < 2; ++lock_free) {
+            server_queue queue;
+            locked_queue queue_locked;
+
+            std::atomic<int> n_done{0};
+            const auto on_task = [&](server_task task) {
+                GGML_ASSERT(task.prompt_tokens.size() == (size_t) n_prompt);
+                n_done++;
+            };
+
+            std::thread loop;
+            if (lock_free) {
+                queue.on_new_task(on_task);
+                queue.on_update_slots([]() {});
+                loop = std::thread([&]() { queue.start_loop(); });
+            } else {
+                loop = std::thread([&]() { queue_locked.start_loop(on_task); });
+            }
+
+            const int64_t t_start = ggml_time_us();
+
+            std::vector<std::thread> producers;
+            for (int p = 0; p < n_producers; ++p) {
+                producers.emplace_back([&, p]() {
+                    for (int seq = 0; seq < n_tasks / n_producers; ++seq) {
+                        server_task task = queue_task(queue, p, seq, n_prompt);
+                        if (lock_free) {
+                            queue.post(std::move(task));
+                        } else {
+                            queue_locked.post(std::move(task));
+                        }
+                    }
+                });
+            }
+            for (auto & t : producers) {
+                t.join();
+            }
+            while (n_done < n_tasks / n_producers * n_producers) {
+                std::this_thread::yield();
+            }
+
+            tps[lock_free] = n_done / (t_ms(t_start) / 1e3);
+
+            if (lock_free) {
+                queue.terminate();
+            } else {
+                queue_locked.terminate();
+            }
+            loop.join();
+        }
+
+        printf("%-12d %16.0f %16.0f\n", n_producers, tps[0], tps[1]);
+    }
+}
+
+//
+// server_response
+//
+
+// a waiter whose tasks were removed (e.g. cancelled) comes back at once instead of sleeping until the timeout
+static void test_response() {
+    server_response response;
+
+    const std::unordered_set<int> id_tasks = { 1, 2 };
+
+    const int64_t t_start = ggml_time_us();
+    assert(response.recv_with_timeout(id_tasks, 5) == nullptr);
+    assert(!response.is_waiting(id_tasks));
+    assert(t_ms(t_start) < 1000);
+
+    std::vector<server_task> tasks(2, server_task(SERVER_TASK_TYPE_COMPLETION));
+    tasks[0].id = 1;
+    tasks[1].id = 2;
+    response.add_waiting_tasks(tasks);
+    assert(response.is_waiting(id_tasks));
+
+    auto result = std::make_unique<server_task_result_cmpl_partial>();
+    result->id = 2;
+    response.send(std::move(result));
+    result = std::make_unique<server_task_result_cmpl_partial>();
+    result->id = 3; // nobody waits for it
+    response.send(std::move(result));
+
+    server_task_result_ptr res = response.recv_with_timeout(id_tasks, 5);
+    assert(res != nullptr && res->id == 2);
+
+    response.remove_waiting_task_ids(id_tasks);
+    assert(!response.is_waiting(id_tasks));
+    assert(response.recv_with_timeout(id_tasks, 5) == nullptr);
+}
+
+// the results before the per-request channels: one vector and one condition for all the waiters
+struct shared_response {
+    std::unordered_set<int> waiting_task_ids;
+    std::vector<server_task_result_ptr> queue_results;
+    std::mutex mutex_results;
+    std::condition_variable condition_results;
+
+    void add_waiting_task_id(int id_task) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.insert(id_task);
+    }
+
+    server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            for (size_t i = 0; i < queue_results.size(); i++) {
+                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
+                    server_task_result_ptr res = std::move(queue_results[i]);
+                    queue_results.erase(queue_results.begin() + i);
+                    return res;
+                }
+            }
+            if (condition_results.wait_for(lock, std::chrono::seconds(timeout)) == std::cv_status::timeout) {
+                return nullptr;
+            }
+        }
+    }
+
+    void send(server_task_result_ptr && result) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        if (waiting_task_ids.count(result->id)) {
+            queue_results.emplace_back(std::move(result));
+            condition_results.notify_all();
+        }
+    }
+};
+
+// one result at a time to a random request, while the others keep waiting for theirs:
+// the time from send() until the owner of the result has it, and the whole round trip per result
+template <typename T_response>
+static void perf_recv_case(int n_waiters, int n_results, std::vector<double> & latency_us, double & t_result_us) {
+    T_response response;
+    for (int id = 0; id < n_waiters; ++id) {
+        response.add_waiting_task_id(id);
+    }
+
+    std::atomic<int64_t> t_sent{0};
+    std::atomic<int> n_received{0};
+    std::atomic<bool> running{true};
+
+    latency_us.assign(n_results, 0.0);
+
+    std::vector<std::thread> waiters;
+    for (int id = 0; id < n_waiters; ++id) {
+        waiters.emplace_back([&, id]() {
+            const std::unordered_set<int> id_tasks = { id };
+            while (running) {
+                server_task_result_ptr res = response.recv_with_timeout(id_tasks, 1);
+                if (res == nullptr) {
+                    continue;
+                }
+                latency_us[n_received] = ggml_time_us() - t_sent;
+                n_received++;
+            }
+        });
+    }
+
+    // let every waiter reach its wait
+    std::this_thread::sleep_for(std::chrono::milliseconds(50 + n_waiters));
+
+    std::mt19937 rng(42);
+    const int64_t t_start = ggml_time_us();
+    for (int i = 0; i < n_results; ++i) {
+        auto result = std::make_unique<server_task_result_cmpl_partial>();
+        result->id = rng() % n_waiters;
+        t_sent = ggml_time_us();
+        response.send(std::move(result));
+        while (n_received <= i) {
+            std::this_thread::yield();
+        }
+    }
+    t_result_us = (double) (ggml_time_us() - t_start) / n_results;
+
+    running = false;
+    for (auto & t : waiters) {
+        t.join();
+    }
+}
+
+static void perf_recv() {
+    const int n_results = 2000;
+
+    printf("%-10s %-10s %14s %14s %14s\n", "n_waiters", "response", "p50 wake us", "p99 wake us", "us/result");
+
+    for (int n_waiters : { 1, 16, 64, 256 }) {
+        for (int channels = 0; channels < 2; ++channels) {
+            std::vector<double> latency_us;
+            double t_result_us = 0.0;
+            if (channels) {
+                perf_recv_case<server_response>(n_waiters, n_results, latency_us, t_result_us);
+            } else {
+                perf_recv_case<shared_response>(n_waiters, n_results, latency_us, t_result_us);
+            }
+            std::sort(latency_us.begin(), latency_us.end());
+
+            printf("%-10d %-10s %14.1f %14.1f %14.1f\n", n_waiters, channels ? "channels" : "shared",
+                   latency_us[n_results / 2], latency_us[n_results * 99 / 100], t_result_us);
+        }
+    }
+}
+
+//
+// server_callback_dispatcher
+//
+
+// a local receiver of the callbacks, the first `n_fail` requests of each path get a 503
+struct callback_stub {
+    httplib::Server svr;
+    std::thread thread;
+    int port = 0;
+
+    std::mutex mutex;
+    std::vector<std::string> received; // path and status of each request, in order
+    std::vector<std::string> bodies;   // of the accepted requests
+    std::unordered_map<std::string, int> n_fail;
+    std::atomic<int> n_ok{0};
+
+    callback_stub() {
+        // a thread per keep-alive connection of the benchmarks
+        svr.new_task_queue = []() { return new httplib::ThreadPool(64); };
+        svr.Post(R"(/.*)", [this](const httplib::Request & req, httplib::Response & res) {
+            std::unique_lock<std::mutex> lock(mutex);
+            res.status = 200;
+            if (n_fail[req.path] > 0) {
+                n_fail[req.path]--;
+                res.status = 503;
+            } else {
+                bodies.push_back(req.body);
+                n_ok++;
+            }
+            received.push_back(req.path + " " + std::to_string(res.status));
+        });
+        port = svr.bind_to_any_port("127.0.0.1");
+        thread = std::thread([this]() { svr.listen_after_bind(); });
+        svr.wait_until_ready();
+    }
+
+    ~callback_stub() {
+        svr.stop();
+        thread.join();
+    }
+
+    std::string url(const std::string & path) const {
+        return "http://127.0.0.1:" + std::to_string(port) + path;
+    }
+
+    // until a request of the path has been accepted
+    void wait_path(const std::string & path) {
+        const int64_t t_deadline = ggml_time_us() + 10 * 1000 * 1000;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (std::find(received.begin(), received.end(), path + " 200") != received.end()) {
+                    return;
+                }
+            }
+            assert(ggml_time_us() < t_deadline && "the callback did not arrive");
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    void wait_ok(int n) {
+        const int64_t t_deadline = ggml_time_us() + 10 * 1000 * 1000;
+        while (n_ok < n) {
+            assert(ggml_time_us() < t_deadline && "the callbacks did not arrive");
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+};
+
+static server_task_result_ptr embd_result(int id, int index) {
+    auto result = std::make_unique<server_task_result_embd>();
+    result->id        = id;
+    result->index     = index;
+    result->n_tokens  = 1;
+    result->embedding = { { (float) index } };
+    return result;
+}
+
+// a failed delivery waits for its retry without its worker, the results of a request are delivered once all are in,
+// and requests are only admitted up to the size of the queue
+static void test_callback() {
+    callback_stub stub;
+
+    server_callback_dispatcher dispatcher;
+    dispatcher.start(1, 2, 2);
+
+    // the only worker delivers "/b" while "/a" waits for its retry
+    {
+        std::unique_lock<std::mutex> lock(stub.mutex);
+        stub.n_fail["/a"] = 1;
+    }
+    dispatcher.submit([&]() { dispatcher.deliver({ { "x", 1 } }, stub.url("/a"), ""); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    dispatcher.submit([&]() { dispatcher.deliver({ { "x", 2 } }, stub.url("/b"), ""); });
+    stub.wait_ok(2);
+    {
+        std::unique_lock<std::mutex> lock(stub.mutex);
+        assert((stub.received == std::vector<std::string>{ "/a 503", "/b 200", "/a 200" }));
+    }
+    assert(dispatcher.n_retries_total == 1);
+    // counted once the response is back in the worker, which may be after the stub has counted it
+    while (dispatcher.n_delivered_total < 2) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // the results come from the "main loop" in any order, only the last one queues the delivery
+    {
+        server_context ctx;
+
+        std::vector<server_task> tasks(2, server_task(SERVER_TASK_TYPE_EMBEDDING));
+        tasks[0].id = 10;
+        tasks[1].id = 11;
+
+        assert(dispatcher.reserve());
+        assert(dispatcher.reserve());
+        assert(!dispatcher.reserve());
+        assert(dispatcher.n_rejected_total == 1);
+
+        dispatcher.watch(ctx, tasks, stub.url("/c"), "", nullptr);
+        assert(ctx.queue_results.is_waiting({ 10, 11 }));
+
+        ctx.queue_results.send(embd_result(11, 1));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        assert(stub.n_ok == 2);
+        assert(dispatcher.n_waiting == 2);
+
+        ctx.queue_results.send(embd_result(10, 0));
+        stub.wait_ok(3);
+        assert(dispatcher.n_waiting == 1);
+        assert(!ctx.queue_results.is_waiting({ 10, 11 }));
+
+        std::unique_lock<std::mutex> lock(stub.mutex);
+        const json body = json::parse(stub.bodies.back());
+        assert(body.is_array() && body.size() == 2);
+        assert(body[0].at("index") == 0 && body[1].at("index") == 1);
+    }
+
+    // a request dropped with its tasks gives back its place
+    {
+        server_context ctx;
+
+        std::vector<server_task> tasks(1, server_task(SERVER_TASK_TYPE_EMBEDDING));
+        tasks[0].id = 20;
+        dispatcher.watch(ctx, tasks, stub.url("/d"), "", nullptr);
+    }
+    assert(dispatcher.n_waiting == 0);
+
+    dispatcher.stop();
+}
+
+// the dispatcher against one thread and one new connection per delivery, as before it, and the delivery latency of an
+// urgent request while the results of slower requests are still pending: a worker that waits for the results of its
+// request, as before the result hooks, is not available for the urgent one
+static void perf_callback() {
+    callback_stub stub;
+
+    const int n_deliveries = 2000;
+    const json data = { { "content", std::string(512, 'x') } };
+
+    printf("%-10s %-22s %14s\n", "n_workers", "delivery", "deliveries/s");
+
+    for (int n_workers : { 1, 4, 16 }) {
+        for (int pooled = 0; pooled < 2; ++pooled) {
+            const int n_start = stub.n_ok;
+            const int64_t t_start = ggml_time_us();
+
+            if (pooled) {
+                server_callback_dispatcher dispatcher;
+                dispatcher.start(n_workers, n_deliveries, 0);
+                for (int i = 0; i < n_deliveries; ++i) {
+                    dispatcher.submit([&]() { dispatcher.deliver(data, stub.url("/cb"), ""); });
+                }
+                stub.wait_ok(n_start + n_deliveries);
+                dispatcher.stop();
+            } else {
+                // n_workers threads at a time, so that the thread count stays the same
+                for (int i = 0; i < n_deliveries; i += n_workers) {
+                    std::vector<std::thread> threads;
+                    for (int j = 0; j < n_workers && i + j < n_deliveries; ++j) {
+                        threads.emplace_back([&]() {
+                            httplib::Client client("http://127.0.0.1:" + std::to_string(stub.port));
+                            client.Post("/cb", safe_json_to_str(data), MIMETYPE_JSON);
+                        });
+                    }
+                    for (auto & t : threads) {
+                        t.join();
+                    }
+                }
+                stub.wait_ok(n_start + n_deliveries);
+            }
+
+            printf("%-10d %-22s %14.0f\n", n_workers, pooled ? "pooled keep-alive" : "thread + new client",
+                   n_deliveries / (t_ms(t_start) / 1e3));
+        }
+    }
+
+    const int n_workers = 4;
+    const int n_pending = 64;
+    const int t_pending_ms = 500;
+
+    printf("\n%-10s %-10s %-22s %14s\n", "n_workers", "n_pending", "waiting for results", "urgent ms");
+
+    for (int hooks = 0; hooks < 2; ++hooks) {
+        server_context ctx;
+        server_callback_dispatcher dispatcher;
+        dispatcher.start(n_workers, n_pending + 1, 0);
+
+        // the slow requests, their results come after t_pending_ms
+        std::vector<server_task> tasks_pending;
+        for (int i = 0; i < n_pending; ++i) {
+            std::vector<server_task> tasks(1, server_task(SERVER_TASK_TYPE_EMBEDDING));
+            tasks[0].id = ctx.queue_tasks.get_new_id();
+            tasks[0].priority = SERVER_TASK_PRIORITY_LOW;
+            tasks_pending.push_back(tasks[0]);
+
+            dispatcher.reserve();
+            if (hooks) {
+                dispatcher.watch(ctx, tasks, stub.url("/slow"), "", nullptr);
+            } else {
+                ctx.queue_results.add_waiting_tasks(tasks);
+                dispatcher.submit([&dispatcher, &ctx, &stub, id = tasks[0].id]() {
+                    server_task_result_ptr result = ctx.queue_results.recv(id);
+                    ctx.queue_results.remove_waiting_task_id(id);
+                    dispatcher.deliver(result->to_json(), stub.url("/slow"), "");
+                });
+            }
+        }
+
+        // let the workers take the jobs of the slow requests
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        std::vector<server_task> tasks(1, server_task(SERVER_TASK_TYPE_EMBEDDING));
+        tasks[0].id = ctx.queue_tasks.get_new_id();
+        tasks[0].priority = SERVER_TASK_PRIORITY_HIGH;
+
+        const int n_start = stub.n_ok;
+        const int64_t t_start = ggml_time_us();
+
+        dispatcher.reserve();
+        if (hooks) {
+            dispatcher.watch(ctx, tasks, stub.url("/urgent"), "", nullptr);
+        } else {
+            ctx.queue_results.add_waiting_tasks(tasks);
+            dispatcher.submit([&dispatcher, &ctx, &stub, id = tasks[0].id]() {
+                server_task_result_ptr result = ctx.queue_results.recv(id);
+                ctx.queue_results.remove_waiting_task_id(id);
+                dispatcher.deliver(result->to_json(), stub.url("/urgent"), "");
+            }, SERVER_TASK_PRIORITY_HIGH);
+        }
+        ctx.queue_results.send(embd_result(tasks[0].id, 0));
+
+        std::thread slow([&]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(t_pending_ms));
+            for (const auto & task : tasks_pending) {
+                ctx.queue_results.send(embd_result(task.id, 0));
+            }
+        });
+
+        stub.wait_path("/urgent");
+        const double t_urgent = t_ms(t_start);
+        slow.join();
+        stub.wait_ok(n_start + n_pending + 1);
+        dispatcher.stop();
+
+        printf("%-10d %-10d %-22s %14.1f\n", n_workers, n_pending, hooks ? "result hook" : "blocked worker", t_urgent);
+    }
+}
+
+//
+// admission control
+//
+
+// the reservation of admit_tasks: concurrent requests never get past the limits together
+static void test_admission() {
+    server_context ctx;
+    ctx.params_base.n_parallel     = 1;
+    ctx.params_base.n_queue_max    = 8;
+    ctx.params_base.n_threads_http = 6; // 4 requests in flight
+
+    const int n_threads = 32;
+
+    for (int hold_thread = 0; hold_thread < 2; ++hold_thread) {
+        for (int round = 0; round < 50; ++round) {
+            std::atomic<int> n_ready{0};
+            std::atomic<int> n_admitted{0};
+
+            std::vector<std::thread> threads;
+            for (int i = 0; i < n_threads; ++i) {
+                threads.emplace_back([&]() {
+                    n_ready++;
+                    while (n_ready < n_threads) {
+                        std::this_thread::yield();
+                    }
+                    int retry_after = 0;
+                    std::string reason;
+                    if (ctx.admit_tasks(1, 16, hold_thread, retry_after, reason)) {
+                        n_admitted++;
+                    } else {
+                        assert(retry_after >= 1);
+                    }
+                });
+            }
+            for (auto & t : threads) {
+                t.join();
+            }
+
+            // the reservations of rejected requests may turn others away too, never the other way round
+            assert(n_admitted >= 1 && n_admitted <= (hold_thread ? 4 : 8));
+            assert(ctx.n_tasks_admitting == n_admitted);
+            assert(ctx.n_tokens_admitting == 16 * n_admitted);
+            assert(server_context::n_requests_inflight == (hold_thread ? n_admitted.load() : 0));
+
+            for (int i = 0; i < n_admitted; ++i) {
+                ctx.end_admission(1, 16);
+                if (hold_thread) {
+                    server_context::n_requests_inflight--;
+                }
+            }
+            assert(ctx.n_tasks_admitting == 0 && ctx.n_tokens_admitting == 0);
+            assert(server_context::n_requests_inflight == 0);
+        }
+    }
+}
+
+// the abort callback of llama_decode() only stops a batch view whose tasks are all cancelled, and follows the view
+static void test_abort_decode() {
+    server_context ctx;
+
+    const auto publish = [&](std::vector<int> id_tasks) {
+        std::unique_lock<std::mutex> lock(ctx.mutex_cancelled);
+        ctx.id_tasks_decoding = std::move(id_tasks);
+        ctx.update_decoding_cancelled();
+    };
+
+    publish({ 1, 2 });
+    assert(!server_context::abort_decode(&ctx));
+
+    ctx.cancel_tasks({ 1 });
+    assert(!server_context::abort_decode(&ctx));
+    ctx.cancel_tasks({ 2 });
+    assert(server_context::abort_decode(&ctx));
+
+    // a new view with a live task
+    publish({ 2, 3 });
+    assert(!server_context::abort_decode(&ctx));
+    publish({ 2 });
+    assert(server_context::abort_decode(&ctx));
+
+    // the main loop processes the cancel task of 2
+    server_task cancel(SERVER_TASK_TYPE_CANCEL);
+    cancel.id_target = 2;
+    ctx.process_single_task(cancel);
+    assert(!server_context::abort_decode(&ctx));
+
+    publish({});
+    assert(!server_context::abort_decode(&ctx));
+}
+
+// a model with its main loop, as the extra models of the server
+static bool start_model(server_model & model, common_params params) {
+    params.warmup = false;
+    // as common_params_parse() does
+    postprocess_cpu_params(params.cpuparams, nullptr);
+    postprocess_cpu_params(params.cpuparams_batch, &params.cpuparams);
+    if (!model.ctx.load_model(params)) {
+        return false;
+    }
+    model.ctx.init();
+
+    server_context * ctx = &model.ctx;
+    ctx->queue_tasks.on_new_task([ctx](const server_task & task) { ctx->process_single_task(task); });
+    ctx->queue_tasks.on_update_slots([ctx]() { ctx->update_slots(); });
+    model.loop = std::thread([ctx]() { ctx->queue_tasks.start_loop(); });
+
+    return true;
+}
+
+// the completion tasks of a request, as handle_answer_impl makes them
+static std::vector<server_task> completion_tasks(server_context & ctx, const json & data) {
+    server_task task(SERVER_TASK_TYPE_COMPLETION);
+    task.id            = ctx.queue_tasks.get_new_id();
+    task.prompt_tokens = common_tokenize(ctx.vocab, data.at("prompt").get<std::string>(), true, true);
+    task.params        = server_task::params_from_json_cmpl(ctx.ctx, ctx.params_base, ctx.grammars, data);
+    task.sched_from_json(data);
+    return { task };
+}
+
+// clients sending completions back to back, more of them than there are slots: without a queue limit every request
+// waits for all the ones before it, with --queue-max the excess is rejected and retried after a backoff, which keeps
+// the latency of the admitted requests bounded
+static void perf_admission(const std::string & model_path) {
+    if (model_path.empty()) {
+        printf("skipped, needs -m MODEL\n");
+        return;
+    }
+
+    const int n_clients  = 16;
+    const int n_parallel = 2;
+    const int t_run_ms   = 10000;
+    const int t_retry_ms = 50;
+
+    printf("%-10s %-10s %10s %10s %10s %12s %12s\n", "n_clients", "queue-max", "completed", "rejected", "req/s",
+           "p50 ms", "p99 ms");
+
+    for (int n_queue_max : { 0, n_parallel }) {
+        common_params params;
+        params.model          = model_path;
+        params.n_parallel     = n_parallel;
+        params.n_ctx          = 512 * n_parallel;
+        params.n_queue_max    = n_queue_max;
+        params.n_threads_http = n_clients + 2;
+
+        server_model model;
+        if (!start_model(model, params)) {
+            fprintf(stderr, "failed to load %s\n", model_path.c_str());
+            return;
+        }
+        server_context & ctx = model.ctx;
+
+        const json data = {
+            { "prompt",     "The caregiver checked in with the patient this morning and noted that" },
+            { "n_predict",  32 },
+            { "ignore_eos", true },
+        };
+
+        std::mutex mutex;
+        std::vector<double> latency_ms;
+        std::atomic<int> n_rejected{0};
+
+        const int64_t t_start = ggml_time_us();
+        const int64_t t_end   = t_start + t_run_ms * 1000;
+
+        std::vector<std::thread> clients;
+        for (int c = 0; c < n_clients; ++c) {
+            clients.emplace_back([&]() {
+                while (ggml_time_us() < t_end) {
+                    std::vector<server_task> tasks = completion_tasks(ctx, data);
+                    const int64_t n_tokens = tasks[0].prompt_tokens.size();
+                    const int64_t t_request = ggml_time_us();
+
+                    int retry_after = 0;
+                    std::string reason;
+                    if (!ctx.admit_tasks(1, n_tokens, true, retry_after, reason)) {
+                        n_rejected++;
+                        std::this_thread::sleep_for(std::chrono::milliseconds(t_retry_ms));
+                        continue;
+                    }
+
+                    const auto id_tasks = server_task::get_list_id(tasks);
+                    ctx.queue_results.add_waiting_tasks(tasks);
+                    ctx.queue_tasks.post(tasks);
+                    ctx.end_admission(1, n_tokens);
+
+                    server_task_result_ptr result = ctx.queue_results.recv(id_tasks);
+                    GGML_ASSERT(!result->is_error());
+                    ctx.queue_results.remove_waiting_task_ids(id_tasks);
+                    server_context::n_requests_inflight--;
+
+                    std::unique_lock<std::mutex> lock(mutex);
+                    latency_ms.push_back(t_ms(t_request));
+                }
+            });
+        }
+        for (auto & t : clients) {
+            t.join();
+        }
+
+        const double t_run = t_ms(t_start) / 1e3;
+        std::sort(latency_ms.begin(), latency_ms.end());
+        const size_t n = latency_ms.size();
+        GGML_ASSERT(n > 0);
+
+        printf("%-10d %-10d %10zu %10d %10.2f %12.1f %12.1f\n", n_clients, n_queue_max, n, n_rejected.load(), n / t_run,
+               latency_ms[n / 2], latency_ms[std::min(n - 1, n * 99 / 100)]);
+    }
+}
+
+//
+// context shift
+//
+
+// a single completion generating several times n_ctx tokens, so that the context is shifted over and over:
+// the time of the shifts in the main loop, and of the K-shift they leave to the next llama_decode(), from the trace
+static void perf_shift(const std::string & model_path) {
+    if (model_path.empty()) {
+        printf("skipped, needs -m MODEL\n");
+        return;
+    }
+
+    const int n_windows = 8;
+
+    printf("%-8s %10s %10s %12s %12s %14s %14s\n", "n_ctx", "n_predict", "n_shifts", "tokens/s", "shift ms",
+           "decode ms", "K-shift ms");
+
+    for (int n_ctx : { 256, 1024, 4096 }) {
+        common_params params;
+        params.model      = model_path;
+        params.n_parallel = 1;
+        params.n_ctx      = n_ctx;
+
+        server_model model;
+        if (!start_model(model, params)) {
+            fprintf(stderr, "failed to load %s\n", model_path.c_str());
+            return;
+        }
+        server_context & ctx = model.ctx;
+
+        const int n_predict = n_windows * n_ctx;
+        const json data = {
+            { "prompt",     "The caregiver checked in with the patient this morning and noted that" },
+            { "n_predict",  n_predict },
+            { "ignore_eos", true },
+        };
+
+        tracer.init(4 * n_predict);
+
+        std::vector<server_task> tasks = completion_tasks(ctx, data);
+        const auto id_tasks = server_task::get_list_id(tasks);
+
+        const int64_t t_start = ggml_time_us();
+        ctx.queue_results.add_waiting_tasks(tasks);
+        ctx.queue_tasks.post(tasks);
+        server_task_result_ptr result = ctx.queue_results.recv(id_tasks);
+        ctx.queue_results.remove_waiting_task_ids(id_tasks);
+        const double t = t_ms(t_start) / 1e3;
+
+        auto * final = dynamic_cast<server_task_result_cmpl_final *>(result.get());
+        GGML_ASSERT(final != nullptr && final->n_decoded == n_predict);
+
+        // the decode right after a shift pays for the K-shift, the others give the baseline
+        const json events = tracer.to_json().at("traceEvents");
+        std::vector<double> t_shift;
+        std::vector<double> t_decode;
+        std::vector<double> t_decode_shifted;
+        bool shifted = false;
+        for (const auto & event : events) {
+            const std::string name = event.at("name");
+            const double dur = event.at("dur").get<int64_t>() / 1e3;
+            if (name == "context_shift") {
+                t_shift.push_back(dur);
+                shifted = true;
+            } else if (name == "llama_decode") {
+                (shifted ? t_decode_shifted : t_decode).push_back(dur);
+                shifted = false;
+            }
+        }
+        tracer.init(0);
+
+        GGML_ASSERT(!t_shift.empty() && t_decode_shifted.size() == t_shift.size());
+        std::sort(t_decode.begin(), t_decode.end());
+        const auto avg = [](const std::vector<double> & v) {
+            return std::accumulate(v.begin(), v.end(), 0.0) / v.size();
+        };
+
+        printf("%-8d %10d %10zu %12.1f %12.3f %14.3f %14.3f\n", n_ctx, n_predict, t_shift.size(), n_predict / t,
+               avg(t_shift), t_decode[t_decode.size() / 2], avg(t_decode_shifted) - t_decode[t_decode.size() / 2]);
+    }
+}
+
+//
+// server_tokenizer
+//
+
+// the check-in prompt of check-in-service, as one string and as the segments [system, user]: the tokens must be the
+// same, then the time to tokenize the prompt of a new transcript each way, with the system prompt cached
+static void perf_tokenize(const std::string & model_path) {
+    if (model_path.empty()) {
+        printf("skipped, needs -m MODEL\n");
+        return;
+    }
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+    llama_model * model = llama_model_load_from_file(model_path.c_str(), mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "failed to load %s\n", model_path.c_str());
+        return;
+    }
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    // markdown, with the trailing double spaces of its line breaks
+    std::string system_prompt;
+    for (int i = 0; i < 40; ++i) {
+        system_prompt += string_format("%d. **field_%d**: What the person said about item %d, in one or two sentences.  \n", i, i, i);
+        system_prompt += "   - `0`: Completely okay, no concerns.  \n   - `3`: Significant concern, needs follow-up.  \n\n";
+    }
+
+    const std::string system_segment = "\n    [INST]\n    <<SYS>>\n    " + system_prompt + "\n    <</SYS>>\n";
+    const auto user_segment = [](const std::string & transcript) {
+        return "    nUser's transcription:\n\"" + transcript + "\"\n    [/INST]\n    ";
+    };
+
+    const std::vector<std::string> transcripts = {
+        "I slept well and had breakfast.",
+        "",
+        " leading space",
+        "\nleading newline",
+        "My knee hurts a bit today, but I walked to the shop.  \n\nThat's all.",
+    };
+
+    server_tokenizer tokenizer;
+    tokenizer.init(64);
+
+    for (const auto & transcript : transcripts) {
+        const std::string user = user_segment(transcript);
+        const llama_tokens whole = tokenize_input_prompts(vocab, system_segment + user, true, true)[0];
+        const llama_tokens segmented = tokenizer.tokenize(vocab, "", json::array({ json::array({ system_segment, user }) }), true, true)[0];
+        GGML_ASSERT(whole == segmented);
+    }
+
+    const prompt_head head = tokenize_prompt_head(vocab, system_segment, true, true);
+    printf("%zu tokens in the system segment, %zu of them cached\n",
+           common_tokenize(vocab, system_segment, true, true).size(), head.tokens.size());
+
+    const int n_requests = 200;
+
+    printf("%-12s %10s %10s\n", "prompt", "p50 us", "p99 us");
+
+    for (const bool segmented : { false, true }) {
+        std::vector<double> latency_us;
+        for (int i = 0; i < n_requests; ++i) {
+            const std::string user = user_segment(string_format("Check-in number %d, I feel fine.", i));
+            const json prompt = segmented ? json::array({ json::array({ system_segment, user }) }) : json(system_segment + user);
+
+            const int64_t t_start = ggml_time_us();
+            tokenizer.tokenize(vocab, "", prompt, true, true);
+            latency_us.push_back(ggml_time_us() - t_start);
+        }
+        std::sort(latency_us.begin(), latency_us.end());
+
+        printf("%-12s %10.1f %10.1f\n", segmented ? "segments" : "one string", latency_us[n_requests / 2],
+               latency_us[n_requests * 99 / 100]);
+    }
+
+    llama_model_free(model);
+}
+
+struct perf_case {
+    const char * name;
+    void (*fn)(const std::string & model);
+};
+
+static const perf_case perf_cases[] = {
+    { "token-index", [](const std::string &) { perf_token_index(); } },
+    { "to-sse",      [](const std::string &) { perf_to_sse();      } },
+    { "queue",       [](const std::string &) { perf_queue();       } },
+    { "recv",        [](const std::string &) { perf_recv();        } },
+    { "callback",    [](const std::string &) { perf_callback();    } },
+    { "admission",   perf_admission },
+    { "shift",       perf_shift },
+    { "tokenize",    perf_tokenize },
+};
+
+static int run_perf(int argc, char ** argv) {
+    std::string name;
+    std::string model;
+    for (int i = 0; i < argc; ++i) {
+        if (std::string(argv[i]) == "-m" && i + 1 < argc) {
+            model = argv[++i];
+        } else {
+            name = argv[i];
+        }
+    }
+
+    bool found = false;
+    for (const auto & c : perf_cases) {
+        if (name.empty() || name == c.name) {
+            printf("\n%s\n", c.name);
+            c.fn(model);
+            found = true;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "unknown benchmark: %s\n", name.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    if (argc > 1 && std::string(argv[1]) == "perf") {
+        return run_perf(argc - 2, argv + 2);
+    }
+
+    test_token_index();
+    test_to_sse();
+    test_queue();
+    test_response();
+    test_callback();
+    test_admission();
+    test_abort_decode();
+
+    printf("OK\n");
+
+    return 0;
+}